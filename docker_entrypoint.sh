@@ -1,3 +1,3 @@
 #!/bin/bash
 /geoip/geolite2pp_get_database.sh
-./masternode --v=$VERBOSE_LOG_LEVEL --logtostderr=1 --tryfromenv=ip,port,ssl_port,origin_host,origin_port,protected_domain,cert_path,key_path,cache_dir,gateway_address,gateway_port,sw_path,upgrade_insecure,pool_domain,cdn_subdomain,enable_compression,enable_service_worker,max_cached_routes,enable_p2p,geoip_path,geo_ip_enabled
+./masternode --v=$VERBOSE_LOG_LEVEL --logtostderr=1 --tryfromenv=ip,port,ssl_port,origin_host,origin_port,tenants_file,route_rules_file,origins,origin_balancing,origin_health_interval,origin_health_path,origin_health_max_failures,origin_idle_sessions,protected_domain,cert_path,key_path,cache_dir,gateway_address,gateway_port,sw_path,upgrade_insecure,pool_domain,cdn_subdomain,enable_compression,enable_service_worker,max_cached_routes,cache_memory_mb,cache_admission,enable_disk_tier,disk_promote_hits,disk_io_engine,disk_io_threads,cache_fsync,cache_dir_levels,cache_disk_quota_mb,cache_snapshot,cache_max_object_mb,max_buffered_mb,cache_slice_kb,stale_if_error,negative_cache_ttl,error_cache_statuses,error_cache_ttl,negative_cache_kb,negative_cache_max_routes,cache_key_drop_params,cache_key_allow_params,cache_key_sort_params,origin_connect_timeout_ms,origin_response_timeout_ms,origin_max_retries,origin_retry_ratio,origin_hedge_connects,origin_breaker_failure_ratio,origin_breaker_min_requests,origin_breaker_open_ms,origin_slow_ms,enable_p2p,geoip_path,geo_ip_enabled,edge_candidate_factor,enable_edge_probing,edge_probe_interval,edge_probe_concurrency,edge_probe_timeout_ms,edge_probe_path,edge_probe_max_failures,edge_probe_max_rtt_ms,enable_network_coordinates,coordinate_max_error,metrics_token
@@ -0,0 +1,82 @@
+#include "ByteRange.h"
+
+#include <algorithm>
+
+#include <folly/Conv.h>
+#include <folly/Range.h>
+#include <folly/String.h>
+
+namespace {
+    // Splits "bytes=first-last" into its two (possibly empty) halves
+    bool splitSpec(const std::string& value, folly::StringPiece& first,
+        folly::StringPiece& last) {
+        folly::StringPiece spec = folly::trimWhitespace(value);
+        if (!spec.removePrefix("bytes=")) return false;
+        // multiple ranges aren't supported
+        if (spec.find(',') != folly::StringPiece::npos) return false;
+        return folly::split('-', spec, first, last);
+    }
+}
+
+RangeResult parseRange(const std::string& value, size_t size,
+    ByteRange& range) {
+    folly::StringPiece first, last;
+    if (!splitSpec(value, first, last)) return RangeResult::NONE;
+    first = folly::trimWhitespace(first);
+    last = folly::trimWhitespace(last);
+
+    if (first.empty()) {
+        // suffix range, the last N bytes
+        auto suffix = folly::tryTo<size_t>(last);
+        if (!suffix.hasValue()) return RangeResult::NONE;
+        if (suffix.value() == 0 || size == 0) {
+            return RangeResult::UNSATISFIABLE;
+        }
+        range.length = std::min(suffix.value(), size);
+        range.offset = size - range.length;
+        return RangeResult::SATISFIABLE;
+    }
+
+    auto start = folly::tryTo<size_t>(first);
+    if (!start.hasValue()) return RangeResult::NONE;
+    size_t end = size;
+    if (!last.empty()) {
+        auto parsed = folly::tryTo<size_t>(last);
+        if (!parsed.hasValue() || parsed.value() < start.value()) {
+            return RangeResult::NONE;
+        }
+        // clamp before adding one, the last byte may be SIZE_MAX (an
+        // empty body is unsatisfiable below, whatever end comes to)
+        end = std::min(size - 1, parsed.value()) + 1;
+    }
+    if (start.value() >= size) return RangeResult::UNSATISFIABLE;
+    range.offset = start.value();
+    range.length = end - start.value();
+    return RangeResult::SATISFIABLE;
+}
+
+folly::Optional<size_t> rangeStart(const std::string& value) {
+    folly::StringPiece first, last;
+    if (!splitSpec(value, first, last)) return folly::none;
+    auto start = folly::tryTo<size_t>(folly::trimWhitespace(first));
+    if (!start.hasValue()) return folly::none;
+    return start.value();
+}
+
+std::string contentRange(const ByteRange& range, size_t size) {
+    return folly::to<std::string>("bytes ", range.offset, "-",
+        range.end() - 1, "/", size);
+}
+
+std::string unsatisfiedRange(size_t size) {
+    return folly::to<std::string>("bytes */", size);
+}
+
+folly::Optional<size_t> contentRangeSize(const std::string& value) {
+    auto slash = value.rfind('/');
+    if (slash == std::string::npos) return folly::none;
+    auto size = folly::tryTo<size_t>(
+        folly::StringPiece(value).subpiece(slash + 1));
+    if (!size.hasValue()) return folly::none;
+    return size.value();
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+
+#include <folly/Optional.h>
+
+// A run of bytes within a response body
+struct ByteRange {
+    size_t offset{0};
+    size_t length{0};
+
+    size_t end() const { return offset + length; }
+};
+
+enum class RangeResult {
+    // no Range header, or one we don't support: send the whole body
+    NONE,
+    SATISFIABLE,
+    // the range starts past the end of the body (416)
+    UNSATISFIABLE
+};
+
+// Parses a Range request header value against a body of "size" bytes.
+// Only a single byte range ("bytes=0-99", "bytes=100-" or "bytes=-100")
+// is supported, requests for several ranges are answered in full.
+RangeResult parseRange(const std::string& value, size_t size,
+    ByteRange& range);
+
+// Returns the offset of the first byte a Range header asks for,
+// without knowing the size of the body ("bytes=-100" has none)
+folly::Optional<size_t> rangeStart(const std::string& value);
+
+// Formats the Content-Range header of a partial response
+std::string contentRange(const ByteRange& range, size_t size);
+
+// Formats the Content-Range header of a 416 response
+std::string unsatisfiedRange(size_t size);
+
+// Returns the complete length of the body from the Content-Range header
+// of a partial response
+folly::Optional<size_t> contentRangeSize(const std::string& value);
@@ -1,74 +1,1048 @@
 #include "Cache.h"
+#include "CacheKey.h"
+
+#include <algorithm>
+
 #include <folly/DynamicConverter.h>
+#include <folly/FileUtil.h>
+#include <folly/String.h>
 #include <folly/ssl/OpenSSLHash.h>
 
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+constexpr const char* ContentCache::JOURNAL_NAME;
+
+namespace {
+    int64_t unixNow() {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    std::shared_ptr<const CachedHeaders> headersFromEntry(
+        const CacheIndexEntry& entry) {
+        return std::make_shared<const CachedHeaders>(entry.status,
+            entry.headers);
+    }
+
+    // Headers stored for a route added from an origin response, with
+    // the headers the policy forwarded if they're given
+    std::shared_ptr<const CachedHeaders> storedHeaders(
+        const std::shared_ptr<proxygen::HTTPMessage>& headers,
+        const proxygen::HTTPHeaders* forwarded) {
+        if (!headers) return nullptr;
+        if (forwarded) {
+            return std::make_shared<const CachedHeaders>(*headers,
+                *forwarded);
+        }
+        return std::make_shared<const CachedHeaders>(*headers);
+    }
+
+    // Routes created without headers share an empty set
+    std::shared_ptr<const CachedHeaders> noHeaders() {
+        static auto empty = std::make_shared<const CachedHeaders>();
+        return empty;
+    }
+
+    // Freshness lifetime from a Cache-Control list and an Expires date
+    int64_t expiresFrom(folly::StringPiece cacheControl,
+        folly::StringPiece expires, int64_t now) {
+        int64_t maxAge = -1;
+        int64_t sharedMaxAge = -1;
+        std::vector<folly::StringPiece> directives;
+        folly::split(',', cacheControl, directives);
+        for (auto d : directives) {
+            d = folly::trimWhitespace(d);
+            int64_t* target = nullptr;
+            if (d.removePrefix("s-maxage=")) {
+                target = &sharedMaxAge;
+            } else if (d.removePrefix("max-age=")) {
+                target = &maxAge;
+            } else {
+                continue;
+            }
+            auto parsed = folly::tryTo<int64_t>(d);
+            if (parsed.hasValue()) *target = parsed.value();
+        }
+        if (sharedMaxAge >= 0) return now + sharedMaxAge;
+        if (maxAge >= 0) return now + maxAge;
+
+        if (!expires.empty()) {
+            struct tm tm{};
+            if (strptime(expires.str().c_str(), "%a, %d %b %Y %H:%M:%S",
+                &tm)) {
+                return timegm(&tm);
+            }
+            // invalid dates (like "0") mean the response is already expired
+            return now;
+        }
+        return 0;
+    }
+}
+
 CachedRoute::CachedRoute(std::string& url,
     std::unique_ptr<folly::IOBuf> data,
-    std::shared_ptr<proxygen::HTTPMessage> headers):
-        url_(url), content_(std::move(data)),
-        headers_(std::move(headers)) {
-    auto out = std::vector<uint8_t>(32);
-    folly::ssl::OpenSSLHash::sha256(folly::range(out), *(content_.get()));
-    sha256_ = folly::hexlify(out);
+    std::shared_ptr<const CachedHeaders> headers,
+    std::string hash, int64_t created):
+        sha256_(hash), url_(url), content_(std::move(data)),
+        headers_(headers ? std::move(headers) : noHeaders()),
+        created_(created) {
+    if (sha256_.empty()) {
+        auto out = std::vector<uint8_t>(32);
+        folly::ssl::OpenSSLHash::sha256(folly::range(out), *(content_.get()));
+        sha256_ = folly::hexlify(out);
+    }
+    if (created_ == 0) {
+        created_ = unixNow();
+    }
+    readHeaders();
+    size_ = content_->computeChainDataLength();
+    if (content_->isChained()) {
+        // one buffer per route, rather than all the pieces it arrived in
+        content_->coalesce();
+    }
+}
+
+std::shared_ptr<CachedRoute> CachedRoute::onDisk(std::string url,
+    size_t size, std::shared_ptr<const CachedHeaders> headers,
+    std::string hash, int64_t created) {
+    std::shared_ptr<CachedRoute> route(new CachedRoute());
+    route->sha256_ = hash;
+    route->url_ = url;
+    route->headers_ = headers ? std::move(headers) : noHeaders();
+    route->created_ = created;
+    route->readHeaders();
+    route->size_ = size;
+    route->persisted_ = true;
+    return route;
+}
+
+void CachedRoute::readHeaders() {
+    expires_ = computeExpires(*headers_, created_);
+    html_ = headers_->get(proxygen::HTTP_HEADER_CONTENT_TYPE)
+        .find("text/html") != std::string::npos;
+    std::vector<folly::StringPiece> directives;
+    folly::split(',', headers_->get(proxygen::HTTP_HEADER_CACHE_CONTROL),
+        directives);
+    for (auto d : directives) {
+        d = folly::trimWhitespace(d);
+        if (d == "must-revalidate" || d == "proxy-revalidate") {
+            mustRevalidate_ = true;
+        } else if (d.removePrefix("stale-if-error=")) {
+            auto parsed = folly::tryTo<int64_t>(d);
+            if (parsed.hasValue()) staleIfError_ = parsed.value();
+        }
+    }
+}
+
+void CachedRoute::writeResponse(proxygen::HTTPMessage& response) const {
+    uint16_t status = getStatus();
+    response.setHTTPVersion(1, 1);
+    response.setStatusCode(status);
+    response.setStatusMessage(proxygen::HTTPMessage::getDefaultReason(status));
+    // a filter (e.g. compression) may have changed how the message it
+    // was last sent with was framed
+    response.setIsChunked(false);
+    auto& out = response.getHeaders();
+    out.removeAll();
+    headers_->forEach([&](proxygen::HTTPHeaderCode code,
+        folly::StringPiece name, folly::StringPiece value) {
+        // the range of a slice describes the stored object, not the
+        // response
+        if (code == proxygen::HTTP_HEADER_CONTENT_RANGE) return;
+        if (code == proxygen::HTTP_HEADER_OTHER) {
+            out.add(name, value.str());
+        } else {
+            out.add(code, value.str());
+        }
+    });
+    if (status == 200) {
+        out.set(proxygen::HTTP_HEADER_ACCEPT_RANGES, "bytes");
+    }
+    out.set(proxygen::HTTP_HEADER_CONTENT_LENGTH,
+        folly::to<std::string>(size_));
 }
 
 std::string CachedRoute::getHash() const { return sha256_; }
 std::string CachedRoute::getURL() const { return url_; }
-std::unique_ptr<folly::IOBuf>
-    CachedRoute::getContent() const { return content_->clone(); }
-std::shared_ptr<proxygen::HTTPMessage>
-    CachedRoute::getHeaders() const { return headers_; }
+std::unique_ptr<folly::IOBuf> CachedRoute::getContent() const {
+    return content_ ? content_->clone() : nullptr;
+}
+const CachedHeaders& CachedRoute::getHeaders() const { return *headers_; }
+uint16_t CachedRoute::getStatus() const {
+    uint16_t status = headers_->getStatus();
+    // slices are stored with the origin's 206, but hold the whole
+    // response to a request for the slice
+    return status == 0 || status == 206 ? 200 : status;
+}
+bool CachedRoute::isHTML() const { return html_; }
+int64_t CachedRoute::getCreated() const { return created_; }
+int64_t CachedRoute::getExpires() const { return expires_; }
+size_t CachedRoute::getSize() const { return size_; }
+size_t CachedRoute::getOverhead() const {
+    return sizeof(CachedRoute) + url_.capacity() + sha256_.capacity() +
+        headers_->getOverhead();
+}
+bool CachedRoute::isOnDisk() const { return !content_; }
+bool CachedRoute::isNegative() const { return negative_; }
+
+bool CachedRoute::isExpired() const {
+    return expires_ != 0 && expires_ <= unixNow();
+}
+
+bool CachedRoute::canServeStale(int64_t grace) const {
+    if (negative_ || mustRevalidate_) return false;
+    if (staleIfError_ >= 0) grace = staleIfError_;
+    return expires_ + grace > unixNow();
+}
+
+int64_t CachedRoute::getAge() const {
+    return std::max<int64_t>(0, unixNow() - created_);
+}
+bool CachedRoute::isPersisted() const { return persisted_; }
+void CachedRoute::setPersisted() { persisted_ = true; }
+
+void CachedRoute::touch() {
+    referenced_.store(true, std::memory_order_relaxed);
+    hits_.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint32_t CachedRoute::getHits() const { return hits_; }
+
+CacheIndexEntry CachedRoute::toIndexEntry() const {
+    CacheIndexEntry entry;
+    entry.url = url_;
+    entry.hash = sha256_;
+    entry.created = created_;
+    entry.expires = expires_;
+    entry.status = headers_->getStatus();
+    headers_->forEach([&](proxygen::HTTPHeaderCode,
+        folly::StringPiece name, folly::StringPiece value) {
+        entry.headers.emplace_back(name.str(), value.str());
+    });
+    return entry;
+}
+
+int64_t CachedRoute::computeExpires(const CachedHeaders& headers,
+    int64_t now) {
+    return expiresFrom(headers.get(proxygen::HTTP_HEADER_CACHE_CONTROL),
+        headers.get(proxygen::HTTP_HEADER_EXPIRES), now);
+}
+
+int64_t CachedRoute::computeExpires(const proxygen::HTTPMessage& headers,
+    int64_t now) {
+    const auto& hs = headers.getHeaders();
+    std::string cacheControl;
+    hs.forEachValueOfHeader(proxygen::HTTP_HEADER_CACHE_CONTROL,
+        [&](const std::string& value) {
+            if (!cacheControl.empty()) cacheControl += ",";
+            cacheControl += value;
+            return false;
+        });
+    return expiresFrom(cacheControl,
+        hs.getSingleOrEmpty(proxygen::HTTP_HEADER_EXPIRES), now);
+}
 
 /////////////////////////////////////////////////////////////////////////
 
+ContentCache::ContentCache(std::shared_ptr<MasternodeConfig> config) :
+    config_(config),
+    // the route count is bounded by eviction rather than by the map
+    map_(DEFAULT_INITIAL_CACHE_SIZE),
+    maxSize_(config->maxRoutesToCache),
+    objectSizes_(std::max<size_t>(maxSize_, 1)),
+    cache_directory_(config->cache_directory),
+    writeToDisk_(config->enableP2P || config->enable_disk_tier) {
+    CHECK(config_) << "Config object was null";
+    hand_ = clock_.end();
+    for (auto& tenant : config_->tenants) {
+        if (tenant.cache_share > 0 && config_->cache_memory_bytes > 0) {
+            namespaces_[tenant.name].limit = static_cast<size_t>(
+                tenant.cache_share * config_->cache_memory_bytes);
+        }
+    }
+    if (config_->cache_admission) {
+        sketch_ = std::make_unique<FrequencySketch>(maxSize_);
+    }
+    if (writeToDisk_) {
+        try {
+            journal_ = std::make_unique<CacheJournal>(
+                cache_directory_ + JOURNAL_NAME);
+        } catch (const std::exception& e) {
+            LOG(ERROR) << "Could not open cache index, cached routes " <<
+                "won't survive a restart: " << e.what();
+        }
+        store_ = std::make_unique<DiskStore>(cache_directory_,
+            config_->cache_dir_levels);
+        io_ = DiskIOEngine::create(config_->disk_io_engine,
+            config_->disk_io_threads, config_->disk_io_queue_depth);
+        LOG(INFO) << "Using the " << io_->getName() << " disk I/O engine";
+        if (config_->cache_gc_interval > 0) {
+            gc_.addFunction([this]() { collectGarbage(); },
+                std::chrono::seconds(config_->cache_gc_interval),
+                "CacheGC");
+            gc_.start();
+        }
+    }
+}
+
+ContentCache::~ContentCache() {
+    stopping_ = true;
+    gc_.shutdown();
+    waitForLoad();
+    // finishes the queued writes, which still update the journal
+    io_.reset();
+}
+
 std::shared_ptr<CachedRoute>
-    ContentCache::getCachedRoute(std::string url) const {
+    ContentCache::getCachedRoute(const std::string& url) const {
+    if (sketch_) {
+        // misses count too, they're the candidates for admission
+        sketch_->record(url);
+    }
     auto item = map_.find(url);
     if (item == map_.cend()) {
         // URL is not in the cache
         return nullptr;
     }
-    
+    if (item->second->isNegative() &&
+        item->second->getExpires() <= unixNow()) {
+        // expired, the origin is asked again
+        return nullptr;
+    }
+    item->second->touch();
     return item->second;
 }
 
+std::string ContentCache::getVary(const std::string& key) const {
+    auto item = vary_.find(key);
+    if (item == vary_.cend()) return "";
+    return item->second;
+}
+
+bool ContentCache::setVary(const std::string& key, const std::string& vary) {
+    auto item = vary_.find(key);
+    if (item != vary_.cend() && item->second == vary) return true;
+    std::lock_guard<std::mutex> guard(lock_);
+    if (item == vary_.cend() && vary_.size() >= maxSize_) {
+        // make room by dropping the routes none of whose variants made
+        // it into the cache (a request still fetching one just caches
+        // it under a route the next miss records again)
+        for (auto it = vary_.cbegin(); it != vary_.cend();) {
+            if (variants_.count(it->first)) {
+                ++it;
+            } else {
+                it = vary_.erase(it);
+            }
+        }
+        if (vary_.size() >= maxSize_) return false;
+    }
+    vary_.insert_or_assign(key, vary);
+    return true;
+}
+
+void ContentCache::clearVary(const std::string& key) {
+    vary_.erase(key);
+}
+
+size_t ContentCache::getObjectSize(const std::string& key) const {
+    std::lock_guard<std::mutex> guard(sizesLock_);
+    auto item = objectSizes_.findWithoutPromotion(key);
+    if (item == objectSizes_.cend()) return 0;
+    return item->second;
+}
+
+void ContentCache::setObjectSize(const std::string& key, size_t size) {
+    std::lock_guard<std::mutex> guard(sizesLock_);
+    objectSizes_.set(key, size);
+}
+
 bool ContentCache::addCachedRoute(std::string url,
     std::unique_ptr<folly::IOBuf> chain,
-    std::shared_ptr<proxygen::HTTPMessage> headers) {
+    std::shared_ptr<proxygen::HTTPMessage> headers, int32_t ttl,
+    const proxygen::HTTPHeaders* forwarded) {
     
     // Create a new CachedRoute class
     std::shared_ptr<CachedRoute> newEntry = 
-        std::make_shared<CachedRoute>(url, chain->clone(), std::move(headers));
+        std::make_shared<CachedRoute>(url, std::move(chain),
+            storedHeaders(headers, forwarded));
+    if (ttl >= 0) {
+        newEntry->expires_ = newEntry->getCreated() + ttl;
+    }
     
     // Insert the CachedRoute class into the cache
-    if (!map_.insert(url, newEntry).second) { // blocks for write access
-        VLOG(1) << "Could not add route into cache: " << url;
-        return false;
+    { // critical section
+        std::lock_guard<std::mutex> guard(lock_);
+        if (!admitLocked(*newEntry)) {
+            VLOG(1) << "Route not popular enough to cache: " << url;
+            return false;
+        }
+        // fresh content replaces a 404, an error or an expired copy
+        std::shared_ptr<CachedRoute> replaced;
+        auto existing = map_.find(url);
+        if (existing != map_.cend() && (existing->second->isNegative() ||
+            existing->second->isExpired())) {
+            replaced = existing->second;
+            retireLocked(*replaced);
+        }
+        if (!insertLocked(newEntry, replaced)) {
+            VLOG(1) << "Could not add route into cache: " << url;
+            return false;
+        }
     }
-    size_t dataSize = newEntry->getContent()->computeChainDataLength();
+    size_t dataSize = newEntry->getSize();
     VLOG(1) << "Route chain byte size: " << dataSize;
     LOG(INFO) << "Added new cached route: " << url;
 
     if (this->writeToDisk_) {
-        // write bytes to file
-        // todo: use thread pool to do this off of the event IO threads
-        folly::File f(cache_directory_ + newEntry->getHash(),
-            O_WRONLY | O_CREAT | O_TRUNC, 0666);
-        folly::gen::from(*newEntry->getContent()) | 
-            folly::gen::toFile(f.dup(), dataSize);
+        writeBody(newEntry);
     }
     
     return true;
 }
 
+void ContentCache::writeBody(std::shared_ptr<CachedRoute> route) {
+    std::string hash = route->getHash();
+    if (store_->acquire(hash, route->getSize())) {
+        // first route with this body, write bytes to file off of the
+        // event IO threads
+        store_->prepare(hash);
+        io_->writeFile(store_->pathFor(hash), route->getContent(),
+            config_->cache_fsync, nullptr,
+            [this, hash](ssize_t written, std::unique_ptr<folly::IOBuf>) {
+                if (written < 0) {
+                    LOG(ERROR) << "Could not write cached route to disk: " <<
+                        folly::errnoStr(-written);
+                }
+                store_->markWritten(hash, written >= 0);
+            });
+    }
+    pendingWrites_++;
+    store_->whenWritten(hash, [this, route](bool ok) {
+        // the route can only be demoted (and is only indexed) once its
+        // body is on disk
+        auto current = map_.find(route->getURL());
+        if (ok && current != map_.cend() && current->second == route) {
+            route->setPersisted();
+            if (journal_) {
+                journal_->appendAdd(route->toIndexEntry());
+            }
+        }
+        pendingWrites_--;
+    });
+}
+
+bool ContentCache::insertLocked(std::shared_ptr<CachedRoute> route,
+    std::shared_ptr<CachedRoute> expected) {
+    std::string url = route->getURL();
+    // share the body before the route can be seen by other threads
+    shareBodyLocked(*route);
+    if (expected) {
+        if (!map_.assign_if_equal(std::string(url), expected,
+            std::shared_ptr<CachedRoute>(route))) {
+            releaseBodyLocked(*route);
+            return false;
+        }
+    } else if (!map_.insert(url, route).second) { // blocks for write access
+        releaseBodyLocked(*route);
+        return false;
+    }
+    if (!expected) addVariantLocked(url);
+    // new routes go just behind the hand, so they get a full sweep
+    // before they can be evicted
+    route->clockPos_ = clock_.insert(hand_, route);
+    evictLocked(namespaceOf(url));
+    return true;
+}
+
+bool ContentCache::admitLocked(const CachedRoute& route) {
+    if (!sketch_) return true;
+    size_t memoryLimit = config_->cache_memory_bytes;
+    bool full = clock_.size() >= maxSize_ || (memoryLimit > 0 &&
+        memoryBytes_ + route.getSize() > memoryLimit);
+    if (!full || clock_.empty()) {
+        admitted_++;
+        return true;
+    }
+    // find the route the hand would evict next, without moving it
+    auto it = hand_ == clock_.end() ? clock_.begin() : hand_;
+    for (size_t i = 0; i < clock_.size(); i++) {
+        if (!(*it)->referenced_) break;
+        if (++it == clock_.end()) it = clock_.begin();
+    }
+    if (sketch_->estimate(route.getURL()) >
+        sketch_->estimate((*it)->getURL())) {
+        admitted_++;
+        return true;
+    }
+    rejected_++;
+    return false;
+}
+
+void ContentCache::retireLocked(const CachedRoute& route) {
+    // negative routes are dropped from their own list as it fills up
+    if (route.isNegative()) return;
+    if (!route.isOnDisk()) {
+        if (hand_ == route.clockPos_) ++hand_;
+        clock_.erase(route.clockPos_);
+        releaseBodyLocked(route);
+    }
+    if (store_) {
+        store_->release(route.getHash());
+    }
+    if (journal_ && route.isPersisted()) {
+        journal_->appendRemove(route.getURL());
+    }
+}
+
+void ContentCache::addVariantLocked(const std::string& url) {
+    auto separator = url.find(CacheKeyBuilder::VARIANT_SEPARATOR);
+    if (separator == std::string::npos) return;
+    variants_[url.substr(0, separator)]++;
+}
+
+void ContentCache::removeVariantLocked(const std::string& url) {
+    auto separator = url.find(CacheKeyBuilder::VARIANT_SEPARATOR);
+    if (separator == std::string::npos) return;
+    auto it = variants_.find(url.substr(0, separator));
+    if (it == variants_.end()) return;
+    if (--it->second == 0) {
+        vary_.erase(it->first);
+        variants_.erase(it);
+    }
+}
+
+void ContentCache::shareBodyLocked(CachedRoute& route) {
+    auto& body = bodies_[route.getHash()];
+    if (body.refs == 0) {
+        body.data = route.content_->clone();
+        memoryBytes_ += route.getSize();
+        body.budget = budgetLocked(namespaceOf(route.getURL()));
+        if (body.budget) {
+            body.budget->bytes += route.getSize();
+        }
+    } else {
+        // drop this route's copy in favour of the one already held
+        route.content_ = body.data->clone();
+    }
+    body.refs++;
+}
+
+void ContentCache::releaseBodyLocked(const CachedRoute& route) {
+    auto it = bodies_.find(route.getHash());
+    if (it == bodies_.end()) return;
+    if (--it->second.refs == 0) {
+        memoryBytes_ -= route.getSize();
+        if (it->second.budget) {
+            it->second.budget->bytes -= route.getSize();
+        }
+        bodies_.erase(it);
+    }
+}
+
+void ContentCache::evictLocked(folly::StringPiece ns) {
+    size_t memoryLimit = config_->cache_memory_bytes;
+    // a namespace over its own budget only evicts its own routes, so one
+    // tenant can't push the others out
+    auto budget = budgetLocked(ns);
+    size_t passed = 0;
+    while (!clock_.empty()) {
+        bool overShare = budget && budget->bytes > budget->limit;
+        if (!overShare && clock_.size() <= maxSize_ &&
+            (memoryLimit == 0 || memoryBytes_ <= memoryLimit)) {
+            break;
+        }
+        if (hand_ == clock_.end()) hand_ = clock_.begin();
+        auto victim = *hand_;
+        if (overShare && namespaceOf(victim->getURL()) != ns) {
+            // its bytes may all be in bodies now only used by others
+            if (++passed > 2 * clock_.size()) budget = nullptr;
+            ++hand_;
+            continue;
+        }
+        if (victim->referenced_.exchange(false)) {
+            // recently used, give it another sweep
+            ++hand_;
+            continue;
+        }
+        hand_ = clock_.erase(hand_);
+        passed = 0;
+        releaseBodyLocked(*victim);
+
+        std::string url = victim->getURL();
+        if (victim->isPersisted()) {
+            // keep serving it from its body file
+            auto demoted = CachedRoute::onDisk(url, victim->getSize(),
+                victim->headers_, victim->getHash(),
+                victim->getCreated());
+            map_.assign_if_equal(std::move(url), victim, std::move(demoted));
+            VLOG(1) << "Demoted cached route to disk: " << victim->getURL();
+        } else {
+            // routes are only ever replaced with lock_ held, so the one
+            // in the map is still the victim
+            map_.erase(url);
+            removeVariantLocked(url);
+            if (store_) {
+                store_->release(victim->getHash());
+            }
+            VLOG(1) << "Evicted cached route: " << url;
+        }
+    }
+}
+
+bool ContentCache::addNegativeRoute(std::string url,
+    std::unique_ptr<folly::IOBuf> chain,
+    std::shared_ptr<proxygen::HTTPMessage> headers, uint32_t ttl,
+    const proxygen::HTTPHeaders* forwarded) {
+    size_t budget = config_->negative_cache_bytes;
+    size_t maxRoutes = config_->negative_cache_max_routes;
+    if (ttl == 0 || maxRoutes == 0 ||
+        chain->computeChainDataLength() > budget) {
+        return false;
+    }
+    auto route = std::make_shared<CachedRoute>(url, std::move(chain),
+        storedHeaders(headers, forwarded));
+    route->negative_ = true;
+    route->expires_ = route->getCreated() + ttl;
+    size_t charge = negativeCharge(*route);
+    if (charge > budget) return false;
+
+    std::lock_guard<std::mutex> guard(lock_);
+    auto existing = map_.find(url);
+    if (existing == map_.cend()) {
+        if (!map_.insert(url, route).second) return false;
+        addVariantLocked(url);
+    } else if (!existing->second->isNegative() ||
+        !map_.assign_if_equal(std::string(url), existing->second,
+            std::shared_ptr<CachedRoute>(route))) {
+        return false;
+    }
+    negative_.push_back(route);
+    negativeBytes_ += charge;
+    while (negativeBytes_ > budget || negative_.size() > maxRoutes) {
+        auto victim = negative_.front();
+        negative_.pop_front();
+        negativeBytes_ -= negativeCharge(*victim);
+        auto current = map_.find(victim->getURL());
+        // routes are only ever replaced with lock_ held
+        if (current != map_.cend() && current->second == victim) {
+            map_.erase(victim->getURL());
+            removeVariantLocked(victim->getURL());
+        }
+    }
+    VLOG(1) << "Added negative cached route: " << url;
+    return true;
+}
+
+size_t ContentCache::negativeCharge(const CachedRoute& route) {
+    // the body, the route's metadata and the map's copy of the URL
+    return route.getSize() + route.getOverhead() + route.url_.size();
+}
+
+std::string ContentCache::getContentPath(const CachedRoute& route) const {
+    if (store_) {
+        return store_->pathFor(route.getHash());
+    }
+    return cache_directory_ + route.getHash();
+}
+
+bool ContentCache::shouldPromote(const CachedRoute& route) const {
+    return route.isOnDisk() && config_->disk_promote_hits > 0 &&
+        route.getHits() >= config_->disk_promote_hits;
+}
+
+bool ContentCache::promote(std::shared_ptr<CachedRoute> route,
+    std::unique_ptr<folly::IOBuf> content) {
+    if (!route->isOnDisk() || !content) return false;
+    std::string url = route->getURL();
+    auto promoted = std::make_shared<CachedRoute>(url, std::move(content),
+        route->headers_, route->getHash(), route->getCreated());
+    promoted->setPersisted();
+    std::lock_guard<std::mutex> guard(lock_);
+    if (!insertLocked(promoted, route)) return false;
+    VLOG(1) << "Promoted cached route to memory: " << url;
+    return true;
+}
+
+void ContentCache::loadFromDisk() {
+    if (!config_->cache_snapshot_path.empty()) {
+        loadSnapshot(config_->cache_snapshot_path);
+    }
+    if (!journal_ || loader_.joinable()) return;
+    loader_ = std::thread([this]() {
+        auto start = std::chrono::steady_clock::now();
+        auto entries = journal_->replay();
+        size_t restored = 0;
+        bool complete = true;
+        // restore the most recently added routes first, so they're the
+        // ones that end up in memory
+        for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+            if (stopping_) {
+                complete = false;
+                break;
+            }
+            if (restoreRoute(*it)) restored++;
+        }
+        // drop superseded and unrestorable records from the journal,
+        // unless shutting down cut the load short and the routes not
+        // restored yet still have to be kept for the next start
+        if (complete) {
+            journal_->compact([this]() { return indexEntries(); });
+            // only now is every body still indexed known to the store
+            size_t orphans = store_->removeOrphans();
+            if (orphans > 0) {
+                LOG(INFO) << "Removed " << orphans <<
+                    " unindexed cached bodies";
+            }
+        }
+        LOG(INFO) << "Restored " << restored << " of " << entries.size() <<
+            " cached routes from disk in " <<
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start).count() << "ms (" <<
+            memoryRoutes() << " in memory)";
+    });
+}
+
+size_t ContentCache::loadSnapshot(const std::string& path) {
+    if (access(path.c_str(), F_OK) != 0) return 0;
+    std::shared_ptr<CacheSnapshot> snapshot;
+    try {
+        snapshot = CacheSnapshot::open(path);
+    } catch (const std::exception& e) {
+        LOG(ERROR) << "Could not load cache snapshot: " << e.what();
+        return 0;
+    }
+
+    size_t loaded = 0;
+    size_t memoryLimit = config_->cache_memory_bytes;
+    for (auto& entry : snapshot->getEntries()) {
+        // entries are newest first, stop once memory is full
+        if (memoryRoutes() >= maxSize_ || (memoryLimit > 0 &&
+            memoryBytes_ + entry.length > memoryLimit)) {
+            break;
+        }
+        std::string url = entry.index.url;
+        auto route = std::make_shared<CachedRoute>(url,
+            snapshot->getBody(entry), headersFromEntry(entry.index),
+            entry.index.hash, entry.index.created);
+        // the body may also be in the cache directory already
+        bool adopted = store_ && store_->adopt(entry.index.hash);
+        if (adopted) {
+            route->setPersisted();
+        }
+        bool inserted;
+        { // critical section
+            std::lock_guard<std::mutex> guard(lock_);
+            inserted = insertLocked(route);
+        }
+        if (!inserted) {
+            if (adopted) store_->release(entry.index.hash);
+            continue;
+        }
+        if (store_ && !adopted) {
+            writeBody(route);
+        }
+        restoreVary(entry.index);
+        loaded++;
+    }
+    LOG(INFO) << "Loaded " << loaded << " of " <<
+        snapshot->getEntries().size() << " cached routes from snapshot " <<
+        path;
+    return loaded;
+}
+
+size_t ContentCache::writeSnapshot(const std::string& path) const {
+    std::vector<std::shared_ptr<CachedRoute>> routes;
+    for (auto it = map_.cbegin(); it != map_.cend(); ++it) {
+        if (it->second->isNegative()) continue;
+        routes.push_back(it->second);
+    }
+    // newest first, so they're the ones loaded when memory is short
+    std::sort(routes.begin(), routes.end(),
+        [](const std::shared_ptr<CachedRoute>& a,
+            const std::shared_ptr<CachedRoute>& b) {
+            return a->getCreated() > b->getCreated();
+        });
+    std::vector<CacheSnapshot::Record> records;
+    for (auto& route : routes) {
+        CacheSnapshot::Record record;
+        record.index = route->toIndexEntry();
+        record.body = route->getContent();
+        if (!record.body) {
+            record.bodyPath = getContentPath(*route);
+        }
+        records.push_back(std::move(record));
+    }
+    try {
+        CacheSnapshot::write(path, records);
+    } catch (const std::exception& e) {
+        LOG(ERROR) << "Could not write cache snapshot: " << e.what();
+        return 0;
+    }
+    LOG(INFO) << "Wrote " << records.size() << " cached routes to snapshot " <<
+        path;
+    return records.size();
+}
+
+void ContentCache::waitForLoad() {
+    if (loader_.joinable()) {
+        loader_.join();
+    }
+}
+
+bool ContentCache::restoreRoute(const CacheIndexEntry& entry) {
+    std::string url = entry.url;
+    // routes fetched since startup are newer than the ones on disk
+    if (map_.find(url) != map_.cend()) return false;
+
+    auto size = store_->adopt(entry.hash);
+    if (!size) {
+        VLOG(1) << "Body of cached route " << url << " is gone";
+        return false;
+    }
+
+    std::unique_ptr<folly::IOBuf> body;
+    size_t memoryLimit = config_->cache_memory_bytes;
+    bool fits = memoryRoutes() < maxSize_ &&
+        (memoryLimit == 0 || memoryBytes_ + *size <= memoryLimit);
+    if (fits) {
+        try {
+            folly::File f(store_->pathFor(entry.hash), O_RDONLY);
+            body = folly::IOBuf::create(*size);
+            auto n = folly::readFull(f.fd(), body->writableData(), *size);
+            if (n < 0 || static_cast<size_t>(n) != *size) {
+                body.reset();
+            } else {
+                body->append(n);
+            }
+        } catch (const std::exception& e) {
+            VLOG(1) << "Could not read cached route " << url << ": " <<
+                e.what();
+        }
+        if (!body) {
+            store_->release(entry.hash);
+            return false;
+        }
+    }
+
+    auto headers = headersFromEntry(entry);
+    std::shared_ptr<CachedRoute> route;
+    if (body) {
+        route = std::make_shared<CachedRoute>(url, std::move(body),
+            std::move(headers), entry.hash, entry.created);
+        route->setPersisted();
+    } else {
+        route = CachedRoute::onDisk(url, *size, std::move(headers),
+            entry.hash, entry.created);
+    }
+    bool inserted;
+    { // critical section
+        std::lock_guard<std::mutex> guard(lock_);
+        inserted = body ? insertLocked(route) :
+            map_.insert(url, route).second;
+        if (inserted && !body) addVariantLocked(url);
+    }
+    if (!inserted) {
+        store_->release(entry.hash);
+    } else {
+        restoreVary(entry);
+    }
+    return inserted;
+}
+
+void ContentCache::restoreVary(const CacheIndexEntry& entry) {
+    auto separator = entry.url.find(CacheKeyBuilder::VARIANT_SEPARATOR);
+    if (separator == std::string::npos) return;
+    // the variant's own Vary header names the headers it was picked by
+    std::string vary;
+    for (auto& header : entry.headers) {
+        if (strcasecmp(header.first.c_str(), "Vary") != 0) continue;
+        std::vector<folly::StringPiece> names;
+        folly::split(',', header.second, names, true);
+        for (auto name : names) {
+            name = folly::trimWhitespace(name);
+            if (!name.empty() && !folly::StringPiece("Accept-Encoding")
+                .equals(name, folly::AsciiCaseInsensitive())) {
+                CacheKeyBuilder::appendVaryHeader(name, vary);
+            }
+        }
+    }
+    if (!vary.empty()) {
+        setVary(entry.url.substr(0, separator), vary);
+    }
+}
+
+void ContentCache::collectGarbage() {
+    uint64_t quota = config_->cache_disk_quota_bytes;
+    uint64_t used = store_->getUsedBytes();
+    if (quota > 0 && used > quota) {
+        // drop disk tier routes, oldest first, until their bodies fit
+        std::vector<std::shared_ptr<CachedRoute>> diskRoutes;
+        for (auto it = map_.cbegin(); it != map_.cend(); ++it) {
+            if (it->second->isOnDisk()) diskRoutes.push_back(it->second);
+        }
+        std::sort(diskRoutes.begin(), diskRoutes.end(),
+            [](const std::shared_ptr<CachedRoute>& a,
+                const std::shared_ptr<CachedRoute>& b) {
+                return a->getCreated() < b->getCreated();
+            });
+        size_t dropped = 0;
+        for (auto& route : diskRoutes) {
+            if (used <= quota) break;
+            std::string url = route->getURL();
+            { // critical section
+                std::lock_guard<std::mutex> guard(lock_);
+                auto current = map_.find(url);
+                if (current == map_.cend() || current->second != route) {
+                    continue;
+                }
+                map_.erase(url);
+                removeVariantLocked(url);
+            }
+            store_->release(route->getHash());
+            if (store_->getRefs(route->getHash()) == 0) {
+                // bodies shared with other routes don't free anything
+                used -= std::min<uint64_t>(used, route->getSize());
+            }
+            if (journal_) {
+                journal_->appendRemove(url);
+            }
+            dropped++;
+        }
+        if (used > quota) {
+            LOG(WARNING) << "Cache directory is over its quota with " <<
+                "only routes held in memory left to drop";
+        }
+        LOG(INFO) << "Dropped " << dropped << " cached routes from disk " <<
+            "to stay within the disk quota";
+    }
+    size_t removed = store_->collect();
+    if (removed > 0) {
+        VLOG(1) << "Removed " << removed << " unused cached bodies";
+    }
+}
+
+std::vector<CacheIndexEntry> ContentCache::indexEntries() const {
+    std::vector<CacheIndexEntry> entries;
+    for (auto it = map_.cbegin(); it != map_.cend(); ++it) {
+        if (!it->second->isPersisted()) continue;
+        entries.push_back(it->second->toIndexEntry());
+    }
+    // keep the oldest routes first so they're restored last
+    std::sort(entries.begin(), entries.end(),
+        [](const CacheIndexEntry& a, const CacheIndexEntry& b) {
+            return a.created < b.created;
+        });
+    return entries;
+}
+
 std::shared_ptr<folly::F14FastMap<std::string, std::string>> 
     ContentCache::getAssetHashMap() const {
     auto map = std::make_shared
         <folly::F14FastMap<std::string, std::string>>(this->size());
     for (auto it = map_.cbegin(); it != map_.cend(); ++it) {
+        if (it->second->isNegative()) continue;
         map->insert(std::make_pair(it->first, it->second->getHash()));
     }
     return map;
 }
 
 size_t ContentCache::size() const { return map_.size(); }
+
+size_t ContentCache::memoryRoutes() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return clock_.size();
+}
+
+size_t ContentCache::memoryBytes() const { return memoryBytes_; }
+
+size_t ContentCache::memoryBodies() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return bodies_.size();
+}
+
+size_t ContentCache::negativeRoutes() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return negative_.size();
+}
+
+size_t ContentCache::negativeBytes() const { return negativeBytes_; }
+
+size_t ContentCache::metadataBytes() const {
+    size_t bytes = 0;
+    for (auto& it : map_) {
+        bytes += it.first.capacity() + it.second->getOverhead();
+    }
+    for (auto& it : vary_) {
+        bytes += it.first.capacity() + it.second.capacity();
+    }
+    { // critical section
+        std::lock_guard<std::mutex> guard(lock_);
+        for (auto& it : variants_) {
+            bytes += it.first.capacity() + sizeof(it.second);
+        }
+    }
+    return bytes;
+}
+
+size_t ContentCache::namespaceBytes(const std::string& ns) const {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = namespaces_.find(ns);
+    return it == namespaces_.end() ? 0 : it->second.bytes;
+}
+
+ContentCache::NamespaceBudget* ContentCache::budgetLocked(
+    folly::StringPiece ns) {
+    if (ns.empty() || namespaces_.empty()) return nullptr;
+    auto it = namespaces_.find(ns.str());
+    return it == namespaces_.end() ? nullptr : &it->second;
+}
+
+std::string ContentCache::namespacedKey(folly::StringPiece ns,
+    folly::StringPiece url) {
+    if (ns.empty()) return url.str();
+    return folly::to<std::string>("@", ns, "@", url);
+}
+
+folly::StringPiece ContentCache::namespaceOf(folly::StringPiece key) {
+    // URLs start with a slash (or a scheme), never with an @, and
+    // namespace names can't contain one
+    if (!key.startsWith('@')) return "";
+    auto end = key.find('@', 1);
+    if (end == folly::StringPiece::npos) return "";
+    return key.subpiece(1, end - 1);
+}
+
+folly::StringPiece ContentCache::pathOf(folly::StringPiece key) {
+    auto ns = namespaceOf(key);
+    if (!ns.empty()) key.advance(ns.size() + 2);
+    if (!key.startsWith('/')) {
+        auto scheme = key.find("://");
+        if (scheme != folly::StringPiece::npos) {
+            auto path = key.find('/', scheme + 3);
+            key = path == folly::StringPiece::npos ?
+                folly::StringPiece("/") : key.subpiece(path);
+        }
+    }
+    // slice and variant suffixes start with a # (clients never send
+    // fragments), the query with a ?
+    auto end = key.find_first_of(folly::StringPiece("?#"));
+    return end == folly::StringPiece::npos ? key : key.subpiece(0, end);
+}
+
+size_t ContentCache::pendingWrites() const { return pendingWrites_; }
+
+uint64_t ContentCache::diskBytes() const {
+    return store_ ? store_->getUsedBytes() : 0;
+}
+
+uint64_t ContentCache::admitted() const { return admitted_; }
+uint64_t ContentCache::rejected() const { return rejected_; }
+
+DiskIOEngine* ContentCache::getDiskIO() const { return io_.get(); }
+
+DiskIOStats ContentCache::getDiskIOStats() const {
+    return io_ ? io_->getStats() : DiskIOStats();
+}
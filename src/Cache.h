@@ -1,62 +1,421 @@
 #pragma once
 
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <thread>
+
+#include <folly/Range.h>
 #include <folly/io/IOBuf.h>
 #include <folly/gen/File.h>
+#include <folly/container/EvictingCacheMap.h>
 #include <folly/container/F14Map.h>
 #include <folly/concurrency/ConcurrentHashMap.h>
+#include <folly/experimental/FunctionScheduler.h>
 
 #include <proxygen/lib/http/HTTPMessage.h>
 
+#include "CacheJournal.h"
+#include "CacheSnapshot.h"
+#include "CachedHeaders.h"
+#include "DiskIOEngine.h"
+#include "DiskStore.h"
+#include "FrequencySketch.h"
+#include "MasternodeConfig.h"
+
 class CachedRoute {
     public:
+        // If the hash of the content is already known (e.g. when the
+        // route is restored from disk) it can be passed in to skip
+        // hashing the content again
         CachedRoute(std::string& url,
             std::unique_ptr<folly::IOBuf> data,
-            std::shared_ptr<proxygen::HTTPMessage> headers);
+            std::shared_ptr<const CachedHeaders> headers,
+            std::string hash = "",
+            int64_t created = 0);
+
+        // Creates a disk tier route, whose content is only in its body
+        // file in the cache directory
+        static std::shared_ptr<CachedRoute> onDisk(std::string url,
+            size_t size, std::shared_ptr<const CachedHeaders> headers,
+            std::string hash, int64_t created);
 
         std::string getHash() const;
         std::string getURL() const;
+        // Returns null for disk tier routes
         std::unique_ptr<folly::IOBuf> getContent() const;
-        std::shared_ptr<proxygen::HTTPMessage> getHeaders() const;
+        // Status and headers the origin sent with the content
+        const CachedHeaders& getHeaders() const;
+        // Status of a response serving the whole route (the origin's,
+        // but a 200 for slices)
+        uint16_t getStatus() const;
+        // Fills in the headers of a response serving the whole route: its
+        // status and the stored headers that are sent to clients,
+        // Accept-Ranges (for 200s) and Content-Length. Any headers the
+        // response already had are replaced. Nothing is parsed, the
+        // headers are copied from their compact form into the message
+        // (which the caller reuses across hits).
+        void writeResponse(proxygen::HTTPMessage& response) const;
+        // True if the content is an HTML page
+        bool isHTML() const;
+        int64_t getCreated() const;
+        int64_t getExpires() const;
+        // Size of the content in bytes
+        size_t getSize() const;
+        // Bytes of memory used by the route's metadata (not its content)
+        size_t getOverhead() const;
+
+        // True if the content isn't held in memory
+        bool isOnDisk() const;
+        // True for a cached 404, 410 or error response
+        bool isNegative() const;
+
+        // True once the route is past its expiry (routes without one
+        // never expire)
+        bool isExpired() const;
+        // True if an expired route may still be served while the origin
+        // is failing: for the origin's stale-if-error window, or "grace"
+        // seconds past its expiry if it didn't give one. Never for
+        // routes the origin said must be revalidated.
+        bool canServeStale(int64_t grace) const;
+        // Seconds since the route was stored
+        int64_t getAge() const;
+        // True once the content has been written to the cache directory
+        bool isPersisted() const;
+        void setPersisted();
+
+        // Marks the route as used (for eviction and promotion)
+        void touch();
+        uint32_t getHits() const;
+
+        // Returns the entry describing this route in the on-disk index
+        CacheIndexEntry toIndexEntry() const;
+
+        // Returns the unix time the response stops being fresh according
+        // to its Cache-Control (s-maxage, max-age) or Expires headers,
+        // or 0 if it doesn't say
+        static int64_t computeExpires(const CachedHeaders& headers,
+            int64_t now);
+        static int64_t computeExpires(const proxygen::HTTPMessage& headers,
+            int64_t now);
     private:
+        friend class ContentCache;
+
+        CachedRoute() = default;
+
+        // Sets the fields derived from the headers
+        void readHeaders();
+
         std::string sha256_;
         std::string url_;
         std::unique_ptr<folly::IOBuf> content_{nullptr};
-        std::shared_ptr<proxygen::HTTPMessage> headers_{nullptr};
+        // Shared with the route's replacement when it moves between tiers
+        std::shared_ptr<const CachedHeaders> headers_{nullptr};
+        // Unix time the route was stored
+        int64_t created_{0};
+        // Unix time the route stops being fresh (0 if unknown)
+        int64_t expires_{0};
+        size_t size_{0};
+        bool html_{false};
+        bool negative_{false};
+        // Cache-Control stale-if-error (-1 if not given), and whether
+        // must-revalidate or proxy-revalidate was set
+        int64_t staleIfError_{-1};
+        bool mustRevalidate_{false};
+        // Position in the CLOCK list while held in memory (guarded by
+        // the cache's lock)
+        std::list<std::shared_ptr<CachedRoute>>::iterator clockPos_;
+        std::atomic<bool> persisted_{false};
+        // CLOCK reference bit, set on every hit and cleared as the
+        // eviction hand sweeps past
+        std::atomic<bool> referenced_{false};
+        std::atomic<uint32_t> hits_{0};
 };
 
+// Two tier HTTP content cache. Routes are kept in memory up to a byte
+// budget (and route count), and evicted with the CLOCK algorithm. Bodies
+// are shared by content hash, so URLs with identical content (e.g. query
+// string variants) hold and are charged for a single buffer. When
+// writing to disk is enabled, evicted routes are demoted to a disk tier
+// instead of being dropped: only their metadata stays in memory and
+// their content is served from the body file in the cache directory.
+// Disk tier routes that keep being hit are promoted back to memory.
+// With admission enabled, a new route that would push another one out
+// of a full memory tier is only added if it's been requested more often
+// recently than the route it would evict (TinyLFU). 404s, 410s and
+// selected errors from the origin are cached briefly alongside the
+// regular routes, in a small budget of their own.
 class ContentCache {
     public:
         const size_t DEFAULT_INITIAL_CACHE_SIZE = 64;
         const size_t DEFAULT_MAX_CACHE_SIZE = 1024;
+        // Name of the index journal inside the cache directory
+        static constexpr const char* JOURNAL_NAME = "index.journal";
+
+        // Cache key of a URL in a tenant's namespace ("@ns@url"). Keys of
+        // the default namespace ("") are the URLs themselves.
+        static std::string namespacedKey(folly::StringPiece ns,
+            folly::StringPiece url);
+        // Namespace a cache key is in
+        static folly::StringPiece namespaceOf(folly::StringPiece key);
+        // Request path a cache key is for, without its namespace, the
+        // scheme and host of an absolute URL, the query, and the slice
+        // or variant suffix (what route rules are matched against)
+        static folly::StringPiece pathOf(folly::StringPiece key);
 
-        ContentCache(size_t maxSize, std::string& dir, bool writeToDisk) : 
-            map_(DEFAULT_INITIAL_CACHE_SIZE, maxSize),
-            cache_directory_(dir),
-            writeToDisk_(writeToDisk) {}
+        explicit ContentCache(std::shared_ptr<MasternodeConfig> config);
+        ~ContentCache();
 
         // Retrieve cached content with the URL as the lookup key
-        std::shared_ptr<CachedRoute> getCachedRoute(std::string) const;
+        std::shared_ptr<CachedRoute> getCachedRoute(
+            const std::string& url) const;
 
-        // Add a new CachedRoute entry to the memory cache
+        // Request headers the route cached under a key varies on (as in
+        // HeaderPolicy::Summary::vary), empty if it doesn't vary. Its
+        // variants are cached under the key followed by the suffix
+        // CacheKeyBuilder::appendVariant builds from those headers.
+        // An entry lasts as long as the route has variants cached;
+        // setVary returns false if there's no room to record it.
+        std::string getVary(const std::string& key) const;
+        bool setVary(const std::string& key, const std::string& vary);
+        void clearVary(const std::string& key);
+
+        // Size of the object a response for a route's key said it was,
+        // kept for the most recent objects larger than a cache slice so
+        // range requests for them are known to be worth slicing. 0 if
+        // it isn't known.
+        size_t getObjectSize(const std::string& key) const;
+        void setObjectSize(const std::string& key, size_t size);
+
+        // Add a new CachedRoute entry to the memory cache, taking over
+        // the chain (which is coalesced if it's in pieces). Returns false
+        // if the route wasn't added (including when the admission filter
+        // turned it away). A ttl of 0 or more overrides how long the
+        // origin's headers say the route is fresh for (in seconds).
+        // Hits are sent the headers in "forwarded" (the ones the header
+        // policy sent the client on the miss), or only the
+        // CachedHeaders::KEPT headers of the origin's if it's null.
         bool addCachedRoute(std::string url,
             std::unique_ptr<folly::IOBuf> chain,
-            std::shared_ptr<proxygen::HTTPMessage> headers);
+            std::shared_ptr<proxygen::HTTPMessage> headers,
+            int32_t ttl = -1,
+            const proxygen::HTTPHeaders* forwarded = nullptr);
+
+        // Adds a negative (404, 410) or error response from the origin,
+        // which is served until it's ttl seconds old. These routes are
+        // only held in memory, in their own budget of bytes (bodies and
+        // metadata) and routes, and replace an expired negative route
+        // for the URL but never a regular one.
+        bool addNegativeRoute(std::string url,
+            std::unique_ptr<folly::IOBuf> chain,
+            std::shared_ptr<proxygen::HTTPMessage> headers, uint32_t ttl,
+            const proxygen::HTTPHeaders* forwarded = nullptr);
+
+        // Returns the path of the file holding a route's content
+        std::string getContentPath(const CachedRoute& route) const;
+
+        // True if a disk tier route has been hit often enough to be
+        // brought back into memory
+        bool shouldPromote(const CachedRoute& route) const;
+
+        // Moves a disk tier route back into memory with its content
+        // (read by the caller while serving it). Does nothing if the
+        // route was replaced in the meantime.
+        bool promote(std::shared_ptr<CachedRoute> route,
+            std::unique_ptr<folly::IOBuf> content);
+
+        // Loads the configured cache snapshot, if any, then starts
+        // restoring the routes recorded in the on-disk index on a
+        // background thread. Routes are served as soon as they're
+        // loaded; the index is compacted once loading has finished.
+        // The index is only used when writing to disk is enabled.
+        void loadFromDisk();
+
+        // Maps a snapshot and adds the routes in it to memory, serving
+        // their bodies straight from the mapped file. Returns the number
+        // of routes added.
+        size_t loadSnapshot(const std::string& path);
+
+        // Writes every cached route (in both tiers) into a snapshot at
+        // path. Returns the number of routes written.
+        size_t writeSnapshot(const std::string& path) const;
+
+        // Blocks until a load started by loadFromDisk() has finished
+        void waitForLoad();
 
         std::shared_ptr<folly::F14FastMap<std::string, std::string>>
             getAssetHashMap() const;
 
+        // Total number of routes (in both tiers)
         size_t size() const;
+        // Number of routes and bytes held in memory
+        size_t memoryRoutes() const;
+        size_t memoryBytes() const;
+        // Number of distinct bodies held in memory
+        size_t memoryBodies() const;
+        // Number of negative routes and the bytes charged for them
+        // (their bodies and metadata)
+        size_t negativeRoutes() const;
+        size_t negativeBytes() const;
+        // Bytes of memory used by route metadata (URLs, hashes, headers)
+        // in both tiers, and by the records of what routes vary on
+        size_t metadataBytes() const;
+        // Bytes held in memory for a namespace with its own budget
+        size_t namespaceBytes(const std::string& ns) const;
+        // Number of routes whose body is still being written to disk
+        size_t pendingWrites() const;
+        // Bytes used by bodies in the cache directory
+        uint64_t diskBytes() const;
+        // Routes let in and turned away by the admission filter
+        uint64_t admitted() const;
+        uint64_t rejected() const;
+
+        // Drops the oldest disk tier routes while the cache directory is
+        // over its quota and deletes bodies no route uses anymore. Runs
+        // periodically in the background.
+        void collectGarbage();
+
+        // Engine for reading and writing body files (null unless writing
+        // to disk is enabled)
+        DiskIOEngine* getDiskIO() const;
+        DiskIOStats getDiskIOStats() const;
 
     private:
+        // Adds a memory route to the map (replacing "expected" if given)
+        // and evicts routes until the memory tier is within its limits.
+        // Must be called with lock_ held.
+        bool insertLocked(std::shared_ptr<CachedRoute> route,
+            std::shared_ptr<CachedRoute> expected = nullptr);
+        void evictLocked(folly::StringPiece ns = "");
+
+        // Drops what a route being replaced in the map holds: its place
+        // in the memory tier, its body reference and its index entry.
+        // Must be called with lock_ held.
+        void retireLocked(const CachedRoute& route);
+
+        // Count a route added to or removed from map_ against the route
+        // it's a variant of (if it is one), dropping that route's vary_
+        // entry along with its last variant. Must be called with lock_
+        // held.
+        void addVariantLocked(const std::string& url);
+        void removeVariantLocked(const std::string& url);
+
+        // Decides whether a new route may go into the memory tier. If
+        // it's full, the route has to be more popular than the route
+        // the CLOCK hand would evict next. Must be called with lock_
+        // held.
+        bool admitLocked(const CachedRoute& route);
+
+        // Points a memory route's content at the body already held for
+        // its hash, or records its content as that body. Bytes are only
+        // charged to the memory tier for the first route with a body.
+        // Must be called with lock_ held, before the route is published.
+        void shareBodyLocked(CachedRoute& route);
+        // Drops a memory route's reference to its body, freeing the
+        // body's bytes once no route uses it. Must be called with lock_
+        // held.
+        void releaseBodyLocked(const CachedRoute& route);
+
+        // Writes the body of a newly added route to disk (unless another
+        // route already has) and indexes the route once it's there
+        void writeBody(std::shared_ptr<CachedRoute> route);
+
+        // Reads the body file of an index entry and inserts the route,
+        // into memory while there's room and into the disk tier after
+        bool restoreRoute(const CacheIndexEntry& entry);
+
+        // Records the headers a restored variant route is picked by
+        void restoreVary(const CacheIndexEntry& entry);
+
+        // Returns the index entries of every route in the cache
+        std::vector<CacheIndexEntry> indexEntries() const;
+
+        std::shared_ptr<MasternodeConfig> config_{nullptr};
+
         // Shared cache object that all handler threads use
         // to serve cached content from. Thread-safe!
         // Reads are wait-free, writes are locking.
         folly::ConcurrentHashMap<std::string /* url */, 
             std::shared_ptr<CachedRoute>> map_;
+
+        // Request headers each varying route's variants are picked by
+        // (at most maxSize_ routes)
+        folly::ConcurrentHashMap<std::string /* key */,
+            std::string /* vary */> vary_;
+        // Variants in map_ of each varying route (guarded by lock_)
+        folly::F14FastMap<std::string /* key */, size_t> variants_;
+
+        // Maximum number of routes held in memory
+        size_t maxSize_;
+
+        // Sizes of large objects, least recently set evicted first (at
+        // most maxSize_ objects)
+        mutable std::mutex sizesLock_;
+        folly::EvictingCacheMap<std::string /* key */, size_t> objectSizes_;
         
         // Directory to write cached files to
         std::string cache_directory_;
 
         // Flag to enable writing cached content to disk
         bool writeToDisk_{false};
+
+        // Serializes changes to the memory tier
+        mutable std::mutex lock_;
+        // Routes held in memory, in CLOCK order (guarded by lock_)
+        std::list<std::shared_ptr<CachedRoute>> clock_;
+        std::list<std::shared_ptr<CachedRoute>>::iterator hand_;
+        std::atomic<size_t> memoryBytes_{0};
+
+        // Negative routes, oldest first, and the bytes charged for them
+        // (guarded by lock_). Routes stay charged until they drop out
+        // of the list, even if they were replaced in the map.
+        std::list<std::shared_ptr<CachedRoute>> negative_;
+        std::atomic<size_t> negativeBytes_{0};
+        // Bytes a negative route is charged: its body and metadata
+        static size_t negativeCharge(const CachedRoute& route);
+
+        // Recent request frequencies of URLs (null unless admission is
+        // enabled)
+        std::unique_ptr<FrequencySketch> sketch_{nullptr};
+        std::atomic<uint64_t> admitted_{0};
+        std::atomic<uint64_t> rejected_{0};
+
+        // Memory budget of a tenant's namespace, and the bytes charged
+        // to it (guarded by lock_)
+        struct NamespaceBudget {
+            size_t limit{0};
+            size_t bytes{0};
+        };
+        // Namespaces with a budget of their own, fixed at construction
+        folly::F14FastMap<std::string, NamespaceBudget> namespaces_;
+        // Must be called with lock_ held, null if ns has no budget
+        NamespaceBudget* budgetLocked(folly::StringPiece ns);
+
+        // A body shared by the memory routes with the same content hash,
+        // charged to the namespace of the route that brought it in
+        struct MemoryBody {
+            std::unique_ptr<folly::IOBuf> data;
+            size_t refs{0};
+            NamespaceBudget* budget{nullptr};
+        };
+        // Bodies of the memory routes by hash (guarded by lock_)
+        folly::F14FastMap<std::string /* sha256 */, MemoryBody> bodies_;
+
+        // Journal of the routes written to disk (null if it couldn't
+        // be opened)
+        std::unique_ptr<CacheJournal> journal_{nullptr};
+
+        // Thread restoring routes from disk on startup
+        std::thread loader_;
+        std::atomic<bool> stopping_{false};
+
+        // Body files in the cache directory (null unless writing to disk
+        // is enabled)
+        std::unique_ptr<DiskStore> store_{nullptr};
+        folly::FunctionScheduler gc_;
+
+        // Runs the disk reads and writes for body files. Its callbacks
+        // use the members above, so it's declared (and destroyed) last.
+        std::unique_ptr<DiskIOEngine> io_{nullptr};
+        std::atomic<size_t> pendingWrites_{0};
 };
@@ -0,0 +1,137 @@
+#include "CacheJournal.h"
+
+#include <unordered_map>
+
+#include <folly/FileUtil.h>
+#include <folly/String.h>
+#include <folly/dynamic.h>
+#include <folly/json.h>
+
+namespace {
+    std::string serializeAdd(const CacheIndexEntry& entry) {
+        folly::dynamic record = indexEntryToDynamic(entry);
+        record["op"] = "add";
+        return folly::toJson(record) + "\n";
+    }
+}
+
+folly::dynamic indexEntryToDynamic(const CacheIndexEntry& entry) {
+    folly::dynamic headers = folly::dynamic::array;
+    for (auto& h : entry.headers) {
+        headers.push_back(folly::dynamic::array(h.first, h.second));
+    }
+    return folly::dynamic::object
+        ("url", entry.url)
+        ("hash", entry.hash)
+        ("created", entry.created)
+        ("expires", entry.expires)
+        ("status", entry.status)
+        ("headers", headers);
+}
+
+CacheIndexEntry indexEntryFromDynamic(const folly::dynamic& record) {
+    CacheIndexEntry entry;
+    entry.url = record["url"].getString();
+    entry.hash = record["hash"].getString();
+    entry.created = record["created"].asInt();
+    entry.expires = record["expires"].asInt();
+    entry.status = record["status"].asInt();
+    for (auto& h : record["headers"]) {
+        entry.headers.emplace_back(h[0].getString(), h[1].getString());
+    }
+    return entry;
+}
+
+CacheJournal::CacheJournal(std::string path): path_(path) {
+    file_ = folly::File(path_, O_RDWR | O_CREAT | O_APPEND, 0666);
+    // terminate a record torn by a crash so the next one starts on its
+    // own line
+    auto locked = file_.wlock();
+    struct stat st;
+    char last;
+    if (fstat(locked->fd(), &st) == 0 && st.st_size > 0 &&
+        folly::preadFull(locked->fd(), &last, 1, st.st_size - 1) == 1 &&
+        last != '\n') {
+        folly::writeFull(locked->fd(), "\n", 1);
+    }
+}
+
+void CacheJournal::appendAdd(const CacheIndexEntry& entry) {
+    append(serializeAdd(entry));
+}
+
+void CacheJournal::appendRemove(const std::string& url) {
+    folly::dynamic record = folly::dynamic::object("op", "remove")("url", url);
+    append(folly::toJson(record) + "\n");
+}
+
+void CacheJournal::append(const std::string& line) {
+    auto locked = file_.wlock();
+    if (folly::writeFull(locked->fd(), line.data(), line.size()) < 0) {
+        LOG(ERROR) << "Could not append to cache journal " << path_;
+    }
+}
+
+std::vector<CacheIndexEntry> CacheJournal::replay() const {
+    std::vector<CacheIndexEntry> entries;
+    std::string contents;
+    if (!folly::readFile(path_.c_str(), contents)) {
+        return entries;
+    }
+    // url -> position in entries, so later records replace earlier ones
+    std::unordered_map<std::string, size_t> positions;
+    std::vector<bool> removed;
+    std::vector<folly::StringPiece> lines;
+    folly::split('\n', contents, lines, true);
+    for (auto& line : lines) {
+        folly::dynamic record;
+        try {
+            record = folly::parseJson(line);
+        } catch (const std::exception& e) {
+            LOG(ERROR) << "Skipping corrupt cache journal record: " << e.what();
+            continue;
+        }
+        try {
+            std::string url = record["url"].getString();
+            auto pos = positions.find(url);
+            if (record["op"].getString() == "remove") {
+                if (pos != positions.end()) {
+                    removed[pos->second] = true;
+                    positions.erase(pos);
+                }
+                continue;
+            }
+            CacheIndexEntry entry = indexEntryFromDynamic(record);
+            if (pos != positions.end()) {
+                removed[pos->second] = true;
+            }
+            positions[url] = entries.size();
+            entries.push_back(std::move(entry));
+            removed.push_back(false);
+        } catch (const std::exception& e) {
+            LOG(ERROR) << "Skipping invalid cache journal record: " << e.what();
+        }
+    }
+
+    std::vector<CacheIndexEntry> live;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (!removed[i]) live.push_back(std::move(entries[i]));
+    }
+    return live;
+}
+
+void CacheJournal::compact(
+    std::function<std::vector<CacheIndexEntry>()> liveEntries) {
+    auto locked = file_.wlock();
+    std::string contents;
+    for (auto& entry : liveEntries()) {
+        contents += serializeAdd(entry);
+    }
+    std::string tmp = path_ + ".tmp";
+    if (!folly::writeFile(contents, tmp.c_str()) ||
+        rename(tmp.c_str(), path_.c_str()) != 0) {
+        LOG(ERROR) << "Could not compact cache journal " << path_;
+        return;
+    }
+    *locked = folly::File(path_, O_WRONLY | O_CREAT | O_APPEND, 0666);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <functional>
+
+#include <folly/File.h>
+#include <folly/Synchronized.h>
+#include <folly/dynamic.h>
+
+// One entry of the persistent cache index
+struct CacheIndexEntry {
+    std::string url;
+    // SHA-256 of the body, which is also the name of the body file
+    std::string hash;
+    // Unix time (seconds) the entry was stored
+    int64_t created{0};
+    // Unix time (seconds) the entry stops being fresh (0 if the origin
+    // didn't give it an explicit lifetime)
+    int64_t expires{0};
+    uint16_t status{200};
+    std::vector<std::pair<std::string, std::string>> headers;
+};
+
+// Conversions between index entries and their JSON representation,
+// shared by the journal and cache snapshots
+folly::dynamic indexEntryToDynamic(const CacheIndexEntry& entry);
+CacheIndexEntry indexEntryFromDynamic(const folly::dynamic& record);
+
+// Append-only journal of the cache index stored next to the cached
+// body files. Every admission appends an "add" record and every
+// removal a "remove" record (one JSON object per line), so writing
+// the index never rewrites existing data. Replaying the journal yields
+// the live entries, and compacting rewrites it with only those.
+class CacheJournal {
+    public:
+        explicit CacheJournal(std::string path);
+
+        void appendAdd(const CacheIndexEntry& entry);
+        void appendRemove(const std::string& url);
+
+        // Reads the journal and returns the live entries in the order
+        // they were added. A truncated last record (from a crash while
+        // appending) is ignored.
+        std::vector<CacheIndexEntry> replay() const;
+
+        // Atomically replaces the journal with one containing only the
+        // entries returned by liveEntries. It's called with appends
+        // blocked, so no record added concurrently is lost.
+        void compact(std::function<std::vector<CacheIndexEntry>()> liveEntries);
+    private:
+        void append(const std::string& line);
+
+        std::string path_;
+        folly::Synchronized<folly::File> file_;
+};
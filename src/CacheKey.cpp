@@ -0,0 +1,108 @@
+#include "CacheKey.h"
+
+#include <algorithm>
+
+#include <folly/String.h>
+#include <folly/small_vector.h>
+
+constexpr const char* CacheKeyBuilder::VARIANT_SEPARATOR;
+
+CacheKeyBuilder::CacheKeyBuilder(std::vector<std::string> drop,
+    std::vector<std::string> allow, bool sort):
+    allow_(std::move(allow)), sort_(sort) {
+    for (auto& name : drop) {
+        if (!name.empty() && name.back() == '*') {
+            dropPrefixes_.push_back(name.substr(0, name.size() - 1));
+        } else {
+            drop_.push_back(name);
+        }
+    }
+}
+
+bool CacheKeyBuilder::keepParam(folly::StringPiece name) const {
+    if (!allow_.empty()) {
+        return std::find(allow_.begin(), allow_.end(), name) != allow_.end();
+    }
+    if (std::find(drop_.begin(), drop_.end(), name) != drop_.end()) {
+        return false;
+    }
+    for (auto& prefix : dropPrefixes_) {
+        if (name.startsWith(prefix)) return false;
+    }
+    return true;
+}
+
+void CacheKeyBuilder::build(folly::StringPiece url, std::string& out) const {
+    // the fragment is never part of the resource
+    url = url.subpiece(0, url.find('#'));
+    auto query = url.find('?');
+    folly::StringPiece path = url.subpiece(0, query);
+
+    // scheme and host of an absolute URL are case insensitive
+    auto scheme = path.find("://");
+    if (scheme != folly::StringPiece::npos &&
+        path.find('/') > scheme) {
+        auto hostEnd = path.find('/', scheme + 3);
+        if (hostEnd == folly::StringPiece::npos) hostEnd = path.size();
+        size_t start = out.size();
+        out.append(path.data(), hostEnd);
+        std::transform(out.begin() + start, out.end(),
+            out.begin() + start, ::tolower);
+        path.advance(hostEnd);
+    }
+    out.append(path.data(), path.size());
+    if (query == folly::StringPiece::npos) return;
+
+    folly::small_vector<folly::StringPiece, INLINE_PARAMS> params;
+    folly::StringPiece rest = url.subpiece(query + 1);
+    while (!rest.empty()) {
+        folly::StringPiece param = rest.split_step('&');
+        if (param.empty()) continue;
+        if (keepParam(param.subpiece(0, param.find('=')))) {
+            params.push_back(param);
+        }
+    }
+    if (sort_) {
+        // by name only, repeated parameters keep their order
+        std::stable_sort(params.begin(), params.end(),
+            [](folly::StringPiece a, folly::StringPiece b) {
+                return a.subpiece(0, a.find('=')) <
+                    b.subpiece(0, b.find('='));
+            });
+    }
+    char separator = '?';
+    for (auto param : params) {
+        out.push_back(separator);
+        out.append(param.data(), param.size());
+        separator = '&';
+    }
+}
+
+void CacheKeyBuilder::appendVaryHeader(folly::StringPiece name,
+    std::string& vary) {
+    if (!vary.empty()) vary.push_back(',');
+    size_t start = vary.size();
+    vary.append(name.data(), name.size());
+    std::transform(vary.begin() + start, vary.end(), vary.begin() + start,
+        ::tolower);
+}
+
+void CacheKeyBuilder::appendVariant(folly::StringPiece vary,
+    const proxygen::HTTPHeaders& headers, std::string& out) {
+    out.append(VARIANT_SEPARATOR);
+    bool first = true;
+    while (!vary.empty()) {
+        folly::StringPiece name = vary.split_step(',');
+        if (name.empty()) continue;
+        if (!first) out.push_back('\n');
+        first = false;
+        bool firstValue = true;
+        headers.forEachValueOfHeader(name, [&](const std::string& value) {
+            if (!firstValue) out.push_back(',');
+            firstValue = false;
+            auto trimmed = folly::trimWhitespace(value);
+            out.append(trimmed.data(), trimmed.size());
+            return false;
+        });
+    }
+}
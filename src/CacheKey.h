@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <folly/Range.h>
+
+#include <proxygen/lib/http/HTTPHeaders.h>
+
+// Turns request URLs into cache keys, so requests for the same content
+// share one cached copy: query parameters that don't change the content
+// (tracking tags and the like) are dropped, the rest are put in order,
+// and the scheme and host of an absolute URL are lowercased. The origin
+// still gets the URL as the client sent it.
+//
+// Keys are written into a string the caller owns, so a handler's key
+// buffer is the only allocation; the parameters are sorted in place on
+// the stack unless a URL has more than INLINE_PARAMS of them.
+class CacheKeyBuilder {
+    public:
+        static const size_t INLINE_PARAMS = 16;
+        // Separates a route's key from the request header values that
+        // select one of its variants
+        static constexpr const char* VARIANT_SEPARATOR = "#vary=";
+
+        // Parameters in drop are removed from keys (a name ending in *
+        // drops every parameter starting with the rest of it). If allow
+        // isn't empty, only the parameters it names are kept.
+        CacheKeyBuilder(std::vector<std::string> drop,
+            std::vector<std::string> allow, bool sort);
+
+        // Appends the key for a request URL (path and query, or an
+        // absolute URL) to "out"
+        void build(folly::StringPiece url, std::string& out) const;
+
+        // Appends the variant suffix for a response that varies on the
+        // request headers named in "vary" (comma separated, as recorded
+        // by the header policy) to "out"
+        static void appendVariant(folly::StringPiece vary,
+            const proxygen::HTTPHeaders& headers, std::string& out);
+
+        // Adds a request header name from a Vary header to a list of
+        // them in the form appendVariant takes
+        static void appendVaryHeader(folly::StringPiece name,
+            std::string& vary);
+    private:
+        bool keepParam(folly::StringPiece name) const;
+
+        std::vector<std::string> drop_;
+        std::vector<std::string> dropPrefixes_;
+        std::vector<std::string> allow_;
+        bool sort_{true};
+};
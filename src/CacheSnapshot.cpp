@@ -0,0 +1,148 @@
+#include "CacheSnapshot.h"
+
+#include <folly/File.h>
+#include <folly/FileUtil.h>
+#include <folly/json.h>
+#include <folly/lang/Bits.h>
+
+constexpr const char* CacheSnapshot::MAGIC;
+constexpr uint32_t CacheSnapshot::VERSION;
+constexpr size_t CacheSnapshot::HEADER_SIZE;
+
+namespace {
+    const size_t COPY_CHUNK_SIZE = 1024 * 1024;
+
+    void writeOrThrow(int fd, const void* data, size_t len) {
+        if (folly::writeFull(fd, data, len) != static_cast<ssize_t>(len)) {
+            folly::throwSystemError("Could not write cache snapshot");
+        }
+    }
+
+    template <class T>
+    void putLE(std::string& out, T value) {
+        value = folly::Endian::little(value);
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    template <class T>
+    T getLE(const uint8_t* data) {
+        T value;
+        memcpy(&value, data, sizeof(value));
+        return folly::Endian::little(value);
+    }
+}
+
+void CacheSnapshot::write(const std::string& path,
+    const std::vector<Record>& records) {
+    std::string tmp = path + ".tmp";
+    folly::File f(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    // bodies first, the header is filled in once the index is written
+    std::string placeholder(HEADER_SIZE, '\0');
+    writeOrThrow(f.fd(), placeholder.data(), placeholder.size());
+    uint64_t offset = HEADER_SIZE;
+    folly::dynamic index = folly::dynamic::array;
+    for (auto& record : records) {
+        uint64_t length = 0;
+        if (record.body) {
+            for (auto& range : *record.body) {
+                writeOrThrow(f.fd(), range.data(), range.size());
+                length += range.size();
+            }
+        } else {
+            folly::File in(record.bodyPath, O_RDONLY);
+            std::vector<char> buf(COPY_CHUNK_SIZE);
+            ssize_t n;
+            while ((n = folly::readFull(in.fd(), buf.data(), buf.size())) > 0) {
+                writeOrThrow(f.fd(), buf.data(), n);
+                length += n;
+            }
+            if (n < 0) {
+                folly::throwSystemError("Could not read " + record.bodyPath);
+            }
+        }
+        folly::dynamic entry = indexEntryToDynamic(record.index);
+        entry["offset"] = offset;
+        entry["length"] = length;
+        index.push_back(entry);
+        offset += length;
+    }
+    std::string json = folly::toJson(index);
+    writeOrThrow(f.fd(), json.data(), json.size());
+
+    std::string header(MAGIC, 8);
+    putLE<uint32_t>(header, VERSION);
+    putLE<uint32_t>(header, 0);
+    putLE<uint64_t>(header, records.size());
+    putLE<uint64_t>(header, offset);
+    putLE<uint64_t>(header, json.size());
+    if (folly::pwriteFull(f.fd(), header.data(), header.size(), 0) !=
+        static_cast<ssize_t>(header.size())) {
+        folly::throwSystemError("Could not write cache snapshot header");
+    }
+    if (fsync(f.fd()) != 0) {
+        folly::throwSystemError("Could not flush cache snapshot");
+    }
+    f.close();
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        folly::throwSystemError("Could not move cache snapshot into place");
+    }
+}
+
+std::shared_ptr<CacheSnapshot> CacheSnapshot::open(const std::string& path) {
+    std::shared_ptr<CacheSnapshot> snapshot(new CacheSnapshot());
+    snapshot->mapping_ = std::make_unique<folly::MemoryMapping>(path.c_str());
+    auto data = snapshot->mapping_->range();
+    if (data.size() < HEADER_SIZE ||
+        memcmp(data.data(), MAGIC, 8) != 0) {
+        throw std::runtime_error("Not a cache snapshot: " + path);
+    }
+    if (getLE<uint32_t>(data.data() + 8) != VERSION) {
+        throw std::runtime_error("Unsupported cache snapshot version");
+    }
+    uint64_t count = getLE<uint64_t>(data.data() + 16);
+    uint64_t indexOffset = getLE<uint64_t>(data.data() + 24);
+    uint64_t indexLength = getLE<uint64_t>(data.data() + 32);
+    if (indexOffset < HEADER_SIZE || indexOffset > data.size() ||
+        indexLength > data.size() - indexOffset) {
+        throw std::runtime_error("Truncated cache snapshot: " + path);
+    }
+
+    auto index = folly::parseJson(folly::StringPiece(
+        reinterpret_cast<const char*>(data.data() + indexOffset),
+        indexLength));
+    if (!index.isArray() || index.size() != count) {
+        throw std::runtime_error("Invalid cache snapshot index: " + path);
+    }
+    snapshot->entries_.reserve(count);
+    for (auto& record : index) {
+        SnapshotEntry entry;
+        entry.index = indexEntryFromDynamic(record);
+        entry.offset = record["offset"].asInt();
+        entry.length = record["length"].asInt();
+        // bodies have to lie between the header and the index
+        if (entry.offset < HEADER_SIZE || entry.offset > indexOffset ||
+            entry.length > indexOffset - entry.offset) {
+            throw std::runtime_error("Invalid cache snapshot entry for " +
+                entry.index.url);
+        }
+        snapshot->entries_.push_back(std::move(entry));
+    }
+    return snapshot;
+}
+
+const std::vector<SnapshotEntry>& CacheSnapshot::getEntries() const {
+    return entries_;
+}
+
+std::unique_ptr<folly::IOBuf> CacheSnapshot::getBody(
+    const SnapshotEntry& entry) {
+    auto data = mapping_->range();
+    // the IOBuf holds a reference to the snapshot, which owns the mapping
+    auto owner = new std::shared_ptr<CacheSnapshot>(shared_from_this());
+    return folly::IOBuf::takeOwnership(
+        const_cast<uint8_t*>(data.data() + entry.offset), entry.length,
+        [](void* /* buf */, void* userData) {
+            delete static_cast<std::shared_ptr<CacheSnapshot>*>(userData);
+        }, owner);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <memory>
+
+#include <folly/io/IOBuf.h>
+#include <folly/system/MemoryMapping.h>
+
+#include "CacheJournal.h"
+
+// A cached route as stored in a snapshot
+struct SnapshotEntry {
+    CacheIndexEntry index;
+    // Position of the body in the pack file
+    uint64_t offset{0};
+    uint64_t length{0};
+};
+
+// Single file snapshot of a cache: every body packed one after the
+// other, followed by an index of URL -> (offset, length, hash, headers).
+// A snapshot is mapped read-only and bodies are served straight from
+// the mapped pages, so opening one only costs reading its index. The
+// same file can be copied to a seed edge node to fill it.
+//
+// Layout (integers are little endian):
+//   magic "GLDSNAP1" | u32 version | u32 reserved | u64 entry count |
+//   u64 index offset | u64 index length | bodies... | index (JSON)
+class CacheSnapshot : public std::enable_shared_from_this<CacheSnapshot> {
+    public:
+        static constexpr const char* MAGIC = "GLDSNAP1";
+        static constexpr uint32_t VERSION = 1;
+        static constexpr size_t HEADER_SIZE = 40;
+
+        // A route to write into a snapshot along with its body, either
+        // in memory or in a file it's copied from
+        struct Record {
+            CacheIndexEntry index;
+            std::unique_ptr<folly::IOBuf> body;
+            std::string bodyPath;
+        };
+
+        // Writes a snapshot of the given routes to path, atomically
+        // replacing any existing file. Throws on errors.
+        static void write(const std::string& path,
+            const std::vector<Record>& records);
+
+        // Maps the snapshot at path. Throws if it can't be read or isn't
+        // a valid snapshot.
+        static std::shared_ptr<CacheSnapshot> open(const std::string& path);
+
+        const std::vector<SnapshotEntry>& getEntries() const;
+
+        // Returns an IOBuf wrapping a body in the mapped file, which
+        // keeps the mapping alive for as long as it exists
+        std::unique_ptr<folly::IOBuf> getBody(const SnapshotEntry& entry);
+    private:
+        CacheSnapshot() = default;
+
+        std::unique_ptr<folly::MemoryMapping> mapping_{nullptr};
+        std::vector<SnapshotEntry> entries_;
+};
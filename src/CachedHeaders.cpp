@@ -0,0 +1,211 @@
+#include "CachedHeaders.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <folly/Synchronized.h>
+#include <folly/container/F14Set.h>
+
+using namespace proxygen;
+
+constexpr size_t CachedHeaders::NUM_KEPT;
+constexpr size_t CachedHeaders::MAX_INTERNED;
+
+const std::array<HTTPHeaderCode, CachedHeaders::NUM_KEPT>
+    CachedHeaders::KEPT = {{
+    HTTP_HEADER_CONTENT_TYPE,
+    HTTP_HEADER_CACHE_CONTROL,
+    HTTP_HEADER_ETAG,
+    HTTP_HEADER_EXPIRES,
+    HTTP_HEADER_LAST_MODIFIED,
+    HTTP_HEADER_CONTENT_ENCODING,
+    HTTP_HEADER_CONTENT_LANGUAGE,
+    HTTP_HEADER_VARY,
+    HTTP_HEADER_CONTENT_DISPOSITION,
+    HTTP_HEADER_ACCESS_CONTROL_ALLOW_ORIGIN,
+    // the range a cached slice holds
+    HTTP_HEADER_CONTENT_RANGE
+}};
+
+namespace {
+    // Values of these headers come from a small set shared by most routes
+    bool isInterned(HTTPHeaderCode code) {
+        return code == HTTP_HEADER_CONTENT_TYPE ||
+            code == HTTP_HEADER_CACHE_CONTROL ||
+            code == HTTP_HEADER_CONTENT_ENCODING ||
+            code == HTTP_HEADER_CONTENT_LANGUAGE ||
+            code == HTTP_HEADER_VARY ||
+            code == HTTP_HEADER_ACCESS_CONTROL_ALLOW_ORIGIN;
+    }
+
+    // Node based so the interned strings never move. Never destroyed,
+    // routes may still point into it during shutdown.
+    folly::Synchronized<folly::F14NodeSet<std::string>>& internTable() {
+        static auto table =
+            new folly::Synchronized<folly::F14NodeSet<std::string>>();
+        return *table;
+    }
+
+    // Returns the shared copy of a value, or null if the table is full
+    const std::string* intern(const std::string& value) {
+        auto& table = internTable();
+        { // critical section
+            auto locked = table.rlock();
+            auto it = locked->find(value);
+            if (it != locked->end()) return &*it;
+        }
+        auto locked = table.wlock();
+        auto it = locked->find(value);
+        if (it != locked->end()) return &*it;
+        if (locked->size() >= CachedHeaders::MAX_INTERNED) return nullptr;
+        return &*locked->insert(value).first;
+    }
+
+    void appendValue(std::string& list, const std::string& value) {
+        if (!list.empty()) list += ", ";
+        list += value;
+    }
+}
+
+CachedHeaders::CachedHeaders(const HTTPMessage& msg):
+    status_(msg.getStatusCode()) {
+    std::array<std::string, NUM_KEPT> values;
+    const auto& hs = msg.getHeaders();
+    for (size_t i = 0; i < NUM_KEPT; i++) {
+        hs.forEachValueOfHeader(KEPT[i], [&](const std::string& value) {
+            appendValue(values[i], value);
+            return false;
+        });
+    }
+    pack(values, {});
+}
+
+CachedHeaders::CachedHeaders(const HTTPMessage& msg,
+    const HTTPHeaders& forwarded):
+    status_(msg.getStatusCode()) {
+    std::array<std::string, NUM_KEPT> values;
+    const auto& hs = msg.getHeaders();
+    for (size_t i = 0; i < NUM_KEPT; i++) {
+        hs.forEachValueOfHeader(KEPT[i], [&](const std::string& value) {
+            appendValue(values[i], value);
+            return false;
+        });
+    }
+    std::vector<std::pair<std::string, std::string>> extras;
+    forwarded.forEachWithCode([&](HTTPHeaderCode code,
+        const std::string& name, const std::string& value) {
+        if (std::find(KEPT.begin(), KEPT.end(), code) == KEPT.end()) {
+            extras.emplace_back(name, value);
+        }
+    });
+    pack(values, extras);
+}
+
+CachedHeaders::CachedHeaders(uint16_t status,
+    const std::vector<std::pair<std::string, std::string>>& headers):
+    status_(status) {
+    std::array<std::string, NUM_KEPT> values;
+    std::vector<std::pair<std::string, std::string>> extras;
+    for (auto& h : headers) {
+        auto it = std::find(KEPT.begin(), KEPT.end(),
+            HTTPCommonHeaders::hash(h.first));
+        if (it != KEPT.end()) {
+            appendValue(values[it - KEPT.begin()], h.second);
+        } else {
+            extras.push_back(h);
+        }
+    }
+    pack(values, extras);
+}
+
+void CachedHeaders::pack(const std::array<std::string, NUM_KEPT>& values,
+    const std::vector<std::pair<std::string, std::string>>& extras) {
+    std::array<const std::string*, NUM_KEPT> interned{};
+    size_t size = 0;
+    for (size_t i = 0; i < NUM_KEPT; i++) {
+        if (values[i].empty()) continue;
+        if (isInterned(KEPT[i])) {
+            interned[i] = intern(values[i]);
+        }
+        if (!interned[i]) {
+            size += values[i].size();
+        }
+    }
+    std::vector<HTTPHeaderCode> codes;
+    codes.reserve(extras.size());
+    for (auto& h : extras) {
+        codes.push_back(HTTPCommonHeaders::hash(h.first));
+        if (codes.back() == HTTP_HEADER_OTHER) {
+            size += h.first.size();
+        }
+        size += h.second.size();
+    }
+    if (size > 0) {
+        arena_.reset(new char[size]);
+    }
+    arenaSize_ = size;
+
+    size_t offset = 0;
+    auto store = [&](const std::string& value, Slot& slot) {
+        memcpy(arena_.get() + offset, value.data(), value.size());
+        slot.data = arena_.get() + offset;
+        slot.length = value.size();
+        offset += value.size();
+    };
+    for (size_t i = 0; i < NUM_KEPT; i++) {
+        if (values[i].empty()) continue;
+        if (interned[i]) {
+            slots_[i].data = interned[i]->data();
+            slots_[i].length = values[i].size();
+        } else {
+            store(values[i], slots_[i]);
+        }
+    }
+    if (!extras.empty()) {
+        extras_.reset(new Extra[extras.size()]);
+    }
+    numExtras_ = extras.size();
+    for (size_t i = 0; i < extras.size(); i++) {
+        extras_[i].code = codes[i];
+        if (codes[i] == HTTP_HEADER_OTHER) {
+            store(extras[i].first, extras_[i].name);
+        }
+        store(extras[i].second, extras_[i].value);
+    }
+}
+
+uint16_t CachedHeaders::getStatus() const { return status_; }
+
+folly::StringPiece CachedHeaders::get(HTTPHeaderCode code) const {
+    auto it = std::find(KEPT.begin(), KEPT.end(), code);
+    if (it == KEPT.end()) return folly::StringPiece();
+    const Slot& slot = slots_[it - KEPT.begin()];
+    return folly::StringPiece(slot.data, slot.length);
+}
+
+void CachedHeaders::forEach(const std::function<void(HTTPHeaderCode,
+    folly::StringPiece, folly::StringPiece)>& fn) const {
+    for (size_t i = 0; i < NUM_KEPT; i++) {
+        if (slots_[i].length > 0) {
+            fn(KEPT[i], HTTPCommonHeaders::getHeaderCodeString(KEPT[i]),
+                folly::StringPiece(slots_[i].data, slots_[i].length));
+        }
+    }
+    for (size_t i = 0; i < numExtras_; i++) {
+        const Extra& extra = extras_[i];
+        folly::StringPiece name = extra.code == HTTP_HEADER_OTHER ?
+            folly::StringPiece(extra.name.data, extra.name.length) :
+            folly::StringPiece(
+                HTTPCommonHeaders::getHeaderCodeString(extra.code));
+        fn(extra.code, name,
+            folly::StringPiece(extra.value.data, extra.value.length));
+    }
+}
+
+size_t CachedHeaders::getOverhead() const {
+    return sizeof(CachedHeaders) + arenaSize_ + numExtras_ * sizeof(Extra);
+}
+
+size_t CachedHeaders::internedValues() {
+    return internTable().rlock()->size();
+}
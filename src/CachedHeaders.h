@@ -0,0 +1,85 @@
+#pragma once
+
+#include <array>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <folly/Range.h>
+
+#include <proxygen/lib/http/HTTPMessage.h>
+
+// The parts of an origin response a cached route needs for serving and
+// revalidation: the status, a fixed set of headers that can be looked
+// up, and any other headers the header policy forwarded to the client,
+// instead of the whole HTTPMessage. Values are packed into a single
+// arena allocation, and values that repeat across many routes (content
+// types, cache policies) are interned and shared rather than stored per
+// route. Immutable once built, so routes share it through a shared_ptr.
+class CachedHeaders {
+    public:
+        // Headers kept from the origin's response, which get() looks up
+        static constexpr size_t NUM_KEPT = 11;
+        static const std::array<proxygen::HTTPHeaderCode, NUM_KEPT> KEPT;
+        // Maximum number of distinct interned values, any others are
+        // stored in the arena of each route
+        static constexpr size_t MAX_INTERNED = 4096;
+
+        CachedHeaders() = default;
+        // Keeps only the KEPT headers of msg
+        explicit CachedHeaders(const proxygen::HTTPMessage& msg);
+        // Keeps the KEPT headers of the origin's response msg, and every
+        // other header in "forwarded", the headers the header policy
+        // sent the client with it
+        CachedHeaders(const proxygen::HTTPMessage& msg,
+            const proxygen::HTTPHeaders& forwarded);
+        // Rebuilds headers from (name, value) pairs, e.g. from the index
+        CachedHeaders(uint16_t status,
+            const std::vector<std::pair<std::string, std::string>>& headers);
+
+        CachedHeaders(const CachedHeaders&) = delete;
+        CachedHeaders& operator=(const CachedHeaders&) = delete;
+
+        uint16_t getStatus() const;
+
+        // Returns the value of a kept header (repeated headers are
+        // combined into one list), empty if the origin didn't send it
+        folly::StringPiece get(proxygen::HTTPHeaderCode code) const;
+
+        // Calls fn with the code, name and value of every stored header
+        void forEach(const std::function<void(proxygen::HTTPHeaderCode,
+            folly::StringPiece, folly::StringPiece)>& fn) const;
+
+        // Bytes used by this object and its arena
+        size_t getOverhead() const;
+
+        // Number of distinct values interned so far
+        static size_t internedValues();
+    private:
+        struct Slot {
+            const char* data{nullptr};
+            uint32_t length{0};
+        };
+
+        // A forwarded header that isn't one of KEPT. The name is only
+        // stored for headers without a code of their own.
+        struct Extra {
+            proxygen::HTTPHeaderCode code{proxygen::HTTP_HEADER_OTHER};
+            Slot name;
+            Slot value;
+        };
+
+        // Fills the slots from values indexed like KEPT, and the extras
+        // from (name, value) pairs
+        void pack(const std::array<std::string, NUM_KEPT>& values,
+            const std::vector<std::pair<std::string, std::string>>& extras);
+
+        std::array<Slot, NUM_KEPT> slots_;
+        std::unique_ptr<Extra[]> extras_;
+        uint32_t numExtras_{0};
+        std::unique_ptr<char[]> arena_;
+        uint32_t arenaSize_{0};
+        uint16_t status_{0};
+};
@@ -3,30 +3,155 @@
 #include <folly/dynamic.h>
 #include <folly/json.h>
 
+#include <functional>
+
+#include "CacheKey.h"
 #include "DirectHandler.h"
+#include "Metrics.h"
+#include "ProxyHandler.h"
 
 using namespace proxygen;
 
 DirectHandler::DirectHandler(std::shared_ptr<ContentCache> cache, 
     std::shared_ptr<MasternodeConfig> config,
-    std::shared_ptr<NetworkState> state):
+    std::shared_ptr<NetworkState> state,
+    std::shared_ptr<const RouteRules> rules,
+    std::shared_ptr<TenantTable> tenants):
         cache_(cache),
         config_(config),
-        state_(state) {
+        state_(state),
+        rules_(rules),
+        tenants_(tenants) {
             CHECK(cache_) << "Cache object was null";
             CHECK(config_) << "Config object was null";
 }
 
 void DirectHandler::onRequest(std::unique_ptr<HTTPMessage> headers) noexcept {
+    request_ = std::move(headers);
+    if (request_->getMethod() == HTTPMethod::POST &&
+        request_->getPath() == EDGE_REPORT_PATH) {
+        // wait for the beacon body
+        isEdgeReport_ = true;
+        return;
+    }
+    if (request_->getMethod() == HTTPMethod::GET &&
+        request_->getPath() == METRICS_PATH) {
+        if (config_->metrics_token.empty()) {
+            // metrics are off, the path is nothing special
+            ResponseBuilder(downstream_)
+                .status(404, "Not Found")
+                .sendWithEOM();
+        } else if (!metricsAuthorized()) {
+            ResponseBuilder(downstream_)
+                .status(403, "Forbidden")
+                .sendWithEOM();
+        } else {
+            sendMetrics();
+        }
+        return;
+    }
+    sendCacheList();
+}
+
+bool DirectHandler::metricsAuthorized() const {
+    const std::string& auth = request_->getHeaders().getSingleOrEmpty(
+        HTTP_HEADER_AUTHORIZATION);
+    const std::string& token = config_->metrics_token;
+    folly::StringPiece scheme("Bearer ");
+    if (auth.size() != scheme.size() + token.size() ||
+        !folly::StringPiece(auth).startsWith(scheme)) {
+        return false;
+    }
+    // compare every byte, so the time taken doesn't tell how much of
+    // the token was right
+    unsigned char diff = 0;
+    for (size_t i = 0; i < token.size(); i++) {
+        diff |= auth[scheme.size() + i] ^ token[i];
+    }
+    return diff == 0;
+}
+
+void DirectHandler::sendMetrics() {
+    std::string out;
+    Metrics::get().render(out);
+
+    Metrics::appendGauge(out, "masternode_cache_routes",
+        "Routes in the cache", cache_->size());
+    Metrics::appendGauge(out, "masternode_cache_memory_bytes",
+        "Bytes of cached content held in memory", cache_->memoryBytes());
+    Metrics::appendGauge(out, "masternode_cache_negative_bytes",
+        "Bytes of cached negative and error responses",
+        cache_->negativeBytes());
+    Metrics::appendGauge(out, "masternode_cache_metadata_bytes",
+        "Bytes of memory used by cache entries besides their content",
+        cache_->metadataBytes());
+    Metrics::appendGauge(out, "masternode_cache_disk_bytes",
+        "Bytes of cached content on disk", cache_->diskBytes());
+    Metrics::appendCounter(out, "masternode_cache_admitted_total",
+        "Routes the admission filter let into a full cache",
+        cache_->admitted());
+    Metrics::appendCounter(out, "masternode_cache_rejected_total",
+        "Routes the admission filter turned away", cache_->rejected());
+    Metrics::appendGauge(out, "masternode_buffered_bytes",
+        "Bytes of origin responses being buffered for the cache",
+        ProxyHandler::getBufferedBytes());
+
+    if (tenants_) {
+        // one sample per origin of every site, told apart by their
+        // index in the site's origin list so their addresses aren't
+        // given away
+        struct OriginGauge {
+            const char* name;
+            const char* help;
+            std::function<double(Origin&)> value;
+        };
+        std::vector<OriginGauge> gauges{
+            {"masternode_origin_healthy",
+                "1 if the origin passes its health checks",
+                [](Origin& o) { return o.isHealthy() ? 1.0 : 0.0; }},
+            {"masternode_origin_outstanding",
+                "Requests waiting on a response from the origin",
+                [](Origin& o) { return double(o.getOutstanding()); }},
+            {"masternode_origin_breaker_state",
+                "State of the origin's circuit breaker (0 closed, 1 open, "
+                "2 half open)",
+                [](Origin& o) {
+                    return double(static_cast<int>(o.getGuard().getState()));
+                }}};
+        for (auto& gauge : gauges) {
+            Metrics::appendHeader(out, gauge.name, gauge.help, "gauge");
+            for (auto& tenant : tenants_->getTenants()) {
+                auto& origins = tenant->origins->getOrigins();
+                for (size_t i = 0; i < origins.size(); i++) {
+                    std::string labels;
+                    Metrics::appendLabel(labels, "site", tenant->name);
+                    Metrics::appendLabel(labels, "origin",
+                        folly::to<std::string>(i));
+                    Metrics::appendSample(out, gauge.name, labels,
+                        gauge.value(*origins[i]));
+                }
+            }
+        }
+    }
+
+    ResponseBuilder(downstream_)
+        .status(200, "OK")
+        .header("Content-Type", "text/plain; version=0.0.4")
+        .body(std::move(out))
+        .sendWithEOM();
+}
+
+void DirectHandler::sendCacheList() {
     // Construct network state json response
 
     // top level JSON response object
     folly::dynamic jsonRes = folly::dynamic::object;
     std::vector<std::shared_ptr<EdgeNode>> edgeNodes;
     if (config_->enableP2P && state_) {
-        // if geoip is on, use nearest neighbor edge nodes
-        if (config_->geo_ip_enabled) {
-            edgeNodes = state_->getNearestEdgeNodes(headers->getClientIP(), 5);
+        // if geoip or network coordinates are on, use nearest
+        // neighbor edge nodes
+        if (config_->geo_ip_enabled || config_->enable_network_coordinates) {
+            edgeNodes = state_->getNearestEdgeNodes(request_->getClientIP(), 5);
         } else { // else send all edge node addresses for now (random in future?)
             edgeNodes = state_->getEdgeNodes();
         }
@@ -41,6 +166,18 @@ void DirectHandler::onRequest(std::unique_ptr<HTTPMessage> headers) noexcept {
     const auto& assetMap = cache_->getAssetHashMap(); // map of urls : hashes
     jsonRes["assetHashes"] = folly::dynamic::object;
     for (auto kv : *assetMap.get()) {
+        // variants are only told apart by the masternode
+        if (kv.first.find(CacheKeyBuilder::VARIANT_SEPARATOR) !=
+            std::string::npos) {
+            continue;
+        }
+        if (rules_) {
+            // keys carry the namespace, query and slice besides the path
+            auto path = ContentCache::pathOf(kv.first);
+            if (!rules_->match(path, "GET", nullptr).edge_offload) {
+                continue;
+            }
+        }
         jsonRes["assetHashes"][kv.first] = kv.second;
     }
 
@@ -51,9 +188,65 @@ void DirectHandler::onRequest(std::unique_ptr<HTTPMessage> headers) noexcept {
         .sendWithEOM();
 }
 
-void DirectHandler::onBody(std::unique_ptr<folly::IOBuf> body) noexcept {}
+// Parses a beacon and records each report. Malformed entries are
+// skipped, the client always gets a 204 so it never retries.
+void DirectHandler::ingestEdgeReports() {
+    if (!state_ || body_.empty()) return;
+    auto body = body_.move();
+    body->coalesce();
+    try {
+        folly::dynamic beacon = folly::parseJson(folly::StringPiece(
+            reinterpret_cast<const char*>(body->data()), body->length()));
+        auto reports = beacon.get_ptr("reports");
+        if (!reports || !reports->isArray()) return;
+        std::string clientIP = request_->getClientIP();
+        size_t count = 0;
+        for (auto& report : *reports) {
+            if (++count > MAX_REPORTS_PER_BEACON) break;
+            auto edge = report.get_ptr("edge");
+            if (!edge || !edge->isString()) continue;
+            auto ok = report.get_ptr("ok");
+            if (ok && !ok->isBool()) continue;
+            auto ms = report.get_ptr("ms");
+            bool success = ok ? ok->getBool() : true;
+            double timing = (ms && ms->isNumber()) ? ms->asDouble() : 0.0;
+            if (success && timing <= 0.0) continue;
+            state_->recordEdgeReport(clientIP,
+                EdgeReports::ethAddressFromHost(edge->getString()),
+                success, timing);
+        }
+    } catch (const std::exception& e) {
+        VLOG(1) << "Could not parse edge report beacon: " << e.what();
+    }
+}
+
+void DirectHandler::onBody(std::unique_ptr<folly::IOBuf> body) noexcept {
+    if (!isEdgeReport_ || bodyTooLarge_ || !body) return;
+    if (body_.chainLength() + body->computeChainDataLength() >
+        config_->edge_report_max_bytes) {
+        bodyTooLarge_ = true;
+        body_.move();
+        return;
+    }
+    body_.append(std::move(body));
+}
+
 void DirectHandler::onUpgrade(UpgradeProtocol protocol) noexcept {}
-void DirectHandler::onEOM() noexcept {}
+
+void DirectHandler::onEOM() noexcept {
+    if (!isEdgeReport_) return;
+    if (bodyTooLarge_) {
+        ResponseBuilder(downstream_)
+            .status(413, "Payload Too Large")
+            .sendWithEOM();
+        return;
+    }
+    ingestEdgeReports();
+    ResponseBuilder(downstream_)
+        .status(204, "No Content")
+        .sendWithEOM();
+}
+
 void DirectHandler::requestComplete() noexcept { delete this; }
 void DirectHandler::onError(proxygen::ProxygenError err) 
     noexcept { delete this; }
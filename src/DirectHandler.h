@@ -3,14 +3,33 @@
 #include "Cache.h"
 #include "MasternodeConfig.h"
 #include "NetworkState.h"
+#include "RouteRules.h"
+#include "Tenant.h"
 
+#include <folly/io/IOBufQueue.h>
 #include <proxygen/httpserver/RequestHandler.h>
 
+// Handles requests meant for the masternode itself (sent with the
+// direct header). POSTs to EDGE_REPORT_PATH are client beacons with
+// batched edge node timings:
+//   {"reports": [{"edge": "<edge URL or hostname>", "ms": 83.2,
+//                 "ok": true}, ...]}
+// GETs of METRICS_PATH get the metrics in the Prometheus text format,
+// if they carry the configured metrics token as a bearer token.
+// Everything else gets the edge node and asset hash lists.
 class DirectHandler : public proxygen::RequestHandler {
     public:
+        static constexpr const char* EDGE_REPORT_PATH =
+            "/masternode-edge-report";
+        // Reports beyond this many in one beacon are ignored
+        static const size_t MAX_REPORTS_PER_BEACON = 32;
+        static constexpr const char* METRICS_PATH = "/metrics";
+
         DirectHandler(std::shared_ptr<ContentCache>, 
             std::shared_ptr<MasternodeConfig>, 
-            std::shared_ptr<NetworkState>);
+            std::shared_ptr<NetworkState>,
+            std::shared_ptr<const RouteRules> rules = nullptr,
+            std::shared_ptr<TenantTable> tenants = nullptr);
 
         // RequestHandler methods
         void onRequest(std::unique_ptr<proxygen::HTTPMessage> headers) noexcept override;
@@ -20,6 +39,13 @@ class DirectHandler : public proxygen::RequestHandler {
         void requestComplete() noexcept override;
         void onError(proxygen::ProxygenError err) noexcept override;
     private:
+        void sendCacheList();
+        void sendMetrics();
+        // Checks the request's Authorization header against the
+        // metrics token
+        bool metricsAuthorized() const;
+        void ingestEdgeReports();
+
         // HTTP content cache
         std::shared_ptr<ContentCache> cache_{nullptr};
 
@@ -28,4 +54,22 @@ class DirectHandler : public proxygen::RequestHandler {
 
         // Network state
         std::shared_ptr<NetworkState> state_{nullptr};
+
+        // Route rules (only routes that may be offloaded are listed)
+        std::shared_ptr<const RouteRules> rules_{nullptr};
+
+        // Sites served (for their origins' state in the metrics)
+        std::shared_ptr<TenantTable> tenants_{nullptr};
+
+        // Incoming request (headers)
+        std::unique_ptr<proxygen::HTTPMessage> request_{nullptr};
+
+        // Body of an edge report beacon
+        folly::IOBufQueue body_{folly::IOBufQueue::cacheChainLength()};
+
+        // Set if this request is an edge report beacon
+        bool isEdgeReport_{false};
+
+        // Set if the beacon body grew beyond the allowed size
+        bool bodyTooLarge_{false};
 };
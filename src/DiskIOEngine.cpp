@@ -0,0 +1,446 @@
+#include "DiskIOEngine.h"
+
+#include <deque>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <folly/FileUtil.h>
+#include <folly/Synchronized.h>
+#include <folly/container/F14Set.h>
+#include <folly/executors/CPUThreadPoolExecutor.h>
+#include <folly/executors/thread_factory/NamedThreadFactory.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#include <sys/eventfd.h>
+#endif
+
+using namespace std::chrono;
+
+namespace {
+    // Writes the whole chain to fd with as few syscalls as possible
+    ssize_t writeChain(int fd, const folly::IOBuf& data) {
+        auto iov = data.getIov();
+        ssize_t n = folly::writevFull(fd, iov.data(),
+            std::min<size_t>(iov.size(), IOV_MAX));
+        if (n < 0 || iov.size() <= IOV_MAX) return n < 0 ? -errno : n;
+        // rare, chains this long are coalesced
+        auto rest = data.cloneCoalesced();
+        rest->trimStart(n);
+        ssize_t m = folly::writeFull(fd, rest->data(), rest->length());
+        return m < 0 ? -errno : n + m;
+    }
+
+    // Blocking implementation of DiskIOEngine::writeFile
+    ssize_t writeFileBlocking(const std::string& path,
+        const folly::IOBuf& data, bool sync) {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+            0666);
+        if (fd < 0) return -errno;
+        ssize_t n = writeChain(fd, data);
+        if (n >= 0 && sync && fdatasync(fd) != 0) {
+            n = -errno;
+        }
+        close(fd);
+        return n;
+    }
+
+    // Runs every operation as blocking syscalls on a thread pool
+    class ThreadPoolDiskIOEngine : public DiskIOEngine {
+        public:
+            explicit ThreadPoolDiskIOEngine(size_t threads):
+                executor_(std::max<size_t>(1, threads),
+                    std::make_shared<folly::NamedThreadFactory>("DiskIO")) {}
+
+            ~ThreadPoolDiskIOEngine() override {
+                executor_.join();
+            }
+
+            void writeFile(std::string path,
+                std::unique_ptr<folly::IOBuf> data, bool sync,
+                folly::EventBase* evb, Callback cb) override {
+                auto submitted = onSubmit();
+                executor_.add([this, submitted, path = std::move(path),
+                    data = std::move(data), sync, evb,
+                    cb = std::move(cb)]() mutable {
+                    ssize_t n = writeFileBlocking(path, *data, sync);
+                    complete(submitted, n, nullptr, evb, std::move(cb));
+                });
+            }
+
+            void read(int fd, off_t offset, size_t len,
+                folly::EventBase* evb, Callback cb) override {
+                auto submitted = onSubmit();
+                executor_.add([this, submitted, fd, offset, len, evb,
+                    cb = std::move(cb)]() mutable {
+                    auto buf = folly::IOBuf::create(len);
+                    ssize_t n = folly::preadFull(fd, buf->writableData(),
+                        len, offset);
+                    if (n < 0) {
+                        n = -errno;
+                        buf.reset();
+                    } else {
+                        buf->append(n);
+                    }
+                    complete(submitted, n, std::move(buf), evb, std::move(cb));
+                });
+            }
+
+            std::string getName() const override { return "threads"; }
+        private:
+            folly::CPUThreadPoolExecutor executor_;
+    };
+
+#ifdef HAVE_LIBURING
+    // Submits operations through an io_uring from one engine thread.
+    // Everything queued since the last pass is prepared and submitted
+    // with a single io_uring_enter, and completions are reaped in
+    // batches as well. Submitters wake the thread through an eventfd
+    // that is itself read through the ring.
+    class UringDiskIOEngine : public DiskIOEngine {
+        public:
+            explicit UringDiskIOEngine(size_t queueDepth):
+                queueDepth_(std::max<size_t>(8, queueDepth)) {
+                int ret = io_uring_queue_init(queueDepth_, &ring_, 0);
+                if (ret < 0) {
+                    throw std::runtime_error(std::string(
+                        "io_uring_queue_init failed: ") + strerror(-ret));
+                }
+                wakeFd_ = eventfd(0, EFD_CLOEXEC);
+                if (wakeFd_ < 0) {
+                    io_uring_queue_exit(&ring_);
+                    throw std::runtime_error("eventfd failed");
+                }
+                thread_ = std::thread([this]() { run(); });
+            }
+
+            ~UringDiskIOEngine() override {
+                stopping_ = true;
+                wake();
+                thread_.join();
+                close(wakeFd_);
+                io_uring_queue_exit(&ring_);
+            }
+
+            void writeFile(std::string path,
+                std::unique_ptr<folly::IOBuf> data, bool sync,
+                folly::EventBase* evb, Callback cb) override {
+                auto op = std::make_unique<Op>();
+                op->type = Op::WRITE;
+                op->path = std::move(path);
+                op->data = std::move(data);
+                op->sync = sync;
+                op->evb = evb;
+                op->cb = std::move(cb);
+                enqueue(std::move(op));
+            }
+
+            void read(int fd, off_t offset, size_t len,
+                folly::EventBase* evb, Callback cb) override {
+                auto op = std::make_unique<Op>();
+                op->type = Op::READ;
+                op->fd = fd;
+                op->offset = offset;
+                op->len = len;
+                op->evb = evb;
+                op->cb = std::move(cb);
+                enqueue(std::move(op));
+            }
+
+            std::string getName() const override { return "uring"; }
+        private:
+            struct Op {
+                enum Type { READ, WRITE } type;
+                std::string path;
+                int fd{-1};
+                off_t offset{0};
+                size_t len{0};
+                bool sync{false};
+                std::unique_ptr<folly::IOBuf> data;
+                folly::fbvector<struct iovec> iov;
+                folly::EventBase* evb{nullptr};
+                Callback cb;
+                steady_clock::time_point submitted;
+                // Completions still expected (write + fsync are linked)
+                unsigned pending{0};
+                ssize_t result{0};
+            };
+
+            void enqueue(std::unique_ptr<Op> op) {
+                op->submitted = onSubmit();
+                queue_.wlock()->push_back(std::move(op));
+                wake();
+            }
+
+            void wake() {
+                uint64_t one = 1;
+                folly::writeNoInt(wakeFd_, &one, sizeof(one));
+            }
+
+            void armWake() {
+                auto sqe = io_uring_get_sqe(&ring_);
+                io_uring_prep_read(sqe, wakeFd_, &wakeValue_,
+                    sizeof(wakeValue_), 0);
+                io_uring_sqe_set_data(sqe, nullptr);
+            }
+
+            // Number of submission entries an operation needs
+            static unsigned entriesFor(const Op& op) {
+                return op.type == Op::WRITE && op.sync ? 2 : 1;
+            }
+
+            // Prepares the submission entries for an operation. Returns
+            // false if the operation failed before reaching the ring.
+            bool prepare(Op* op) {
+                if (op->type == Op::READ) {
+                    op->data = folly::IOBuf::create(op->len);
+                    auto sqe = io_uring_get_sqe(&ring_);
+                    io_uring_prep_read(sqe, op->fd, op->data->writableData(),
+                        op->len, op->offset);
+                    io_uring_sqe_set_data(sqe, op);
+                    op->pending = 1;
+                    return true;
+                }
+                op->fd = open(op->path.c_str(),
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+                if (op->fd < 0) {
+                    op->result = -errno;
+                    return false;
+                }
+                op->len = op->data->computeChainDataLength();
+                if (op->data->countChainElements() > IOV_MAX) {
+                    op->data = op->data->cloneCoalesced();
+                }
+                op->iov = op->data->getIov();
+                auto sqe = io_uring_get_sqe(&ring_);
+                io_uring_prep_writev(sqe, op->fd, op->iov.data(),
+                    op->iov.size(), 0);
+                io_uring_sqe_set_data(sqe, op);
+                op->pending = 1;
+                if (op->sync) {
+                    sqe->flags |= IOSQE_IO_LINK;
+                    sqe = io_uring_get_sqe(&ring_);
+                    io_uring_prep_fsync(sqe, op->fd, IORING_FSYNC_DATASYNC);
+                    io_uring_sqe_set_data(sqe, op);
+                    op->pending = 2;
+                }
+                return true;
+            }
+
+            void onCompletion(Op* op, int res) {
+                if (op->type == Op::READ) {
+                    op->result = res;
+                    if (res >= 0) op->data->append(res);
+                } else if (op->result >= 0 && res < 0) {
+                    // the first error of the write/fsync pair sticks, but
+                    // a short write cancels the fsync and is redone in finish
+                    bool shortWrite = static_cast<size_t>(op->result) < op->len;
+                    if (res != -ECANCELED || !shortWrite) {
+                        op->result = res;
+                    }
+                } else if (op->result >= 0 && op->pending == entriesFor(*op)) {
+                    // the write's completion comes first
+                    op->result = res;
+                }
+                if (--op->pending > 0) return;
+                finish(op);
+            }
+
+            void finish(Op* op) {
+                std::unique_ptr<Op> owned(op);
+                if (op->type == Op::WRITE) {
+                    if (op->result >= 0 &&
+                        static_cast<size_t>(op->result) < op->len) {
+                        // short write, finish it the blocking way
+                        op->result = writeFileBlocking(op->path, *op->data,
+                            op->sync);
+                    }
+                    if (op->fd >= 0) close(op->fd);
+                    op->data.reset();
+                } else if (op->result < 0) {
+                    op->data.reset();
+                }
+                inFlight_.erase(op);
+                complete(op->submitted, op->result, std::move(op->data),
+                    op->evb, std::move(op->cb));
+            }
+
+            void run() {
+                std::deque<std::unique_ptr<Op>> backlog;
+                armWake();
+                io_uring_submit(&ring_);
+                while (true) {
+                    struct io_uring_cqe* cqe;
+                    int ret = io_uring_wait_cqe(&ring_, &cqe);
+                    if (ret < 0 && ret != -EINTR) {
+                        // the ring is unusable (torn down, out of
+                        // resources), waiting on it again would only spin
+                        LOG(ERROR) << "io_uring_wait_cqe failed, using " <<
+                            "blocking disk I/O from now on: " <<
+                            strerror(-ret);
+                        runBlocking(std::move(backlog));
+                        return;
+                    }
+                    bool woken = false;
+                    unsigned head;
+                    unsigned seen = 0;
+                    io_uring_for_each_cqe(&ring_, head, cqe) {
+                        seen++;
+                        auto op = static_cast<Op*>(io_uring_cqe_get_data(cqe));
+                        if (!op) {
+                            woken = true;
+                        } else {
+                            onCompletion(op, cqe->res);
+                        }
+                    }
+                    io_uring_cq_advance(&ring_, seen);
+
+                    if (woken) {
+                        auto queued = queue_.wlock();
+                        for (auto& op : *queued) {
+                            backlog.push_back(std::move(op));
+                        }
+                        queued->clear();
+                    }
+                    if (stopping_ && backlog.empty() && inFlight_.empty()) {
+                        break;
+                    }
+
+                    // batch everything that fits into one submission
+                    while (!backlog.empty() &&
+                        io_uring_sq_space_left(&ring_) >=
+                            entriesFor(*backlog.front()) + (woken ? 1 : 0) &&
+                        inFlight_.size() < queueDepth_) {
+                        Op* op = backlog.front().release();
+                        backlog.pop_front();
+                        inFlight_.insert(op);
+                        if (!prepare(op)) finish(op);
+                    }
+                    if (woken) armWake();
+                    io_uring_submit(&ring_);
+                }
+            }
+
+            // Fails the operations lost in a broken ring, then runs
+            // everything queued as blocking syscalls on the engine thread
+            void runBlocking(std::deque<std::unique_ptr<Op>> backlog) {
+                std::vector<Op*> lost(inFlight_.begin(), inFlight_.end());
+                for (Op* op : lost) {
+                    op->result = -EIO;
+                    finish(op);
+                }
+                while (true) {
+                    { // critical section
+                        auto queued = queue_.wlock();
+                        for (auto& op : *queued) {
+                            backlog.push_back(std::move(op));
+                        }
+                        queued->clear();
+                    }
+                    if (backlog.empty()) {
+                        if (stopping_) return;
+                        // submitters still wake us through the eventfd
+                        uint64_t value;
+                        folly::readNoInt(wakeFd_, &value, sizeof(value));
+                        continue;
+                    }
+                    auto op = std::move(backlog.front());
+                    backlog.pop_front();
+                    ssize_t n;
+                    if (op->type == Op::WRITE) {
+                        n = writeFileBlocking(op->path, *op->data, op->sync);
+                        op->data.reset();
+                    } else {
+                        op->data = folly::IOBuf::create(op->len);
+                        n = folly::preadFull(op->fd,
+                            op->data->writableData(), op->len, op->offset);
+                        if (n < 0) {
+                            n = -errno;
+                            op->data.reset();
+                        } else {
+                            op->data->append(n);
+                        }
+                    }
+                    complete(op->submitted, n, std::move(op->data),
+                        op->evb, std::move(op->cb));
+                }
+            }
+
+            size_t queueDepth_;
+            struct io_uring ring_;
+            int wakeFd_{-1};
+            uint64_t wakeValue_{0};
+            std::thread thread_;
+            std::atomic<bool> stopping_{false};
+            // Operations submitted to the ring and not finished yet (only
+            // accessed on the engine thread)
+            folly::F14FastSet<Op*> inFlight_;
+            folly::Synchronized<std::vector<std::unique_ptr<Op>>> queue_;
+    };
+#endif
+}
+
+std::unique_ptr<DiskIOEngine> DiskIOEngine::create(const std::string& name,
+    size_t threads, size_t queueDepth) {
+    if (name != "threads") {
+#ifdef HAVE_LIBURING
+        try {
+            return std::make_unique<UringDiskIOEngine>(queueDepth);
+        } catch (const std::exception& e) {
+            LOG(ERROR) << "Could not set up io_uring, using a thread pool " <<
+                "for disk I/O: " << e.what();
+        }
+#else
+        if (name == "uring") {
+            LOG(ERROR) << "Built without io_uring support, using a thread " <<
+                "pool for disk I/O";
+        }
+#endif
+    }
+    return std::make_unique<ThreadPoolDiskIOEngine>(threads);
+}
+
+DiskIOStats DiskIOEngine::getStats() const {
+    DiskIOStats stats;
+    stats.completed = completed_;
+    stats.submitted = submitted_;
+    stats.queue_depth = stats.submitted - std::min(stats.submitted,
+        stats.completed);
+    stats.failed = failed_;
+    if (stats.completed > 0) {
+        stats.mean_latency_us =
+            static_cast<double>(totalLatencyUs_) / stats.completed;
+    }
+    stats.max_latency_us = maxLatencyUs_;
+    return stats;
+}
+
+steady_clock::time_point DiskIOEngine::onSubmit() {
+    submitted_++;
+    return steady_clock::now();
+}
+
+void DiskIOEngine::complete(steady_clock::time_point submitted,
+    ssize_t result, std::unique_ptr<folly::IOBuf> data,
+    folly::EventBase* evb, Callback cb) {
+    uint64_t us = duration_cast<microseconds>(
+        steady_clock::now() - submitted).count();
+    totalLatencyUs_ += us;
+    uint64_t max = maxLatencyUs_;
+    while (us > max && !maxLatencyUs_.compare_exchange_weak(max, us)) {}
+    if (result < 0) failed_++;
+    completed_++;
+
+    if (!cb) return;
+    if (evb) {
+        evb->runInEventBaseThread([cb = std::move(cb), result,
+            data = std::move(data)]() mutable {
+            cb(result, std::move(data));
+        });
+    } else {
+        cb(result, std::move(data));
+    }
+}
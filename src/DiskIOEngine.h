@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+
+#include <folly/Function.h>
+#include <folly/io/IOBuf.h>
+#include <folly/io/async/EventBase.h>
+
+// Counters kept by a disk I/O engine
+struct DiskIOStats {
+    // Operations submitted but not completed yet
+    uint64_t queue_depth{0};
+    uint64_t submitted{0};
+    uint64_t completed{0};
+    uint64_t failed{0};
+    // Mean and maximum time from submission to completion
+    double mean_latency_us{0.0};
+    uint64_t max_latency_us{0};
+};
+
+// Asynchronous disk I/O for cache files, so reading and writing them
+// never blocks an event loop. Completion callbacks are run on the given
+// EventBase, or on an engine thread if it's null (they must not block
+// for long there).
+//
+// Two engines are available: one built on io_uring, which batches the
+// queued operations into as few submissions as possible, and a thread
+// pool of blocking syscalls used where io_uring isn't available.
+class DiskIOEngine {
+    public:
+        // Called with the number of bytes transferred (or -errno), and
+        // for reads the data that was read
+        using Callback = folly::Function<void(ssize_t,
+            std::unique_ptr<folly::IOBuf>)>;
+
+        // Creates the named engine ("uring", "threads" or "auto" for
+        // io_uring if this build and the kernel support it). Falls back
+        // to the thread pool if io_uring can't be set up.
+        static std::unique_ptr<DiskIOEngine> create(const std::string& name,
+            size_t threads, size_t queueDepth);
+
+        virtual ~DiskIOEngine() = default;
+
+        // Writes data to a new file at path (replacing any existing
+        // one), flushing it to stable storage first if sync is set
+        virtual void writeFile(std::string path,
+            std::unique_ptr<folly::IOBuf> data, bool sync,
+            folly::EventBase* evb, Callback cb) = 0;
+
+        // Reads up to len bytes at offset from an open file
+        virtual void read(int fd, off_t offset, size_t len,
+            folly::EventBase* evb, Callback cb) = 0;
+
+        virtual std::string getName() const = 0;
+
+        DiskIOStats getStats() const;
+    protected:
+        // Bookkeeping for implementations, returning the submission time
+        std::chrono::steady_clock::time_point onSubmit();
+        // Records the completion and delivers the result
+        void complete(std::chrono::steady_clock::time_point submitted,
+            ssize_t result, std::unique_ptr<folly::IOBuf> data,
+            folly::EventBase* evb, Callback cb);
+    private:
+        std::atomic<uint64_t> submitted_{0};
+        std::atomic<uint64_t> completed_{0};
+        std::atomic<uint64_t> failed_{0};
+        std::atomic<uint64_t> totalLatencyUs_{0};
+        std::atomic<uint64_t> maxLatencyUs_{0};
+};
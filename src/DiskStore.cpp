@@ -0,0 +1,232 @@
+#include "DiskStore.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+namespace {
+    const size_t HASH_LENGTH = 64;
+
+    bool isBodyName(const char* name) {
+        size_t len = strlen(name);
+        if (len != HASH_LENGTH) return false;
+        for (size_t i = 0; i < len; i++) {
+            if (!isxdigit(static_cast<unsigned char>(name[i]))) return false;
+        }
+        return true;
+    }
+
+    folly::Optional<size_t> fileSize(const std::string& path) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            return folly::none;
+        }
+        return static_cast<size_t>(st.st_size);
+    }
+}
+
+DiskStore::DiskStore(std::string dir, unsigned levels):
+    dir_(dir), levels_(levels) {}
+
+std::string DiskStore::pathFor(const std::string& hash) const {
+    std::string path = dir_;
+    for (unsigned i = 0; i < levels_ && (i + 1) * 2 <= hash.size(); i++) {
+        path.append(hash, i * 2, 2);
+        path.push_back('/');
+    }
+    return path + hash;
+}
+
+bool DiskStore::acquire(const std::string& hash, size_t size) {
+    auto locked = bodies_.wlock();
+    auto inserted = locked->emplace(hash, Body());
+    Body& body = inserted.first->second;
+    if (inserted.second) {
+        body.size = size;
+        usedBytes_ += size;
+    }
+    body.refs++;
+    if (body.written || body.writing) {
+        return false;
+    }
+    body.writing = true;
+    return true;
+}
+
+folly::Optional<size_t> DiskStore::adopt(const std::string& hash) {
+    std::string path = pathFor(hash);
+    auto size = fileSize(path);
+    if (!size) {
+        std::string flat = dir_ + hash;
+        if (levels_ == 0) return folly::none;
+        size = fileSize(flat);
+        if (!size) return folly::none;
+        prepare(hash);
+        if (rename(flat.c_str(), path.c_str()) != 0) {
+            LOG(ERROR) << "Could not move " << flat << " to " << path;
+            return folly::none;
+        }
+    }
+    auto locked = bodies_.wlock();
+    auto inserted = locked->emplace(hash, Body());
+    Body& body = inserted.first->second;
+    // the file found above is being deleted
+    if (body.removing) return folly::none;
+    if (inserted.second) {
+        body.size = *size;
+        usedBytes_ += *size;
+    }
+    body.refs++;
+    if (!body.writing) {
+        body.written = true;
+    }
+    return size;
+}
+
+void DiskStore::markWritten(const std::string& hash, bool ok) {
+    std::vector<std::function<void(bool)>> waiting;
+    { // critical section
+        auto locked = bodies_.wlock();
+        auto it = locked->find(hash);
+        if (it == locked->end()) return;
+        it->second.writing = false;
+        it->second.written = ok;
+        waiting.swap(it->second.waiting);
+    }
+    for (auto& cb : waiting) {
+        cb(ok);
+    }
+}
+
+void DiskStore::whenWritten(const std::string& hash,
+    std::function<void(bool)> cb) {
+    bool written = false;
+    { // critical section
+        auto locked = bodies_.wlock();
+        auto it = locked->find(hash);
+        if (it != locked->end()) {
+            if (it->second.writing) {
+                it->second.waiting.push_back(std::move(cb));
+                return;
+            }
+            written = it->second.written;
+        }
+    }
+    cb(written);
+}
+
+void DiskStore::release(const std::string& hash) {
+    auto locked = bodies_.wlock();
+    auto it = locked->find(hash);
+    if (it != locked->end() && it->second.refs > 0) {
+        it->second.refs--;
+    }
+}
+
+void DiskStore::prepare(const std::string& hash) {
+    if (levels_ == 0) return;
+    std::string path = pathFor(hash);
+    std::string subdir = path.substr(0, path.size() - hash.size());
+    if (createdDirs_.rlock()->count(subdir)) return;
+    // create each level in turn
+    for (size_t pos = dir_.size(); pos < subdir.size(); pos += 3) {
+        std::string level = subdir.substr(0, pos + 2);
+        if (mkdir(level.c_str(), 0777) != 0 && errno != EEXIST) {
+            LOG(ERROR) << "Could not create cache directory " << level;
+            return;
+        }
+    }
+    createdDirs_.wlock()->insert(subdir);
+}
+
+size_t DiskStore::collect() {
+    // mark the victims as being written, so a body acquired while its
+    // file is deleted waits instead of being written (or trusted) in
+    // the meantime, and unlink them without blocking the event threads
+    std::vector<std::string> victims;
+    { // critical section
+        auto locked = bodies_.wlock();
+        for (auto& it : *locked) {
+            Body& body = it.second;
+            if (body.refs > 0 || body.writing) continue;
+            body.writing = true;
+            body.removing = true;
+            victims.push_back(it.first);
+        }
+    }
+
+    size_t removed = 0;
+    for (auto& hash : victims) {
+        if (unlink(pathFor(hash).c_str()) == 0) {
+            removed++;
+        } else if (errno != ENOENT) {
+            LOG(ERROR) << "Could not remove cached body " << hash;
+        }
+    }
+
+    std::vector<std::function<void(bool)>> failed;
+    { // critical section
+        auto locked = bodies_.wlock();
+        for (auto& hash : victims) {
+            auto it = locked->find(hash);
+            if (it == locked->end()) continue;
+            Body& body = it->second;
+            if (body.refs == 0) {
+                usedBytes_ -= body.size;
+                locked->erase(it);
+                continue;
+            }
+            // acquired again while its file was deleted, the next
+            // acquire() writes it again
+            body.writing = false;
+            body.removing = false;
+            body.written = false;
+            for (auto& cb : body.waiting) {
+                failed.push_back(std::move(cb));
+            }
+            body.waiting.clear();
+        }
+    }
+    for (auto& cb : failed) {
+        cb(false);
+    }
+    return removed;
+}
+
+size_t DiskStore::removeOrphans() {
+    size_t removed = 0;
+    std::function<void(const std::string&, unsigned)> scan =
+        [&](const std::string& dir, unsigned depth) {
+        DIR* d = opendir(dir.c_str());
+        if (!d) return;
+        while (struct dirent* entry = readdir(d)) {
+            std::string name = entry->d_name;
+            if (name == "." || name == "..") continue;
+            std::string path = dir + name;
+            if (depth < levels_ && name.size() == 2) {
+                scan(path + "/", depth + 1);
+                continue;
+            }
+            if (depth != levels_ || !isBodyName(entry->d_name)) continue;
+            auto locked = bodies_.rlock();
+            if (locked->count(name) == 0 && unlink(path.c_str()) == 0) {
+                removed++;
+            }
+        }
+        closedir(d);
+    };
+    scan(dir_, 0);
+    return removed;
+}
+
+uint64_t DiskStore::getUsedBytes() const { return usedBytes_; }
+
+size_t DiskStore::getBodyCount() const { return bodies_.rlock()->size(); }
+
+uint32_t DiskStore::getRefs(const std::string& hash) const {
+    auto locked = bodies_.rlock();
+    auto it = locked->find(hash);
+    return it == locked->end() ? 0 : it->second.refs;
+}
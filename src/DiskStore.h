@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+
+#include <folly/Optional.h>
+#include <folly/Synchronized.h>
+#include <folly/container/F14Map.h>
+#include <folly/container/F14Set.h>
+
+// Content addressed store of cached bodies in the cache directory.
+// Bodies are named by their SHA-256 and fanned out into hash prefix
+// subdirectories (e.g. ab/cd/abcd...), so no directory grows too large.
+// Every cached route using a body holds a reference to it: identical
+// bodies under different URLs are written once, and bodies nobody
+// references anymore are deleted by collect().
+class DiskStore {
+    public:
+        // levels is the number of two character prefix subdirectories
+        // (0 keeps every file directly in dir)
+        DiskStore(std::string dir, unsigned levels);
+
+        std::string pathFor(const std::string& hash) const;
+
+        // Adds a reference to a body of the given size. Returns true if
+        // it's the first one and the caller has to write the body (after
+        // which it calls markWritten()).
+        bool acquire(const std::string& hash, size_t size);
+
+        // Adds a reference to a body that's already on disk. If it was
+        // written under the flat layout it's moved into place. Returns
+        // the size of the body, or none if there's no such file.
+        folly::Optional<size_t> adopt(const std::string& hash);
+
+        // Records the outcome of writing a body and runs the callbacks
+        // waiting for it. A failed body is written again by the next
+        // acquire().
+        void markWritten(const std::string& hash, bool ok);
+
+        // Runs cb(true) once the body is on disk, or cb(false) if
+        // writing it fails. Runs it right away if it already is.
+        void whenWritten(const std::string& hash, std::function<void(bool)> cb);
+
+        // Drops a reference, the body is deleted by the next collect()
+        // once there are none left
+        void release(const std::string& hash);
+
+        // Creates the subdirectory a body goes in, if needed
+        void prepare(const std::string& hash);
+
+        // Deletes the bodies without references. The files are removed
+        // without holding the lock; a body acquired meanwhile is written
+        // again. Returns the number of files removed.
+        size_t collect();
+
+        // Deletes body files in the directory that aren't known to the
+        // store (left behind by a crash or an older index). Returns the
+        // number of files removed.
+        size_t removeOrphans();
+
+        // Bytes used by referenced and not yet collected bodies
+        uint64_t getUsedBytes() const;
+        size_t getBodyCount() const;
+        uint32_t getRefs(const std::string& hash) const;
+    private:
+        struct Body {
+            uint32_t refs{0};
+            size_t size{0};
+            bool written{false};
+            // A write is in flight
+            bool writing{false};
+            // collect() is deleting the file (writing is set too, so
+            // acquire() waits for it)
+            bool removing{false};
+            std::vector<std::function<void(bool)>> waiting;
+        };
+
+        std::string dir_;
+        unsigned levels_;
+
+        folly::Synchronized<folly::F14NodeMap<std::string /* hash */, Body>>
+            bodies_;
+        std::atomic<uint64_t> usedBytes_{0};
+
+        // Subdirectories already created (levels > 0 only)
+        folly::Synchronized<folly::F14FastSet<std::string>> createdDirs_;
+};
@@ -9,11 +9,25 @@ uint16_t EdgeNode::getPort() { return port_; }
 std::string EdgeNode::getEthAddress() { return eth_address_; }
 uint32_t EdgeNode::getHeartbeat() { return heartbeat_; }
 
+std::string EdgeNode::getHostname(std::string pool_domain,
+    std::string cdn_subdomain) {
+    return std::string(eth_address_ + "." + cdn_subdomain + "." + pool_domain);
+}
+
 std::string EdgeNode::getFQDN(std::string pool_domain,
     std::string cdn_subdomain) {
-    return std::string("https://" + eth_address_ + "." + cdn_subdomain + "." 
-        + pool_domain + ":" + std::to_string(port_));
+    return std::string("https://" + getHostname(pool_domain, cdn_subdomain)
+        + ":" + std::to_string(port_));
 }
 
 Location EdgeNode::getLocation() { return location_; }
 void EdgeNode::setLocation(Location l) { location_ = l; }
+
+double EdgeNode::getLoad() { return load_; }
+void EdgeNode::setLoad(double load) { load_ = load; }
+double EdgeNode::getBandwidth() { return bandwidth_; }
+void EdgeNode::setBandwidth(double bandwidth) { bandwidth_ = bandwidth; }
+double EdgeNode::getErrorRate() { return error_rate_; }
+void EdgeNode::setErrorRate(double rate) { error_rate_ = rate; }
+double EdgeNode::getLatency() { return latency_; }
+void EdgeNode::setLatency(double latency) { latency_ = latency; }
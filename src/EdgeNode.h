@@ -13,6 +13,15 @@ class EdgeNode {
 
         Location location_;
 
+        // Utilization reported by the gateway (0.0 idle - 1.0 saturated)
+        double load_{0.0};
+        // Available bandwidth reported by the gateway (Mbit/s, 0 if unknown)
+        double bandwidth_{0.0};
+        // Fraction of failed requests reported by the gateway (0.0 - 1.0)
+        double error_rate_{0.0};
+        // Mean latency clients reported for this node (ms, 0 if unknown)
+        double latency_{0.0};
+
     public:
         EdgeNode(std::string ip,
             uint16_t port,
@@ -23,7 +32,17 @@ class EdgeNode {
         uint16_t getPort();
         std::string getEthAddress();
         uint32_t getHeartbeat();
+        std::string getHostname(std::string, std::string);
         std::string getFQDN(std::string, std::string);
         Location getLocation();
         void setLocation(Location l);
+
+        double getLoad();
+        void setLoad(double load);
+        double getBandwidth();
+        void setBandwidth(double bandwidth);
+        double getErrorRate();
+        void setErrorRate(double rate);
+        double getLatency();
+        void setLatency(double latency);
 };
@@ -0,0 +1,299 @@
+#include "EdgeProber.h"
+
+#include <folly/synchronization/Baton.h>
+
+#include <proxygen/lib/http/HTTPConnector.h>
+#include <proxygen/lib/http/session/HTTPTransaction.h>
+#include <proxygen/lib/http/session/HTTPUpstreamSession.h>
+
+using namespace proxygen;
+using namespace std::chrono;
+
+// A single probe against one edge node. Connects (with TLS if enabled),
+// sends a GET for the probe path and records how long each step took.
+// Deletes itself once the probe has finished.
+class EdgeProber::Probe : private HTTPConnector::Callback,
+                            private HTTPTransactionHandler {
+    public:
+        Probe(EdgeProber* prober, std::shared_ptr<EdgeNode> node,
+            folly::HHWheelTimer* timer):
+            prober_(prober), node_(node), connector_{this, timer} {}
+
+        void start(folly::EventBase* evb,
+            std::shared_ptr<folly::SSLContext> sslContext) {
+            auto& config = *prober_->config_;
+            started_ = steady_clock::now();
+            folly::SocketAddress addr;
+            try {
+                // connect to the node's IP directly so probes don't
+                // depend on (blocking) DNS resolution of the FQDN
+                addr.setFromIpPort(node_->getIP(), node_->getPort());
+            } catch (const std::exception& e) {
+                VLOG(1) << "Invalid edge node address: " << e.what();
+                finish(false);
+                return;
+            }
+            auto timeout = milliseconds(config.edge_probe_timeout_ms);
+            if (sslContext) {
+                connector_.connectSSL(evb, addr, sslContext, nullptr,
+                    timeout, folly::AsyncSocket::emptyOptionMap,
+                    folly::AsyncSocket::anyAddress(),
+                    node_->getHostname(config.pool_domain,
+                        config.cdn_subdomain));
+            } else {
+                connector_.connect(evb, addr, timeout);
+            }
+        }
+
+        // Stops the probe without reporting a result
+        void cancel() {
+            prober_ = nullptr;
+            if (txn_) {
+                txn_->sendAbort(); // detachTransaction() finishes the probe
+            } else {
+                connector_.reset();
+                delete this;
+            }
+        }
+
+        std::shared_ptr<EdgeNode> getNode() const { return node_; }
+    private:
+        // HTTPConnector::Callback methods
+        void connectSuccess(HTTPUpstreamSession* session) noexcept override {
+            connectMs_ = elapsedMs();
+            session_ = session;
+            txn_ = session->newTransaction(this);
+            if (!txn_) {
+                session_->closeWhenIdle();
+                finish(false);
+                return;
+            }
+            auto& config = *prober_->config_;
+            txn_->setIdleTimeout(milliseconds(config.edge_probe_timeout_ms));
+            HTTPMessage req;
+            req.setMethod(HTTPMethod::GET);
+            req.setURL(config.edge_probe_path);
+            req.getHeaders().set(HTTP_HEADER_HOST,
+                node_->getHostname(config.pool_domain, config.cdn_subdomain));
+            txn_->sendHeaders(req);
+            txn_->sendEOM();
+        }
+
+        void connectError(const folly::AsyncSocketException& ex) noexcept override {
+            VLOG(1) << "Could not connect to edge node " <<
+                node_->getEthAddress() << ": " << ex.what();
+            finish(false);
+        }
+
+        // HTTPTransactionHandler methods
+        void setTransaction(HTTPTransaction* txn) noexcept override {
+            txn_ = txn;
+        }
+
+        void detachTransaction() noexcept override {
+            txn_ = nullptr;
+            if (session_) {
+                session_->closeWhenIdle();
+            }
+            finish(success_);
+        }
+
+        void onHeadersComplete(std::unique_ptr<HTTPMessage> msg) noexcept override {
+            status_ = msg->getStatusCode();
+        }
+
+        void onBody(std::unique_ptr<folly::IOBuf> chain) noexcept override {}
+        void onTrailers(std::unique_ptr<HTTPHeaders> trailers) noexcept override {}
+
+        void onEOM() noexcept override {
+            totalMs_ = elapsedMs();
+            success_ = status_ >= 200 && status_ < 400;
+        }
+
+        void onUpgrade(UpgradeProtocol protocol) noexcept override {}
+
+        void onError(const HTTPException& error) noexcept override {
+            VLOG(1) << "Probe of edge node " << node_->getEthAddress() <<
+                " failed: " << error.describe();
+            success_ = false;
+        }
+
+        void onEgressPaused() noexcept override {}
+        void onEgressResumed() noexcept override {}
+
+        double elapsedMs() const {
+            return duration_cast<microseconds>(
+                steady_clock::now() - started_).count() / 1000.0;
+        }
+
+        void finish(bool success) {
+            if (prober_) {
+                prober_->recordResult(node_->getEthAddress(),
+                    success, connectMs_, totalMs_);
+                prober_->onProbeFinished(this);
+            }
+            delete this;
+        }
+
+        EdgeProber* prober_{nullptr};
+        std::shared_ptr<EdgeNode> node_{nullptr};
+        HTTPConnector connector_;
+        HTTPUpstreamSession* session_{nullptr};
+        HTTPTransaction* txn_{nullptr};
+        steady_clock::time_point started_;
+        double connectMs_{0.0};
+        double totalMs_{0.0};
+        uint16_t status_{0};
+        bool success_{false};
+};
+
+/////////////////////////////////////////////////////////////////////////
+
+EdgeProber::EdgeProber(std::shared_ptr<MasternodeConfig> config):
+    config_(config), evbThread_("EdgeProber") {
+    CHECK(config_) << "Config object was null";
+    if (config_->edge_probe_tls) {
+        sslContext_ = std::make_shared<folly::SSLContext>();
+        // we're only measuring the handshake, not authenticating the node
+        sslContext_->setVerificationOption(
+            folly::SSLContext::SSLVerifyPeerEnum::NO_VERIFY);
+    }
+    auto evb = evbThread_.getEventBase();
+    evb->runInEventBaseThreadAndWait([&]() {
+        timer_ = folly::HHWheelTimer::newTimer(evb,
+            milliseconds(folly::HHWheelTimer::DEFAULT_TICK_INTERVAL),
+            folly::AsyncTimeout::InternalEnum::NORMAL,
+            milliseconds(config_->edge_probe_timeout_ms));
+    });
+}
+
+EdgeProber::~EdgeProber() {
+    evbThread_.getEventBase()->runInEventBaseThreadAndWait([&]() {
+        stopping_ = true;
+        queue_.clear();
+        auto active = active_;
+        active_.clear();
+        for (auto probe : active) {
+            probe->cancel();
+        }
+        timer_.reset();
+    });
+}
+
+void EdgeProber::probe(std::vector<std::shared_ptr<EdgeNode>> nodes,
+    std::function<void()> done) {
+    evbThread_.getEventBase()->runInEventBaseThread(
+        [this, nodes = std::move(nodes), done = std::move(done)]() {
+        if (stopping_ || roundRunning_) {
+            VLOG(1) << "Skipping edge probe round, previous one still running";
+            if (done) done();
+            return;
+        }
+        roundRunning_ = true;
+        roundDone_ = done;
+        queue_.insert(queue_.end(), nodes.begin(), nodes.end());
+        startProbes();
+    });
+}
+
+void EdgeProber::probeAndWait(std::vector<std::shared_ptr<EdgeNode>> nodes) {
+    folly::Baton<> baton;
+    probe(std::move(nodes), [&]() { baton.post(); });
+    baton.wait();
+}
+
+void EdgeProber::startProbes() {
+    auto evb = evbThread_.getEventBase();
+    while (!queue_.empty() &&
+        active_.size() < config_->edge_probe_concurrency) {
+        auto node = queue_.front();
+        queue_.pop_front();
+        auto probe = new Probe(this, node, timer_.get());
+        active_.insert(probe);
+        probe->start(evb, sslContext_);
+    }
+    if (queue_.empty() && active_.empty() && roundRunning_) {
+        roundRunning_ = false;
+        auto done = std::move(roundDone_);
+        roundDone_ = nullptr;
+        if (done) done();
+    }
+}
+
+void EdgeProber::onProbeFinished(Probe* probe) {
+    active_.erase(probe);
+    if (!stopping_) {
+        startProbes();
+    }
+}
+
+void EdgeProber::recordResult(const std::string& ethAddress, bool success,
+    double connectMs, double totalMs) {
+    { // critical section
+        auto locked = health_.wlock();
+        EdgeHealth& h = (*locked)[ethAddress];
+        if (!success) {
+            h.failures++;
+            h.consecutive_failures++;
+            return;
+        }
+        h.successes++;
+        h.consecutive_failures = 0;
+        if (!h.sampled) {
+            h.connect_ms = connectMs;
+            h.rtt_ms = totalMs;
+            h.sampled = true;
+        } else {
+            h.connect_ms =
+                EWMA_ALPHA * connectMs + (1 - EWMA_ALPHA) * h.connect_ms;
+            h.rtt_ms = EWMA_ALPHA * totalMs + (1 - EWMA_ALPHA) * h.rtt_ms;
+        }
+    }
+    auto observer = rttObserver_.copy();
+    if (observer && totalMs > connectMs) {
+        observer(ethAddress, totalMs - connectMs);
+    }
+}
+
+void EdgeProber::setRttObserver(
+    std::function<void(const std::string&, double)> observer) {
+    { // critical section
+        rttObserver_ = observer;
+    }
+}
+
+bool EdgeProber::isHealthy(const std::string& ethAddress) const {
+    auto locked = health_.rlock();
+    auto it = locked->find(ethAddress);
+    if (it == locked->end()) return true;
+    const EdgeHealth& h = it->second;
+    if (h.consecutive_failures >= config_->edge_probe_max_failures) {
+        return false;
+    }
+    if (config_->edge_probe_max_rtt_ms > 0 && h.sampled &&
+        h.rtt_ms > config_->edge_probe_max_rtt_ms) {
+        return false;
+    }
+    return true;
+}
+
+std::vector<std::shared_ptr<EdgeNode>> EdgeProber::filterHealthy(
+    const std::vector<std::shared_ptr<EdgeNode>>& nodes) const {
+    std::vector<std::shared_ptr<EdgeNode>> healthy;
+    for (auto& node : nodes) {
+        if (isHealthy(node->getEthAddress())) {
+            healthy.push_back(node);
+        } else {
+            VLOG(1) << "Demoting unhealthy edge node " << node->getEthAddress();
+        }
+    }
+    return healthy;
+}
+
+folly::Optional<EdgeHealth> EdgeProber::getHealth(
+    const std::string& ethAddress) const {
+    auto locked = health_.rlock();
+    auto it = locked->find(ethAddress);
+    if (it == locked->end()) return folly::none;
+    return it->second;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <deque>
+
+#include <folly/Optional.h>
+#include <folly/Synchronized.h>
+#include <folly/container/F14Map.h>
+#include <folly/container/F14Set.h>
+#include <folly/io/async/HHWheelTimer.h>
+#include <folly/io/async/SSLContext.h>
+#include <folly/io/async/ScopedEventBaseThread.h>
+
+#include "MasternodeConfig.h"
+#include "EdgeNode.h"
+
+// Health and latency figures collected for one edge node
+struct EdgeHealth {
+    // EWMA of the TCP (and TLS) connect time in milliseconds
+    double connect_ms{0.0};
+    // EWMA of the time to connect and complete the probe request
+    double rtt_ms{0.0};
+    // Number of probes that failed in a row
+    uint32_t consecutive_failures{0};
+    // Lifetime probe counters
+    uint64_t successes{0};
+    uint64_t failures{0};
+    // Set once the first successful probe has been recorded
+    bool sampled{false};
+};
+
+// Actively measures edge nodes by connecting to them and fetching a
+// small resource. Probes run on the prober's own EventBase thread with
+// at most edge_probe_concurrency connections open at once. Results are
+// kept per edge node (by eth address) so they survive the node list
+// being rebuilt on every gateway poll.
+class EdgeProber {
+    public:
+        // Smoothing factor for the latency EWMAs
+        static constexpr double EWMA_ALPHA = 0.3;
+
+        explicit EdgeProber(std::shared_ptr<MasternodeConfig> config);
+        ~EdgeProber();
+
+        // Starts a probe round over the given nodes. If a round is
+        // still running, the new one is skipped. "done" is called on the
+        // prober thread once every node has been probed.
+        void probe(std::vector<std::shared_ptr<EdgeNode>> nodes,
+            std::function<void()> done = nullptr);
+
+        // Runs a probe round and blocks until it has finished
+        void probeAndWait(std::vector<std::shared_ptr<EdgeNode>> nodes);
+
+        // Records the outcome of a single probe against a node
+        void recordResult(const std::string& ethAddress, bool success,
+            double connectMs, double totalMs);
+
+        // Returns true unless the node has failed too many probes in a row
+        // or is slower than the configured limit. Nodes that were never
+        // probed are considered healthy.
+        bool isHealthy(const std::string& ethAddress) const;
+
+        // Returns the nodes from the list that are healthy
+        std::vector<std::shared_ptr<EdgeNode>> filterHealthy(
+            const std::vector<std::shared_ptr<EdgeNode>>& nodes) const;
+
+        folly::Optional<EdgeHealth> getHealth(
+            const std::string& ethAddress) const;
+
+        // Sets a function that is called with the RTT (ms) of every
+        // successful probe (time from request sent to response complete
+        // on the established connection)
+        void setRttObserver(
+            std::function<void(const std::string&, double)> observer);
+    private:
+        class Probe;
+
+        // Starts queued probes until the concurrency limit is reached.
+        // Only called on the prober thread.
+        void startProbes();
+        void onProbeFinished(Probe* probe);
+
+        std::shared_ptr<MasternodeConfig> config_{nullptr};
+
+        // Thread running the event loop probes are performed on
+        folly::ScopedEventBaseThread evbThread_;
+        folly::HHWheelTimer::UniquePtr timer_;
+        std::shared_ptr<folly::SSLContext> sslContext_{nullptr};
+
+        // The following are only accessed on the prober thread
+        std::deque<std::shared_ptr<EdgeNode>> queue_;
+        folly::F14FastSet<Probe*> active_;
+        std::function<void()> roundDone_{nullptr};
+        bool roundRunning_{false};
+        bool stopping_{false};
+
+        folly::Synchronized<folly::F14FastMap<std::string /* eth address */,
+            EdgeHealth>> health_;
+
+        folly::Synchronized<std::function<void(const std::string&, double)>>
+            rttObserver_;
+};
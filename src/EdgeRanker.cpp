@@ -0,0 +1,83 @@
+#include "EdgeRanker.h"
+
+#include <algorithm>
+
+#include <folly/Random.h>
+
+EdgeRanker::EdgeRanker(RankingWeights weights): weights_(weights) {}
+
+std::vector<double> EdgeRanker::score(
+    const std::vector<EdgeCandidate>& candidates, int64_t now) const {
+    // find the largest distance and bandwidth in the candidate set
+    // to normalize against
+    double maxDistance = 0.0;
+    double maxBandwidth = 0.0;
+    double maxLatency = 0.0;
+    for (auto& c : candidates) {
+        maxDistance = std::max(maxDistance, c.distance);
+        maxBandwidth = std::max(maxBandwidth, c.node->getBandwidth());
+        maxLatency = std::max(maxLatency, c.node->getLatency());
+    }
+
+    std::vector<double> costs;
+    costs.reserve(candidates.size());
+    for (auto& c : candidates) {
+        double distance = (maxDistance > 0.0) ? c.distance / maxDistance : 0.0;
+        // nodes that don't report bandwidth aren't penalized
+        double bandwidth = (maxBandwidth > 0.0 && c.node->getBandwidth() > 0.0)
+            ? 1.0 - (c.node->getBandwidth() / maxBandwidth) : 0.0;
+        int64_t age = now - static_cast<int64_t>(c.node->getHeartbeat());
+        double staleness = std::min(1.0, std::max(0.0,
+            static_cast<double>(age) / MAX_HEARTBEAT_AGE));
+        double load = std::min(1.0, std::max(0.0, c.node->getLoad()));
+        double errors = std::min(1.0, std::max(0.0, c.node->getErrorRate()));
+        // nodes without client reports aren't penalized either
+        double latency = (maxLatency > 0.0)
+            ? c.node->getLatency() / maxLatency : 0.0;
+
+        costs.push_back(
+            weights_.distance * distance +
+            weights_.load * load +
+            weights_.bandwidth * bandwidth +
+            weights_.error_rate * errors +
+            weights_.staleness * staleness +
+            weights_.latency * latency);
+    }
+    return costs;
+}
+
+std::vector<std::shared_ptr<EdgeNode>> EdgeRanker::select(
+    const std::vector<EdgeCandidate>& candidates,
+    size_t n, int64_t now) const {
+    std::vector<double> costs = score(candidates, now);
+
+    // indices of the candidates that haven't been picked yet
+    std::vector<size_t> remaining(candidates.size());
+    for (size_t i = 0; i < remaining.size(); i++) remaining[i] = i;
+
+    std::vector<size_t> chosen;
+    while (chosen.size() < n && !remaining.empty()) {
+        size_t pick = 0;
+        if (remaining.size() > 1) {
+            // draw two distinct candidates and keep the cheaper one
+            size_t a = folly::Random::rand32(remaining.size());
+            size_t b = folly::Random::rand32(remaining.size() - 1);
+            if (b >= a) b++;
+            pick = (costs[remaining[a]] <= costs[remaining[b]]) ? a : b;
+        }
+        chosen.push_back(remaining[pick]);
+        remaining[pick] = remaining.back();
+        remaining.pop_back();
+    }
+
+    std::sort(chosen.begin(), chosen.end(), [&](size_t a, size_t b) {
+        return costs[a] < costs[b];
+    });
+
+    std::vector<std::shared_ptr<EdgeNode>> nodes;
+    nodes.reserve(chosen.size());
+    for (auto i : chosen) {
+        nodes.push_back(candidates[i].node);
+    }
+    return nodes;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "EdgeNode.h"
+
+// Relative importance of each signal when scoring an edge node.
+// Every signal is normalized to roughly 0.0 - 1.0 before weighting,
+// so the weights can be compared against each other directly.
+struct RankingWeights {
+    double distance{1.0};
+    double load{1.0};
+    double bandwidth{0.25};
+    double error_rate{2.0};
+    double staleness{0.5};
+    double latency{1.0};
+};
+
+// An edge node under consideration for a client along with
+// its distance from that client (units don't matter, they are
+// normalized against the other candidates)
+struct EdgeCandidate {
+    std::shared_ptr<EdgeNode> node;
+    double distance;
+};
+
+// Scores edge nodes by combining distance with the load, bandwidth,
+// error rate and heartbeat freshness reported by the gateway (and the
+// latency reported by clients), then
+// picks nodes from the candidate set using power-of-two-choices so
+// that one nearby node doesn't receive every client in its area.
+class EdgeRanker {
+    public:
+        EdgeRanker() = default;
+        explicit EdgeRanker(RankingWeights weights);
+
+        // Heartbeats older than this (seconds) receive the full
+        // staleness penalty
+        static const int64_t MAX_HEARTBEAT_AGE = 2 * 60;
+
+        // Returns the cost of each candidate (lower is better).
+        // "now" is the current unix time in seconds.
+        std::vector<double> score(
+            const std::vector<EdgeCandidate>& candidates, int64_t now) const;
+
+        // Selects up to n nodes from the candidates. Each pick draws two
+        // random candidates that haven't been chosen yet and keeps the
+        // cheaper one. The chosen nodes are returned cheapest first.
+        std::vector<std::shared_ptr<EdgeNode>> select(
+            const std::vector<EdgeCandidate>& candidates,
+            size_t n, int64_t now) const;
+    private:
+        RankingWeights weights_;
+};
@@ -0,0 +1,108 @@
+#include "EdgeReports.h"
+
+#include <algorithm>
+
+EdgeReports::EdgeReports(size_t maxEntries): maxEntries_(maxEntries) {}
+
+void EdgeReports::record(const std::string& prefix,
+    const std::string& ethAddress, bool success, double ms) {
+    auto edgeStats = getOrCreate(byEdge_, ethAddress);
+    if (edgeStats) {
+        add(*edgeStats, success, ms);
+    }
+    auto pairStats = getOrCreate(byPrefixEdge_, prefix + "|" + ethAddress);
+    if (pairStats) {
+        add(*pairStats, success, ms);
+    }
+}
+
+std::shared_ptr<EdgeReportStats> EdgeReports::getOrCreate(
+    StatsMap& map, const std::string& key) {
+    auto it = map.find(key);
+    if (it != map.cend()) {
+        return it->second;
+    }
+    if (map.size() >= maxEntries_) {
+        return nullptr;
+    }
+    // if another thread inserted the key first, use its stats
+    auto res = map.insert(key, std::make_shared<EdgeReportStats>());
+    return res.first->second;
+}
+
+void EdgeReports::add(EdgeReportStats& stats, bool success, double ms) {
+    stats.reports.fetch_add(1, std::memory_order_relaxed);
+    if (success) {
+        stats.total_us.fetch_add(
+            static_cast<uint64_t>(std::max(0.0, ms) * 1000),
+            std::memory_order_relaxed);
+    } else {
+        stats.failures.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+EdgeReportSummary EdgeReports::summarize(const EdgeReportStats& stats) {
+    EdgeReportSummary s;
+    s.reports = stats.reports.load(std::memory_order_relaxed);
+    s.failures = std::min(s.reports,
+        stats.failures.load(std::memory_order_relaxed));
+    uint64_t successes = s.reports - s.failures;
+    s.mean_ms = (successes > 0) ? stats.total_us.load(
+        std::memory_order_relaxed) / 1000.0 / successes : 0.0;
+    return s;
+}
+
+folly::Optional<EdgeReportSummary> EdgeReports::getEdgeSummary(
+    const std::string& ethAddress) const {
+    auto it = byEdge_.find(ethAddress);
+    if (it == byEdge_.cend()) return folly::none;
+    return summarize(*it->second);
+}
+
+folly::Optional<EdgeReportSummary> EdgeReports::getSummary(
+    const std::string& prefix, const std::string& ethAddress) const {
+    auto it = byPrefixEdge_.find(prefix + "|" + ethAddress);
+    if (it == byPrefixEdge_.cend()) return folly::none;
+    return summarize(*it->second);
+}
+
+void EdgeReports::decay() {
+    decay(byEdge_);
+    decay(byPrefixEdge_);
+}
+
+// Reports that arrive while decaying may be partially lost, which is
+// fine for statistics that are only used as a ranking signal
+void EdgeReports::decay(StatsMap& map) {
+    for (auto it = map.cbegin(); it != map.cend();) {
+        auto& stats = *it->second;
+        uint64_t reports = stats.reports.load() / 2;
+        stats.reports.store(reports);
+        stats.failures.store(stats.failures.load() / 2);
+        stats.total_us.store(stats.total_us.load() / 2);
+        if (reports == 0) {
+            // makes room for other keys, so junk can't fill the map
+            it = map.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+std::string EdgeReports::ethAddressFromHost(folly::StringPiece host) {
+    auto scheme = host.find("://");
+    if (scheme != folly::StringPiece::npos) {
+        host.advance(scheme + 3);
+    }
+    auto dot = host.find('.');
+    if (dot != folly::StringPiece::npos) {
+        host = host.subpiece(0, dot);
+    }
+    auto colon = host.find(':');
+    if (colon != folly::StringPiece::npos) {
+        host = host.subpiece(0, colon);
+    }
+    std::string eth = host.str();
+    std::transform(eth.begin(), eth.end(), eth.begin(), ::tolower);
+    return eth;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+
+#include <folly/Optional.h>
+#include <folly/Range.h>
+#include <folly/concurrency/ConcurrentHashMap.h>
+
+// Counters for the reports received about one edge node (optionally
+// from one client prefix). Updated with relaxed atomics so that any
+// number of handler threads can record reports without locking.
+struct EdgeReportStats {
+    std::atomic<uint64_t> reports{0};
+    std::atomic<uint64_t> failures{0};
+    // sum of the timings of successful reports in microseconds
+    std::atomic<uint64_t> total_us{0};
+};
+
+// Point in time view of an EdgeReportStats
+struct EdgeReportSummary {
+    uint64_t reports;
+    uint64_t failures;
+    // mean timing of successful reports (0 if there were none)
+    double mean_ms;
+};
+
+// Aggregates the edge node performance reports that clients send back
+// to the masternode, both per edge node and per (client prefix, edge
+// node) pair. Lookups are wait-free and recording a report only takes
+// a lock the first time a key is seen.
+class EdgeReports {
+    public:
+        explicit EdgeReports(size_t maxEntries = 100000);
+
+        // Records one report from a client in "prefix" about an edge node
+        void record(const std::string& prefix, const std::string& ethAddress,
+            bool success, double ms);
+
+        folly::Optional<EdgeReportSummary> getEdgeSummary(
+            const std::string& ethAddress) const;
+        folly::Optional<EdgeReportSummary> getSummary(
+            const std::string& prefix, const std::string& ethAddress) const;
+
+        // Halves every counter so that recent reports outweigh old ones,
+        // and drops the entries that have decayed to nothing
+        void decay();
+
+        // Number of entries per edge node and per (prefix, edge node)
+        size_t edgeEntries() const { return byEdge_.size(); }
+        size_t pairEntries() const { return byPrefixEdge_.size(); }
+
+        // Extracts the eth address from an edge node URL or hostname
+        // (https://0xabc.cdn.example.com:8080 -> 0xabc)
+        static std::string ethAddressFromHost(folly::StringPiece host);
+    private:
+        typedef folly::ConcurrentHashMap<std::string,
+            std::shared_ptr<EdgeReportStats>> StatsMap;
+
+        // Returns the stats for a key, creating them if there is room
+        std::shared_ptr<EdgeReportStats> getOrCreate(
+            StatsMap& map, const std::string& key);
+        static void add(EdgeReportStats& stats, bool success, double ms);
+        static EdgeReportSummary summarize(const EdgeReportStats& stats);
+        static void decay(StatsMap& map);
+
+        size_t maxEntries_;
+        StatsMap byEdge_;
+        StatsMap byPrefixEdge_;
+};
@@ -0,0 +1,123 @@
+#include "FrequencySketch.h"
+
+#include <algorithm>
+#include <functional>
+
+constexpr uint32_t FrequencySketch::MAX_COUNT;
+constexpr size_t FrequencySketch::DEPTH;
+constexpr size_t FrequencySketch::DOORKEEPER_HASHES;
+
+namespace {
+    size_t nextPowerOfTwo(size_t n) {
+        size_t p = 1;
+        while (p < n) p <<= 1;
+        return p;
+    }
+
+    // Derives the i-th independent hash of a key from its base hash
+    uint64_t rehash(uint64_t hash, size_t i) {
+        uint64_t h = hash + (i + 1) * 0x9e3779b97f4a7c15ULL;
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+        return h ^ (h >> 31);
+    }
+
+    uint64_t keyHash(const std::string& key) {
+        return std::hash<std::string>()(key);
+    }
+}
+
+FrequencySketch::FrequencySketch(size_t capacity) {
+    capacity = std::max<size_t>(capacity, 16);
+    width_ = nextPowerOfTwo(capacity);
+    table_ = std::vector<std::atomic<uint64_t>>(DEPTH * width_ / 16);
+    doorkeeperBits_ = nextPowerOfTwo(capacity * 8);
+    doorkeeper_ = std::vector<std::atomic<uint64_t>>(doorkeeperBits_ / 64);
+    for (auto& word : table_) word.store(0, std::memory_order_relaxed);
+    for (auto& word : doorkeeper_) word.store(0, std::memory_order_relaxed);
+    sampleSize_ = capacity * 10;
+}
+
+size_t FrequencySketch::counterIndex(uint64_t hash, size_t i) const {
+    return (i * width_ + (rehash(hash, i) & (width_ - 1))) * 4;
+}
+
+void FrequencySketch::record(const std::string& key) {
+    uint64_t hash = keyHash(key);
+    if (!doorkeeperContains(hash)) {
+        // first sighting since the last reset
+        for (size_t i = 0; i < DOORKEEPER_HASHES; i++) {
+            size_t bit = rehash(hash, DEPTH + i) & (doorkeeperBits_ - 1);
+            doorkeeper_[bit / 64].fetch_or(1ULL << (bit % 64),
+                std::memory_order_relaxed);
+        }
+    } else {
+        // conservative update: only the smallest counters are raised
+        uint32_t min = estimateHash(hash);
+        if (min < MAX_COUNT) {
+            for (size_t i = 0; i < DEPTH; i++) {
+                size_t index = counterIndex(hash, i);
+                auto& word = table_[index / 64];
+                uint64_t old = word.load(std::memory_order_relaxed);
+                while (((old >> (index % 64)) & 0xf) == min &&
+                    !word.compare_exchange_weak(old,
+                        old + (1ULL << (index % 64)),
+                        std::memory_order_relaxed)) {
+                }
+            }
+        }
+    }
+    // the access that fills the sample resets the counters
+    if (additions_.fetch_add(1, std::memory_order_relaxed) + 1 ==
+        sampleSize_) {
+        reset();
+    }
+}
+
+uint32_t FrequencySketch::estimate(const std::string& key) const {
+    uint64_t hash = keyHash(key);
+    uint32_t count = estimateHash(hash);
+    // the doorkeeper holds the first access
+    return doorkeeperContains(hash) ? count + 1 : count;
+}
+
+uint64_t FrequencySketch::getResets() const {
+    return resets_.load(std::memory_order_relaxed);
+}
+
+uint32_t FrequencySketch::estimateHash(uint64_t hash) const {
+    uint32_t min = MAX_COUNT;
+    for (size_t i = 0; i < DEPTH; i++) {
+        size_t index = counterIndex(hash, i);
+        uint32_t count = (table_[index / 64].load(std::memory_order_relaxed)
+            >> (index % 64)) & 0xf;
+        min = std::min(min, count);
+    }
+    return min;
+}
+
+bool FrequencySketch::doorkeeperContains(uint64_t hash) const {
+    for (size_t i = 0; i < DOORKEEPER_HASHES; i++) {
+        size_t bit = rehash(hash, DEPTH + i) & (doorkeeperBits_ - 1);
+        if (!(doorkeeper_[bit / 64].load(std::memory_order_relaxed) &
+            (1ULL << (bit % 64)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void FrequencySketch::reset() {
+    for (auto& word : table_) {
+        // halve all 16 counters in the word at once
+        uint64_t old = word.load(std::memory_order_relaxed);
+        while (!word.compare_exchange_weak(old,
+            (old >> 1) & 0x7777777777777777ULL, std::memory_order_relaxed)) {
+        }
+    }
+    for (auto& word : doorkeeper_) {
+        word.store(0, std::memory_order_relaxed);
+    }
+    additions_.fetch_sub(sampleSize_ / 2, std::memory_order_relaxed);
+    resets_.fetch_add(1, std::memory_order_relaxed);
+}
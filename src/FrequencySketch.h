@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+// Approximate access counts for a large set of keys in a fixed amount
+// of memory, for TinyLFU cache admission (Einziger et al.). A count-min
+// sketch of 4 bit counters holds the counts, and is aged by halving
+// every counter once sampleSize accesses have been recorded, so the
+// counts follow recent popularity. A doorkeeper Bloom filter in front
+// of it absorbs the first access to each key, which keeps keys that are
+// only ever seen once (crawlers, long tail URLs) out of the counters.
+// Every lookup is recorded, so there's no lock: the counters are atomic
+// words updated with compare-and-swap, and an increment racing with a
+// reset may be lost, which the estimates can afford.
+class FrequencySketch {
+    public:
+        // Counters saturate at this value
+        static constexpr uint32_t MAX_COUNT = 15;
+
+        // Sized for tracking about "capacity" keys
+        explicit FrequencySketch(size_t capacity);
+
+        // Records an access to key
+        void record(const std::string& key);
+
+        // Returns the estimated number of recent accesses to key
+        uint32_t estimate(const std::string& key) const;
+
+        // Number of times the counters have been halved
+        uint64_t getResets() const;
+    private:
+        static constexpr size_t DEPTH = 4;
+        static constexpr size_t DOORKEEPER_HASHES = 3;
+
+        // Bit index of the counter for row i of a key's hash in table_
+        size_t counterIndex(uint64_t hash, size_t i) const;
+        uint32_t estimateHash(uint64_t hash) const;
+        bool doorkeeperContains(uint64_t hash) const;
+        // Halves every counter and clears the doorkeeper
+        void reset();
+
+        // 16 4 bit counters per word, DEPTH rows of width_ counters
+        std::vector<std::atomic<uint64_t>> table_;
+        size_t width_;
+        std::vector<std::atomic<uint64_t>> doorkeeper_;
+        size_t doorkeeperBits_;
+        std::atomic<size_t> additions_{0};
+        size_t sampleSize_;
+        std::atomic<uint64_t> resets_{0};
+};
@@ -1,4 +1,5 @@
 #include "Geo.h"
+#include "Metrics.h"
 
 // Create a Geo object without a maxmind database
 // (used for testing currently)
@@ -80,13 +81,43 @@ std::vector<size_t> Geo::getNearestNodes(Location l, int n) {
     nanoflann::KNNResultSet<double> resultSet(n);
     resultSet.init(&ret_indices[0], &out_dist_sqr[0]);
     std::vector<double> query_pt{l.x, l.y, l.z};
+    auto started = std::chrono::steady_clock::now();
     { // critical section
         treeData_.rlock()->get()->tree->findNeighbors(resultSet, 
             &query_pt[0], nanoflann::SearchParams(10));
     }
+    Metrics::get().kdtree_query_ms.recordSince(started);
     return ret_indices;
 }
 
+// Queries the KD-Tree for the "n" nearest Locations to the
+// provided Location "l". Unlike getNearestNodes(), the EdgeNodes
+// are resolved from the same tree snapshot that was searched, so
+// the results stay valid if the tree is swapped out concurrently.
+// Returns fewer than "n" neighbors if the tree holds fewer nodes.
+std::vector<Neighbor> Geo::getNearestNeighbors(Location l, int n) {
+    std::vector<Neighbor> neighbors;
+    std::shared_ptr<TreeData> treeData = treeData_.copy();
+    if (!treeData || !treeData->tree || n <= 0) {
+        return neighbors;
+    }
+    std::vector<size_t> ret_indices(n);
+    std::vector<double> out_dist_sqr(n);
+    nanoflann::KNNResultSet<double> resultSet(n);
+    resultSet.init(&ret_indices[0], &out_dist_sqr[0]);
+    std::vector<double> query_pt{l.x, l.y, l.z};
+    auto started = std::chrono::steady_clock::now();
+    treeData->tree->findNeighbors(resultSet,
+        &query_pt[0], nanoflann::SearchParams(10));
+    Metrics::get().kdtree_query_ms.recordSince(started);
+    for (size_t i = 0; i < resultSet.size(); i++) {
+        neighbors.push_back(Neighbor{
+            treeData->cloud.pts.at(ret_indices[i]),
+            std::sqrt(out_dist_sqr[i])});
+    }
+    return neighbors;
+}
+
 // Sets the TreeData class member to a new TreeData instance
 // in a thread-safe manner.
 void Geo::setTreeData(std::shared_ptr<TreeData> treeData) {
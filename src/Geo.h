@@ -39,6 +39,13 @@ struct TreeData {
 	std::shared_ptr<kd_tree_t> tree;
 };
 
+// An edge node returned from a nearest neighbor search along
+// with its distance (km) from the query location
+struct Neighbor {
+	std::shared_ptr<EdgeNode> node;
+	double distance;
+};
+
 // This class handles installing the maxmind geoip database
 // and provides utility methods wrapping the libmaxmind library
 // to access the database. This class will also hold a reference
@@ -54,6 +61,7 @@ class Geo {
 		void setTreeData(std::shared_ptr<TreeData> tree);
 		std::shared_ptr<TreeData> getTree();
 		std::vector<size_t> getNearestNodes(Location l, int n);
+		std::vector<Neighbor> getNearestNeighbors(Location l, int n);
     private:
         // reference to maxmind geoip database
         std::unique_ptr<GeoLite2PP::DB> db_;
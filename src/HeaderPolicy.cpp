@@ -0,0 +1,133 @@
+#include "HeaderPolicy.h"
+#include "CacheKey.h"
+
+#include <strings.h>
+
+#include <folly/String.h>
+
+using namespace proxygen;
+
+constexpr uint8_t HeaderPolicy::PRIVATE;
+constexpr uint8_t HeaderPolicy::DIRECTIVES;
+constexpr uint8_t HeaderPolicy::CACHE_KEY;
+
+namespace {
+    // Calls fn with each trimmed, non-empty token of a comma separated
+    // header value
+    template <typename F>
+    void forEachToken(const std::string& value, F&& fn) {
+        std::vector<folly::StringPiece> tokens;
+        folly::split(',', value, tokens);
+        for (auto t : tokens) {
+            t = folly::trimWhitespace(t);
+            if (!t.empty()) fn(t);
+        }
+    }
+
+    bool startsWithNoCase(folly::StringPiece s, folly::StringPiece prefix) {
+        return s.size() >= prefix.size() &&
+            strncasecmp(s.data(), prefix.data(), prefix.size()) == 0;
+    }
+}
+
+HeaderPolicy::HeaderPolicy(const MasternodeConfig& config):
+    HeaderPolicy(config.getOrigins()) {}
+
+HeaderPolicy::HeaderPolicy(const std::vector<OriginServer>& origins) {
+    for (auto code : {HTTP_HEADER_CONNECTION, HTTP_HEADER_KEEP_ALIVE,
+        HTTP_HEADER_PROXY_AUTHENTICATE, HTTP_HEADER_PROXY_CONNECTION,
+        HTTP_HEADER_TE, HTTP_HEADER_TRAILER, HTTP_HEADER_TRANSFER_ENCODING,
+        HTTP_HEADER_UPGRADE, HTTP_HEADER_ALT_SVC}) {
+        set(code, Action::STRIP);
+    }
+    for (auto code : {HTTP_HEADER_CONTENT_LENGTH, HTTP_HEADER_CONTENT_RANGE,
+        HTTP_HEADER_ACCEPT_RANGES}) {
+        set(code, Action::REPLACE);
+    }
+    set(HTTP_HEADER_LOCATION, Action::REWRITE);
+    set(HTTP_HEADER_CONTENT_LOCATION, Action::REWRITE);
+    set(HTTP_HEADER_SET_COOKIE, Action::FORWARD, PRIVATE);
+    set(HTTP_HEADER_CACHE_CONTROL, Action::FORWARD, DIRECTIVES);
+    set(HTTP_HEADER_VARY, Action::FORWARD, CACHE_KEY);
+
+    for (auto& server : origins) {
+        std::string origin = "http://" + server.host;
+        originPrefixes_.push_back(
+            origin + ":" + folly::to<std::string>(server.port));
+        if (server.port == 80) {
+            originPrefixes_.push_back(origin);
+        }
+    }
+}
+
+void HeaderPolicy::set(HTTPHeaderCode code, Action action, uint8_t flags) {
+    rules_[code].action = action;
+    rules_[code].flags = flags;
+}
+
+const HeaderPolicy::Rule& HeaderPolicy::getRule(HTTPHeaderCode code) const {
+    return rules_[code];
+}
+
+HeaderPolicy::Summary HeaderPolicy::apply(const HTTPHeaders& in,
+    HTTPHeaders& out, bool bodyChanged) const {
+    Summary summary;
+    in.forEachWithCode([&](HTTPHeaderCode code, const std::string& name,
+        const std::string& value) {
+        const Rule& rule = rules_[code];
+        if (rule.flags & PRIVATE) {
+            summary.shareable = false;
+        }
+        if (rule.flags & DIRECTIVES) {
+            forEachToken(value, [&](folly::StringPiece t) {
+                if (startsWithNoCase(t, "no-store") ||
+                    startsWithNoCase(t, "private")) {
+                    summary.shareable = false;
+                }
+            });
+        }
+        if (rule.flags & CACHE_KEY) {
+            forEachToken(value, [&](folly::StringPiece t) {
+                if (t == "*") {
+                    summary.shareable = false;
+                } else if (!folly::StringPiece("Accept-Encoding")
+                    .equals(t, folly::AsciiCaseInsensitive())) {
+                    // Accept-Encoding is stripped from origin requests,
+                    // so every client gets the same variant
+                    summary.varies = true;
+                    CacheKeyBuilder::appendVaryHeader(t, summary.vary);
+                }
+            });
+        }
+
+        switch (rule.action) {
+            case Action::FORWARD:
+                break;
+            case Action::STRIP:
+                return;
+            case Action::REPLACE:
+                if (bodyChanged) return;
+                break;
+            case Action::REWRITE:
+                out.add(name, rewriteURL(value));
+                return;
+        }
+        if (code == HTTP_HEADER_OTHER) {
+            out.add(name, value);
+        } else {
+            out.add(code, value);
+        }
+    });
+    return summary;
+}
+
+std::string HeaderPolicy::rewriteURL(const std::string& value) const {
+    for (auto& prefix : originPrefixes_) {
+        if (!startsWithNoCase(value, prefix)) continue;
+        std::string rest = value.substr(prefix.size());
+        if (rest.empty()) return "/";
+        if (rest[0] == '/') return rest;
+        if (rest[0] == '?' || rest[0] == '#') return "/" + rest;
+    }
+    return value;
+}
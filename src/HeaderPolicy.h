@@ -0,0 +1,79 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <vector>
+
+#include <proxygen/lib/http/HTTPMessage.h>
+
+#include "MasternodeConfig.h"
+
+// Decides what happens to each header of an origin's response on its way
+// to the client. The rules are compiled into a table indexed by header
+// code when the policy is created, so a response's headers are copied
+// (and checked for anything that keeps it out of the cache) with a
+// single pass over its header list.
+class HeaderPolicy {
+    public:
+        enum class Action : uint8_t {
+            // sent to the client as is
+            FORWARD,
+            // never sent: hop-by-hop headers, and ones that only apply
+            // to the connection to the origin
+            STRIP,
+            // describes the body as the origin sent it, so it's only
+            // forwarded when the body is passed through unchanged and
+            // set by the masternode otherwise
+            REPLACE,
+            // URLs pointing at the origin itself are made relative, so
+            // clients keep going through the masternode
+            REWRITE
+        };
+
+        // A response with this header can't be shared between clients
+        static constexpr uint8_t PRIVATE = 1 << 0;
+        // The header's value holds caching directives
+        static constexpr uint8_t DIRECTIVES = 1 << 1;
+        // The header names request headers that select between variants
+        // of the response (so they're relevant to its cache key)
+        static constexpr uint8_t CACHE_KEY = 1 << 2;
+
+        struct Rule {
+            Action action{Action::FORWARD};
+            uint8_t flags{0};
+        };
+
+        // What copying a response's headers found out about it
+        struct Summary {
+            // false if the response must not be stored in a shared cache
+            bool shareable{true};
+            // true if the response varies on request headers the
+            // masternode doesn't normalize away
+            bool varies{false};
+            // Those request headers, lowercased and comma separated
+            std::string vary;
+        };
+
+        explicit HeaderPolicy(const MasternodeConfig& config);
+        // Policy for a site with its own origins
+        explicit HeaderPolicy(const std::vector<OriginServer>& origins);
+
+        const Rule& getRule(proxygen::HTTPHeaderCode code) const;
+
+        // Copies the headers of an origin's response to "out". When
+        // bodyChanged is set, the headers describing the body (REPLACE)
+        // are left for the caller to set.
+        Summary apply(const proxygen::HTTPHeaders& in,
+            proxygen::HTTPHeaders& out, bool bodyChanged) const;
+
+        // Returns a URL header value relative to the masternode if it
+        // points at the origin, otherwise the value unchanged
+        std::string rewriteURL(const std::string& value) const;
+    private:
+        void set(proxygen::HTTPHeaderCode code, Action action,
+            uint8_t flags = 0);
+
+        std::array<Rule, 256> rules_;
+        // Absolute URLs of the origin as it may refer to itself
+        std::vector<std::string> originPrefixes_;
+};
@@ -1,6 +1,8 @@
 #include "Masternode.h"
 #include "Router.h"
 
+#include <algorithm>
+
 using namespace masternode;
 
 Masternode::Masternode(std::shared_ptr<MasternodeConfig> config):
@@ -10,12 +12,14 @@ Masternode::Masternode(std::shared_ptr<MasternodeConfig> config):
         state_ = std::make_shared<NetworkState>(config_);
     }
     
-    cache_ = std::make_shared<ContentCache>(
-        config_->maxRoutesToCache,
-        config_->cache_directory,
-        config->enableP2P);
+    cache_ = std::make_shared<ContentCache>(config_);
+    // warm the cache with the routes stored by a previous run
+    cache_->loadFromDisk();
 
-    if (config_->enableServiceWorker) {
+    bool tenantWorkers = std::any_of(config_->tenants.begin(),
+        config_->tenants.end(),
+        [](const TenantConfig& t) { return t.enable_service_worker; });
+    if (config_->enableServiceWorker || tenantWorkers) {
         sw_ = std::make_shared<ServiceWorker>(config_->service_worker_path);
     }
     
@@ -35,7 +39,13 @@ void Masternode::start(std::function<void()> onSuccess,
         state_->beginPollingGateway();
     }
     server_->bind(config_->IPs);
+    // blocks until the server is stopped
     server_->start(onSuccess, onError);
+
+    if (!config_->cache_snapshot_path.empty()) {
+        // lets the next start (or a seed edge node) begin warm
+        cache_->writeSnapshot(config_->cache_snapshot_path);
+    }
 }
 
 void Masternode::stop() {
@@ -25,5 +25,7 @@ namespace masternode {
             void start(std::function<void()> onSuccess = nullptr,
                 std::function<void(std::exception_ptr)> onError = nullptr);
             void stop();
+            // Cache the masternode serves content from
+            std::shared_ptr<ContentCache> getCache() const { return cache_; }
     };
 }
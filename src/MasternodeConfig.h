@@ -2,10 +2,45 @@
 
 #include <string.h>
 
+#include <vector>
+
 #include <proxygen/httpserver/HTTPServer.h>
 
+#include "EdgeRanker.h"
+#include "RouteRules.h"
+
+// An origin server content is fetched from
+struct OriginServer {
+    std::string host;
+    uint16_t port{80};
+    // Share of the requests the origin gets relative to the others
+    uint32_t weight{1};
+};
+
+// A site served alongside the protected domain, with its own origins
+// and cache namespace
+struct TenantConfig {
+    // Name of the site, also the namespace its content is cached under
+    std::string name;
+    // Host header values (without a port) the site is reached at
+    std::vector<std::string> hosts;
+    // Origin servers of the site
+    std::vector<OriginServer> origins;
+    bool enable_service_worker{false};
+    // Fraction of cache_memory_bytes the site's cached content may use
+    // (0 for no limit of its own)
+    double cache_share{0.0};
+};
+
 class MasternodeConfig {
     public:
+        // Returns the origin pool, or origin_host/origin_port if no pool
+        // is configured
+        std::vector<OriginServer> getOrigins() const {
+            if (!origins.empty()) return origins;
+            return {OriginServer{origin_host, origin_port, 1}};
+        }
+
         // IP address to bind to locally to serve requests
         std::string ip{""};
         // Port to bind to locally to serve requests
@@ -17,8 +52,30 @@ class MasternodeConfig {
         std::string origin_host{""};
         // Port of the origin server (required)
         uint16_t origin_port{80};
-        // Domain we're protecting (singular for now) (required)
+        // Origin servers requests are balanced over, in place of
+        // origin_host and origin_port
+        std::vector<OriginServer> origins;
+        // How an origin is picked for a request: "least_outstanding"
+        // (fewest requests waiting on a response, by weight) or "ewma"
+        // (also weighs in each origin's recent response time)
+        std::string origin_balancing{"least_outstanding"};
+        // Seconds between origin health checks (0 disables them)
+        uint32_t origin_health_interval{5};
+        // Path requested from each origin by health checks
+        std::string origin_health_path{"/"};
+        // Health checks an origin has to fail in a row before no more
+        // requests are sent to it
+        uint32_t origin_health_max_failures{3};
+        // Idle connections kept open to each origin per server thread
+        uint32_t origin_idle_sessions{8};
+        // Domain we're protecting (required unless tenants are set)
         std::string protected_domain{""};
+        // Other sites served by the masternode, by the Host they're
+        // requested with
+        std::vector<TenantConfig> tenants;
+        // Rules deciding how requests are handled and cached by path,
+        // method and headers (first matching rule wins)
+        std::vector<RouteRule> route_rules;
         // Proxygen server options
         proxygen::HTTPServerOptions options;
         // IPs for the server to locally bind to
@@ -51,6 +108,131 @@ class MasternodeConfig {
         std::string geoip_path{""};
         // GeoIP enabled
         bool geo_ip_enabled{false};
-        // Maximum number of routes to cache
+        // Maximum number of routes to cache in memory
         size_t maxRoutesToCache{1024};
+        // Memory budget for cached content in bytes (0 for no limit)
+        size_t cache_memory_bytes{256 * 1024 * 1024};
+        // Only let new routes push older ones out of memory if they're
+        // requested more often (TinyLFU admission)
+        bool cache_admission{false};
+        // Demote routes evicted from memory to a disk tier in the cache
+        // directory (always on with p2p, which writes every route there)
+        bool enable_disk_tier{false};
+        // Hits a disk tier route needs before it's promoted to memory
+        // (0 disables promotion)
+        uint32_t disk_promote_hits{2};
+        // Size of the chunks disk tier routes are streamed in
+        size_t disk_stream_chunk_size{64 * 1024};
+        // Disk I/O engine for cache files ("auto", "uring" or "threads")
+        std::string disk_io_engine{"auto"};
+        // Threads used by the thread pool disk I/O engine
+        size_t disk_io_threads{4};
+        // Maximum number of disk operations in flight with io_uring
+        size_t disk_io_queue_depth{256};
+        // Flush cached bodies to stable storage before indexing them
+        bool cache_fsync{false};
+        // Levels of hash prefix subdirectories cached bodies are fanned
+        // out into (0 writes them all directly in the cache directory)
+        unsigned cache_dir_levels{2};
+        // Disk space cached bodies may use in bytes (0 for no limit)
+        uint64_t cache_disk_quota_bytes{0};
+        // Cache snapshot file loaded on startup and written on shutdown
+        // (empty to disable)
+        std::string cache_snapshot_path{""};
+        // Largest response that is buffered and cached, bigger ones are
+        // streamed straight through to the client (0 for no limit)
+        size_t cache_max_object_bytes{32 * 1024 * 1024};
+        // Bytes all requests together may hold in responses being
+        // buffered for the cache. Responses that would go over are
+        // streamed through instead. (0 for no limit)
+        size_t max_buffered_bytes{256 * 1024 * 1024};
+        // Size of the slices large objects are fetched from the origin
+        // and cached in when a range of them is requested, instead of
+        // fetching the whole object (0 disables slicing)
+        size_t cache_slice_size{0};
+        // Seconds past its expiry a cached route is still served when
+        // the origin can't be reached or answers with a 5xx, unless the
+        // origin gave its own stale-if-error (0 disables)
+        uint32_t stale_if_error{300};
+        // Seconds 404 and 410 responses from the origin are cached for
+        // (0 disables negative caching)
+        uint32_t negative_cache_ttl{10};
+        // 5xx statuses from the origin that are cached for
+        // error_cache_ttl seconds, so repeated requests don't pile onto a
+        // struggling origin (none by default)
+        std::vector<uint16_t> error_cache_statuses;
+        uint32_t error_cache_ttl{2};
+        // Memory budget for cached negative and error responses in bytes
+        // (bodies and metadata), and the most of them that are cached
+        size_t negative_cache_bytes{4 * 1024 * 1024};
+        size_t negative_cache_max_routes{10000};
+        // Query parameters left out of cache keys because they don't
+        // change the content (a trailing * matches any parameter
+        // starting with the rest of the name)
+        std::vector<std::string> cache_key_drop_params{
+            "utm_*", "fbclid", "gclid"};
+        // If set, the only query parameters kept in cache keys
+        std::vector<std::string> cache_key_allow_params;
+        // Put the query parameters of cache keys in order, so the same
+        // parameters in another order hit the same route
+        bool cache_key_sort_params{true};
+        // Milliseconds to wait for a connection to the origin, and for
+        // each read from it once connected
+        uint32_t origin_connect_timeout_ms{5000};
+        uint32_t origin_response_timeout_ms{30000};
+        // Times a GET is retried on a new connection when the origin
+        // fails before responding
+        uint32_t origin_max_retries{1};
+        // Retries (and hedged connects) allowed as a fraction of the
+        // requests sent to the origin
+        double origin_retry_ratio{0.1};
+        // Start a second connect to the origin when a GET's connect takes
+        // longer than the 95th percentile
+        bool origin_hedge_connects{false};
+        // The origin circuit opens when at least this fraction of the
+        // requests in a window fail, once there were min_requests
+        double origin_breaker_failure_ratio{0.5};
+        uint32_t origin_breaker_min_requests{20};
+        // Milliseconds the circuit stays open before the origin is probed
+        uint32_t origin_breaker_open_ms{5000};
+        // Responses slower than this count as failures (0 disables)
+        uint32_t origin_slow_ms{0};
+        // Seconds between cache directory garbage collection runs
+        // (0 disables it)
+        uint32_t cache_gc_interval{30};
+        // Number of nearest edge nodes to consider per requested node
+        // when ranking edge nodes for a client
+        int edge_candidate_factor{3};
+        // Weights of each signal used to rank edge nodes
+        RankingWeights ranking_weights;
+        // Actively probe edge nodes and demote unhealthy ones
+        bool enable_edge_probing{false};
+        // Edge probing interval in seconds
+        uint16_t edge_probe_interval{10};
+        // Maximum number of edge probes in flight at once
+        size_t edge_probe_concurrency{16};
+        // Timeout for connecting to and fetching from an edge node
+        uint32_t edge_probe_timeout_ms{2000};
+        // Path requested from edge nodes when probing
+        std::string edge_probe_path{"/"};
+        // Connect to edge nodes with TLS when probing
+        bool edge_probe_tls{true};
+        // Consecutive probe failures before a node is demoted
+        uint32_t edge_probe_max_failures{3};
+        // Probe latency (ms) above which a node is demoted (0 disables)
+        uint32_t edge_probe_max_rtt_ms{0};
+        // Select edge nodes by network coordinates fitted from measured
+        // RTTs, falling back to geographic location
+        bool enable_network_coordinates{false};
+        // Client coordinates with a higher error than this aren't used
+        double coordinate_max_error{0.5};
+        // Client coordinates fitted to fewer samples than this aren't used
+        uint32_t coordinate_min_samples{3};
+        // Client reports needed before they affect an edge node's ranking
+        uint64_t edge_report_min_samples{10};
+        // Maximum size of a client edge report beacon body
+        size_t edge_report_max_bytes{16384};
+        // Token scrapers must send as "Authorization: Bearer <token>" to
+        // read the metrics (empty disables them)
+        std::string metrics_token{""};
 };
\ No newline at end of file
@@ -2,7 +2,12 @@
 #define STRIP_FLAG_HELP 1 // removes google gflags help messages in the binary
 #include <proxygen/httpserver/HTTPServer.h>
 
+#include <folly/FileUtil.h>
+#include <folly/String.h>
+
 #include "Masternode.h"
+#include "OriginPool.h"
+#include "Tenant.h"
 
 using namespace proxygen;
 using namespace folly::ssl;
@@ -13,6 +18,14 @@ DEFINE_int32(port, 80, "The port to listen for HTTP requests on");
 DEFINE_int32(ssl_port, 443, "The port to listen for HTTPS requests on");
 DEFINE_string(origin_host, "0.0.0.0", "The IP/Hostname of the origin server to proxy for");
 DEFINE_int32(origin_port, 80, "The port of the origin server to connect to");
+DEFINE_string(tenants_file, "", "Path of a JSON file listing other sites to serve, each with its own hosts, origins and cache namespace");
+DEFINE_string(route_rules_file, "", "Path of a JSON file with rules deciding how requests are handled and cached by path, method and headers");
+DEFINE_string(origins, "", "Comma separated origin servers to balance requests over as host:port*weight, in place of origin_host and origin_port");
+DEFINE_string(origin_balancing, "least_outstanding", "How an origin is picked for a request: least_outstanding or ewma");
+DEFINE_int32(origin_health_interval, 5, "Seconds between origin health checks (0 to disable)");
+DEFINE_string(origin_health_path, "/", "Path to request from origins when health checking them");
+DEFINE_int32(origin_health_max_failures, 3, "Health checks an origin has to fail in a row before it's taken out");
+DEFINE_int32(origin_idle_sessions, 8, "Idle connections kept open to each origin per server thread");
 DEFINE_string(protected_domain, 
     "localhost", "The domain name we are protecting"); // i.e. www.example.com
 DEFINE_string(cert_path, "", "File path to SSL certificate");
@@ -31,7 +44,49 @@ DEFINE_bool(geo_ip_enabled, false, "Set to true to enable geoip request routing"
 DEFINE_bool(enable_compression, false, "Set to true to enable compression");
 DEFINE_bool(enable_service_worker, true, "Set to true to enable service worker injection");
 DEFINE_int32(max_cached_routes, 1024, "Maximum number of routes to cache");
+DEFINE_int32(cache_memory_mb, 256, "Memory budget for cached content in megabytes (0 for no limit)");
+DEFINE_bool(cache_admission, false, "Set to true to only cache new routes over older ones when they're requested more often");
+DEFINE_bool(enable_disk_tier, false, "Set to true to keep routes evicted from memory in cache_dir instead of dropping them");
+DEFINE_int32(disk_promote_hits, 2, "Hits a route cached on disk needs before it's moved back into memory");
+DEFINE_string(disk_io_engine, "auto", "Disk I/O engine for cache files: auto, uring or threads");
+DEFINE_int32(disk_io_threads, 4, "Number of threads used by the threads disk I/O engine");
+DEFINE_bool(cache_fsync, false, "Set to true to flush cached content to stable storage before indexing it");
+DEFINE_int32(cache_dir_levels, 2, "Levels of hash prefix subdirectories to fan cached content out into (0 for a flat directory)");
+DEFINE_int32(cache_disk_quota_mb, 0, "Disk space cached content may use in megabytes (0 for no limit)");
+DEFINE_string(cache_snapshot, "", "Path of a cache snapshot file to load on startup and write on shutdown");
+DEFINE_int32(cache_max_object_mb, 32, "Size in megabytes of the largest response to cache, bigger ones are streamed through (0 for no limit)");
+DEFINE_int32(max_buffered_mb, 256, "Megabytes all requests together may hold in responses being buffered for the cache (0 for no limit)");
+DEFINE_int32(cache_slice_kb, 0, "Size in kilobytes of the slices large objects are cached in when ranges of them are requested (0 to disable)");
+DEFINE_int32(stale_if_error, 300, "Seconds past its expiry cached content is still served when the origin is down or failing (0 to disable)");
+DEFINE_int32(negative_cache_ttl, 10, "Seconds 404 and 410 responses from the origin are cached for (0 to disable)");
+DEFINE_string(error_cache_statuses, "", "Comma separated 5xx statuses from the origin to cache for error_cache_ttl seconds, e.g. 502,503,504");
+DEFINE_int32(error_cache_ttl, 2, "Seconds the statuses in error_cache_statuses are cached for");
+DEFINE_int32(negative_cache_kb, 4096, "Memory budget for cached 404, 410 and error responses in kilobytes, including their metadata");
+DEFINE_int32(negative_cache_max_routes, 10000, "Maximum number of cached 404, 410 and error responses");
+DEFINE_string(cache_key_drop_params, "utm_*,fbclid,gclid", "Comma separated query parameters left out of cache keys (a trailing * matches any parameter starting with the rest)");
+DEFINE_string(cache_key_allow_params, "", "Comma separated query parameters to keep in cache keys, all others are left out (empty keeps all but the dropped ones)");
+DEFINE_bool(cache_key_sort_params, true, "Sort the query parameters of cache keys so their order doesn't matter");
+DEFINE_int32(origin_connect_timeout_ms, 5000, "Milliseconds to wait for a connection to the origin");
+DEFINE_int32(origin_response_timeout_ms, 30000, "Milliseconds to wait for each read from the origin once connected");
+DEFINE_int32(origin_max_retries, 1, "Times a GET is retried when the origin fails before responding");
+DEFINE_double(origin_retry_ratio, 0.1, "Retries and hedged connects allowed as a fraction of origin requests");
+DEFINE_bool(origin_hedge_connects, false, "Set to true to start a second connect to the origin when one is slower than usual");
+DEFINE_double(origin_breaker_failure_ratio, 0.5, "Fraction of failed origin requests that opens the origin circuit");
+DEFINE_int32(origin_breaker_min_requests, 20, "Origin requests in a window needed before the circuit can open");
+DEFINE_int32(origin_breaker_open_ms, 5000, "Milliseconds the origin circuit stays open before the origin is probed");
+DEFINE_int32(origin_slow_ms, 0, "Origin responses slower than this many milliseconds count as failures (0 to disable)");
 DEFINE_bool(enable_p2p, false, "Set to true if running masternode alongside a Gladius p2p network");
+DEFINE_int32(edge_candidate_factor, 3, "Number of nearby edge nodes to consider per edge node handed to a client");
+DEFINE_bool(enable_edge_probing, false, "Set to true to actively probe edge nodes and demote unhealthy ones");
+DEFINE_int32(edge_probe_interval, 10, "Seconds between edge node probe rounds");
+DEFINE_int32(edge_probe_concurrency, 16, "Maximum number of edge node probes in flight at once");
+DEFINE_int32(edge_probe_timeout_ms, 2000, "Timeout in milliseconds for a single edge node probe");
+DEFINE_string(edge_probe_path, "/", "Path to request from edge nodes when probing them");
+DEFINE_int32(edge_probe_max_failures, 3, "Consecutive failed probes before an edge node is demoted");
+DEFINE_int32(edge_probe_max_rtt_ms, 0, "Probe latency in milliseconds above which an edge node is demoted (0 to disable)");
+DEFINE_bool(enable_network_coordinates, false, "Set to true to select edge nodes by network coordinates fitted from measured latencies");
+DEFINE_double(coordinate_max_error, 0.5, "Maximum error of a client network coordinate for it to be used (0.0 - 1.0)");
+DEFINE_string(metrics_token, "", "Token to send as a bearer token to read /metrics (metrics are disabled if empty)");
 
 // debug use only
 DEFINE_bool(ignore_heartbeat, false, "Set to true to disable heartbeat checking for edge nodes");
@@ -75,6 +130,37 @@ int main(int argc, char *argv[]) {
     config->port = FLAGS_port;
     config->origin_host = FLAGS_origin_host;
     config->origin_port = FLAGS_origin_port;
+    config->origins = OriginPool::parseOrigins(FLAGS_origins);
+    config->origin_balancing = FLAGS_origin_balancing;
+    if (!FLAGS_tenants_file.empty()) {
+        std::string tenants;
+        if (!folly::readFile(FLAGS_tenants_file.c_str(), tenants)) {
+            LOG(FATAL) << "Could not read tenants file " << FLAGS_tenants_file;
+        }
+        try {
+            config->tenants = TenantTable::parseTenants(tenants);
+        } catch (const std::exception& e) {
+            LOG(FATAL) << "Invalid tenants file: " << e.what();
+        }
+        LOG(INFO) << "Serving " << config->tenants.size() << " other sites";
+    }
+    if (!FLAGS_route_rules_file.empty()) {
+        std::string rules;
+        if (!folly::readFile(FLAGS_route_rules_file.c_str(), rules)) {
+            LOG(FATAL) << "Could not read route rules file " <<
+                FLAGS_route_rules_file;
+        }
+        try {
+            config->route_rules = RouteRules::parseRules(rules);
+        } catch (const std::exception& e) {
+            LOG(FATAL) << "Invalid route rules file: " << e.what();
+        }
+        LOG(INFO) << "Loaded " << config->route_rules.size() << " route rules";
+    }
+    config->origin_health_interval = FLAGS_origin_health_interval;
+    config->origin_health_path = FLAGS_origin_health_path;
+    config->origin_health_max_failures = FLAGS_origin_health_max_failures;
+    config->origin_idle_sessions = FLAGS_origin_idle_sessions;
     config->protected_domain = FLAGS_protected_domain;
     config->enableP2P = FLAGS_enable_p2p;
     config->gateway_address = FLAGS_gateway_address;
@@ -84,11 +170,72 @@ int main(int argc, char *argv[]) {
     config->IPs = IPs;
     config->cache_directory = FLAGS_cache_dir;
     config->maxRoutesToCache = FLAGS_max_cached_routes;
+    config->cache_memory_bytes =
+        static_cast<size_t>(FLAGS_cache_memory_mb) * 1024 * 1024;
+    config->cache_admission = FLAGS_cache_admission;
+    config->enable_disk_tier = FLAGS_enable_disk_tier;
+    config->disk_promote_hits = FLAGS_disk_promote_hits;
+    config->disk_io_engine = FLAGS_disk_io_engine;
+    config->disk_io_threads = FLAGS_disk_io_threads;
+    config->cache_fsync = FLAGS_cache_fsync;
+    config->cache_dir_levels = FLAGS_cache_dir_levels;
+    config->cache_snapshot_path = FLAGS_cache_snapshot;
+    config->cache_disk_quota_bytes =
+        static_cast<uint64_t>(FLAGS_cache_disk_quota_mb) * 1024 * 1024;
+    config->cache_max_object_bytes =
+        static_cast<size_t>(FLAGS_cache_max_object_mb) * 1024 * 1024;
+    config->max_buffered_bytes =
+        static_cast<size_t>(FLAGS_max_buffered_mb) * 1024 * 1024;
+    config->cache_slice_size =
+        static_cast<size_t>(FLAGS_cache_slice_kb) * 1024;
+    config->stale_if_error = FLAGS_stale_if_error;
+    config->negative_cache_ttl = FLAGS_negative_cache_ttl;
+    std::vector<folly::StringPiece> statuses;
+    folly::split(',', FLAGS_error_cache_statuses, statuses, true);
+    for (auto s : statuses) {
+        auto status = folly::tryTo<uint16_t>(folly::trimWhitespace(s));
+        if (!status.hasValue() || status.value() < 500 ||
+            status.value() > 599) {
+            LOG(WARNING) << "Ignoring invalid error cache status: " << s;
+            continue;
+        }
+        config->error_cache_statuses.push_back(status.value());
+    }
+    config->error_cache_ttl = FLAGS_error_cache_ttl;
+    config->negative_cache_bytes =
+        static_cast<size_t>(FLAGS_negative_cache_kb) * 1024;
+    config->negative_cache_max_routes = FLAGS_negative_cache_max_routes;
+    config->cache_key_drop_params.clear();
+    folly::split(',', FLAGS_cache_key_drop_params,
+        config->cache_key_drop_params, true);
+    folly::split(',', FLAGS_cache_key_allow_params,
+        config->cache_key_allow_params, true);
+    config->cache_key_sort_params = FLAGS_cache_key_sort_params;
+    config->origin_connect_timeout_ms = FLAGS_origin_connect_timeout_ms;
+    config->origin_response_timeout_ms = FLAGS_origin_response_timeout_ms;
+    config->origin_max_retries = FLAGS_origin_max_retries;
+    config->origin_retry_ratio = FLAGS_origin_retry_ratio;
+    config->origin_hedge_connects = FLAGS_origin_hedge_connects;
+    config->origin_breaker_failure_ratio = FLAGS_origin_breaker_failure_ratio;
+    config->origin_breaker_min_requests = FLAGS_origin_breaker_min_requests;
+    config->origin_breaker_open_ms = FLAGS_origin_breaker_open_ms;
+    config->origin_slow_ms = FLAGS_origin_slow_ms;
     config->ignore_heartbeat = FLAGS_ignore_heartbeat;
     config->pool_domain = FLAGS_pool_domain;
     config->cdn_subdomain = FLAGS_cdn_subdomain;
     config->geoip_path = FLAGS_geoip_path;
     config->geo_ip_enabled = FLAGS_geo_ip_enabled;
+    config->edge_candidate_factor = FLAGS_edge_candidate_factor;
+    config->enable_edge_probing = FLAGS_enable_edge_probing;
+    config->edge_probe_interval = FLAGS_edge_probe_interval;
+    config->edge_probe_concurrency = FLAGS_edge_probe_concurrency;
+    config->edge_probe_timeout_ms = FLAGS_edge_probe_timeout_ms;
+    config->edge_probe_path = FLAGS_edge_probe_path;
+    config->edge_probe_max_failures = FLAGS_edge_probe_max_failures;
+    config->edge_probe_max_rtt_ms = FLAGS_edge_probe_max_rtt_ms;
+    config->enable_network_coordinates = FLAGS_enable_network_coordinates;
+    config->coordinate_max_error = FLAGS_coordinate_max_error;
+    config->metrics_token = FLAGS_metrics_token;
     config->options.threads = threads;
     config->options.idleTimeout = std::chrono::milliseconds(60000);
     config->options.shutdownOn = {SIGINT, SIGTERM};
@@ -0,0 +1,178 @@
+#include "Metrics.h"
+
+#include <algorithm>
+
+#include <folly/Conv.h>
+
+constexpr size_t Histogram::NUM_BOUNDS;
+
+const std::array<double, Histogram::NUM_BOUNDS> Histogram::BOUNDS{{
+    0.1, 0.25, 0.5, 1, 2.5, 5, 10, 25, 50, 100, 250, 500, 1000, 2500,
+    5000, 10000}};
+
+Histogram::Shard::~Shard() {
+    for (size_t i = 0; i < buckets.size(); i++) {
+        parent.retired_[i] += buckets[i].load(std::memory_order_relaxed);
+    }
+    parent.retiredMicros_ += sumMicros.load(std::memory_order_relaxed);
+}
+
+void Histogram::record(double ms) {
+    Shard* shard = shards_.get();
+    if (!shard) {
+        shard = new Shard(*this);
+        shards_.reset(shard);
+    }
+    size_t bucket = std::lower_bound(BOUNDS.begin(), BOUNDS.end(), ms) -
+        BOUNDS.begin();
+    // only this thread writes the shard, so a load and a store will do
+    auto& count = shard->buckets[bucket];
+    count.store(count.load(std::memory_order_relaxed) + 1,
+        std::memory_order_relaxed);
+    uint64_t micros = ms > 0 ? static_cast<uint64_t>(ms * 1000) : 0;
+    shard->sumMicros.store(
+        shard->sumMicros.load(std::memory_order_relaxed) + micros,
+        std::memory_order_relaxed);
+}
+
+Histogram::Snapshot Histogram::snapshot() const {
+    Snapshot snapshot;
+    uint64_t micros = retiredMicros_;
+    for (size_t i = 0; i < snapshot.buckets.size(); i++) {
+        snapshot.buckets[i] = retired_[i];
+    }
+    for (const auto& shard : shards_.accessAllThreads()) {
+        for (size_t i = 0; i < snapshot.buckets.size(); i++) {
+            snapshot.buckets[i] +=
+                shard.buckets[i].load(std::memory_order_relaxed);
+        }
+        micros += shard.sumMicros.load(std::memory_order_relaxed);
+    }
+    for (auto count : snapshot.buckets) {
+        snapshot.count += count;
+    }
+    snapshot.sum = micros / 1000.0;
+    return snapshot;
+}
+
+/////////////////////////////////////////////////////////////////////////
+
+Metrics& Metrics::get() {
+    static Metrics metrics;
+    return metrics;
+}
+
+void Metrics::appendHeader(std::string& out, folly::StringPiece name,
+    folly::StringPiece help, folly::StringPiece type) {
+    folly::toAppend("# HELP ", name, " ", help, "\n# TYPE ", name, " ",
+        type, "\n", &out);
+}
+
+void Metrics::appendLabel(std::string& labels, folly::StringPiece name,
+    folly::StringPiece value) {
+    if (!labels.empty()) labels.push_back(',');
+    folly::toAppend(name, "=\"", &labels);
+    for (char c : value) {
+        switch (c) {
+            case '\\': labels.append("\\\\"); break;
+            case '"': labels.append("\\\""); break;
+            case '\n': labels.append("\\n"); break;
+            default: labels.push_back(c);
+        }
+    }
+    labels.push_back('"');
+}
+
+void Metrics::appendSample(std::string& out, folly::StringPiece name,
+    folly::StringPiece labels, double value) {
+    out.append(name.data(), name.size());
+    if (!labels.empty()) {
+        folly::toAppend("{", labels, "}", &out);
+    }
+    folly::toAppend(" ", value, "\n", &out);
+}
+
+void Metrics::appendCounter(std::string& out, folly::StringPiece name,
+    folly::StringPiece help, uint64_t value) {
+    appendHeader(out, name, help, "counter");
+    folly::toAppend(name, " ", value, "\n", &out);
+}
+
+void Metrics::appendGauge(std::string& out, folly::StringPiece name,
+    folly::StringPiece help, double value) {
+    appendHeader(out, name, help, "gauge");
+    appendSample(out, name, "", value);
+}
+
+void Metrics::appendHistogram(std::string& out, folly::StringPiece name,
+    folly::StringPiece help, const Histogram& histogram) {
+    auto snapshot = histogram.snapshot();
+    appendHeader(out, name, help, "histogram");
+    // buckets are cumulative in the text format
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < snapshot.buckets.size(); i++) {
+        cumulative += snapshot.buckets[i];
+        folly::toAppend(name, "_bucket{le=\"", &out);
+        if (i < Histogram::NUM_BOUNDS) {
+            folly::toAppend(Histogram::BOUNDS[i], &out);
+        } else {
+            out.append("+Inf");
+        }
+        folly::toAppend("\"} ", cumulative, "\n", &out);
+    }
+    folly::toAppend(name, "_sum ", snapshot.sum, "\n", name, "_count ",
+        snapshot.count, "\n", &out);
+}
+
+void Metrics::render(std::string& out) const {
+    static const char* handlerNames[NUM_HANDLERS] = {
+        "proxy", "direct", "redirect", "service_worker", "reject"};
+    appendHeader(out, "masternode_requests_total",
+        "Requests by the handler the router picked", "counter");
+    for (size_t i = 0; i < NUM_HANDLERS; i++) {
+        std::string labels;
+        appendLabel(labels, "handler", handlerNames[i]);
+        appendSample(out, "masternode_requests_total", labels,
+            requests[i].value());
+    }
+
+    appendCounter(out, "masternode_cache_hits_total",
+        "Proxied GET requests answered from the cache", cache_hits.value());
+    appendCounter(out, "masternode_cache_misses_total",
+        "Proxied GET requests sent to the origin", cache_misses.value());
+    appendCounter(out, "masternode_cache_stale_served_total",
+        "Expired cached routes served because the origin failed",
+        stale_served.value());
+    appendCounter(out, "masternode_cache_bytes_served_total",
+        "Response body bytes sent from the cache", cache_bytes.value());
+    appendCounter(out, "masternode_origin_bytes_served_total",
+        "Response body bytes sent from the origin", origin_bytes.value());
+
+    appendCounter(out, "masternode_origin_failures_total",
+        "Origin requests that failed before a response",
+        origin_failures.value());
+    appendCounter(out, "masternode_origin_retries_total",
+        "Origin requests that were retried", origin_retries.value());
+    appendHistogram(out, "masternode_origin_connect_ms",
+        "Time to open a new connection to the origin", origin_connect_ms);
+    appendHistogram(out, "masternode_origin_ttfb_ms",
+        "Time from starting an origin request to its response headers",
+        origin_ttfb_ms);
+    appendHistogram(out, "masternode_origin_total_ms",
+        "Time from starting an origin request to the end of its response",
+        origin_total_ms);
+
+    appendHistogram(out, "masternode_sw_inject_ms",
+        "Time spent injecting the service worker into HTML", sw_inject_ms);
+
+    appendHistogram(out, "masternode_gateway_poll_ms",
+        "Time to fetch the network state from the gateway", gateway_poll_ms);
+    appendHistogram(out, "masternode_gateway_parse_ms",
+        "Time to parse and apply the gateway's network state",
+        gateway_parse_ms);
+    appendCounter(out, "masternode_gateway_poll_failures_total",
+        "Gateway polls that failed", gateway_poll_failures.value());
+
+    appendHistogram(out, "masternode_kdtree_query_ms",
+        "Time of nearest edge node searches", kdtree_query_ms);
+}
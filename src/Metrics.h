@@ -0,0 +1,151 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+
+#include <folly/Range.h>
+#include <folly/ThreadCachedInt.h>
+#include <folly/ThreadLocal.h>
+
+// A count that only goes up. Each thread adds to its own copy, the
+// copies are summed when the count is read.
+class Counter {
+    public:
+        void add(uint64_t n = 1) { value_.increment(n); }
+        uint64_t value() const { return value_.readFull(); }
+    private:
+        folly::ThreadCachedInt<uint64_t> value_;
+};
+
+// Distribution of durations in milliseconds over fixed, roughly
+// logarithmic buckets. Each thread records into buckets of its own, so
+// recording takes no locks and no atomic read-modify-writes; a snapshot
+// adds up every thread's buckets (and those of threads that exited).
+class Histogram {
+    public:
+        // Upper bounds of the buckets in milliseconds, the last bucket
+        // (+Inf) takes everything above them
+        static constexpr size_t NUM_BOUNDS = 16;
+        static const std::array<double, NUM_BOUNDS> BOUNDS;
+
+        struct Snapshot {
+            // Not cumulative, buckets[NUM_BOUNDS] is the +Inf bucket
+            std::array<uint64_t, NUM_BOUNDS + 1> buckets{};
+            uint64_t count{0};
+            double sum{0.0};
+        };
+
+        Histogram() = default;
+        Histogram(const Histogram&) = delete;
+        Histogram& operator=(const Histogram&) = delete;
+
+        void record(double ms);
+        void record(std::chrono::steady_clock::duration d) {
+            record(std::chrono::duration_cast<std::chrono::microseconds>(
+                d).count() / 1000.0);
+        }
+        // Records the time since "start"
+        void recordSince(std::chrono::steady_clock::time_point start) {
+            record(std::chrono::steady_clock::now() - start);
+        }
+
+        Snapshot snapshot() const;
+    private:
+        struct Tag {};
+
+        // One thread's buckets. Only that thread writes them, the atomics
+        // are there for snapshots reading them at the same time.
+        struct Shard {
+            explicit Shard(Histogram& parent): parent(parent) {}
+            // hands the counts over to the histogram when the thread exits
+            ~Shard();
+
+            Histogram& parent;
+            std::array<std::atomic<uint64_t>, NUM_BOUNDS + 1> buckets{};
+            std::atomic<uint64_t> sumMicros{0};
+        };
+
+        // Counts of threads that exited (declared before the shards so
+        // it outlives them)
+        std::array<std::atomic<uint64_t>, NUM_BOUNDS + 1> retired_{};
+        std::atomic<uint64_t> retiredMicros_{0};
+
+        folly::ThreadLocalPtr<Shard, Tag> shards_;
+};
+
+// The masternode's metrics, shared by every thread and served in the
+// Prometheus text format by the direct handler
+class Metrics {
+    public:
+        // Handlers the router hands requests to
+        enum Handler {
+            PROXY,
+            DIRECT,
+            REDIRECT,
+            SERVICE_WORKER,
+            REJECT,
+            NUM_HANDLERS
+        };
+
+        static Metrics& get();
+
+        // Requests by the handler picked for them
+        std::array<Counter, NUM_HANDLERS> requests;
+
+        // Proxied GETs answered from the cache, and the ones that had
+        // to go to the origin (bypassed routes aren't counted)
+        Counter cache_hits;
+        Counter cache_misses;
+        // Expired routes served because the origin failed
+        Counter stale_served;
+        // Response body bytes sent from the cache and from the origin
+        Counter cache_bytes;
+        Counter origin_bytes;
+
+        // Origin requests that failed before a response, and retries
+        Counter origin_failures;
+        Counter origin_retries;
+        // Time from starting an origin request (connecting, or picking
+        // an idle connection) to being connected, to the response
+        // headers, and to the end of the response
+        Histogram origin_connect_ms;
+        Histogram origin_ttfb_ms;
+        Histogram origin_total_ms;
+
+        // Time spent injecting the service worker into HTML
+        Histogram sw_inject_ms;
+
+        // Time to fetch and to parse the gateway's network state, and
+        // polls that failed
+        Histogram gateway_poll_ms;
+        Histogram gateway_parse_ms;
+        Counter gateway_poll_failures;
+
+        // Time of nearest edge node searches in the KD-trees
+        Histogram kdtree_query_ms;
+
+        // Appends every metric above to "out"
+        void render(std::string& out) const;
+
+        // Helpers for writing the text format. Labels are given as they
+        // go between the braces (e.g. tenant="shop"), if any; a metric
+        // with several labelled samples gets one header before them.
+        // appendLabel adds a label to such a list, escaping its value.
+        static void appendLabel(std::string& labels, folly::StringPiece name,
+            folly::StringPiece value);
+        static void appendHeader(std::string& out, folly::StringPiece name,
+            folly::StringPiece help, folly::StringPiece type);
+        static void appendSample(std::string& out, folly::StringPiece name,
+            folly::StringPiece labels, double value);
+        static void appendCounter(std::string& out, folly::StringPiece name,
+            folly::StringPiece help, uint64_t value);
+        static void appendGauge(std::string& out, folly::StringPiece name,
+            folly::StringPiece help, double value);
+        static void appendHistogram(std::string& out, folly::StringPiece name,
+            folly::StringPiece help, const Histogram& histogram);
+    private:
+        Metrics() = default;
+};
@@ -4,16 +4,36 @@
 #include <folly/json.h>
 
 #include "NetworkState.h"
+#include "Metrics.h"
 
 using namespace std::chrono;
 
+namespace {
+    // Reads an optional numeric field formatted like the other gateway
+    // state fields ({"field": {"data": value}}). Returns def if the field
+    // is missing or isn't a number.
+    double optionalDouble(const folly::dynamic& value,
+        const char* field, double def) {
+        auto f = value.get_ptr(field);
+        if (!f || !f->isObject()) return def;
+        auto data = f->get_ptr("data");
+        if (!data) return def;
+        try {
+            return data->asDouble();
+        } catch (const std::exception& e) {
+            return def;
+        }
+    }
+}
+
 NetworkState::NetworkState(std::shared_ptr<MasternodeConfig> config):
-    config_(config) {
+    config_(config), ranker_(config->ranking_weights) {
     httpClient_ = std::make_unique<httplib::Client>(
         config_->gateway_address.c_str(),
         config->gateway_port,
         config_->gateway_poll_interval /* timeout in seconds */
     );
+    initEdgeMeasurement();
     if (config_->geo_ip_enabled) {
         try {
             geo_ = std::make_unique<Geo>(
@@ -27,15 +47,34 @@ NetworkState::NetworkState(std::shared_ptr<MasternodeConfig> config):
 }
 
 NetworkState::NetworkState(std::shared_ptr<MasternodeConfig> config,
-    std::unique_ptr<Geo> g): config_(config), geo_(std::move(g)) {
+    std::unique_ptr<Geo> g): config_(config), geo_(std::move(g)),
+    ranker_(config->ranking_weights) {
     httpClient_ = std::make_unique<httplib::Client>(
     config_->gateway_address.c_str(),
     config->gateway_port,
     config_->gateway_poll_interval /* timeout in seconds */);
+    initEdgeMeasurement();
 }
 
 NetworkState::~NetworkState() {
     fs.shutdown();
+    // stop probing before the coordinate system it reports to goes away
+    prober_.reset();
+}
+
+void NetworkState::initEdgeMeasurement() {
+    if (config_->enable_network_coordinates) {
+        coords_ = std::make_unique<VivaldiSystem>();
+    }
+    if (config_->enable_edge_probing) {
+        prober_ = std::make_unique<EdgeProber>(config_);
+        if (coords_) {
+            prober_->setRttObserver(
+                [this](const std::string& ethAddress, double rttMs) {
+                    coords_->observeEdge(ethAddress, rttMs);
+                });
+        }
+    }
 }
 
 void NetworkState::parseStateUpdate(std::string body,
@@ -62,6 +101,11 @@ void NetworkState::parseStateUpdate(std::string body,
             if (hasNoContent) continue;
             std::shared_ptr<EdgeNode> node = std::make_shared<EdgeNode>(
                 ip, port, nodeAddress, heartbeat);
+            // optional performance figures used for ranking
+            node->setLoad(optionalDouble(value, "load", 0.0));
+            node->setBandwidth(optionalDouble(value, "bandwidth", 0.0));
+            node->setErrorRate(optionalDouble(value, "error_rate", 0.0));
+            applyEdgeReports(node);
             if (config_->geo_ip_enabled) 
                 node->setLocation(geo_->lookupCoordinates(ip));
             newList.push_back(node);
@@ -70,13 +114,34 @@ void NetworkState::parseStateUpdate(std::string body,
                 "Caught exception when parsing network state: " << e.what();
         }
     }
-    
+
+    // age the client reports so that recent ones count the most
+    reports_.decay();
+
+    folly::F14FastSet<std::string> known;
+    for (auto& node : newList) {
+        known.insert(node->getEthAddress());
+    }
+    knownEdges_ = std::move(known);
+
+    // keep every live node around for the prober, but leave the ones
+    // that are failing probes out of the list handed to clients
+    probeTargets_ = newList;
+    if (prober_) {
+        newList = prober_->filterHealthy(newList);
+    }
+
     if (config_->geo_ip_enabled) {
         // create new KD-Tree with new LockedNodeList
         auto newTreeData = geo_->buildTreeData(newList);
         // swap the old one with the new one
         geo_->setTreeData(newTreeData);
     }
+    if (coords_) {
+        // nodes without a coordinate yet are only reachable through
+        // the geographic tree
+        coords_->setTreeData(coords_->buildTreeData(newList));
+    }
     // swap the old LockedNodeList out with the new one
     { // critical section
         edgeNodes_ = newList;
@@ -110,16 +175,19 @@ std::vector<std::shared_ptr<EdgeNode>> NetworkState::getEdgeNodes() {
     }
 }
 
-// performs an N-nearest-neighbor search for up to n edge nodes around
-// a geographic location l
+// performs an N-nearest-neighbor search for a pool of candidate edge
+// nodes around a geographic location l and selects up to n of them
+// with the EdgeRanker
 std::vector<std::shared_ptr<EdgeNode>> 
     NetworkState::getNearestEdgeNodes(Location l, int n) {
-    std::vector<size_t> indices = geo_->getNearestNodes(l, n);
-    std::vector<std::shared_ptr<EdgeNode>> nodes;
-    for (auto i : indices) {
-        nodes.push_back(edgeNodes_.rlock()->at(i));
+    int poolSize = n * std::max(1, config_->edge_candidate_factor);
+    std::vector<EdgeCandidate> candidates;
+    for (auto& neighbor : geo_->getNearestNeighbors(l, poolSize)) {
+        candidates.push_back(EdgeCandidate{neighbor.node, neighbor.distance});
     }
-    return nodes;
+    int64_t now = duration_cast<seconds>(
+        system_clock::now().time_since_epoch()).count();
+    return ranker_.select(candidates, n, now);
 }
 
 // looks up the geographic location of an ip address "ip"
@@ -127,9 +195,67 @@ std::vector<std::shared_ptr<EdgeNode>>
 // it.
 std::vector<std::shared_ptr<EdgeNode>> 
     NetworkState::getNearestEdgeNodes(std::string ip, int n) {
+    if (coords_) {
+        auto c = coords_->getClientCoordinate(VivaldiSystem::clientPrefix(ip));
+        if (c && c->samples >= config_->coordinate_min_samples &&
+            c->error <= config_->coordinate_max_error) {
+            int poolSize = n * std::max(1, config_->edge_candidate_factor);
+            std::vector<EdgeCandidate> candidates;
+            for (auto& neighbor : coords_->getNearestNeighbors(*c, poolSize)) {
+                candidates.push_back(
+                    EdgeCandidate{neighbor.node, neighbor.rtt});
+            }
+            if (candidates.size() >= static_cast<size_t>(n)) {
+                int64_t now = duration_cast<seconds>(
+                    system_clock::now().time_since_epoch()).count();
+                return ranker_.select(candidates, n, now);
+            }
+        }
+    }
+    if (!geo_) {
+        // cold start without geographic data, hand out every node
+        return getEdgeNodes();
+    }
     return getNearestEdgeNodes(geo_->lookupCoordinates(ip), n);
 }
 
+void NetworkState::observeClientTiming(const std::string& ip,
+    const std::string& ethAddress, double rttMs) {
+    if (coords_) {
+        coords_->observeClient(
+            VivaldiSystem::clientPrefix(ip), ethAddress, rttMs);
+    }
+}
+
+void NetworkState::recordEdgeReport(const std::string& ip,
+    const std::string& ethAddress, bool success, double ms) {
+    // the edge names come from clients, don't let them make up new ones
+    if (!knownEdges_.rlock()->count(ethAddress)) {
+        VLOG(1) << "Dropping report about unknown edge node " << ethAddress;
+        return;
+    }
+    reports_.record(VivaldiSystem::clientPrefix(ip), ethAddress, success, ms);
+    if (success) {
+        observeClientTiming(ip, ethAddress, ms);
+    }
+}
+
+// Folds what clients reported about a node into its ranking inputs
+void NetworkState::applyEdgeReports(std::shared_ptr<EdgeNode> node) {
+    auto summary = reports_.getEdgeSummary(node->getEthAddress());
+    if (!summary || summary->reports < config_->edge_report_min_samples) {
+        return;
+    }
+    double reportedErrors =
+        static_cast<double>(summary->failures) / summary->reports;
+    node->setErrorRate(std::max(node->getErrorRate(), reportedErrors));
+    node->setLatency(summary->mean_ms);
+}
+
+EdgeReports& NetworkState::getEdgeReports() { return reports_; }
+
+VivaldiSystem* NetworkState::getCoordinates() const { return coords_.get(); }
+
 // Start a separate thread to periodically poll the network
 // gateway for state. Calls parseStateUpdate()
 void NetworkState::beginPollingGateway() {
@@ -137,14 +263,35 @@ void NetworkState::beginPollingGateway() {
         LOG(INFO) << "Fetching network state from gateway...";
         // Make a GET request to the Gladius network gateway
         // to fetch state
+        auto& metrics = Metrics::get();
+        auto started = std::chrono::steady_clock::now();
         auto res = httpClient_->Get("/api/p2p/state");
+        metrics.gateway_poll_ms.recordSince(started);
         if (res && res->status == 200) {
             LOG(INFO) << "Received network state from gateway";
             // parse the JSON into state structs/classes
+            started = std::chrono::steady_clock::now();
             parseStateUpdate(res->body, config_->ignore_heartbeat);
+            metrics.gateway_parse_ms.recordSince(started);
+        } else {
+            metrics.gateway_poll_failures.add();
         }
     }, std::chrono::seconds(config_->gateway_poll_interval), "GatewayPoller");
+    if (prober_) {
+        fs.addFunction([&] {
+            // results are picked up on the next state update
+            prober_->probe(probeTargets_.copy());
+        }, std::chrono::seconds(config_->edge_probe_interval), "EdgeProber");
+    }
     fs.setSteady(true);
     fs.start();
     LOG(INFO) << "Started network state polling thread...";
 }
+
+void NetworkState::probeEdgeNodes() {
+    if (prober_) {
+        prober_->probeAndWait(probeTargets_.copy());
+    }
+}
+
+EdgeProber* NetworkState::getProber() const { return prober_.get(); }
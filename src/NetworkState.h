@@ -2,12 +2,17 @@
 
 #include <folly/experimental/FunctionScheduler.h>
 #include <folly/Synchronized.h>
+#include <folly/container/F14Set.h>
 
 #include "httplib.h"
 #include "MasternodeConfig.h"
 #include "EdgeNode.h"
 #include "Location.h"
 #include "Geo.h"
+#include "EdgeRanker.h"
+#include "EdgeProber.h"
+#include "Vivaldi.h"
+#include "EdgeReports.h"
 
 typedef folly::Synchronized<std::vector
     <std::shared_ptr<EdgeNode>>> LockedNodeList;
@@ -20,6 +25,10 @@ class NetworkState {
         // List of edge node data classes
         LockedNodeList edgeNodes_;
 
+        // Every edge node from the last state update, including the
+        // ones demoted for failing health probes (so they can recover)
+        LockedNodeList probeTargets_;
+
         // Used to fetch p2p network state on a repeated basis
         folly::FunctionScheduler fs;
 
@@ -29,6 +38,29 @@ class NetworkState {
         // Used to perform geographic lookups
         std::unique_ptr<Geo> geo_{nullptr};
 
+        // Scores and selects edge nodes for clients
+        EdgeRanker ranker_;
+
+        // Actively probes edge nodes for health and latency
+        // (null unless edge probing is enabled)
+        std::unique_ptr<EdgeProber> prober_{nullptr};
+
+        // Network coordinates of edge nodes and client prefixes
+        // (null unless network coordinates are enabled)
+        std::unique_ptr<VivaldiSystem> coords_{nullptr};
+
+        // Edge node performance reported by clients
+        EdgeReports reports_;
+
+        // Eth addresses of the nodes in the last state update (including
+        // demoted ones), the only ones client reports are taken for
+        folly::Synchronized<folly::F14FastSet<std::string>> knownEdges_;
+
+        // Sets up the optional edge prober and coordinate system
+        void initEdgeMeasurement();
+
+        void applyEdgeReports(std::shared_ptr<EdgeNode> node);
+
     public:
         explicit NetworkState(std::shared_ptr<MasternodeConfig> config);
         explicit NetworkState(std::shared_ptr<MasternodeConfig> config,
@@ -50,10 +82,38 @@ class NetworkState {
         // gateway for state. Calls parseStateUpdate()
         void beginPollingGateway();
 
+        // Probes every known edge node once and waits for the results.
+        // Nodes that fail are demoted on the next state update.
+        void probeEdgeNodes();
+
+        EdgeProber* getProber() const;
+
         void setEdgeNodes(std::vector<std::shared_ptr<EdgeNode>> nodes);
         std::vector<std::shared_ptr<EdgeNode>> getEdgeNodes();
+        // Selects up to n edge nodes for a client at Location l.
+        // Candidates are the nearest nodes in the KD-tree, which are then
+        // ranked by distance, load, bandwidth, error rate and heartbeat
+        // age and picked with power-of-two-choices.
         std::vector<std::shared_ptr<EdgeNode>> 
             getNearestEdgeNodes(Location l, int n);
+        // Selects up to n edge nodes for the client at "ip". Uses the
+        // client prefix's network coordinate when it is known well
+        // enough, and falls back to its geographic location otherwise.
         std::vector<std::shared_ptr<EdgeNode>> 
             getNearestEdgeNodes(std::string ip, int n);
+
+        // Records an RTT a client reported to an edge node
+        void observeClientTiming(const std::string& ip,
+            const std::string& ethAddress, double rttMs);
+
+        // Records a client's report about one edge node. Feeds the
+        // report aggregates used for ranking and, for successful
+        // requests, the network coordinates. Reports about nodes that
+        // aren't in the network state are dropped.
+        void recordEdgeReport(const std::string& ip,
+            const std::string& ethAddress, bool success, double ms);
+
+        EdgeReports& getEdgeReports();
+
+        VivaldiSystem* getCoordinates() const;
 };
@@ -0,0 +1,138 @@
+#include "OriginGuard.h"
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+using namespace std::chrono;
+
+constexpr seconds OriginGuard::WINDOW;
+constexpr size_t OriginGuard::CONNECT_SAMPLES;
+constexpr size_t OriginGuard::MIN_HEDGE_SAMPLES;
+constexpr double OriginGuard::MAX_RETRY_TOKENS;
+
+OriginGuard::OriginGuard(const MasternodeConfig& config):
+    failureRatio_(config.origin_breaker_failure_ratio),
+    minRequests_(config.origin_breaker_min_requests),
+    openDuration_(config.origin_breaker_open_ms),
+    slow_(config.origin_slow_ms),
+    retryRatio_(config.origin_retry_ratio),
+    windowStart_(Clock::now()) {
+    connectTimes_.reserve(CONNECT_SAMPLES);
+}
+
+bool OriginGuard::allowRequest() {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto now = Clock::now();
+    switch (state_) {
+        case State::CLOSED:
+            retryTokens_ = std::min(MAX_RETRY_TOKENS,
+                retryTokens_ + retryRatio_);
+            return true;
+        case State::OPEN:
+            if (now - openedAt_ < openDuration_) return false;
+            LOG(INFO) << "Origin circuit half open, probing the origin";
+            state_ = State::HALF_OPEN;
+            probing_ = false;
+            // fall through
+        case State::HALF_OPEN:
+            if (probing_ && now - probeStarted_ < openDuration_) {
+                return false;
+            }
+            probing_ = true;
+            probeStarted_ = now;
+            return true;
+    }
+    return true;
+}
+
+void OriginGuard::recordSuccess(milliseconds latency) {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto now = Clock::now();
+    if (slow_.count() > 0 && latency > slow_) {
+        failureLocked(now);
+        return;
+    }
+    if (state_ == State::HALF_OPEN) {
+        LOG(INFO) << "Origin circuit closed";
+        state_ = State::CLOSED;
+        probing_ = false;
+        windowStart_ = now;
+        requests_ = 0;
+        failures_ = 0;
+    } else if (state_ == State::CLOSED) {
+        rollWindowLocked(now);
+        requests_++;
+    }
+}
+
+void OriginGuard::recordFailure() {
+    std::lock_guard<std::mutex> guard(lock_);
+    failureLocked(Clock::now());
+}
+
+void OriginGuard::failureLocked(Clock::time_point now) {
+    if (state_ == State::CLOSED) {
+        rollWindowLocked(now);
+        requests_++;
+        failures_++;
+        if (requests_ < minRequests_ ||
+            failures_ < failureRatio_ * requests_) {
+            return;
+        }
+        LOG(WARNING) << "Origin circuit open after " << failures_ <<
+            " failures in " << requests_ << " requests";
+    } else if (state_ == State::HALF_OPEN) {
+        LOG(WARNING) << "Origin probe failed, circuit open again";
+    } else {
+        // requests let through before the circuit opened
+        return;
+    }
+    state_ = State::OPEN;
+    openedAt_ = now;
+    probing_ = false;
+}
+
+void OriginGuard::rollWindowLocked(Clock::time_point now) {
+    if (now - windowStart_ >= WINDOW) {
+        windowStart_ = now;
+        requests_ = 0;
+        failures_ = 0;
+    }
+}
+
+OriginGuard::State OriginGuard::getState() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return state_;
+}
+
+void OriginGuard::recordConnect(milliseconds latency) {
+    std::lock_guard<std::mutex> guard(lock_);
+    uint32_t ms = static_cast<uint32_t>(std::max<int64_t>(0, latency.count()));
+    if (connectTimes_.size() < CONNECT_SAMPLES) {
+        connectTimes_.push_back(ms);
+    } else {
+        connectTimes_[connects_ % CONNECT_SAMPLES] = ms;
+    }
+    connects_++;
+    // the percentile only moves slowly, so it's not worked out every time
+    if (connectTimes_.size() >= MIN_HEDGE_SAMPLES && connects_ % 16 == 0) {
+        std::vector<uint32_t> sorted(connectTimes_);
+        auto p95 = sorted.begin() + (sorted.size() * 95) / 100;
+        std::nth_element(sorted.begin(), p95, sorted.end());
+        // never hedge sooner than a millisecond
+        hedgeDelay_ = milliseconds(std::max<uint32_t>(1, *p95));
+    }
+}
+
+milliseconds OriginGuard::getHedgeDelay() const {
+    std::lock_guard<std::mutex> guard(lock_);
+    return hedgeDelay_;
+}
+
+bool OriginGuard::withdrawRetry() {
+    std::lock_guard<std::mutex> guard(lock_);
+    if (retryTokens_ < 1.0) return false;
+    retryTokens_ -= 1.0;
+    return true;
+}
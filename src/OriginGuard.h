@@ -0,0 +1,79 @@
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "MasternodeConfig.h"
+
+// Protects an origin from the masternode, and clients from a failing
+// origin. A circuit breaker stops sending the origin requests once too
+// many recent ones failed (or were too slow), then lets a single probe
+// request through after a cool down until one succeeds. A retry budget
+// caps retries (and hedged connects) to a fraction of the requests, so
+// they can't multiply the load on an origin that's struggling. Connect
+// times are kept to work out when a connect is slow enough to be worth
+// hedging with a second one. Shared by all handler threads.
+class OriginGuard {
+    public:
+        enum class State { CLOSED, OPEN, HALF_OPEN };
+
+        // Length of the window failures are counted in
+        static constexpr std::chrono::seconds WINDOW{10};
+        // Number of recent connect times kept
+        static constexpr size_t CONNECT_SAMPLES = 256;
+        // Connect times needed before connects are hedged
+        static constexpr size_t MIN_HEDGE_SAMPLES = 20;
+        // Most retries that can be saved up
+        static constexpr double MAX_RETRY_TOKENS = 10.0;
+
+        explicit OriginGuard(const MasternodeConfig& config);
+
+        // Returns false if no request should be sent to the origin now.
+        // While half open, lets one probe request through at a time.
+        bool allowRequest();
+        // Records the outcome of a request that was let through. Slow
+        // responses count as failures if a limit is configured.
+        void recordSuccess(std::chrono::milliseconds latency);
+        void recordFailure();
+        State getState() const;
+
+        // Records how long a connect to the origin took
+        void recordConnect(std::chrono::milliseconds latency);
+        // Delay after which a connect still in progress is hedged: the
+        // 95th percentile connect time, 0 while there are too few samples
+        std::chrono::milliseconds getHedgeDelay() const;
+
+        // Takes a retry from the budget, false if it's spent. Every
+        // request let through adds a fraction of a retry.
+        bool withdrawRetry();
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        // Must be called with lock_ held
+        void failureLocked(Clock::time_point now);
+        void rollWindowLocked(Clock::time_point now);
+
+        const double failureRatio_;
+        const uint32_t minRequests_;
+        const std::chrono::milliseconds openDuration_;
+        const std::chrono::milliseconds slow_;
+        const double retryRatio_;
+
+        mutable std::mutex lock_;
+        State state_{State::CLOSED};
+        // Requests and failures counted since windowStart_
+        Clock::time_point windowStart_;
+        uint32_t requests_{0};
+        uint32_t failures_{0};
+        Clock::time_point openedAt_;
+        // Set while a half open probe is in flight (a probe that never
+        // reports back is given up on after openDuration_)
+        bool probing_{false};
+        Clock::time_point probeStarted_;
+        double retryTokens_{MAX_RETRY_TOKENS};
+        // Ring of recent connect times in milliseconds
+        std::vector<uint32_t> connectTimes_;
+        size_t connects_{0};
+        std::chrono::milliseconds hedgeDelay_{0};
+};
@@ -0,0 +1,245 @@
+#include "OriginPool.h"
+
+#include <algorithm>
+#include <limits>
+#include <thread>
+
+#include <folly/Conv.h>
+#include <folly/String.h>
+#include <folly/small_vector.h>
+
+#include "httplib.h"
+
+using namespace std::chrono;
+
+constexpr double OriginPool::EWMA_ALPHA;
+
+Origin::Origin(size_t index, const OriginServer& server,
+    const MasternodeConfig& config):
+    index_(index), server_(server), guard_(config) {}
+
+folly::SocketAddress Origin::getAddress() const {
+    return address_.copy();
+}
+
+void Origin::resolve() {
+    folly::SocketAddress addr;
+    try {
+        addr.setFromHostPort(server_.host, server_.port);
+    } catch (const std::exception& e) {
+        LOG(ERROR) << "Could not resolve origin " << server_.host <<
+            ": " << e.what();
+        return;
+    }
+    address_ = addr;
+    resolved_ = true;
+}
+
+void Origin::recordHealthCheck(bool success, uint32_t maxFailures) {
+    if (success) {
+        healthFailures_ = 0;
+        if (!healthy_.exchange(true)) {
+            LOG(INFO) << "Origin " << server_.host << ":" << server_.port <<
+                " is healthy again";
+        }
+        return;
+    }
+    if (++healthFailures_ >= maxFailures && healthy_.exchange(false)) {
+        LOG(WARNING) << "Origin " << server_.host << ":" << server_.port <<
+            " failed " << maxFailures << " health checks, taking it out";
+    }
+}
+
+double Origin::getLatency() const {
+    return latency_.copy().value_or(0.0);
+}
+
+void Origin::startRequest() {
+    outstanding_++;
+}
+
+void Origin::finishRequest(folly::Optional<milliseconds> latency) {
+    outstanding_--;
+    if (!latency) return;
+    double ms = latency.value().count();
+    auto locked = latency_.wlock();
+    if (!locked->hasValue()) {
+        *locked = ms;
+    } else {
+        *locked = OriginPool::EWMA_ALPHA * ms +
+            (1 - OriginPool::EWMA_ALPHA) * locked->value();
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////
+
+OriginPool::OriginPool(std::shared_ptr<MasternodeConfig> config):
+    OriginPool(config, config ? config->getOrigins()
+        : std::vector<OriginServer>()) {}
+
+OriginPool::OriginPool(std::shared_ptr<MasternodeConfig> config,
+    const std::vector<OriginServer>& servers):
+    config_(config) {
+    CHECK(config_) << "Config object was null";
+    if (config_->origin_balancing == "ewma") {
+        balancing_ = Balancing::EWMA;
+    } else if (config_->origin_balancing != "least_outstanding") {
+        LOG(WARNING) << "Unknown origin balancing " <<
+            config_->origin_balancing << ", using least_outstanding";
+    }
+    for (auto& server : servers) {
+        auto origin = std::make_shared<Origin>(origins_.size(), server,
+            *config_);
+        origin->resolve();
+        origins_.push_back(origin);
+    }
+    if (config_->origin_health_interval > 0) {
+        healthChecker_.addFunction([this]() { checkHealth(); },
+            seconds(config_->origin_health_interval), "OriginHealth");
+        healthChecker_.setSteady(true);
+        healthChecker_.start();
+    }
+}
+
+OriginPool::~OriginPool() {
+    healthChecker_.shutdown();
+}
+
+std::vector<OriginServer> OriginPool::parseOrigins(const std::string& list) {
+    std::vector<OriginServer> servers;
+    std::vector<folly::StringPiece> entries;
+    folly::split(',', list, entries, true);
+    for (auto entry : entries) {
+        entry = folly::trimWhitespace(entry);
+        OriginServer server;
+        auto star = entry.rfind('*');
+        if (star != folly::StringPiece::npos) {
+            auto weight = folly::tryTo<uint32_t>(entry.subpiece(star + 1));
+            if (!weight.hasValue() || weight.value() == 0) {
+                LOG(WARNING) << "Ignoring origin with invalid weight: " <<
+                    entry;
+                continue;
+            }
+            server.weight = weight.value();
+            entry = entry.subpiece(0, star);
+        }
+        // the port follows the last colon, unless it's inside the
+        // brackets of an IPv6 address
+        auto colon = entry.rfind(':');
+        auto bracket = entry.rfind(']');
+        if (colon != folly::StringPiece::npos &&
+            (bracket == folly::StringPiece::npos || colon > bracket)) {
+            auto port = folly::tryTo<uint16_t>(entry.subpiece(colon + 1));
+            if (!port.hasValue()) {
+                LOG(WARNING) << "Ignoring origin with invalid port: " << entry;
+                continue;
+            }
+            server.port = port.value();
+            entry = entry.subpiece(0, colon);
+        }
+        if (entry.startsWith('[') && entry.endsWith(']')) {
+            entry = entry.subpiece(1, entry.size() - 2);
+        }
+        if (entry.empty()) {
+            LOG(WARNING) << "Ignoring origin without a host";
+            continue;
+        }
+        server.host = entry.str();
+        servers.push_back(server);
+    }
+    return servers;
+}
+
+double OriginPool::score(const Origin& origin) const {
+    double load = origin.getOutstanding() + 1;
+    if (balancing_ == Balancing::EWMA) {
+        // an origin without samples yet looks as fast as possible
+        load *= origin.getLatency() + 1;
+    }
+    return load / origin.getServer().weight;
+}
+
+std::shared_ptr<Origin> OriginPool::pick(const Origin* exclude) {
+    size_t n = origins_.size();
+    if (n == 0) return nullptr;
+    // ties go to the first origin from a rotating start, so equally
+    // loaded origins share the requests
+    size_t start = next_++ % n;
+    // origins whose circuit turned the request away
+    folly::small_vector<bool, 16> refused(n, false);
+    // healthy origins first, then unhealthy ones: if every origin failed
+    // its health checks the checks may be wrong, and an unhealthy origin
+    // beats failing the request when every healthy one's circuit is open
+    for (bool healthy : {true, false}) {
+        while (true) {
+            size_t best = n;
+            double bestScore = 0;
+            for (size_t k = 0; k < n; k++) {
+                size_t i = (start + k) % n;
+                const auto& origin = origins_[i];
+                if (refused[i] || origin->isHealthy() != healthy ||
+                    !origin->isResolved()) {
+                    continue;
+                }
+                double s = origin.get() == exclude ?
+                    std::numeric_limits<double>::max() : score(*origin);
+                if (best == n || s < bestScore) {
+                    best = i;
+                    bestScore = s;
+                }
+            }
+            if (best == n) break;
+            if (origins_[best]->getGuard().allowRequest()) {
+                return origins_[best];
+            }
+            refused[best] = true;
+        }
+    }
+    return nullptr;
+}
+
+proxygen::SessionPool& OriginPool::getSessions(const Origin& origin) {
+    auto& pools = sessions_->pools;
+    if (pools.empty()) {
+        pools.resize(origins_.size());
+    }
+    auto& pool = pools[origin.getIndex()];
+    if (!pool) {
+        // idle connections are closed after a minute
+        pool = std::make_unique<proxygen::SessionPool>(nullptr,
+            config_->origin_idle_sessions, seconds(60));
+    }
+    return *pool;
+}
+
+void OriginPool::releaseSessions() {
+    sessions_->pools.clear();
+}
+
+void OriginPool::checkHealth() {
+    // httplib's timeout is in whole seconds
+    time_t timeout = std::max<time_t>(1,
+        config_->origin_connect_timeout_ms / 1000);
+    // each check blocks, so a dead origin doesn't hold up the others'
+    std::vector<std::thread> checks;
+    checks.reserve(origins_.size());
+    for (auto& origin : origins_) {
+        checks.emplace_back([this, origin, timeout]() {
+            origin->resolve();
+            auto& server = origin->getServer();
+            httplib::Client client(server.host.c_str(), server.port,
+                timeout);
+            auto res = client.Get(config_->origin_health_path.c_str());
+            bool success = res && res->status >= 200 && res->status < 400;
+            if (!success) {
+                VLOG(1) << "Health check of origin " << server.host <<
+                    ":" << server.port << " failed";
+            }
+            origin->recordHealthCheck(success,
+                config_->origin_health_max_failures);
+        });
+    }
+    for (auto& check : checks) {
+        check.join();
+    }
+}
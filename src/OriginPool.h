@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <folly/Optional.h>
+#include <folly/SocketAddress.h>
+#include <folly/Synchronized.h>
+#include <folly/ThreadLocal.h>
+#include <folly/experimental/FunctionScheduler.h>
+
+#include <proxygen/lib/http/connpool/SessionPool.h>
+
+#include "MasternodeConfig.h"
+#include "OriginGuard.h"
+
+// One origin server of the pool, with its circuit breaker and the load
+// and health figures requests are balanced on
+class Origin {
+    public:
+        Origin(size_t index, const OriginServer& server,
+            const MasternodeConfig& config);
+
+        size_t getIndex() const { return index_; }
+        const OriginServer& getServer() const { return server_; }
+        OriginGuard& getGuard() { return guard_; }
+
+        // Address of the origin, resolved when the pool is created and
+        // again on every health check. Unset if it never resolved.
+        folly::SocketAddress getAddress() const;
+        // True once the address has resolved
+        bool isResolved() const { return resolved_; }
+        // Resolves the origin's host (blocks on DNS)
+        void resolve();
+
+        // False once the origin failed too many health checks in a row
+        bool isHealthy() const { return healthy_; }
+        void recordHealthCheck(bool success, uint32_t maxFailures);
+
+        // Requests sent to the origin that are waiting on a response
+        uint32_t getOutstanding() const { return outstanding_; }
+        // EWMA of the time the origin takes to respond, in milliseconds
+        double getLatency() const;
+
+        void startRequest();
+        // Ends a request started with startRequest(), with the time the
+        // origin took to respond if it did
+        void finishRequest(folly::Optional<std::chrono::milliseconds> latency);
+    private:
+        const size_t index_;
+        const OriginServer server_;
+        OriginGuard guard_;
+        folly::Synchronized<folly::SocketAddress> address_;
+        std::atomic<bool> resolved_{false};
+        std::atomic<bool> healthy_{true};
+        std::atomic<uint32_t> healthFailures_{0};
+        std::atomic<uint32_t> outstanding_{0};
+        folly::Synchronized<folly::Optional<double>> latency_;
+};
+
+// Origin servers requests are balanced over. Each request goes to the
+// healthy origin with the lowest load for its weight (requests waiting
+// on a response, times the recent response time with EWMA balancing),
+// skipping origins whose circuit is open. If no healthy origin will
+// take it, unhealthy origins are tried the same way. Origins are health
+// checked in the background, and idle connections to each are pooled
+// per server thread so requests can reuse them.
+class OriginPool {
+    public:
+        enum class Balancing { LEAST_OUTSTANDING, EWMA };
+
+        // Smoothing factor for the response time EWMAs
+        static constexpr double EWMA_ALPHA = 0.3;
+
+        explicit OriginPool(std::shared_ptr<MasternodeConfig> config);
+        // Pool of a site with its own origins
+        OriginPool(std::shared_ptr<MasternodeConfig> config,
+            const std::vector<OriginServer>& servers);
+        ~OriginPool();
+
+        // Parses a comma separated list of host:port*weight entries (the
+        // port and weight are optional, IPv6 hosts go in brackets)
+        static std::vector<OriginServer> parseOrigins(
+            const std::string& list);
+
+        // Picks the origin to send a request to and lets its guard know
+        // about the request. "exclude" (an origin that just failed) is
+        // only picked if nothing else is available. Returns null if no
+        // origin can take the request.
+        std::shared_ptr<Origin> pick(const Origin* exclude = nullptr);
+
+        // Idle connections to an origin kept for the calling thread
+        proxygen::SessionPool& getSessions(const Origin& origin);
+        // Closes the calling thread's idle connections, before the
+        // thread's event loop stops
+        void releaseSessions();
+
+        // Runs a health check of every origin, all at once (blocks until
+        // they've finished)
+        void checkHealth();
+
+        const std::vector<std::shared_ptr<Origin>>& getOrigins() const {
+            return origins_;
+        }
+    private:
+        // Load of an origin for its weight, lower is better
+        double score(const Origin& origin) const;
+
+        std::shared_ptr<MasternodeConfig> config_{nullptr};
+        Balancing balancing_{Balancing::LEAST_OUTSTANDING};
+        std::vector<std::shared_ptr<Origin>> origins_;
+        // Rotates where ties are broken so equally loaded origins share
+        // the requests
+        std::atomic<size_t> next_{0};
+
+        struct ThreadSessions {
+            std::vector<std::unique_ptr<proxygen::SessionPool>> pools;
+        };
+        folly::ThreadLocal<ThreadSessions> sessions_;
+
+        folly::FunctionScheduler healthChecker_;
+};
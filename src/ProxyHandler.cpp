@@ -1,23 +1,68 @@
 #include "ProxyHandler.h"
+#include "Metrics.h"
+
+#include <algorithm>
+#include <limits>
+
+#include <folly/io/Cursor.h>
 
 #include <proxygen/httpserver/ResponseBuilder.h>
 #include <proxygen/lib/http/session/HTTPUpstreamSession.h>
 #include <proxygen/lib/utils/URL.h>
 
 using namespace proxygen;
+using namespace std::chrono;
+
+namespace {
+    // Returns the part of a body to send
+    std::unique_ptr<folly::IOBuf> trimBody(std::unique_ptr<folly::IOBuf> body,
+        const ByteRange& part) {
+        if (part.offset == 0 && part.length == body->computeChainDataLength()) {
+            return body;
+        }
+        // shares the body's buffers rather than copying them
+        folly::IOBufQueue queue{folly::IOBufQueue::cacheChainLength()};
+        queue.append(std::move(body));
+        queue.trimStart(part.offset);
+        return queue.split(part.length);
+    }
+}
 
 ProxyHandler::ProxyHandler(folly::HHWheelTimer *timer,
-    std::shared_ptr<ContentCache> cache, 
+    std::shared_ptr<ContentCache> cache,
     std::shared_ptr<MasternodeConfig> config,
-    std::shared_ptr<ServiceWorker> sw):
+    std::shared_ptr<ServiceWorker> sw,
+    std::shared_ptr<Tenant> tenant,
+    RouteAction action):
+        timer_(timer),
         connector_{this, timer},
         originHandler_(*this),
+        hedgeTimeout_(*this),
         cache_(cache),
+        tenant_(tenant),
+        action_(action),
         config_(config),
-        sw_(sw) {}
+        sw_(sw),
+        policy_(tenant->policy),
+        origins_(tenant->origins) {
+    CHECK(policy_) << "Header policy object was null";
+    CHECK(origins_) << "Origin pool object was null";
+}
+
+ProxyHandler::~ProxyHandler() {
+    releaseBuffer();
+    if (guardPending_ && origin_) {
+        origin_->finishRequest(folly::none);
+    }
+}
+
+std::atomic<size_t> ProxyHandler::bufferedBytes_{0};
+
+size_t ProxyHandler::getBufferedBytes() { return bufferedBytes_; }
 
 bool ProxyHandler::checkForShutdown() {
-    if (clientTerminated_ && !originTxn_) {
+    // a pending disk read calls back into this handler
+    if (clientTerminated_ && !originTxn_ && !diskReadPending_) {
         delete this;
         return true;
     }
@@ -33,69 +78,237 @@ void ProxyHandler::abortDownstream() {
 // RequestHandler methods
 void ProxyHandler::onRequest(std::unique_ptr<HTTPMessage> headers) noexcept {
     request_ = std::move(headers);
-    proxygen::URL url(request_->getURL());
-
-    if (request_->getMethod() == HTTPMethod::GET) {
+    cacheKey_ = ContentCache::namespacedKey(tenant_->cacheNamespace, "");
+    tenant_->keys->build(request_->getURL(), cacheKey_);
+    routeKeyLength_ = cacheKey_.size();
+
+    if (request_->getMethod() == HTTPMethod::GET && !action_.bypass_cache) {
+        rangeHeader_ =
+            request_->getHeaders().getSingleOrEmpty(HTTP_HEADER_RANGE);
+        // a route that varies on request headers is cached per variant
+        auto vary = cache_->getVary(cacheKey_);
+        if (!vary.empty()) {
+            CacheKeyBuilder::appendVariant(vary, request_->getHeaders(),
+                cacheKey_);
+            varied_ = true;
+        }
         // check the cache for this url
-        const auto& cachedRoute = cache_->getCachedRoute(url.getUrl());
+        auto cachedRoute = lookupRoute();
         
         // if we have it cached, reply to client
-        if (cachedRoute) {
-            std::unique_ptr<folly::IOBuf> content = cachedRoute->getContent();
-            VLOG(1) << "Serving from cache for " << url.getUrl();
-            if (config_->enableServiceWorker &&
-                cachedRoute->getHeaders()->getHeaders().rawGet("Content-Type")
-                .find("text/html") != std::string::npos) {
-                // inject service worker bootstrap into <head> tag
-                auto injected_body = 
-                    sw_->injectServiceWorker(*cachedRoute->getContent());
-                if (!injected_body.empty()) {
-                    content = folly::IOBuf::copyBuffer(injected_body);
-                }
-            }
-            
-            ResponseBuilder(downstream_)
-                .status(200, "OK")
-                .header("Content-Type", cachedRoute->getHeaders()->
-                    getHeaders().getSingleOrEmpty(HTTP_HEADER_CONTENT_TYPE))
-                .header("Cache-Control", cachedRoute->getHeaders()->
-                    getHeaders().getSingleOrEmpty(HTTP_HEADER_CACHE_CONTROL))
-                .header("ETag", cachedRoute->getHeaders()->
-                    getHeaders().getSingleOrEmpty(HTTP_HEADER_ETAG))
-                .header("Expires", cachedRoute->getHeaders()->
-                    getHeaders().getSingleOrEmpty(HTTP_HEADER_EXPIRES))
-                .header("Last-Modified", cachedRoute->getHeaders()->
-                    getHeaders().getSingleOrEmpty(HTTP_HEADER_LAST_MODIFIED))
-                .body(content->clone())
-                .sendWithEOM();
+        if (cachedRoute && serveCachedRoute(cachedRoute)) {
+            VLOG(1) << "Serving from cache for " << cacheKey_;
+            Metrics::get().cache_hits.add();
             return;
         }
+
+        // large objects may be cached in slices instead
+        if (!cachedRoute && !staleRoute_ && !varied_ && startSlice()) {
+            cachedRoute = lookupRoute();
+            if (cachedRoute && serveCachedRoute(cachedRoute)) {
+                VLOG(1) << "Serving from cache for " << cacheKey_;
+                Metrics::get().cache_hits.add();
+                return;
+            }
+        }
+        Metrics::get().cache_misses.add();
     }
     
     // otherwise, connect to origin server to fetch content
+    fetchFromOrigin();
+}
+
+std::shared_ptr<CachedRoute> ProxyHandler::lookupRoute() {
+    auto route = cache_->getCachedRoute(cacheKey_);
+    if (route && route->isExpired()) {
+        // the origin is asked for a fresh copy, this one is only kept
+        // in case it fails
+        if (route->canServeStale(config_->stale_if_error)) {
+            staleRoute_ = route;
+        }
+        return nullptr;
+    }
+    return route;
+}
+
+bool ProxyHandler::serveStale() {
+    if (!staleRoute_ || clientTerminated_) return false;
+    auto route = std::move(staleRoute_);
+    servingStale_ = true;
+    if (!serveCachedRoute(route)) {
+        servingStale_ = false;
+        return false;
+    }
+    LOG(WARNING) << "Origin failed, served stale cached copy of " <<
+        cacheKey_;
+    Metrics::get().stale_served.add();
+    return true;
+}
+
+bool ProxyHandler::startSlice() {
+    size_t sliceSize = config_->cache_slice_size;
+    // If-Range can't be checked before the object's validators are known
+    if (sliceSize == 0 || rangeHeader_.empty() ||
+        request_->getHeaders().exists(HTTP_HEADER_IF_RANGE)) {
+        return false;
+    }
+    ByteRange range;
+    auto start = rangeStart(rangeHeader_);
+    if (!start || parseRange(rangeHeader_,
+        std::numeric_limits<size_t>::max(), range) !=
+        RangeResult::SATISFIABLE) {
+        return false;
+    }
+    // only objects known to be larger than a slice are sliced: the
+    // range reaches past the first slice, or an earlier response said
+    // so. Smaller objects are fetched (and cached) whole, as is one
+    // that's already cached whole but has to be refetched.
+    bool boundedEnd = range.end() != std::numeric_limits<size_t>::max();
+    if (*start < sliceSize && (!boundedEnd || range.end() <= sliceSize) &&
+        cache_->getObjectSize(cacheKey_) <= sliceSize) {
+        return false;
+    }
+    if (cache_->getCachedRoute(cacheKey_)) return false;
+    size_t slice = *start / sliceSize;
+    sliceOffset_ = slice * sliceSize;
+    cacheKey_ = folly::to<std::string>(cacheKey_, "#slice=", slice);
+    slicing_ = true;
+    return true;
+}
+
+void ProxyHandler::recordObjectSize() {
+    size_t sliceSize = config_->cache_slice_size;
+    if (sliceSize == 0 || varied_ ||
+        request_->getMethod() != HTTPMethod::GET) {
+        return;
+    }
+    const auto& headers = contentHeaders_->getHeaders();
+    folly::Optional<size_t> size;
+    if (slicing_) {
+        size = contentRangeSize(
+            headers.getSingleOrEmpty(HTTP_HEADER_CONTENT_RANGE));
+    } else if (contentHeaders_->getStatusCode() == 200) {
+        auto length = folly::tryTo<size_t>(
+            headers.getSingleOrEmpty(HTTP_HEADER_CONTENT_LENGTH));
+        if (length.hasValue()) size = length.value();
+    }
+    if (size && *size > sliceSize) {
+        cache_->setObjectSize(cacheKey_.substr(0, routeKeyLength_), *size);
+    }
+}
+
+void ProxyHandler::fetchFromOrigin() {
     request_->stripPerHopHeaders();
-    folly::SocketAddress addr;
-    try {
-        addr.setFromHostPort(config_->origin_host, config_->origin_port);
-    } catch (...) {
+    if (request_->getMethod() == HTTPMethod::GET) {
+        // fetch the whole object (or slice) so it can be cached, the
+        // client's range is cut out of it
+        request_->getHeaders().remove(HTTP_HEADER_RANGE);
+        request_->getHeaders().remove(HTTP_HEADER_IF_RANGE);
+        if (slicing_) {
+            request_->getHeaders().set(HTTP_HEADER_RANGE,
+                folly::to<std::string>("bytes=", sliceOffset_, "-",
+                    sliceOffset_ + config_->cache_slice_size - 1));
+        }
+    }
+    origin_ = origins_->pick();
+    if (!origin_) {
+        VLOG(1) << "No origin available, not forwarding " << cacheKey_;
+        if (serveStale()) return;
         ResponseBuilder(downstream_)
-            .status(503, "Bad Gateway")
+            .status(503, "Service Unavailable")
             .sendWithEOM();
         return;
     }
 
     // Stop listening for data from the client while we contact the origin
     downstream_->pauseIngress();
+    connectToOrigin();
+}
 
+void ProxyHandler::connectToOrigin() {
+    guardPending_ = true;
+    origin_->startRequest();
+    connectStarted_ = steady_clock::now();
+    sessions_ = &origins_->getSessions(*origin_);
+    if (startOriginTransaction()) {
+        VLOG(1) << "Reusing a connection to the origin server";
+        return;
+    }
     auto evb = folly::EventBaseManager::get()->getEventBase();
-    // TODO: use a connection pool
     const folly::AsyncSocket::OptionMap opts {
         {{SOL_SOCKET, SO_REUSEADDR}, 1}
     };
 
     // Make a connection to the origin server
     VLOG(1) << "Connecting to origin server...";
-    connector_.connect(evb, addr, std::chrono::milliseconds(60000), opts);
+    connector_.connect(evb, origin_->getAddress(),
+        milliseconds(config_->origin_connect_timeout_ms), opts);
+
+    // only idempotent requests are safe to send twice
+    auto delay = origin_->getGuard().getHedgeDelay();
+    if (config_->origin_hedge_connects && !hedge_ &&
+        request_->getMethod() == HTTPMethod::GET && delay.count() > 0) {
+        timer_->scheduleTimeout(&hedgeTimeout_, delay);
+    }
+}
+
+void ProxyHandler::startHedge() {
+    if (clientTerminated_ || !connector_.isBusy() || hedge_) return;
+    // hedges are paid for out of the retry budget
+    if (!origin_->getGuard().withdrawRetry()) return;
+    VLOG(1) << "Origin connect is slow, starting a hedged connect";
+    auto evb = folly::EventBaseManager::get()->getEventBase();
+    const folly::AsyncSocket::OptionMap opts {
+        {{SOL_SOCKET, SO_REUSEADDR}, 1}
+    };
+    hedge_ = std::make_unique<HedgeConnector>(*this, timer_);
+    hedge_->getConnector().connect(evb, origin_->getAddress(),
+        milliseconds(config_->origin_connect_timeout_ms), opts);
+}
+
+void ProxyHandler::originFailed() {
+    recordOriginResult(false);
+    if (clientTerminated_) {
+        abortDownstream();
+        checkForShutdown();
+        return;
+    }
+    if (retryOrigin() || serveStale()) return;
+    ResponseBuilder(downstream_)
+        .status(503, "Bad Gateway")
+        .sendWithEOM();
+}
+
+bool ProxyHandler::retryOrigin() {
+    if (request_->getMethod() != HTTPMethod::GET ||
+        retries_ >= config_->origin_max_retries ||
+        !origin_->getGuard().withdrawRetry()) {
+        return false;
+    }
+    auto next = origins_->pick(origin_.get());
+    if (!next) return false;
+    origin_ = next;
+    hedgeTimeout_.cancelTimeout();
+    retries_++;
+    Metrics::get().origin_retries.add();
+    VLOG(1) << "Retrying origin request for " << cacheKey_;
+    connectToOrigin();
+    return true;
+}
+
+void ProxyHandler::recordOriginResult(bool success) {
+    if (!guardPending_) return;
+    guardPending_ = false;
+    auto latency = duration_cast<milliseconds>(
+        steady_clock::now() - connectStarted_);
+    if (success) {
+        origin_->getGuard().recordSuccess(latency);
+        origin_->finishRequest(latency);
+    } else {
+        origin_->getGuard().recordFailure();
+        origin_->finishRequest(folly::none);
+        Metrics::get().origin_failures.add();
+    }
 }
 
 void ProxyHandler::onBody(std::unique_ptr<folly::IOBuf> body) noexcept {
@@ -110,6 +323,24 @@ void ProxyHandler::onBody(std::unique_ptr<folly::IOBuf> body) noexcept {
 }
 void ProxyHandler::onUpgrade(UpgradeProtocol protocol) noexcept {}
 
+void ProxyHandler::onEgressPaused() noexcept {
+    egressPaused_ = true;
+    // a streamed response can only go as fast as the client takes it
+    if (streaming_ && originTxn_) {
+        originTxn_->pauseIngress();
+    }
+}
+
+void ProxyHandler::onEgressResumed() noexcept {
+    egressPaused_ = false;
+    if (streaming_ && originTxn_) {
+        originTxn_->resumeIngress();
+    }
+    if (diskRoute_) {
+        streamFromDisk();
+    }
+}
+
 // Called when the client sends their EOM to the masternode
 void ProxyHandler::onEOM() noexcept {
     VLOG(1) << "Client sent EOM";
@@ -125,13 +356,21 @@ void ProxyHandler::requestComplete() noexcept {
     VLOG(1) << "Completed request";
     // If we stored new content to cache
     if (request_->getMethod() == HTTPMethod::GET &&
-        contentBody_ && contentHeaders_) {
-        proxygen::URL url(request_->getURL());
-        VLOG(1) << "Adding " << url.getUrl() << " to memory cache";
+        contentBody_ && !contentBody_->empty() && isCacheable() &&
+        selectVariant()) {
+        VLOG(1) << "Adding " << cacheKey_ << " to memory cache";
         // todo: may want to do this asynchronously
-        cache_->addCachedRoute(url.getUrl(),
-            contentBody_->cloneCoalesced(), contentHeaders_); 
+        cache_->addCachedRoute(cacheKey_, std::move(contentBody_),
+            contentHeaders_, action_.cache_ttl, &forwarded_);
+    } else if (request_->getMethod() == HTTPMethod::GET && contentBody_) {
+        uint32_t ttl = negativeTTL();
+        if (ttl > 0) {
+            cache_->addNegativeRoute(cacheKey_, std::move(contentBody_),
+                contentHeaders_, ttl, &forwarded_);
+        }
     }
+    contentBody_.reset();
+    releaseBuffer();
 
     clientTerminated_ = true;
     checkForShutdown();
@@ -146,13 +385,315 @@ void ProxyHandler::onError(ProxygenError err) noexcept {
     checkForShutdown();
 }
 
+bool ProxyHandler::serveCachedRoute(std::shared_ptr<CachedRoute> route) {
+    size_t objectSize = route->getSize();
+    if (slicing_) {
+        auto size = contentRangeSize(
+            route->getHeaders().get(HTTP_HEADER_CONTENT_RANGE).str());
+        if (!size) return false;
+        objectSize = *size;
+    }
+    ByteRange part;
+    const auto& headers = route->getHeaders();
+    auto result = selectRange(headers.get(HTTP_HEADER_ETAG),
+        headers.get(HTTP_HEADER_LAST_MODIFIED),
+        shouldInjectServiceWorker(*route) ||
+            !acceptsRange(route->getStatus()), slicing_ ? sliceOffset_ : 0,
+        route->getSize(), objectSize, part);
+    if (result == RangeResult::UNSATISFIABLE) {
+        sendUnsatisfiable(objectSize);
+        return true;
+    }
+
+    std::unique_ptr<folly::IOBuf> content = route->getContent();
+    if (content) {
+        sendCachedResponse(*route, trimBody(std::move(content), part));
+        return true;
+    }
+
+    // disk tier route, its content is only in the body file
+    try {
+        diskFile_ = folly::File(cache_->getContentPath(*route), O_RDONLY);
+    } catch (const std::exception& e) {
+        LOG(ERROR) << "Could not open cached route body: " << e.what();
+        return false;
+    }
+    diskRoute_ = route;
+    diskOffset_ = part.offset;
+    diskEnd_ = part.end();
+    // only a route read in full can be promoted
+    promoteFromDisk_ = cache_->shouldPromote(*route) &&
+        part.length == route->getSize();
+    // the service worker is injected into the whole page, so pages are
+    // read in full before replying (they're small compared to assets)
+    bufferDiskBody_ = shouldInjectServiceWorker(*route);
+    if (!bufferDiskBody_) {
+        // stream the body file in chunks as the client's connection allows
+        sendCachedResponse(*route, nullptr);
+    }
+    streamFromDisk();
+    return true;
+}
+
+bool ProxyHandler::shouldInjectServiceWorker(const CachedRoute& route) const {
+    return tenant_->enableServiceWorker && sw_ &&
+        action_.inject_service_worker && route.isHTML();
+}
+
+bool ProxyHandler::shouldInjectServiceWorker(
+    const HTTPMessage& headers) const {
+    return tenant_->enableServiceWorker && sw_ &&
+        action_.inject_service_worker &&
+        headers.getHeaders().rawGet("Content-Type")
+        .find("text/html") != std::string::npos;
+}
+
+RangeResult ProxyHandler::selectRange(folly::StringPiece etag,
+    folly::StringPiece lastModified, bool wholeBody, size_t bodyOffset,
+    size_t bodySize, size_t objectSize, ByteRange& part) {
+    part.offset = 0;
+    part.length = bodySize;
+    partial_ = folly::none;
+    objectSize_ = objectSize;
+    if (rangeHeader_.empty()) return RangeResult::NONE;
+    if (wholeBody) return RangeResult::NONE;
+    // a range is only applied to the representation the client has
+    const auto& ifRange =
+        request_->getHeaders().getSingleOrEmpty(HTTP_HEADER_IF_RANGE);
+    if (!ifRange.empty() && ifRange != etag && ifRange != lastModified) {
+        return RangeResult::NONE;
+    }
+
+    ByteRange range;
+    auto result = parseRange(rangeHeader_, objectSize, range);
+    if (result != RangeResult::SATISFIABLE) return result;
+    // a slice only answers the part of the range it holds, the client
+    // asks for the rest after
+    size_t end = std::min(range.end(), bodyOffset + bodySize);
+    if (range.offset < bodyOffset || range.offset >= end) {
+        return RangeResult::UNSATISFIABLE;
+    }
+    range.length = end - range.offset;
+    partial_ = range;
+    part.offset = range.offset - bodyOffset;
+    part.length = range.length;
+    return result;
+}
+
+bool ProxyHandler::chargeBuffer(size_t len) {
+    size_t maxObject = config_->cache_max_object_bytes;
+    if (maxObject > 0 && buffered_ + len > maxObject) {
+        return false;
+    }
+    size_t limit = config_->max_buffered_bytes;
+    size_t total = bufferedBytes_.fetch_add(len) + len;
+    if (limit > 0 && total > limit) {
+        bufferedBytes_ -= len;
+        return false;
+    }
+    buffered_ += len;
+    return true;
+}
+
+void ProxyHandler::releaseBuffer() {
+    bufferedBytes_ -= buffered_;
+    buffered_ = 0;
+    reserved_ = 0;
+}
+
+void ProxyHandler::startStreaming() {
+    streaming_ = true;
+    uint16_t status = contentHeaders_->getStatusCode();
+    HTTPMessage response;
+    response.setHTTPVersion(1, 1);
+    response.setStatusCode(status);
+    response.setStatusMessage(contentHeaders_->getStatusMessage());
+    originSummary_ = policy_->apply(contentHeaders_->getHeaders(),
+        response.getHeaders(), false);
+    bool hasBody = request_->getMethod() != HTTPMethod::HEAD &&
+        status != 204 && status != 304;
+    if (hasBody &&
+        !response.getHeaders().exists(HTTP_HEADER_CONTENT_LENGTH)) {
+        // the body is forwarded as it arrives
+        response.setIsChunked(true);
+    }
+    downstream_->sendHeaders(response);
+    if (contentBody_ && !contentBody_->empty()) {
+        Metrics::get().origin_bytes.add(contentBody_->computeChainDataLength());
+        downstream_->sendBody(std::move(contentBody_));
+    }
+    contentBody_.reset();
+    releaseBuffer();
+}
+
+void ProxyHandler::sendUnsatisfiable(size_t objectSize) {
+    ResponseBuilder(downstream_)
+        .status(416, "Range Not Satisfiable")
+        .header(HTTP_HEADER_CONTENT_RANGE, unsatisfiedRange(objectSize))
+        .sendWithEOM();
+}
+
+void ProxyHandler::sendCachedResponse(const CachedRoute& route,
+    std::unique_ptr<folly::IOBuf> content) {
+    // hits on a thread share one message, so its header storage is
+    // reused instead of allocated for every hit. sendHeaders has
+    // serialized it by the time it returns.
+    static thread_local HTTPMessage response;
+    route.writeResponse(response);
+    response.getHeaders().set(HTTP_HEADER_AGE,
+        folly::to<std::string>(route.getAge()));
+    if (servingStale_) {
+        response.getHeaders().set(HTTP_HEADER_WARNING,
+            "111 - \"Revalidation Failed\"");
+    }
+    if (content && shouldInjectServiceWorker(route)) {
+        // inject service worker bootstrap into <head> tag
+        auto started = steady_clock::now();
+        auto injected_body = sw_->injectServiceWorker(*content);
+        Metrics::get().sw_inject_ms.recordSince(started);
+        if (!injected_body.empty()) {
+            content = folly::IOBuf::copyBuffer(injected_body);
+        }
+        response.getHeaders().remove(HTTP_HEADER_ACCEPT_RANGES);
+        response.getHeaders().set(HTTP_HEADER_CONTENT_LENGTH,
+            folly::to<std::string>(content->computeChainDataLength()));
+    } else if (partial_) {
+        response.setStatusCode(206);
+        response.setStatusMessage("Partial Content");
+        response.getHeaders().set(HTTP_HEADER_CONTENT_RANGE,
+            contentRange(*partial_, objectSize_));
+        response.getHeaders().set(HTTP_HEADER_CONTENT_LENGTH,
+            folly::to<std::string>(partial_->length));
+    }
+
+    downstream_->sendHeaders(response);
+    if (content) {
+        if (!content->empty()) {
+            Metrics::get().cache_bytes.add(content->computeChainDataLength());
+            downstream_->sendBody(std::move(content));
+        }
+        downstream_->sendEOM();
+    }
+}
+
+void ProxyHandler::streamFromDisk() {
+    if (!diskRoute_ || diskReadPending_ || clientTerminated_ ||
+        (egressPaused_ && !bufferDiskBody_)) {
+        return;
+    }
+    size_t len = std::min(config_->disk_stream_chunk_size,
+        diskEnd_ - diskOffset_);
+    if (len == 0) {
+        finishDiskStream();
+        return;
+    }
+    diskReadPending_ = true;
+    cache_->getDiskIO()->read(diskFile_.fd(), diskOffset_, len,
+        folly::EventBaseManager::get()->getEventBase(),
+        [this](ssize_t n, std::unique_ptr<folly::IOBuf> chunk) {
+            diskReadPending_ = false;
+            if (clientTerminated_) {
+                diskRoute_.reset();
+                checkForShutdown();
+                return;
+            }
+            if (n <= 0) {
+                LOG(ERROR) << "Could not read cached route body from disk";
+                diskRoute_.reset();
+                diskFile_.close();
+                if (bufferDiskBody_) {
+                    // nothing was sent yet, the origin can still answer
+                    servingStale_ = false;
+                    fetchFromOrigin();
+                } else {
+                    abortDownstream();
+                }
+                return;
+            }
+            diskOffset_ += n;
+            if (bufferDiskBody_ || promoteFromDisk_) {
+                diskBody_.append(bufferDiskBody_ ?
+                    std::move(chunk) : chunk->clone());
+            }
+            if (chunk) {
+                Metrics::get().cache_bytes.add(
+                    chunk->computeChainDataLength());
+                downstream_->sendBody(std::move(chunk));
+            }
+            streamFromDisk();
+        });
+}
+
+void ProxyHandler::finishDiskStream() {
+    auto route = std::move(diskRoute_);
+    diskFile_.close();
+    if (bufferDiskBody_) {
+        auto body = diskBody_.move();
+        if (promoteFromDisk_) {
+            cache_->promote(route, body->clone());
+        }
+        sendCachedResponse(*route, std::move(body));
+        return;
+    }
+    downstream_->sendEOM();
+    if (promoteFromDisk_) {
+        // the whole body passed through here, keep it in memory
+        cache_->promote(route, diskBody_.move());
+    }
+}
+
 // HTTPConnector::Callback methods
 
 // Called when the masternode connects to an origin server
 void ProxyHandler::connectSuccess(
     proxygen::HTTPUpstreamSession* session) noexcept {
     VLOG(1) << "Connected to origin server";
-    originTxn_ = session->newTransaction(&originHandler_);
+    // drops the hedged connect if it's still in progress
+    hedgeTimeout_.cancelTimeout();
+    hedge_.reset();
+    sendToOrigin(session);
+}
+
+// Called when the masternode fails to connect to an origin server
+void ProxyHandler::connectError(
+    const folly::AsyncSocketException& ex) noexcept {
+    LOG(ERROR) << "Encountered an error when connecting to the origin server: "
+        << ex.what();
+    hedgeTimeout_.cancelTimeout();
+    // the hedged connect may still make it
+    if (hedge_ && hedge_->getConnector().isBusy()) return;
+    originFailed();
+}
+
+void ProxyHandler::hedgeConnectSuccess(
+    proxygen::HTTPUpstreamSession* session) noexcept {
+    VLOG(1) << "Hedged connect to origin server won";
+    connector_.reset();
+    sendToOrigin(session);
+}
+
+void ProxyHandler::hedgeConnectError(
+    const folly::AsyncSocketException& ex) noexcept {
+    VLOG(1) << "Hedged connect to origin server failed: " << ex.what();
+    if (connector_.isBusy()) return;
+    originFailed();
+}
+
+void ProxyHandler::sendToOrigin(proxygen::HTTPUpstreamSession* session) {
+    origin_->getGuard().recordConnect(duration_cast<milliseconds>(
+        steady_clock::now() - connectStarted_));
+    Metrics::get().origin_connect_ms.recordSince(connectStarted_);
+    sessions_->putSession(session);
+    if (!startOriginTransaction()) {
+        originFailed();
+    }
+}
+
+bool ProxyHandler::startOriginTransaction() {
+    originTxn_ = sessions_->getTransaction(&originHandler_);
+    if (!originTxn_) return false;
+    originTxn_->setIdleTimeout(
+        milliseconds(config_->origin_response_timeout_ms));
 
     // strip compression headers so that we receive an uncompressed
     // response
@@ -163,21 +704,7 @@ void ProxyHandler::connectSuccess(
     originTxn_->sendHeaders(*request_);
     VLOG(1) << "Sent headers to origin server";
     downstream_->resumeIngress();
-}
-
-// Called when the masternode fails to connect to an origin server
-void ProxyHandler::connectError(
-    const folly::AsyncSocketException& ex) noexcept {
-    LOG(ERROR) << "Encountered an error when connecting to the origin server: "
-        << ex.what();
-    if (!clientTerminated_) {
-        ResponseBuilder(downstream_)
-            .status(503, "Bad Gateway")
-            .sendWithEOM();
-    } else {
-        abortDownstream();
-        checkForShutdown();
-    }
+    return true;
 }
 
 /////////////////////////////////////////////////////////////
@@ -192,25 +719,96 @@ void ProxyHandler::originSetTransaction(
 void ProxyHandler::originDetachTransaction() noexcept {
     VLOG(1) << "Detached origin transaction";
     originTxn_ = nullptr;
+    if (failedBeforeResponse_) {
+        failedBeforeResponse_ = false;
+        originFailed();
+        return;
+    }
     checkForShutdown();
 }
 
 void ProxyHandler::originOnHeadersComplete(
     std::unique_ptr<proxygen::HTTPMessage> msg) noexcept {
-    if (clientTerminated_) return;
+    if (clientTerminated_ || servingStale_) return;
+    Metrics::get().origin_ttfb_ms.recordSince(connectStarted_);
+    recordOriginResult(msg->getStatusCode() < 500);
+    if (msg->getStatusCode() >= 500 && serveStale()) {
+        // the stale copy is better than the origin's error, the rest of
+        // which isn't needed
+        if (originTxn_) {
+            originTxn_->sendAbort();
+        }
+        return;
+    }
     contentHeaders_ = std::move(msg);
+    if (slicing_ && contentHeaders_->getStatusCode() == 200) {
+        // the origin ignored the slice range and sent the whole object
+        slicing_ = false;
+        cacheKey_.resize(routeKeyLength_);
+    }
+    recordObjectSize();
+
+    // only GET responses are cached, everything else is passed through,
+    // as are responses that never have a body and routes the rules keep
+    // out of the cache
+    uint16_t status = contentHeaders_->getStatusCode();
+    if (request_->getMethod() != HTTPMethod::GET || action_.bypass_cache ||
+        status == 204 || status == 304) {
+        startStreaming();
+        return;
+    }
+    // don't start buffering a response that's known to be too big
+    auto length = folly::tryTo<size_t>(contentHeaders_->getHeaders()
+        .getSingleOrEmpty(HTTP_HEADER_CONTENT_LENGTH));
+    size_t maxObject = config_->cache_max_object_bytes;
+    if (length.hasValue() && maxObject > 0 && length.value() > maxObject) {
+        VLOG(1) << "Streaming " << length.value() <<
+            " byte response without caching it";
+        startStreaming();
+    } else if (length.hasValue() && length.value() > 0 &&
+        chargeBuffer(length.value())) {
+        // the body is copied into one buffer as it arrives, so the
+        // origin's buffers can go right away and the cache gets the body
+        // in one piece. The whole buffer is charged before it's
+        // allocated; if it can't be, the origin's buffers are kept and
+        // charged as they arrive instead.
+        contentBody_ = folly::IOBuf::create(length.value());
+        reserved_ = length.value();
+    }
 }
 
 // Called when the masternode receives body content from the origin server
 // (can be called multiple times for one request as content comes through)
 void ProxyHandler::originOnBody(
     std::unique_ptr<folly::IOBuf> chain) noexcept {
-    if (clientTerminated_) return;
-    // If we've already received some body content
-    if (contentBody_) {
-        contentBody_->prependChain(chain->clone());
+    if (clientTerminated_ || servingStale_) return;
+    if (streaming_) {
+        Metrics::get().origin_bytes.add(chain->computeChainDataLength());
+        downstream_->sendBody(std::move(chain));
+        return;
+    }
+    size_t len = chain->computeChainDataLength();
+    // bytes the preallocated buffer was charged for already
+    size_t covered = std::min(len, reserved_);
+    reserved_ -= covered;
+    if (!chargeBuffer(len - covered)) {
+        // too big to cache after all (or too much is buffered already)
+        VLOG(1) << "Response outgrew the cache limits, streaming it";
+        startStreaming();
+        Metrics::get().origin_bytes.add(len);
+        downstream_->sendBody(std::move(chain));
+        return;
+    }
+    if (contentBody_ && !contentBody_->isChained() &&
+        contentBody_->tailroom() >= len) {
+        folly::io::Cursor(chain.get()).pull(contentBody_->writableTail(), len);
+        contentBody_->append(len);
+    } else if (contentBody_) {
+        // no Content-Length (or more body than it said), keep the
+        // origin's buffers and coalesce them once in the cache
+        contentBody_->prependChain(std::move(chain));
     } else {
-        contentBody_ = chain->clone();
+        contentBody_ = std::move(chain);
     }
 }
 
@@ -228,16 +826,141 @@ void ProxyHandler::originOnTrailers(
 }
 
 void ProxyHandler::originOnEOM() noexcept {
-    // check that there's still a connection and body/headers
-    // to be able to send back to the client
-    if (!clientTerminated_ && contentHeaders_ && contentBody_){
-        ResponseBuilder(downstream_)
-            .status(200, "OK")
-            .header("Content-Type", contentHeaders_->
-                getHeaders().rawGet("Content-Type"))
-            .body(contentBody_->clone())
-            .sendWithEOM();
+    if (servingStale_) return;
+    Metrics::get().origin_total_ms.recordSince(connectStarted_);
+    if (streaming_) {
+        if (!clientTerminated_) {
+            downstream_->sendEOM();
+        }
+        return;
+    }
+    if (!clientTerminated_ && slicing_ && contentHeaders_ &&
+        contentHeaders_->getStatusCode() == 416) {
+        // the slice starts past the end of the object
+        auto size = contentRangeSize(contentHeaders_->getHeaders()
+            .getSingleOrEmpty(HTTP_HEADER_CONTENT_RANGE));
+        sendUnsatisfiable(size ? *size : 0);
+        return;
+    }
+    // check that there's still a connection and headers to be able to
+    // send back to the client
+    if (!clientTerminated_ && contentHeaders_) {
+        sendOriginResponse();
+    }
+}
+
+void ProxyHandler::sendOriginResponse() {
+    if (!contentBody_) {
+        // e.g. a redirect without a body
+        contentBody_ = folly::IOBuf::create(0);
     }
+    uint16_t status = contentHeaders_->getStatusCode();
+    size_t bodySize = contentBody_->computeChainDataLength();
+    size_t objectSize = bodySize;
+    if (slicing_) {
+        auto size = contentRangeSize(contentHeaders_->getHeaders()
+            .getSingleOrEmpty(HTTP_HEADER_CONTENT_RANGE));
+        if (size) objectSize = *size;
+    }
+    bool wholeBody = shouldInjectServiceWorker(*contentHeaders_) ||
+        !acceptsRange(status);
+    const auto& headers = contentHeaders_->getHeaders();
+    HTTPMessage response;
+    response.setHTTPVersion(1, 1);
+    // the body is sent with its own length (the origin may have sent it
+    // chunked), and the range of it that's sent
+    originSummary_ = policy_->apply(headers, response.getHeaders(), true);
+    auto& out = response.getHeaders();
+    // hits on the cached copy get the same headers
+    forwarded_ = out;
+
+    ByteRange part;
+    auto result = selectRange(headers.getSingleOrEmpty(HTTP_HEADER_ETAG),
+        headers.getSingleOrEmpty(HTTP_HEADER_LAST_MODIFIED), wholeBody,
+        slicing_ ? sliceOffset_ : 0, bodySize, objectSize, part);
+    if (result == RangeResult::UNSATISFIABLE) {
+        sendUnsatisfiable(objectSize);
+        return;
+    }
+    if (partial_) {
+        response.setStatusCode(206);
+        response.setStatusMessage("Partial Content");
+        out.set(HTTP_HEADER_CONTENT_RANGE,
+            contentRange(*partial_, objectSize_));
+    } else {
+        response.setStatusCode(status);
+        response.setStatusMessage(contentHeaders_->getStatusMessage());
+        const auto& range =
+            headers.getSingleOrEmpty(HTTP_HEADER_CONTENT_RANGE);
+        if (slicing_ && !range.empty()) {
+            out.set(HTTP_HEADER_CONTENT_RANGE, range);
+        }
+    }
+    if (!wholeBody) {
+        out.set(HTTP_HEADER_ACCEPT_RANGES, "bytes");
+    }
+    auto body = trimBody(contentBody_->clone(), part);
+    out.set(HTTP_HEADER_CONTENT_LENGTH,
+        folly::to<std::string>(body->computeChainDataLength()));
+
+    downstream_->sendHeaders(response);
+    if (!body->empty()) {
+        Metrics::get().origin_bytes.add(body->computeChainDataLength());
+        downstream_->sendBody(std::move(body));
+    }
+    downstream_->sendEOM();
+}
+
+bool ProxyHandler::isCacheable() const {
+    if (!contentHeaders_ || streaming_) return false;
+    uint16_t status = contentHeaders_->getStatusCode();
+    if (slicing_) {
+        // slices are only cached if the origin sent just the slice, and
+        // not once the whole object has been cached
+        if (status != 206 ||
+            cache_->getCachedRoute(cacheKey_.substr(0, routeKeyLength_))) {
+            return false;
+        }
+    } else if (status < 200 || status >= 300 || status == 206) {
+        return false;
+    }
+    // slices of a varying object aren't told apart
+    return originSummary_.shareable && !(slicing_ && originSummary_.varies);
+}
+
+bool ProxyHandler::selectVariant() {
+    if (slicing_) return true;
+    cacheKey_.resize(routeKeyLength_);
+    if (!originSummary_.varies) {
+        // the route stopped varying, it's looked up by its URL again
+        if (varied_) cache_->clearVary(cacheKey_);
+        return true;
+    }
+    if (!cache_->setVary(cacheKey_, originSummary_.vary)) return false;
+    CacheKeyBuilder::appendVariant(originSummary_.vary,
+        request_->getHeaders(), cacheKey_);
+    return true;
+}
+
+uint32_t ProxyHandler::negativeTTL() const {
+    if (!contentHeaders_ || streaming_ || slicing_ ||
+        !originSummary_.shareable) {
+        return 0;
+    }
+    uint16_t status = contentHeaders_->getStatusCode();
+    if (status == 404 || status == 410) {
+        return config_->negative_cache_ttl;
+    }
+    const auto& errors = config_->error_cache_statuses;
+    if (std::find(errors.begin(), errors.end(), status) != errors.end()) {
+        return config_->error_cache_ttl;
+    }
+    return 0;
+}
+
+bool ProxyHandler::acceptsRange(uint16_t status) const {
+    // ranges only apply to the object itself, not to errors or redirects
+    return status == 200 || (slicing_ && status == 206);
 }
 
 void ProxyHandler::originOnUpgrade(
@@ -246,9 +969,19 @@ void ProxyHandler::originOnUpgrade(
 void ProxyHandler::originOnError(
     const proxygen::HTTPException& error) noexcept {
     LOG(ERROR) << "Received error from origin: " << error.describe();
+    if (!contentHeaders_ && !servingStale_ && !clientTerminated_) {
+        // the origin failed before responding, the request can still be
+        // retried on a new connection once this transaction is gone
+        failedBeforeResponse_ = true;
+        return;
+    }
+    // nothing has been sent to the client yet unless it's streaming
+    if (!streaming_ && !servingStale_ && serveStale()) return;
     // todo: send an error back to the client and set condtions so
     // request handling doesn't proceed
-    abortDownstream();
+    if (!servingStale_) {
+        abortDownstream();
+    }
 }
 
 void ProxyHandler::originOnEgressPaused() noexcept {
@@ -1,8 +1,21 @@
 #pragma once
 
+#include "ByteRange.h"
 #include "Cache.h"
+#include "HeaderPolicy.h"
 #include "MasternodeConfig.h"
+#include "OriginPool.h"
+#include "RouteRules.h"
 #include "ServiceWorker.h"
+#include "Tenant.h"
+
+#include <atomic>
+#include <chrono>
+
+#include <folly/File.h>
+#include <folly/SocketAddress.h>
+#include <folly/io/IOBufQueue.h>
+#include <folly/io/async/HHWheelTimer.h>
 
 #include <proxygen/httpserver/RequestHandler.h>
 #include <proxygen/lib/http/HTTPConnector.h>
@@ -14,8 +27,15 @@ class ProxyHandler : public proxygen::RequestHandler,
     public:
         ProxyHandler(folly::HHWheelTimer *timer,
             std::shared_ptr<ContentCache> cache,
-            std::shared_ptr<MasternodeConfig> config, 
-            std::shared_ptr<ServiceWorker> sw);
+            std::shared_ptr<MasternodeConfig> config,
+            std::shared_ptr<ServiceWorker> sw,
+            std::shared_ptr<Tenant> tenant,
+            RouteAction action = RouteAction());
+        ~ProxyHandler() override;
+
+        // Bytes held by all handlers in response bodies being buffered
+        // for the cache
+        static size_t getBufferedBytes();
 
         bool checkForShutdown();
         void abortDownstream();
@@ -25,6 +45,8 @@ class ProxyHandler : public proxygen::RequestHandler,
         void onBody(std::unique_ptr<folly::IOBuf> body) noexcept override;
         void onUpgrade(proxygen::UpgradeProtocol protocol) noexcept override;
         void onEOM() noexcept override;
+        void onEgressPaused() noexcept override;
+        void onEgressResumed() noexcept override;
         void requestComplete() noexcept override;
         void onError(proxygen::ProxygenError err) noexcept override;
     
@@ -32,6 +54,10 @@ class ProxyHandler : public proxygen::RequestHandler,
         void connectSuccess(proxygen::HTTPUpstreamSession* session) noexcept override;
         void connectError(const folly::AsyncSocketException& ex) noexcept override;
 
+        // Same for the hedged connect
+        void hedgeConnectSuccess(proxygen::HTTPUpstreamSession* session) noexcept;
+        void hedgeConnectError(const folly::AsyncSocketException& ex) noexcept;
+
         // HTTPTransactionHandler delegated methods
         void originSetTransaction(proxygen::HTTPTransaction* txn) noexcept;
         void originDetachTransaction() noexcept;
@@ -47,6 +73,127 @@ class ProxyHandler : public proxygen::RequestHandler,
         void originOnEgressResumed() noexcept;
         void originOnPushedTransaction(proxygen::HTTPTransaction *txn) noexcept;
     private:
+        // Connects to the origin to fetch the requested content
+        void fetchFromOrigin();
+
+        // Sends the request to origin_ over an idle connection, or starts
+        // a connect to it (and schedules a hedged connect if enabled)
+        void connectToOrigin();
+
+        // Starts a second connect to the origin if the first one is still
+        // in progress
+        void startHedge();
+
+        // Adds a new connection to origin_ to the thread's pool and sends
+        // the request over it
+        void sendToOrigin(proxygen::HTTPUpstreamSession* session);
+
+        // Sends the request over an idle connection to origin_. Returns
+        // false if there's none.
+        bool startOriginTransaction();
+
+        // Called when the origin couldn't be reached or failed before
+        // responding. Retries the request if allowed, otherwise falls
+        // back to a stale route or an error.
+        void originFailed();
+
+        // Sends the request again, to another origin if there is one, if
+        // it's idempotent and neither the per request limit nor the
+        // retry budget is spent
+        bool retryOrigin();
+
+        // Reports the outcome of the current origin request to origin_
+        // (only the first report of each request counts)
+        void recordOriginResult(bool success);
+
+        // Looks up cacheKey_ in the cache. An expired route isn't
+        // returned, but kept in staleRoute_ if it may be served should
+        // the origin fail.
+        std::shared_ptr<CachedRoute> lookupRoute();
+
+        // Replies with staleRoute_ after the origin failed. Returns false
+        // if there's none to serve.
+        bool serveStale();
+
+        // Replies to the client with a cached route. Returns false if the
+        // route couldn't be served (e.g. its body file is gone).
+        bool serveCachedRoute(std::shared_ptr<CachedRoute> route);
+
+        bool shouldInjectServiceWorker(const CachedRoute& route) const;
+        bool shouldInjectServiceWorker(
+            const proxygen::HTTPMessage& headers) const;
+
+        // Switches a request for a range of a large object over to the
+        // slice holding the first byte of the range, if slicing is
+        // enabled and the object is known to be larger than a slice.
+        // Returns false if the request isn't sliced.
+        bool startSlice();
+        // Records the size of an object larger than a slice from the
+        // origin's response, so later ranges of it are sliced
+        void recordObjectSize();
+
+        // Works out which part of a body answers the request's Range.
+        // The body holds the bytes of an object of objectSize bytes
+        // starting at bodyOffset (a slice, or the whole object). Sets
+        // partial_ and returns the part relative to the body in "part"
+        // (all of it if the request doesn't have a usable range, or if
+        // wholeBody is set because the body is rewritten). An If-Range
+        // is checked against the body's ETag and Last-Modified.
+        RangeResult selectRange(folly::StringPiece etag,
+            folly::StringPiece lastModified, bool wholeBody,
+            size_t bodyOffset, size_t bodySize, size_t objectSize,
+            ByteRange& part);
+
+        // Counts "len" more bytes of the origin's response as buffered.
+        // Returns false if that would take the response over the largest
+        // cacheable size, or all handlers over the buffered bytes limit.
+        bool chargeBuffer(size_t len);
+        void releaseBuffer();
+
+        // Gives up on caching the origin's response and passes it
+        // straight through to the client: sends its status and headers
+        // and what was buffered so far, the rest of the body follows as
+        // it arrives
+        void startStreaming();
+
+        // Replies with the origin's buffered response (or the part of it
+        // the request's range asks for)
+        void sendOriginResponse();
+
+        // True if the origin's buffered response may be cached: a 2xx
+        // (the 206 for a slice) that the origin allows to be shared
+        bool isCacheable() const;
+
+        // Points cacheKey_ at the variant of the route the origin's
+        // cacheable response is for, and records the request headers
+        // its variants are picked by. Returns false if the variant can't
+        // be cached.
+        bool selectVariant();
+
+        // Seconds the origin's buffered response may be cached for as a
+        // negative (404, 410) or error response, 0 if it can't be
+        uint32_t negativeTTL() const;
+
+        // True if a range of a response with this status may be served
+        bool acceptsRange(uint16_t status) const;
+
+        // Replies with a 416 for a range past the end of the object
+        void sendUnsatisfiable(size_t objectSize);
+
+        // Sends the response for a cached route (a 206 if partial_ is
+        // set), starting from the route's headers. Only service worker
+        // injection and partial responses change them. Without content,
+        // only the headers are sent and the part of the body file
+        // between diskOffset_ and diskEnd_ is streamed after.
+        void sendCachedResponse(const CachedRoute& route,
+            std::unique_ptr<folly::IOBuf> content);
+
+        // Reads the next chunk of a disk tier route and sends it to the
+        // client, until the body is complete or the client's connection
+        // is backed up
+        void streamFromDisk();
+        void finishDiskStream();
+
         class OriginTransactionHandler : public proxygen::HTTPTransactionHandler {
             public:
                 explicit OriginTransactionHandler(ProxyHandler& parent) : parent_(parent) {}
@@ -106,6 +253,44 @@ class ProxyHandler : public proxygen::RequestHandler,
                 ProxyHandler& parent_;
         };
 
+        // Second connect to the origin, started alongside the first when
+        // it takes longer than usual. Whichever connects first is used.
+        class HedgeConnector : private proxygen::HTTPConnector::Callback {
+            public:
+                HedgeConnector(ProxyHandler& parent, folly::HHWheelTimer* timer) :
+                    parent_(parent), connector_{this, timer} {}
+
+                proxygen::HTTPConnector& getConnector() { return connector_; }
+            private:
+                void connectSuccess(proxygen::HTTPUpstreamSession* session) noexcept override {
+                    parent_.hedgeConnectSuccess(session);
+                }
+
+                void connectError(const folly::AsyncSocketException& ex) noexcept override {
+                    parent_.hedgeConnectError(ex);
+                }
+
+                ProxyHandler& parent_;
+                proxygen::HTTPConnector connector_;
+        };
+
+        // Fires when it's time to hedge a slow connect
+        class HedgeTimeout : public folly::HHWheelTimer::Callback {
+            public:
+                explicit HedgeTimeout(ProxyHandler& parent) : parent_(parent) {}
+            private:
+                void timeoutExpired() noexcept override {
+                    parent_.startHedge();
+                }
+
+                // the timer going away doesn't need to start a hedge
+                void callbackCanceled() noexcept override {}
+
+                ProxyHandler& parent_;
+        };
+
+        folly::HHWheelTimer* timer_{nullptr};
+
         // Creates a connection to origin servers we're protecting when we need
         // to fetch content.
         proxygen::HTTPConnector connector_;
@@ -113,30 +298,121 @@ class ProxyHandler : public proxygen::RequestHandler,
         // Handles connection lifecycle events between origin servers and us
         OriginTransactionHandler originHandler_;
 
+        // Origin the request is sent to, the thread's idle connections to
+        // it, and the hedged connect to it if one was started
+        std::shared_ptr<Origin> origin_{nullptr};
+        proxygen::SessionPool* sessions_{nullptr};
+        std::unique_ptr<HedgeConnector> hedge_{nullptr};
+        HedgeTimeout hedgeTimeout_;
+
+        // When the request was sent to origin_, whether its outcome still
+        // has to be reported, and the number of times it was retried
+        std::chrono::steady_clock::time_point connectStarted_;
+        bool guardPending_{false};
+        uint32_t retries_{0};
+
+        // Set when the origin transaction failed before a response came,
+        // to handle the failure once the transaction is detached
+        bool failedBeforeResponse_{false};
+
         // HTTP transaction used to get content from an origin server
         proxygen::HTTPTransaction* originTxn_{nullptr};
 
         // Incoming request (headers)
         std::unique_ptr<proxygen::HTTPMessage> request_{nullptr};
 
+        // Range header of a GET request (empty for the whole body)
+        std::string rangeHeader_;
+
+        // Key the response is cached under: the URL, or the URL and slice
+        // number when only a slice of a large object is fetched
+        std::string cacheKey_;
+
+        // Length of the part of cacheKey_ that's the route's key (without
+        // the slice or variant suffix), and whether the request was
+        // looked up as a variant of it
+        size_t routeKeyLength_{0};
+        bool varied_{false};
+
+        // Set when the origin is asked for the slice of the object
+        // starting at sliceOffset_ instead of the whole object
+        bool slicing_{false};
+        size_t sliceOffset_{0};
+
+        // Expired copy of the route to fall back on if the origin can't
+        // be reached, times out or answers with a 5xx, and whether it's
+        // being served
+        std::shared_ptr<CachedRoute> staleRoute_{nullptr};
+        bool servingStale_{false};
+
+        // Part of the object (of objectSize_ bytes) sent in a 206
+        folly::Optional<ByteRange> partial_;
+        size_t objectSize_{0};
+
         // Content received from the origin. Used to collect data as it
         // comes in from the origin and later pass in to the cache once
-        // all the data is there.
+        // all the data is there. Sized from the Content-Length when the
+        // origin sends one, otherwise a chain of the origin's buffers.
         std::unique_ptr<folly::IOBuf> contentBody_{nullptr};
 
         // Origin response headers
         std::shared_ptr<proxygen::HTTPMessage> contentHeaders_{nullptr};
 
+        // What the header policy found in the origin's response headers,
+        // and the headers it forwarded to the client
+        HeaderPolicy::Summary originSummary_;
+        proxygen::HTTPHeaders forwarded_;
+
+        // Set when the origin's response is streamed through to the
+        // client instead of being buffered and cached
+        bool streaming_{false};
+
+        // Bytes of the response charged as buffered, and how many of
+        // them were charged up front for a buffer allocated at the
+        // response's Content-Length but haven't arrived yet
+        size_t buffered_{0};
+        size_t reserved_{0};
+        static std::atomic<size_t> bufferedBytes_;
+
         // if the client's request is finished/cancelled
         bool clientTerminated_{false};
 
+        // if the client's connection can't take more data right now
+        bool egressPaused_{false};
+
+        // Disk tier route being streamed to the client, and its body file
+        std::shared_ptr<CachedRoute> diskRoute_{nullptr};
+        folly::File diskFile_;
+        size_t diskOffset_{0};
+        size_t diskEnd_{0};
+        bool diskReadPending_{false};
+
+        // Body of a disk tier route collected as it's read, either to
+        // reply with it in one piece (bufferDiskBody_) or to promote the
+        // route back to memory without reading it again
+        bool bufferDiskBody_{false};
+        bool promoteFromDisk_{false};
+        folly::IOBufQueue diskBody_{folly::IOBufQueue::cacheChainLength()};
+
         // HTTP content cache
         std::shared_ptr<ContentCache> cache_{nullptr};
 
+        // Site the request is for
+        std::shared_ptr<Tenant> tenant_{nullptr};
+
+        // What the route rules decided for the request
+        RouteAction action_;
+
         // Configuration class
         std::shared_ptr<MasternodeConfig> config_{nullptr};
 
         // Service worker wrapper
         std::shared_ptr<ServiceWorker> sw_{nullptr};
+
+        // Rules for passing the origin's response headers on
+        std::shared_ptr<const HeaderPolicy> policy_{nullptr};
+
+        // Origin servers requests are balanced over
+        std::shared_ptr<OriginPool> origins_{nullptr};
 }; 
 
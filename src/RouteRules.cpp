@@ -0,0 +1,185 @@
+#include "RouteRules.h"
+
+#include <algorithm>
+
+#include <folly/Conv.h>
+#include <folly/dynamic.h>
+#include <folly/json.h>
+
+#include <proxygen/lib/http/HTTPCommonHeaders.h>
+
+using namespace proxygen;
+
+RouteRules::RouteRules(std::vector<RouteRule> rules) {
+    nodes_.emplace_back(); // root
+    for (auto& rule : rules) {
+        Compiled c;
+        c.rule = std::move(rule);
+        // the literal part of a glob narrows the rule down as far as the
+        // trie goes, the rest is matched against what's left of the path
+        std::string prefix = c.rule.path;
+        if (!c.rule.glob.empty()) {
+            auto wildcard = c.rule.glob.find_first_of("*?");
+            if (wildcard == std::string::npos) {
+                wildcard = c.rule.glob.size();
+            }
+            prefix = c.rule.glob.substr(0, wildcard);
+            c.globRest = c.rule.glob.substr(wildcard);
+        }
+        if (!c.rule.header.empty()) {
+            c.headerCode = HTTPCommonHeaders::hash(c.rule.header);
+        }
+        auto node = insert(prefix);
+        nodes_[node].rules.push_back(rules_.size());
+        rules_.push_back(std::move(c));
+    }
+}
+
+uint32_t RouteRules::insert(folly::StringPiece prefix) {
+    uint32_t node = 0;
+    for (char c : prefix) {
+        int32_t child = findChild(nodes_[node], c);
+        if (child < 0) {
+            child = nodes_.size();
+            auto& children = nodes_[node].children;
+            auto pos = std::lower_bound(children.begin(), children.end(),
+                std::make_pair(c, uint32_t(0)));
+            children.emplace(pos, c, child);
+            nodes_.emplace_back();
+        }
+        node = child;
+    }
+    return node;
+}
+
+int32_t RouteRules::findChild(const Node& node, char c) const {
+    auto pos = std::lower_bound(node.children.begin(), node.children.end(),
+        std::make_pair(c, uint32_t(0)));
+    if (pos == node.children.end() || pos->first != c) return -1;
+    return pos->second;
+}
+
+bool RouteRules::accepts(const Compiled& c, folly::StringPiece path,
+    size_t depth, folly::StringPiece extension, folly::StringPiece method,
+    const HTTPHeaders* headers) const {
+    const RouteRule& rule = c.rule;
+    if (!rule.glob.empty()) {
+        if (!rule.path.empty() && !path.startsWith(rule.path)) return false;
+        if (!globMatch(c.globRest, path.subpiece(depth))) return false;
+    }
+    if (!rule.extension.empty() && extension != rule.extension) return false;
+    if (!rule.method.empty() && method != rule.method) return false;
+    if (!rule.header.empty()) {
+        if (!headers) return false;
+        if (c.headerCode != HTTP_HEADER_OTHER) {
+            if (!headers->exists(c.headerCode)) return false;
+        } else if (!headers->exists(rule.header)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+const RouteAction& RouteRules::match(const HTTPMessage& msg) const {
+    return match(msg.getPath(), msg.getMethodString(), &msg.getHeaders());
+}
+
+const RouteAction& RouteRules::match(folly::StringPiece path,
+    folly::StringPiece method, const HTTPHeaders* headers) const {
+    if (rules_.empty()) return default_;
+
+    folly::StringPiece extension;
+    auto slash = path.rfind('/');
+    auto dot = path.rfind('.');
+    if (dot != folly::StringPiece::npos &&
+        (slash == folly::StringPiece::npos || dot > slash)) {
+        extension = path.subpiece(dot + 1);
+    }
+
+    // rules along the path are visited shortest prefix first, but the
+    // one declared first wins, so keep the lowest index that matched
+    uint32_t best = rules_.size();
+    uint32_t node = 0;
+    size_t depth = 0;
+    while (true) {
+        for (auto index : nodes_[node].rules) {
+            if (index >= best) break;
+            if (accepts(rules_[index], path, depth, extension, method,
+                headers)) {
+                best = index;
+                break;
+            }
+        }
+        if (depth == path.size()) break;
+        int32_t child = findChild(nodes_[node], path[depth]);
+        if (child < 0) break;
+        node = child;
+        depth++;
+    }
+    if (best == rules_.size()) return default_;
+    return rules_[best].rule.action;
+}
+
+bool RouteRules::globMatch(folly::StringPiece pattern,
+    folly::StringPiece text) {
+    size_t p = 0, t = 0;
+    // position of the last * seen and the text it was matched up to,
+    // to backtrack to when the rest of the pattern doesn't fit
+    size_t star = folly::StringPiece::npos, starText = 0;
+    while (t < text.size()) {
+        if (p < pattern.size() &&
+            (pattern[p] == '?' || pattern[p] == text[t])) {
+            p++;
+            t++;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            starText = t;
+        } else if (star != folly::StringPiece::npos) {
+            p = star + 1;
+            t = ++starText;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') p++;
+    return p == pattern.size();
+}
+
+std::vector<RouteRule> RouteRules::parseRules(const std::string& json) {
+    std::vector<RouteRule> rules;
+    folly::dynamic list = folly::parseJson(json);
+    for (const auto& value : list) {
+        RouteRule rule;
+        rule.path = value.getDefault("path", "").getString();
+        rule.glob = value.getDefault("glob", "").getString();
+        rule.extension = value.getDefault("extension", "").getString();
+        rule.method = value.getDefault("method", "").getString();
+        rule.header = value.getDefault("header", "").getString();
+        std::transform(rule.method.begin(), rule.method.end(),
+            rule.method.begin(), ::toupper);
+        if (!rule.extension.empty() && rule.extension[0] == '.') {
+            rule.extension.erase(0, 1);
+        }
+
+        RouteAction& action = rule.action;
+        auto handler = value.getDefault("handler", "proxy").getString();
+        if (handler == "proxy") {
+            action.handler = RouteAction::Handler::PROXY;
+        } else if (handler == "reject") {
+            action.handler = RouteAction::Handler::REJECT;
+        } else {
+            throw std::invalid_argument(folly::to<std::string>(
+                "Unknown route handler: ", handler));
+        }
+        action.cache_ttl = value.getDefault("cache_ttl", -1).asInt();
+        action.bypass_cache =
+            value.getDefault("bypass_cache", false).asBool();
+        action.compress = value.getDefault("compress", true).asBool();
+        action.inject_service_worker =
+            value.getDefault("inject_service_worker", true).asBool();
+        action.edge_offload =
+            value.getDefault("edge_offload", true).asBool();
+        rules.push_back(rule);
+    }
+    return rules;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <folly/Range.h>
+
+#include <proxygen/lib/http/HTTPMessage.h>
+
+// What a rule decides for the requests it matches
+struct RouteAction {
+    enum class Handler : uint8_t { PROXY, REJECT };
+    Handler handler{Handler::PROXY};
+    // Seconds a cached response is fresh for, in place of what the
+    // origin's headers say (-1 to follow the origin)
+    int32_t cache_ttl{-1};
+    // Don't look the request up in the cache or cache its response
+    bool bypass_cache{false};
+    // Compress the response if the client accepts it
+    bool compress{true};
+    // Inject the service worker into HTML responses
+    bool inject_service_worker{true};
+    // Let edge nodes serve the content (list it in the asset hashes)
+    bool edge_offload{true};
+};
+
+// A rule: the conditions a request has to meet (all of the ones set)
+// and the action taken for it
+struct RouteRule {
+    // Path prefix
+    std::string path;
+    // Path glob, where * matches any run of characters and ? any one
+    std::string glob;
+    // File extension of the path (without the dot)
+    std::string extension;
+    // Request method
+    std::string method;
+    // Request header that has to be present
+    std::string header;
+    RouteAction action;
+};
+
+// Per route caching and routing policy. Rules are checked in the order
+// they're given and the first one a request meets decides its action;
+// requests no rule matches get the default action. Rules are compiled
+// at startup into a trie over their literal path prefixes (the part of
+// a glob before its first wildcard), so matching a request walks its
+// path once and only checks the other conditions of the rules along
+// the way, without allocating.
+class RouteRules {
+    public:
+        explicit RouteRules(std::vector<RouteRule> rules);
+
+        // Parses a JSON array of rules, each an object like
+        // {"path": "/api/", "method": "GET", "bypass_cache": true}.
+        // Conditions are path, glob, extension, method and header;
+        // actions are handler ("proxy" or "reject"), cache_ttl,
+        // bypass_cache, compress, inject_service_worker and edge_offload.
+        // Throws on malformed input.
+        static std::vector<RouteRule> parseRules(const std::string& json);
+
+        // Returns the action for a request
+        const RouteAction& match(const proxygen::HTTPMessage& msg) const;
+        // Returns the action for a path with the given method and headers
+        // (null headers only match rules without a header condition)
+        const RouteAction& match(folly::StringPiece path,
+            folly::StringPiece method,
+            const proxygen::HTTPHeaders* headers) const;
+
+        size_t size() const { return rules_.size(); }
+
+        // True if text matches a glob pattern (* and ? wildcards)
+        static bool globMatch(folly::StringPiece pattern,
+            folly::StringPiece text);
+    private:
+        struct Node {
+            // Children by next byte, sorted
+            std::vector<std::pair<char, uint32_t>> children;
+            // Rules whose literal prefix ends here, in rule order
+            std::vector<uint32_t> rules;
+        };
+
+        // Compiled rule: its conditions other than the literal prefix
+        struct Compiled {
+            RouteRule rule;
+            // Part of the glob after the literal prefix
+            std::string globRest;
+            proxygen::HTTPHeaderCode headerCode{proxygen::HTTP_HEADER_NONE};
+        };
+
+        uint32_t insert(folly::StringPiece prefix);
+        int32_t findChild(const Node& node, char c) const;
+        bool accepts(const Compiled& c, folly::StringPiece path,
+            size_t depth, folly::StringPiece extension,
+            folly::StringPiece method,
+            const proxygen::HTTPHeaders* headers) const;
+
+        std::vector<Compiled> rules_;
+        std::vector<Node> nodes_;
+        RouteAction default_;
+};
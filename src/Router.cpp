@@ -4,6 +4,7 @@
 #include "ProxyHandler.h"
 #include "ServiceWorkerHandler.h"
 #include "RejectHandler.h"
+#include "Metrics.h"
 
 Router::Router(std::shared_ptr<MasternodeConfig> config,
     std::shared_ptr<NetworkState> state,
@@ -15,6 +16,8 @@ Router::Router(std::shared_ptr<MasternodeConfig> config,
     sw_(sw) {
         CHECK(config_) << "Config object was null";
         CHECK(cache_) << "Cache object was null";
+        tenants_ = std::make_shared<TenantTable>(config_);
+        rules_ = std::make_shared<const RouteRules>(config_->route_rules);
         VLOG(1) << "Router created";
     }
 
@@ -29,19 +32,12 @@ void Router::onServerStart(folly::EventBase *evb) noexcept {
 }
 
 void Router::onServerStop() noexcept {
+    // the pooled connections use the thread's timer
+    tenants_->releaseSessions();
     timer_->timer.reset();
     LOG(INFO) << "Server thread stopped";
 }
 
-bool Router::requestIsValid(std::string host) {
-    if (host == config_->protected_domain) return true;
-    if (config_->ssl_enabled) {
-        if (host == config_->protected_domain + ":" + std::to_string(config_->ssl_port)) return true;
-    }
-    if (host == config_->protected_domain + ":" + std::to_string(config_->port)) return true;
-    return false;
-}
-
 
 RequestHandler* Router::onRequest(
     RequestHandler *req, HTTPMessage *m) noexcept {
@@ -50,10 +46,14 @@ RequestHandler* Router::onRequest(
     // make sure this request always has a Host: header
     m->ensureHostHeader();
     
-    std::string host = m->getHeaders().getSingleOrEmpty(HTTP_HEADER_HOST);
+    const std::string& host =
+        m->getHeaders().getSingleOrEmpty(HTTP_HEADER_HOST);
 
-    if (!requestIsValid(host)) {
+    auto tenant = tenants_->find(host);
+    auto& metrics = Metrics::get();
+    if (!tenant) {
         // reject this request
+        metrics.requests[Metrics::REJECT].add();
         return new RejectHandler(400, "Bad Request");
     }
  
@@ -63,24 +63,40 @@ RequestHandler* Router::onRequest(
     // if upgrading insecure requests is enabled and this request is
     // not secure, redirect to the secure port
     if (config_->upgrade_insecure && !m->isSecure()) {
+        metrics.requests[Metrics::REDIRECT].add();
         return new RedirectHandler(config_);
     }
 
     // For speaking directly to the masternode and not an underlying
     // (protected) domain
     if (m->getHeaders().rawExists(DIRECT_HEADER_NAME)) {
-        return new DirectHandler(cache_, config_, state_);
+        metrics.requests[Metrics::DIRECT].add();
+        return new DirectHandler(cache_, config_, state_, rules_, tenants_);
     }
 
-    if (config_->enableServiceWorker && sw_) {
+    if (tenant->enableServiceWorker && sw_) {
         // serving the service worker javascript file itself
         if (m->getURL() == "/gladius-service-worker.js") {
+            metrics.requests[Metrics::SERVICE_WORKER].add();
             return new ServiceWorkerHandler(config_, sw_);
         }
     }
 
+    const RouteAction& action = rules_->match(*m);
+    if (action.handler == RouteAction::Handler::REJECT) {
+        metrics.requests[Metrics::REJECT].add();
+        return new RejectHandler(403, "Forbidden");
+    }
+    if (!action.compress) {
+        // the compression filter only compresses for clients that
+        // accept it
+        m->getHeaders().remove(HTTP_HEADER_ACCEPT_ENCODING);
+    }
+
     // all other requests for proxied content
-    return new ProxyHandler(timer_->timer.get(), cache_, config_, sw_);
+    metrics.requests[Metrics::PROXY].add();
+    return new ProxyHandler(timer_->timer.get(), cache_, config_, sw_,
+        std::move(tenant), action);
 }
 
 void Router::logRequest(HTTPMessage *m) {
@@ -3,8 +3,10 @@
 #include <proxygen/httpserver/RequestHandlerFactory.h>
 
 #include "NetworkState.h"
+#include "RouteRules.h"
 #include "Cache.h"
 #include "ServiceWorker.h"
+#include "Tenant.h"
 
 using namespace proxygen;
 using folly::HHWheelTimer;
@@ -26,9 +28,13 @@ class Router : public RequestHandlerFactory {
         std::shared_ptr<MasternodeConfig> config_{nullptr};
         std::shared_ptr<NetworkState> state_{nullptr};
         std::shared_ptr<ServiceWorker> sw_{nullptr};
+        // Sites served, by host (each with its own origins and header
+        // policy, shared by all proxy handlers)
+        std::shared_ptr<TenantTable> tenants_{nullptr};
+        // Per route caching and routing policy
+        std::shared_ptr<const RouteRules> rules_{nullptr};
 
         std::string DIRECT_HEADER_NAME = "Gladius-Masternode-Direct";
-        bool requestIsValid(std::string host);
     private:
         void logRequest(HTTPMessage *m);
         struct TimerWrapper {
@@ -0,0 +1,102 @@
+#include "Tenant.h"
+
+#include <algorithm>
+
+#include <folly/Conv.h>
+#include <folly/dynamic.h>
+#include <folly/json.h>
+
+TenantTable::TenantTable(std::shared_ptr<MasternodeConfig> config):
+    config_(config) {
+    CHECK(config_) << "Config object was null";
+    keys_ = std::make_shared<const CacheKeyBuilder>(
+        config_->cache_key_drop_params, config_->cache_key_allow_params,
+        config_->cache_key_sort_params);
+    if (!config_->protected_domain.empty() || config_->tenants.empty()) {
+        auto tenant = std::make_shared<Tenant>();
+        tenant->name = config_->protected_domain;
+        tenant->enableServiceWorker = config_->enableServiceWorker;
+        tenant->policy = std::make_shared<const HeaderPolicy>(*config_);
+        tenant->origins = std::make_shared<OriginPool>(config_);
+        addTenant(tenant, {config_->protected_domain});
+    }
+    for (auto& site : config_->tenants) {
+        auto tenant = std::make_shared<Tenant>();
+        tenant->name = site.name;
+        tenant->cacheNamespace = site.name;
+        tenant->enableServiceWorker = site.enable_service_worker;
+        tenant->policy = std::make_shared<const HeaderPolicy>(site.origins);
+        tenant->origins = std::make_shared<OriginPool>(config_,
+            site.origins);
+        addTenant(tenant, site.hosts);
+    }
+}
+
+void TenantTable::addTenant(std::shared_ptr<Tenant> tenant,
+    const std::vector<std::string>& hosts) {
+    tenant->keys = keys_;
+    tenants_.push_back(tenant);
+    for (auto host : hosts) {
+        std::transform(host.begin(), host.end(), host.begin(), ::tolower);
+        std::vector<std::string> keys{host,
+            folly::to<std::string>(host, ":", config_->port)};
+        if (config_->ssl_enabled) {
+            keys.push_back(folly::to<std::string>(host, ":",
+                config_->ssl_port));
+        }
+        for (auto& key : keys) {
+            if (!hosts_.emplace(key, tenant).second) {
+                LOG(WARNING) << "Host " << key << " of " << tenant->name <<
+                    " is already served by another site";
+            }
+        }
+    }
+}
+
+std::vector<TenantConfig> TenantTable::parseTenants(const std::string& json) {
+    std::vector<TenantConfig> tenants;
+    folly::dynamic list = folly::parseJson(json);
+    for (const auto& value : list) {
+        TenantConfig tenant;
+        tenant.name = value["name"].getString();
+        // names go in cache keys ahead of the URL, between two @s
+        if (tenant.name.empty() ||
+            tenant.name.find_first_of("@/") != std::string::npos) {
+            throw std::invalid_argument(
+                "Tenant names must be non-empty and can't contain @ or /");
+        }
+        for (auto& host : value["hosts"]) {
+            tenant.hosts.push_back(host.getString());
+        }
+        tenant.origins = OriginPool::parseOrigins(
+            value["origins"].getString());
+        if (tenant.origins.empty()) {
+            throw std::invalid_argument(folly::to<std::string>(
+                "Tenant ", tenant.name, " has no origins"));
+        }
+        tenant.enable_service_worker =
+            value.getDefault("service_worker", false).asBool();
+        tenant.cache_share = value.getDefault("cache_share", 0.0).asDouble();
+        tenants.push_back(tenant);
+    }
+    return tenants;
+}
+
+std::shared_ptr<Tenant> TenantTable::find(const std::string& host) const {
+    auto it = hosts_.find(host);
+    if (it != hosts_.end()) return it->second;
+    // hosts are case insensitive, but hardly ever sent in upper case
+    if (std::any_of(host.begin(), host.end(), ::isupper)) {
+        std::string lower(host);
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        it = hosts_.find(lower);
+        if (it != hosts_.end()) return it->second;
+    }
+    return nullptr;
+}
+
+void TenantTable::releaseSessions() {
+    for (auto& tenant : tenants_) {
+        tenant->origins->releaseSessions();
+    }
+}
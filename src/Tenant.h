@@ -0,0 +1,61 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <folly/container/F14Map.h>
+
+#include "CacheKey.h"
+#include "HeaderPolicy.h"
+#include "MasternodeConfig.h"
+#include "OriginPool.h"
+
+// A site served by the masternode, with its own origins, header policy
+// and service worker setting. Its routes are cached under its own
+// namespace.
+struct Tenant {
+    std::string name;
+    // Prefix of the site's cache keys ("" for the protected domain)
+    std::string cacheNamespace;
+    bool enableServiceWorker{false};
+    std::shared_ptr<const HeaderPolicy> policy;
+    std::shared_ptr<OriginPool> origins;
+    // Builds the cache keys of the site's requests
+    std::shared_ptr<const CacheKeyBuilder> keys;
+};
+
+// Finds the site a request is for by its Host header. The table is
+// built once at startup with every host as it may be sent (with and
+// without the listening ports), so a lookup is a single hash probe
+// without building any strings.
+class TenantTable {
+    public:
+        explicit TenantTable(std::shared_ptr<MasternodeConfig> config);
+
+        // Parses a JSON array of tenants, each an object like
+        // {"name": "shop", "hosts": ["shop.example.com"],
+        //  "origins": "10.0.0.5:8080*2,10.0.0.6", "service_worker": false,
+        //  "cache_share": 0.25}. Throws on malformed input.
+        static std::vector<TenantConfig> parseTenants(const std::string& json);
+
+        // Returns the tenant a Host header value belongs to, null if the
+        // host isn't served
+        std::shared_ptr<Tenant> find(const std::string& host) const;
+
+        const std::vector<std::shared_ptr<Tenant>>& getTenants() const {
+            return tenants_;
+        }
+
+        // Closes the calling thread's idle connections to every origin
+        void releaseSessions();
+    private:
+        void addTenant(std::shared_ptr<Tenant> tenant,
+            const std::vector<std::string>& hosts);
+
+        std::shared_ptr<MasternodeConfig> config_{nullptr};
+        std::shared_ptr<const CacheKeyBuilder> keys_{nullptr};
+        std::vector<std::shared_ptr<Tenant>> tenants_;
+        folly::F14FastMap<std::string /* host[:port] */,
+            std::shared_ptr<Tenant>> hosts_;
+};
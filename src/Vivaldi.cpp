@@ -0,0 +1,199 @@
+#include "Vivaldi.h"
+#include "Metrics.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <folly/IPAddress.h>
+#include <folly/Random.h>
+
+constexpr double VivaldiSystem::CE;
+constexpr double VivaldiSystem::CC;
+constexpr double VivaldiSystem::MIN_HEIGHT;
+constexpr double VivaldiSystem::MIN_ERROR;
+
+double NetworkCoordinate::distanceTo(const NetworkCoordinate& other) const {
+    double dx = x - other.x;
+    double dy = y - other.y;
+    double dz = z - other.z;
+    return std::sqrt(dx * dx + dy * dy + dz * dz) + height + other.height;
+}
+
+VivaldiSystem::VivaldiSystem(size_t maxClientPrefixes):
+    clients_(std::max<size_t>(maxClientPrefixes, 1)) {}
+
+// One Vivaldi step with height vectors (Dabek et al. 2004). The local
+// coordinate moves along the line to the remote one, by an amount that
+// depends on how wrong the current prediction is and on how confident
+// each side is in its own position.
+void VivaldiSystem::update(NetworkCoordinate& local,
+    const NetworkCoordinate& remote, double rttMs) {
+    if (rttMs <= 0.0) return;
+
+    double dist = local.distanceTo(remote);
+    double w = local.error / (local.error + remote.error);
+    double sampleError = std::fabs(dist - rttMs) / rttMs;
+    local.error = std::max(MIN_ERROR, std::min(1.0,
+        sampleError * CE * w + local.error * (1.0 - CE * w)));
+
+    double dx = local.x - remote.x;
+    double dy = local.y - remote.y;
+    double dz = local.z - remote.z;
+    double heights = local.height + remote.height;
+    double norm = std::sqrt(dx * dx + dy * dy + dz * dz) + heights;
+    if (norm <= 1e-9) {
+        // both points are in the same place, push in a random direction
+        dx = folly::Random::randDouble01() - 0.5;
+        dy = folly::Random::randDouble01() - 0.5;
+        dz = folly::Random::randDouble01() - 0.5;
+        heights = MIN_HEIGHT;
+        norm = std::sqrt(dx * dx + dy * dy + dz * dz) + heights;
+    }
+
+    double force = CC * w * (rttMs - dist);
+    local.x += force * dx / norm;
+    local.y += force * dy / norm;
+    local.z += force * dz / norm;
+    local.height = std::max(MIN_HEIGHT,
+        local.height + force * heights / norm);
+    local.samples++;
+}
+
+std::string VivaldiSystem::clientPrefix(const std::string& ip) {
+    try {
+        folly::IPAddress addr(ip);
+        if (addr.isV4()) {
+            return addr.mask(24).str() + "/24";
+        }
+        return addr.mask(48).str() + "/48";
+    } catch (const std::exception& e) {
+        VLOG(1) << "Could not parse client address " << ip << ": " << e.what();
+        return ip;
+    }
+}
+
+void VivaldiSystem::observeEdge(const std::string& ethAddress, double rttMs) {
+    NetworkCoordinate self = self_.copy();
+    NetworkCoordinate edge;
+    { // critical section
+        auto locked = edges_.wlock();
+        auto& c = (*locked)[ethAddress];
+        update(c, self, rttMs);
+        edge = c;
+    }
+    { // critical section
+        auto locked = self_.wlock();
+        update(*locked, edge, rttMs);
+    }
+}
+
+void VivaldiSystem::observeClient(const std::string& prefix,
+    const std::string& ethAddress, double rttMs) {
+    NetworkCoordinate edge;
+    { // critical section
+        auto locked = edges_.rlock();
+        auto it = locked->find(ethAddress);
+        // clients can only be placed relative to edges we know about
+        if (it == locked->end()) return;
+        edge = it->second;
+    }
+    NetworkCoordinate client;
+    { // critical section
+        std::lock_guard<std::mutex> guard(clientsLock_);
+        // finding a prefix makes it the most recently used
+        auto it = clients_.find(prefix);
+        if (it != clients_.end()) {
+            client = it->second;
+        }
+        update(client, edge, rttMs);
+        clients_.set(prefix, client);
+    }
+    { // critical section
+        auto locked = edges_.wlock();
+        auto it = locked->find(ethAddress);
+        if (it != locked->end()) {
+            update(it->second, client, rttMs);
+        }
+    }
+}
+
+folly::Optional<NetworkCoordinate> VivaldiSystem::getEdgeCoordinate(
+    const std::string& ethAddress) const {
+    auto locked = edges_.rlock();
+    auto it = locked->find(ethAddress);
+    if (it == locked->end()) return folly::none;
+    return it->second;
+}
+
+folly::Optional<NetworkCoordinate> VivaldiSystem::getClientCoordinate(
+    const std::string& prefix) const {
+    std::lock_guard<std::mutex> guard(clientsLock_);
+    auto it = clients_.findWithoutPromotion(prefix);
+    if (it == clients_.cend()) return folly::none;
+    return it->second;
+}
+
+NetworkCoordinate VivaldiSystem::getSelfCoordinate() const {
+    return self_.copy();
+}
+
+std::shared_ptr<CoordinateTreeData> VivaldiSystem::buildTreeData(
+    const std::vector<std::shared_ptr<EdgeNode>>& nodes) const {
+    auto td = std::make_shared<CoordinateTreeData>();
+    { // critical section
+        auto locked = edges_.rlock();
+        for (auto& node : nodes) {
+            auto it = locked->find(node->getEthAddress());
+            if (it == locked->end() || it->second.samples == 0) continue;
+            td->cloud.nodes.push_back(node);
+            td->cloud.coords.push_back(it->second);
+        }
+    }
+    td->tree = std::make_shared<coord_tree_t>(
+        3, td->cloud, nanoflann::KDTreeSingleIndexAdaptorParams(10));
+    td->tree->buildIndex();
+    return td;
+}
+
+void VivaldiSystem::setTreeData(std::shared_ptr<CoordinateTreeData> treeData) {
+    { // critical section
+        treeData_ = treeData;
+    }
+}
+
+std::vector<CoordinateNeighbor> VivaldiSystem::getNearestNeighbors(
+    const NetworkCoordinate& c, int n) {
+    std::vector<CoordinateNeighbor> neighbors;
+    std::shared_ptr<CoordinateTreeData> treeData = treeData_.copy();
+    if (!treeData || !treeData->tree || n <= 0) {
+        return neighbors;
+    }
+    // the tree only knows the euclidean part of each coordinate, so
+    // search a wider pool and re-rank it with the heights included
+    size_t k = std::min(treeData->cloud.coords.size(),
+        static_cast<size_t>(n) * 3);
+    if (k == 0) return neighbors;
+    std::vector<size_t> ret_indices(k);
+    std::vector<double> out_dist_sqr(k);
+    nanoflann::KNNResultSet<double> resultSet(k);
+    resultSet.init(&ret_indices[0], &out_dist_sqr[0]);
+    std::vector<double> query_pt{c.x, c.y, c.z};
+    auto started = std::chrono::steady_clock::now();
+    treeData->tree->findNeighbors(resultSet,
+        &query_pt[0], nanoflann::SearchParams(10));
+    Metrics::get().kdtree_query_ms.recordSince(started);
+    for (size_t i = 0; i < resultSet.size(); i++) {
+        size_t idx = ret_indices[i];
+        neighbors.push_back(CoordinateNeighbor{
+            treeData->cloud.nodes.at(idx),
+            c.distanceTo(treeData->cloud.coords.at(idx))});
+    }
+    std::sort(neighbors.begin(), neighbors.end(),
+        [](const CoordinateNeighbor& a, const CoordinateNeighbor& b) {
+            return a.rtt < b.rtt;
+        });
+    if (neighbors.size() > static_cast<size_t>(n)) {
+        neighbors.resize(n);
+    }
+    return neighbors;
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <folly/Optional.h>
+#include <folly/Synchronized.h>
+#include <folly/container/EvictingCacheMap.h>
+#include <folly/container/F14Map.h>
+
+#include "nanoflann.hpp"
+
+#include "EdgeNode.h"
+
+// A position in the latency space. Euclidean distance between the
+// (x, y, z) parts plus both heights estimates the RTT in milliseconds
+// between two hosts. The height models the access link a host sits
+// behind, which every path to it has to cross.
+struct NetworkCoordinate {
+    double x{0.0};
+    double y{0.0};
+    double z{0.0};
+    double height{0.0};
+    // Relative confidence in this coordinate (1.0 = no confidence)
+    double error{1.0};
+    // Number of RTT samples this coordinate was fitted to
+    uint32_t samples{0};
+
+    // Predicted RTT in milliseconds between this coordinate and another
+    double distanceTo(const NetworkCoordinate& other) const;
+};
+
+struct CoordinatePointCloud {
+    std::vector<std::shared_ptr<EdgeNode>> nodes;
+    // Coordinates of the nodes at the time the tree was built
+    std::vector<NetworkCoordinate> coords;
+
+    inline size_t kdtree_get_point_count() const { return coords.size(); }
+
+    inline double kdtree_get_pt(const size_t idx, const size_t dim) const {
+        if (dim == 0) return coords.at(idx).x;
+        else if (dim == 1) return coords.at(idx).y;
+        else return coords.at(idx).z;
+    }
+
+    template <class BBOX>
+    bool kdtree_get_bbox(BBOX& /* bb */) const { return false; }
+};
+
+typedef nanoflann::KDTreeSingleIndexAdaptor<
+    nanoflann::L2_Simple_Adaptor<double, CoordinatePointCloud>,
+    CoordinatePointCloud, 3> coord_tree_t;
+
+struct CoordinateTreeData {
+    CoordinatePointCloud cloud;
+    std::shared_ptr<coord_tree_t> tree;
+};
+
+// An edge node returned from a coordinate space search along with
+// its predicted RTT (ms) to the query coordinate
+struct CoordinateNeighbor {
+    std::shared_ptr<EdgeNode> node;
+    double rtt;
+};
+
+// Places edge nodes and client network prefixes in a latency space
+// with the Vivaldi algorithm. Coordinates are fitted centrally from
+// RTTs measured by the masternode (edge probes) and RTTs reported by
+// clients, and a KD-tree over the edge coordinates is used to find
+// the edges with the lowest predicted latency to a client prefix.
+class VivaldiSystem {
+    public:
+        // Error and movement tuning constants from the Vivaldi paper
+        static constexpr double CE = 0.25;
+        static constexpr double CC = 0.25;
+        // Heights never drop below this (ms)
+        static constexpr double MIN_HEIGHT = 0.1;
+        // Errors never drop below this, otherwise a coordinate that fit
+        // its first few samples perfectly would never move again
+        static constexpr double MIN_ERROR = 0.05;
+
+        explicit VivaldiSystem(size_t maxClientPrefixes = 100000);
+
+        // Adjusts "local" to better fit an RTT sample to "remote"
+        static void update(NetworkCoordinate& local,
+            const NetworkCoordinate& remote, double rttMs);
+
+        // Returns the network prefix (/24 for IPv4, /48 for IPv6)
+        // that a client address is grouped under
+        static std::string clientPrefix(const std::string& ip);
+
+        // Records an RTT between the masternode and an edge node
+        void observeEdge(const std::string& ethAddress, double rttMs);
+
+        // Records an RTT between a client prefix and an edge node. Past
+        // maxClientPrefixes, the prefix heard from least recently is
+        // forgotten to make room for a new one.
+        void observeClient(const std::string& prefix,
+            const std::string& ethAddress, double rttMs);
+
+        folly::Optional<NetworkCoordinate> getEdgeCoordinate(
+            const std::string& ethAddress) const;
+        folly::Optional<NetworkCoordinate> getClientCoordinate(
+            const std::string& prefix) const;
+        NetworkCoordinate getSelfCoordinate() const;
+
+        // Builds a KD-tree over the nodes that have a coordinate
+        std::shared_ptr<CoordinateTreeData> buildTreeData(
+            const std::vector<std::shared_ptr<EdgeNode>>& nodes) const;
+        void setTreeData(std::shared_ptr<CoordinateTreeData> treeData);
+
+        // Returns up to n edge nodes with the lowest predicted RTT to c
+        std::vector<CoordinateNeighbor> getNearestNeighbors(
+            const NetworkCoordinate& c, int n);
+    private:
+        // Coordinate of the masternode itself (probe source)
+        folly::Synchronized<NetworkCoordinate> self_;
+        folly::Synchronized<folly::F14FastMap<std::string /* eth address */,
+            NetworkCoordinate>> edges_;
+        // Client prefixes, least recently observed evicted first
+        mutable std::mutex clientsLock_;
+        folly::EvictingCacheMap<std::string /* prefix */,
+            NetworkCoordinate> clients_;
+        folly::Synchronized<std::shared_ptr<CoordinateTreeData>> treeData_;
+};
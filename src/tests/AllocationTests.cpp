@@ -0,0 +1,238 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <cstdint>
+
+#include "TestUtils.h"
+
+#include "Cache.h"
+#include "ProxyHandler.h"
+
+// Every copy of a body needs a buffer at least as large as the body, and
+// IOBuf data buffers come from malloc, so the tests count the mallocs
+// of at least that size. The client and the stand-in origin keep their
+// own copies of the body, their threads aren't counted.
+extern "C" {
+  void* __libc_malloc(size_t size);
+  void* __libc_calloc(size_t n, size_t size);
+  void* __libc_realloc(void* p, size_t size);
+}
+
+namespace {
+  std::atomic<size_t> countedSize{SIZE_MAX};
+  std::atomic<size_t> bodyAllocations{0};
+  thread_local bool uncounted = false;
+
+  void count(size_t size) {
+    if (!uncounted &&
+        size >= countedSize.load(std::memory_order_relaxed)) {
+      bodyAllocations++;
+    }
+  }
+
+  // Counts the allocations of at least "size" bytes from now on
+  void startCounting(size_t size) {
+    bodyAllocations = 0;
+    countedSize = size;
+  }
+
+  size_t stopCounting() {
+    countedSize = SIZE_MAX;
+    return bodyAllocations;
+  }
+
+  // Leaves the allocations of the current thread (the test's client)
+  // uncounted while it's in scope
+  struct Uncounted {
+    Uncounted() { uncounted = true; }
+    ~Uncounted() { uncounted = false; }
+  };
+
+  std::shared_ptr<proxygen::HTTPMessage> makeHeaders() {
+    auto headers = std::make_shared<proxygen::HTTPMessage>();
+    headers->setStatusCode(200);
+    headers->getHeaders().set(proxygen::HTTP_HEADER_CONTENT_TYPE,
+      "application/octet-stream");
+    return headers;
+  }
+}
+
+extern "C" void* malloc(size_t size) {
+  count(size);
+  return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t n, size_t size) {
+  count(n * size);
+  return __libc_calloc(n, size);
+}
+
+extern "C" void* realloc(void* p, size_t size) {
+  count(size);
+  return __libc_realloc(p, size);
+}
+
+TEST (Allocation, TestCachedBodyIsNotCopied) {
+  auto mc = std::make_shared<MasternodeConfig>();
+  ContentCache cache(mc);
+  const size_t size = 1024 * 1024;
+  auto body = folly::IOBuf::create(size);
+  memset(body->writableData(), 'x', size);
+  body->append(size);
+  const uint8_t* data = body->data();
+
+  startCounting(size);
+  EXPECT_TRUE(cache.addCachedRoute("/a", std::move(body), makeHeaders()));
+  EXPECT_EQ(0u, stopCounting());
+
+  // the route owns the buffer it was given
+  auto route = cache.getCachedRoute("/a");
+  ASSERT_TRUE(route != nullptr);
+  auto content = route->getContent();
+  EXPECT_EQ(data, content->data());
+  EXPECT_EQ(1u, content->countChainElements());
+
+  // serving it again only clones the IOBuf, the buffer is shared
+  startCounting(size);
+  auto again = route->getContent();
+  EXPECT_EQ(0u, stopCounting());
+  EXPECT_EQ(data, again->data());
+  EXPECT_TRUE(again->isShared());
+}
+
+TEST (Allocation, TestChainedBodyIsCoalescedOnce) {
+  auto mc = std::make_shared<MasternodeConfig>();
+  ContentCache cache(mc);
+  // a body that arrived in pieces, as without a Content-Length
+  auto body = folly::IOBuf::copyBuffer(std::string(256 * 1024, 'a'));
+  for (char c : {'b', 'c', 'd'}) {
+    body->prependChain(folly::IOBuf::copyBuffer(std::string(256 * 1024, c)));
+  }
+
+  startCounting(1024 * 1024);
+  EXPECT_TRUE(cache.addCachedRoute("/b", std::move(body), makeHeaders()));
+  EXPECT_EQ(1u, stopCounting());
+
+  auto content = cache.getCachedRoute("/b")->getContent();
+  EXPECT_FALSE(content->isChained());
+  EXPECT_EQ(1024u * 1024, content->length());
+  EXPECT_EQ('d', content->data()[content->length() - 1]);
+  // the coalesced buffer is the one every hit shares
+  EXPECT_EQ(content->data(), cache.getCachedRoute("/b")->getContent()->data());
+}
+
+TEST (Allocation, TestMissPathMovesBodyIntoCache) {
+  // Create and start an origin server with a large body, sent with its
+  // Content-Length
+  const std::string large(1024 * 1024, 'x');
+  auto origin = std::make_unique<httplib::Server>();
+  origin->Get("/large", [&](const httplib::Request& req, httplib::Response& res) {
+    uncounted = true;
+    res.set_content(large, "application/octet-stream");
+  });
+  auto origin_thread = std::make_unique<OriginThread>(*origin);
+  origin_thread->start();
+  ASSERT_TRUE(origin_thread->waitUntilListening());
+
+  std::vector<HTTPServer::IPConfig> IPs = {
+        {folly::SocketAddress("0.0.0.0", 8080, true),
+        HTTPServer::Protocol::HTTP}};
+
+  auto mc = std::make_shared<MasternodeConfig>();
+  mc->ip = "0.0.0.0";
+  mc->port = 8080;
+  mc->origin_host = "0.0.0.0";
+  mc->protected_domain = "0.0.0.0";
+  mc->origin_port = OriginThread::PORT;
+  mc->IPs = IPs;
+  mc->options.threads = 1;
+  mc->options.idleTimeout = std::chrono::milliseconds(10000);
+  mc->options.shutdownOn = {SIGINT, SIGTERM};
+  mc->options.enableContentCompression = false;
+  mc->enableServiceWorker = false;
+
+  auto master = std::make_unique<masternode::Masternode>(mc);
+  auto master_thread = std::make_unique<MasternodeThread>(master.get());
+  ASSERT_TRUE(master_thread->start());
+
+  Uncounted client_thread;
+  httplib::Client client("0.0.0.0", 8080);
+  auto cache = master->getCache();
+  startCounting(large.size());
+  auto res = client.Get("/large");
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(200, res->status);
+  EXPECT_EQ(large, res->body);
+  // the route may be added just after the response is sent
+  for (int i = 0; i < 100 && !cache->getCachedRoute("/large"); i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  // the body was copied into one buffer as it arrived, which the cache
+  // took over without coalescing or cloning it again
+  EXPECT_EQ(1u, stopCounting());
+  EXPECT_EQ(0u, ProxyHandler::getBufferedBytes());
+  auto route = cache->getCachedRoute("/large");
+  ASSERT_TRUE(route != nullptr);
+  auto content = route->getContent();
+  EXPECT_EQ(1u, content->countChainElements());
+  EXPECT_EQ(large.size(), content->length());
+  EXPECT_EQ(1u, cache->memoryBodies());
+
+  // hits send that same buffer without copying it
+  startCounting(large.size());
+  res = client.Get("/large");
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(large, res->body);
+  EXPECT_EQ(0u, stopCounting());
+  EXPECT_EQ(content->data(),
+    cache->getCachedRoute("/large")->getContent()->data());
+}
+
+TEST (Allocation, TestPreallocatedBodyIsCharged) {
+  // Create and start an origin server with a body larger than the
+  // buffered bytes limit
+  const std::string large(512 * 1024, 'x');
+  auto origin = std::make_unique<httplib::Server>();
+  origin->Get("/large", [&](const httplib::Request& req, httplib::Response& res) {
+    uncounted = true;
+    res.set_content(large, "application/octet-stream");
+  });
+  auto origin_thread = std::make_unique<OriginThread>(*origin);
+  origin_thread->start();
+  ASSERT_TRUE(origin_thread->waitUntilListening());
+
+  std::vector<HTTPServer::IPConfig> IPs = {
+        {folly::SocketAddress("0.0.0.0", 8080, true),
+        HTTPServer::Protocol::HTTP}};
+
+  auto mc = std::make_shared<MasternodeConfig>();
+  mc->ip = "0.0.0.0";
+  mc->port = 8080;
+  mc->origin_host = "0.0.0.0";
+  mc->protected_domain = "0.0.0.0";
+  mc->origin_port = OriginThread::PORT;
+  mc->IPs = IPs;
+  mc->max_buffered_bytes = 64 * 1024;
+  mc->options.threads = 1;
+  mc->options.idleTimeout = std::chrono::milliseconds(10000);
+  mc->options.shutdownOn = {SIGINT, SIGTERM};
+  mc->options.enableContentCompression = false;
+  mc->enableServiceWorker = false;
+
+  auto master = std::make_unique<masternode::Masternode>(mc);
+  auto master_thread = std::make_unique<MasternodeThread>(master.get());
+  ASSERT_TRUE(master_thread->start());
+
+  // the Content-Length doesn't fit under the limit, so no buffer is
+  // allocated for it and the response is streamed through instead
+  Uncounted client_thread;
+  httplib::Client client("0.0.0.0", 8080);
+  startCounting(large.size());
+  auto res = client.Get("/large");
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(200, res->status);
+  EXPECT_EQ(large, res->body);
+  EXPECT_EQ(0u, stopCounting());
+  EXPECT_EQ(nullptr, master->getCache()->getCachedRoute("/large"));
+  EXPECT_EQ(0u, ProxyHandler::getBufferedBytes());
+}
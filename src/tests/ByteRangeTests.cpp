@@ -0,0 +1,47 @@
+#include <gtest/gtest.h>
+
+#include "ByteRange.h"
+
+TEST (ByteRange, TestParseRange) {
+  ByteRange r;
+  EXPECT_EQ(RangeResult::SATISFIABLE, parseRange("bytes=0-99", 1000, r));
+  EXPECT_EQ(0u, r.offset);
+  EXPECT_EQ(100u, r.length);
+  // open ended and past the end ranges are cut at the end of the body
+  EXPECT_EQ(RangeResult::SATISFIABLE, parseRange("bytes=900-", 1000, r));
+  EXPECT_EQ(900u, r.offset);
+  EXPECT_EQ(100u, r.length);
+  EXPECT_EQ(RangeResult::SATISFIABLE, parseRange("bytes=950-5000", 1000, r));
+  EXPECT_EQ(50u, r.length);
+  // a last byte of SIZE_MAX doesn't overflow
+  EXPECT_EQ(RangeResult::SATISFIABLE,
+    parseRange("bytes=5-18446744073709551615", 1000, r));
+  EXPECT_EQ(5u, r.offset);
+  EXPECT_EQ(995u, r.length);
+  // suffix ranges
+  EXPECT_EQ(RangeResult::SATISFIABLE, parseRange("bytes=-10", 1000, r));
+  EXPECT_EQ(990u, r.offset);
+  EXPECT_EQ(10u, r.length);
+  EXPECT_EQ(RangeResult::SATISFIABLE, parseRange("bytes=-5000", 1000, r));
+  EXPECT_EQ(0u, r.offset);
+  EXPECT_EQ(1000u, r.length);
+
+  EXPECT_EQ(RangeResult::UNSATISFIABLE, parseRange("bytes=1000-", 1000, r));
+  EXPECT_EQ(RangeResult::UNSATISFIABLE, parseRange("bytes=-0", 1000, r));
+
+  // anything else gets the whole body
+  EXPECT_EQ(RangeResult::NONE, parseRange("", 1000, r));
+  EXPECT_EQ(RangeResult::NONE, parseRange("bytes=0-1,5-6", 1000, r));
+  EXPECT_EQ(RangeResult::NONE, parseRange("bytes=10-5", 1000, r));
+  EXPECT_EQ(RangeResult::NONE, parseRange("items=0-5", 1000, r));
+  EXPECT_EQ(RangeResult::NONE, parseRange("bytes=abc", 1000, r));
+}
+
+TEST (ByteRange, TestContentRange) {
+  EXPECT_EQ("bytes 0-99/1000", contentRange(ByteRange{0, 100}, 1000));
+  EXPECT_EQ("bytes */1000", unsatisfiedRange(1000));
+  EXPECT_EQ(1000u, *contentRangeSize("bytes 0-99/1000"));
+  EXPECT_FALSE(contentRangeSize("bytes 0-99/*").hasValue());
+  EXPECT_EQ(100u, *rangeStart("bytes=100-"));
+  EXPECT_FALSE(rangeStart("bytes=-100").hasValue());
+}
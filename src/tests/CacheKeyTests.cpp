@@ -0,0 +1,65 @@
+#include <gtest/gtest.h>
+
+#include "CacheKey.h"
+
+using proxygen::HTTPHeaders;
+
+namespace {
+  std::string keyOf(const CacheKeyBuilder& keys, const std::string& url) {
+    std::string key;
+    keys.build(url, key);
+    return key;
+  }
+}
+
+TEST (CacheKey, TestBuild) {
+  CacheKeyBuilder keys({"utm_*", "fbclid"}, {}, true);
+  EXPECT_EQ("/a", keyOf(keys, "/a"));
+  EXPECT_EQ("/a", keyOf(keys, "/a?utm_source=x&utm_medium=y#top"));
+  EXPECT_EQ("/a?a=1&b=2", keyOf(keys, "/a?b=2&fbclid=z&a=1"));
+  EXPECT_EQ(keyOf(keys, "/a?b=2&a=1"), keyOf(keys, "/a?a=1&b=2"));
+  // repeated parameters keep their order, empty ones are dropped
+  EXPECT_EQ("/a?a=2&a=1&b", keyOf(keys, "/a?b&&a=2&a=1"));
+  EXPECT_EQ("http://example.com/A?x=1",
+    keyOf(keys, "HTTP://Example.COM/A?x=1"));
+  // only the scheme and host of a URL are case insensitive
+  EXPECT_EQ("/Path://Host", keyOf(keys, "/Path://Host"));
+
+  // keys are appended, e.g. to a namespace
+  std::string key = "@shop@";
+  keys.build("/a?z=1&y=2", key);
+  EXPECT_EQ("@shop@/a?y=2&z=1", key);
+}
+
+TEST (CacheKey, TestAllowAndUnsorted) {
+  CacheKeyBuilder allow({}, {"id", "page"}, false);
+  EXPECT_EQ("/a?page=2&id=7", keyOf(allow, "/a?session=1&page=2&id=7"));
+  EXPECT_EQ("/a", keyOf(allow, "/a?session=1"));
+
+  std::string url = "/a?";
+  for (int i = 40; i > 0; i--) {
+    url += "p" + std::to_string(i) + "=" + std::to_string(i) + "&";
+  }
+  CacheKeyBuilder sorted({}, {}, true);
+  // more parameters than fit on the stack
+  auto key = keyOf(sorted, url);
+  EXPECT_EQ(0, key.find("/a?p1=1&p10=10&p11=11"));
+}
+
+TEST (CacheKey, TestVariant) {
+  std::string vary;
+  CacheKeyBuilder::appendVaryHeader("Accept-Language", vary);
+  CacheKeyBuilder::appendVaryHeader("X-Device", vary);
+  EXPECT_EQ("accept-language,x-device", vary);
+
+  HTTPHeaders headers;
+  headers.add("Accept-Language", " en-US ");
+  std::string key = "/a";
+  CacheKeyBuilder::appendVariant(vary, headers, key);
+  EXPECT_EQ("/a#vary=en-US\n", key);
+
+  headers.add("X-Device", "mobile");
+  key = "/a";
+  CacheKeyBuilder::appendVariant(vary, headers, key);
+  EXPECT_EQ("/a#vary=en-US\nmobile", key);
+}
@@ -0,0 +1,813 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <thread>
+
+#include <sys/stat.h>
+
+#include <folly/Conv.h>
+#include <folly/FileUtil.h>
+#include <folly/experimental/TestUtil.h>
+#include <folly/synchronization/Baton.h>
+
+#include "Cache.h"
+
+using namespace proxygen;
+
+namespace {
+  std::shared_ptr<HTTPMessage> makeHeaders(const std::string& contentType) {
+    auto headers = std::make_shared<HTTPMessage>();
+    headers->setStatusCode(200);
+    headers->getHeaders().set(HTTP_HEADER_CONTENT_TYPE, contentType);
+    headers->getHeaders().set(HTTP_HEADER_CACHE_CONTROL, "public, max-age=60");
+    return headers;
+  }
+
+  std::shared_ptr<MasternodeConfig> makeConfig(const std::string& dir) {
+    auto mc = std::make_shared<MasternodeConfig>();
+    mc->cache_directory = dir;
+    mc->enable_disk_tier = true;
+    return mc;
+  }
+
+  void waitForWrites(const ContentCache& cache) {
+    while (cache.pendingWrites() > 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+  std::string contentOf(std::shared_ptr<CachedRoute> route) {
+    return route->getContent()->moveToFbString().toStdString();
+  }
+}
+
+TEST (Cache, TestComputeExpires) {
+  HTTPMessage msg;
+  EXPECT_EQ(0, CachedRoute::computeExpires(msg, 1000));
+  msg.getHeaders().set(HTTP_HEADER_EXPIRES, "Thu, 01 Jan 1970 00:30:00 GMT");
+  EXPECT_EQ(1800, CachedRoute::computeExpires(msg, 1000));
+  msg.getHeaders().set(HTTP_HEADER_CACHE_CONTROL, "public, max-age=60");
+  EXPECT_EQ(1060, CachedRoute::computeExpires(msg, 1000));
+  msg.getHeaders().set(HTTP_HEADER_CACHE_CONTROL, "max-age=60, s-maxage=10");
+  EXPECT_EQ(1010, CachedRoute::computeExpires(msg, 1000));
+}
+
+TEST (Cache, TestHitResponse) {
+  std::string url = "/page";
+  auto headers = makeHeaders("text/html; charset=utf-8");
+  headers->getHeaders().set(HTTP_HEADER_CONTENT_RANGE, "bytes 0-12/20");
+  CachedRoute route(url, folly::IOBuf::copyBuffer("<html></html>"),
+    std::make_shared<const CachedHeaders>(*headers));
+  EXPECT_TRUE(route.isHTML());
+  HTTPMessage response;
+  route.writeResponse(response);
+  EXPECT_EQ(200, response.getStatusCode());
+  const auto& hs = response.getHeaders();
+  EXPECT_EQ("text/html; charset=utf-8",
+    hs.getSingleOrEmpty(HTTP_HEADER_CONTENT_TYPE));
+  EXPECT_EQ("public, max-age=60", hs.getSingleOrEmpty(HTTP_HEADER_CACHE_CONTROL));
+  EXPECT_EQ("13", hs.getSingleOrEmpty(HTTP_HEADER_CONTENT_LENGTH));
+  EXPECT_EQ("bytes", hs.getSingleOrEmpty(HTTP_HEADER_ACCEPT_RANGES));
+  // headers the origin didn't send aren't sent empty
+  EXPECT_FALSE(hs.exists(HTTP_HEADER_ETAG));
+  EXPECT_FALSE(hs.exists(HTTP_HEADER_EXPIRES));
+  EXPECT_FALSE(hs.exists(HTTP_HEADER_CONTENT_RANGE));
+
+  // a message reused from another response only gets the route's headers
+  HTTPMessage reused;
+  reused.getHeaders().set(HTTP_HEADER_SET_COOKIE, "session=1");
+  route.writeResponse(reused);
+  EXPECT_FALSE(reused.getHeaders().exists(HTTP_HEADER_SET_COOKIE));
+  EXPECT_EQ("13", reused.getHeaders().getSingleOrEmpty(
+    HTTP_HEADER_CONTENT_LENGTH));
+
+  // disk tier routes build the same response
+  auto onDisk = CachedRoute::onDisk(url, 13,
+    std::make_shared<const CachedHeaders>(*headers), route.getHash(), 0);
+  HTTPMessage built;
+  onDisk->writeResponse(built);
+  EXPECT_EQ(hs.size(), built.getHeaders().size());
+  EXPECT_EQ("text/html; charset=utf-8",
+    built.getHeaders().getSingleOrEmpty(HTTP_HEADER_CONTENT_TYPE));
+  // routes only hold their compact headers, not a response message
+  EXPECT_LT(route.getOverhead(), sizeof(CachedRoute) + sizeof(HTTPMessage) +
+    route.getHeaders().getOverhead());
+}
+
+TEST (Cache, TestCompactHeaders) {
+  HTTPMessage msg;
+  msg.setStatusCode(200);
+  msg.getHeaders().set(HTTP_HEADER_CONTENT_TYPE, "application/javascript");
+  msg.getHeaders().set(HTTP_HEADER_ETAG, "\"abc\"");
+  msg.getHeaders().add(HTTP_HEADER_VARY, "Accept");
+  msg.getHeaders().add(HTTP_HEADER_VARY, "Origin");
+  msg.getHeaders().set(HTTP_HEADER_SERVER, "origin");
+  msg.getHeaders().set("X-Request-Id", "1234");
+  CachedHeaders a(msg);
+  EXPECT_EQ(200, a.getStatus());
+  EXPECT_EQ("application/javascript", a.get(HTTP_HEADER_CONTENT_TYPE));
+  EXPECT_EQ("\"abc\"", a.get(HTTP_HEADER_ETAG));
+  EXPECT_EQ("Accept, Origin", a.get(HTTP_HEADER_VARY));
+  // only the headers needed to serve and revalidate are kept
+  EXPECT_TRUE(a.get(HTTP_HEADER_SERVER).empty());
+  size_t count = 0;
+  a.forEach([&](HTTPHeaderCode, folly::StringPiece, folly::StringPiece) {
+    count++;
+  });
+  EXPECT_EQ(3u, count);
+
+  // common values are interned, only the ETag is stored per route
+  CachedHeaders b(200,
+    {{"Content-Type", "application/javascript"}, {"ETag", "\"abc\""},
+     {"Vary", "Accept, Origin"}});
+  EXPECT_EQ(a.get(HTTP_HEADER_CONTENT_TYPE).data(),
+    b.get(HTTP_HEADER_CONTENT_TYPE).data());
+  EXPECT_EQ(a.get(HTTP_HEADER_VARY).data(), b.get(HTTP_HEADER_VARY).data());
+  EXPECT_NE(a.get(HTTP_HEADER_ETAG).data(), b.get(HTTP_HEADER_ETAG).data());
+  EXPECT_EQ(sizeof(CachedHeaders) + 5, b.getOverhead());
+}
+
+TEST (Cache, TestForwardedHeaders) {
+  auto origin = makeHeaders("text/html");
+  origin->getHeaders().set(HTTP_HEADER_SERVER, "origin");
+  // what the header policy sent the client with it
+  HTTPHeaders forwarded;
+  forwarded.set(HTTP_HEADER_CONTENT_TYPE, "text/html");
+  forwarded.set(HTTP_HEADER_CACHE_CONTROL, "public, max-age=60");
+  forwarded.set("Content-Security-Policy", "default-src 'self'");
+  forwarded.set("Strict-Transport-Security", "max-age=31536000");
+  forwarded.set("X-Frame-Options", "DENY");
+  auto headers = std::make_shared<const CachedHeaders>(*origin, forwarded);
+  EXPECT_EQ("text/html", headers->get(HTTP_HEADER_CONTENT_TYPE));
+
+  std::string url = "/page";
+  CachedRoute route(url, folly::IOBuf::copyBuffer("<html></html>"), headers);
+  HTTPMessage response;
+  route.writeResponse(response);
+  const auto& hs = response.getHeaders();
+  EXPECT_EQ("default-src 'self'",
+    hs.getSingleOrEmpty("Content-Security-Policy"));
+  EXPECT_EQ("max-age=31536000",
+    hs.getSingleOrEmpty("Strict-Transport-Security"));
+  EXPECT_EQ("DENY", hs.getSingleOrEmpty("X-Frame-Options"));
+  EXPECT_EQ("text/html", hs.getSingleOrEmpty(HTTP_HEADER_CONTENT_TYPE));
+  EXPECT_EQ(1u, hs.getNumberOfValues(HTTP_HEADER_CONTENT_TYPE));
+  // headers the policy didn't forward aren't sent
+  EXPECT_FALSE(hs.exists(HTTP_HEADER_SERVER));
+
+  // and they survive the index
+  auto entry = route.toIndexEntry();
+  CachedHeaders restored(entry.status, entry.headers);
+  size_t count = 0;
+  restored.forEach([&](HTTPHeaderCode, folly::StringPiece name,
+    folly::StringPiece value) {
+    if (name == "X-Frame-Options") {
+      EXPECT_EQ("DENY", value);
+    }
+    count++;
+  });
+  EXPECT_EQ(5u, count);
+}
+
+TEST (Cache, TestNegativeRoutes) {
+  auto mc = std::make_shared<MasternodeConfig>();
+  mc->negative_cache_max_routes = 2;
+  ContentCache cache(mc);
+  auto notFound = std::make_shared<HTTPMessage>();
+  notFound->setStatusCode(404);
+  EXPECT_TRUE(cache.addNegativeRoute("/a",
+    folly::IOBuf::copyBuffer(std::string(10, 'a')), notFound, 60));
+  auto a = cache.getCachedRoute("/a");
+  ASSERT_NE(nullptr, a);
+  EXPECT_TRUE(a->isNegative());
+  EXPECT_EQ(404, a->getStatus());
+  EXPECT_EQ(0u, cache.memoryRoutes());
+  // negative routes never end up in the asset hash map
+  EXPECT_EQ(0u, cache.getAssetHashMap()->size());
+
+  // they don't replace content, but content replaces them
+  EXPECT_TRUE(cache.addCachedRoute("/b", folly::IOBuf::copyBuffer("b"),
+    makeHeaders("text/plain")));
+  EXPECT_FALSE(cache.addNegativeRoute("/b",
+    folly::IOBuf::copyBuffer("b"), notFound, 60));
+  EXPECT_FALSE(cache.getCachedRoute("/b")->isNegative());
+  EXPECT_TRUE(cache.addCachedRoute("/a", folly::IOBuf::copyBuffer("a"),
+    makeHeaders("text/plain")));
+  EXPECT_FALSE(cache.getCachedRoute("/a")->isNegative());
+
+  // the oldest are dropped to stay within their budget
+  for (auto url : {"/c", "/d", "/e"}) {
+    EXPECT_TRUE(cache.addNegativeRoute(url,
+      folly::IOBuf::copyBuffer(std::string(10, 'x')), notFound, 60));
+  }
+  EXPECT_EQ(2u, cache.negativeRoutes());
+  EXPECT_EQ(nullptr, cache.getCachedRoute("/c"));
+  EXPECT_NE(nullptr, cache.getCachedRoute("/e"));
+  // their metadata is charged as well as their bodies
+  auto e = cache.getCachedRoute("/e");
+  EXPECT_EQ(2 * (10 + e->getOverhead() + 2), cache.negativeBytes());
+
+  // a budget the metadata alone doesn't fit in holds nothing
+  auto small = std::make_shared<MasternodeConfig>();
+  small->negative_cache_bytes = 20;
+  ContentCache smallCache(small);
+  EXPECT_FALSE(smallCache.addNegativeRoute("/a",
+    folly::IOBuf::copyBuffer(std::string(10, 'a')), notFound, 60));
+  EXPECT_EQ(0u, smallCache.negativeBytes());
+
+  // and stop being served once they expire
+  EXPECT_TRUE(cache.addNegativeRoute("/f",
+    folly::IOBuf::copyBuffer("f"), notFound, 1));
+  EXPECT_NE(nullptr, cache.getCachedRoute("/f"));
+  std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+  EXPECT_EQ(nullptr, cache.getCachedRoute("/f"));
+  EXPECT_TRUE(cache.addNegativeRoute("/f",
+    folly::IOBuf::copyBuffer("f"), notFound, 60));
+  EXPECT_NE(nullptr, cache.getCachedRoute("/f"));
+}
+
+TEST (Cache, TestStaleRoutes) {
+  std::string url = "/stale";
+  auto headers = std::make_shared<HTTPMessage>();
+  headers->getHeaders().set(HTTP_HEADER_CACHE_CONTROL, "max-age=0");
+  CachedRoute stale(url, folly::IOBuf::copyBuffer("old"),
+    std::make_shared<const CachedHeaders>(*headers));
+  EXPECT_TRUE(stale.isExpired());
+  EXPECT_TRUE(stale.canServeStale(60));
+  EXPECT_FALSE(stale.canServeStale(0));
+
+  // the origin's own window and revalidation rules win
+  headers->getHeaders().set(HTTP_HEADER_CACHE_CONTROL,
+    "max-age=0, stale-if-error=0");
+  CachedRoute noGrace(url, folly::IOBuf::copyBuffer("old"),
+    std::make_shared<const CachedHeaders>(*headers));
+  EXPECT_FALSE(noGrace.canServeStale(60));
+  headers->getHeaders().set(HTTP_HEADER_CACHE_CONTROL,
+    "max-age=0, must-revalidate");
+  CachedRoute revalidate(url, folly::IOBuf::copyBuffer("old"),
+    std::make_shared<const CachedHeaders>(*headers));
+  EXPECT_FALSE(revalidate.canServeStale(60));
+
+  // routes without an expiry never go stale
+  CachedRoute forever(url, folly::IOBuf::copyBuffer("old"), nullptr);
+  EXPECT_FALSE(forever.isExpired());
+
+  // a fresh response replaces an expired one in the memory tier
+  auto mc = std::make_shared<MasternodeConfig>();
+  ContentCache cache(mc);
+  auto expired = std::make_shared<HTTPMessage>();
+  expired->getHeaders().set(HTTP_HEADER_CACHE_CONTROL, "max-age=0");
+  EXPECT_TRUE(cache.addCachedRoute(url, folly::IOBuf::copyBuffer("old"),
+    expired));
+  EXPECT_TRUE(cache.addCachedRoute(url, folly::IOBuf::copyBuffer("newer"),
+    makeHeaders("text/plain")));
+  EXPECT_EQ("newer", contentOf(cache.getCachedRoute(url)));
+  EXPECT_EQ(1u, cache.memoryRoutes());
+  EXPECT_EQ(5u, cache.memoryBytes());
+  EXPECT_EQ(1u, cache.memoryBodies());
+  // but not a fresh one
+  EXPECT_FALSE(cache.addCachedRoute(url, folly::IOBuf::copyBuffer("newest"),
+    makeHeaders("text/plain")));
+}
+
+TEST (Cache, TestWarmRestart) {
+  folly::test::TemporaryDirectory tmp;
+  std::string dir = tmp.path().string() + "/";
+
+  { // first run caches two routes
+    ContentCache cache(makeConfig(dir));
+    cache.loadFromDisk();
+    cache.waitForLoad();
+    EXPECT_TRUE(cache.addCachedRoute("/a",
+      folly::IOBuf::copyBuffer("first"), makeHeaders("text/plain")));
+    EXPECT_TRUE(cache.addCachedRoute("/b",
+      folly::IOBuf::copyBuffer("<html></html>"), makeHeaders("text/html")));
+  }
+
+  // the journal is appended to, not rewritten
+  std::string journal;
+  ASSERT_TRUE(folly::readFile((dir + ContentCache::JOURNAL_NAME).c_str(),
+    journal));
+  EXPECT_EQ(2, std::count(journal.begin(), journal.end(), '\n'));
+  // a torn record from a crash mid-append is ignored
+  folly::writeFile(journal + "{\"op\": \"add\", \"url\"",
+    (dir + ContentCache::JOURNAL_NAME).c_str());
+
+  { // second run restores both from disk
+    ContentCache cache(makeConfig(dir));
+    cache.loadFromDisk();
+    cache.waitForLoad();
+    ASSERT_EQ(2u, cache.size());
+    auto a = cache.getCachedRoute("/a");
+    ASSERT_NE(nullptr, a);
+    EXPECT_EQ("first", a->getContent()->moveToFbString().toStdString());
+    EXPECT_EQ("text/plain", a->getHeaders().get(HTTP_HEADER_CONTENT_TYPE));
+    EXPECT_EQ(200, a->getHeaders().getStatus());
+    EXPECT_EQ(a->getCreated() + 60, a->getExpires());
+    auto b = cache.getCachedRoute("/b");
+    ASSERT_NE(nullptr, b);
+    EXPECT_EQ("<html></html>", b->getContent()->moveToFbString().toStdString());
+  }
+
+  // compaction dropped the torn record
+  ASSERT_TRUE(folly::readFile((dir + ContentCache::JOURNAL_NAME).c_str(),
+    journal));
+  EXPECT_EQ(2, std::count(journal.begin(), journal.end(), '\n'));
+  EXPECT_EQ(std::string::npos, journal.find("\"url\"\n"));
+}
+
+TEST (Cache, TestInterruptedLoadKeepsJournal) {
+  folly::test::TemporaryDirectory tmp;
+  std::string dir = tmp.path().string() + "/";
+  const int routes = 200;
+  {
+    ContentCache cache(makeConfig(dir));
+    for (int i = 0; i < routes; i++) {
+      auto url = folly::to<std::string>("/", i);
+      EXPECT_TRUE(cache.addCachedRoute(url, folly::IOBuf::copyBuffer(url),
+        makeHeaders("text/plain")));
+    }
+    waitForWrites(cache);
+  }
+
+  { // shutting down as soon as the load starts
+    ContentCache cache(makeConfig(dir));
+    cache.loadFromDisk();
+  }
+
+  // every route is still indexed
+  std::string journal;
+  ASSERT_TRUE(folly::readFile((dir + ContentCache::JOURNAL_NAME).c_str(),
+    journal));
+  EXPECT_EQ(routes, std::count(journal.begin(), journal.end(), '\n'));
+
+  // and none of their bodies were taken for orphans
+  ContentCache cache(makeConfig(dir));
+  cache.loadFromDisk();
+  cache.waitForLoad();
+  EXPECT_EQ(static_cast<size_t>(routes), cache.size());
+}
+
+TEST (Cache, TestMissingBodyNotRestored) {
+  folly::test::TemporaryDirectory tmp;
+  std::string dir = tmp.path().string() + "/";
+  std::string path;
+  {
+    ContentCache cache(makeConfig(dir));
+    cache.addCachedRoute("/gone",
+      folly::IOBuf::copyBuffer("gone"), makeHeaders("text/plain"));
+    path = cache.getContentPath(*cache.getCachedRoute("/gone"));
+  }
+  ASSERT_EQ(0, unlink(path.c_str()));
+
+  ContentCache cache(makeConfig(dir));
+  cache.loadFromDisk();
+  cache.waitForLoad();
+  EXPECT_EQ(0u, cache.size());
+}
+
+TEST (Cache, TestDemotionAndPromotion) {
+  folly::test::TemporaryDirectory tmp;
+  std::string dir = tmp.path().string() + "/";
+  auto mc = makeConfig(dir);
+  mc->cache_memory_bytes = 25;
+  mc->disk_promote_hits = 2;
+  ContentCache cache(mc);
+
+  cache.addCachedRoute("/a", folly::IOBuf::copyBuffer(std::string(10, 'a')),
+    makeHeaders("text/plain"));
+  cache.addCachedRoute("/b", folly::IOBuf::copyBuffer(std::string(10, 'b')),
+    makeHeaders("text/plain"));
+  // only routes whose body made it to disk can be demoted
+  waitForWrites(cache);
+  // /a was used since the last sweep, so /b is the one to go
+  EXPECT_EQ(std::string(10, 'a'), contentOf(cache.getCachedRoute("/a")));
+  cache.addCachedRoute("/c", folly::IOBuf::copyBuffer(std::string(10, 'c')),
+    makeHeaders("text/plain"));
+
+  EXPECT_EQ(3u, cache.size());
+  EXPECT_EQ(2u, cache.memoryRoutes());
+  EXPECT_EQ(20u, cache.memoryBytes());
+  EXPECT_FALSE(cache.getCachedRoute("/a")->isOnDisk());
+  auto b = cache.getCachedRoute("/b");
+  ASSERT_TRUE(b->isOnDisk());
+  EXPECT_EQ(nullptr, b->getContent());
+  EXPECT_EQ(10u, b->getSize());
+  EXPECT_FALSE(cache.shouldPromote(*b));
+
+  std::string body;
+  ASSERT_TRUE(folly::readFile(cache.getContentPath(*b).c_str(), body));
+  EXPECT_EQ(std::string(10, 'b'), body);
+
+  // a second hit makes it hot
+  b = cache.getCachedRoute("/b");
+  ASSERT_TRUE(cache.shouldPromote(*b));
+  EXPECT_TRUE(cache.promote(b, folly::IOBuf::copyBuffer(body)));
+  EXPECT_EQ(std::string(10, 'b'), contentOf(cache.getCachedRoute("/b")));
+  EXPECT_EQ(2u, cache.memoryRoutes());
+  EXPECT_EQ(3u, cache.size());
+  // promoting a route that was already replaced does nothing
+  EXPECT_FALSE(cache.promote(b, folly::IOBuf::copyBuffer(body)));
+}
+
+TEST (Cache, TestEvictionWithoutDiskTier) {
+  auto mc = std::make_shared<MasternodeConfig>();
+  mc->maxRoutesToCache = 2;
+  ContentCache cache(mc);
+  for (auto url : {"/a", "/b", "/c"}) {
+    cache.addCachedRoute(url, folly::IOBuf::copyBuffer(url),
+      makeHeaders("text/plain"));
+  }
+  EXPECT_EQ(2u, cache.size());
+  EXPECT_EQ(nullptr, cache.getCachedRoute("/a"));
+}
+
+TEST (Cache, TestPathOf) {
+  EXPECT_EQ("/a", ContentCache::pathOf("/a").str());
+  EXPECT_EQ("/a", ContentCache::pathOf("/a?v=1").str());
+  // slices and variants are matched as the route they belong to
+  EXPECT_EQ("/v/a.mp4", ContentCache::pathOf("/v/a.mp4#slice=3").str());
+  EXPECT_EQ("/v/a.mp4",
+    ContentCache::pathOf("/v/a.mp4?q=1#slice=3").str());
+  EXPECT_EQ("/a.css", ContentCache::pathOf("/a.css#vary=br").str());
+  // tenants' keys lose their namespace
+  EXPECT_EQ("/private/x", ContentCache::pathOf("@shop@/private/x").str());
+  EXPECT_EQ("/v/a.mp4",
+    ContentCache::pathOf("@shop@/v/a.mp4#slice=0").str());
+  EXPECT_EQ("/y", ContentCache::pathOf("@shop@http://shop.example/y").str());
+  EXPECT_EQ("/", ContentCache::pathOf("http://shop.example?x=1").str());
+}
+
+TEST (Cache, TestNamespaces) {
+  EXPECT_EQ("/a", ContentCache::namespacedKey("", "/a"));
+  EXPECT_EQ("@shop@/a", ContentCache::namespacedKey("shop", "/a"));
+  EXPECT_EQ("shop", ContentCache::namespaceOf("@shop@/a#slice=2").str());
+  EXPECT_EQ("", ContentCache::namespaceOf("/a").str());
+  // absolute-form request targets stay in their namespace
+  auto absolute = ContentCache::namespacedKey("shop", "http://shop.example/a");
+  EXPECT_EQ("@shop@http://shop.example/a", absolute);
+  EXPECT_EQ("shop", ContentCache::namespaceOf(absolute).str());
+
+  auto mc = std::make_shared<MasternodeConfig>();
+  mc->cache_memory_bytes = 100;
+  TenantConfig shop;
+  shop.name = "shop";
+  shop.cache_share = 0.3;
+  mc->tenants.push_back(shop);
+  ContentCache cache(mc);
+  for (auto& url : {"/a", "/b"}) {
+    EXPECT_TRUE(cache.addCachedRoute(url,
+      folly::IOBuf::copyBuffer(std::string(40, url[1])),
+      makeHeaders("text/plain")));
+  }
+  EXPECT_TRUE(cache.addCachedRoute("@shop@/x",
+    folly::IOBuf::copyBuffer(std::string(20, 'x')), makeHeaders("text/plain")));
+  EXPECT_EQ(20u, cache.namespaceBytes("shop"));
+
+  // going over its share only evicts the tenant's own routes
+  EXPECT_TRUE(cache.addCachedRoute("@shop@http://shop.example/y",
+    folly::IOBuf::copyBuffer(std::string(20, 'y')), makeHeaders("text/plain")));
+  EXPECT_EQ(20u, cache.namespaceBytes("shop"));
+  EXPECT_EQ(nullptr, cache.getCachedRoute("@shop@/x"));
+  EXPECT_NE(nullptr, cache.getCachedRoute("@shop@http://shop.example/y"));
+  EXPECT_NE(nullptr, cache.getCachedRoute("/a"));
+  EXPECT_NE(nullptr, cache.getCachedRoute("/b"));
+  EXPECT_EQ(100u, cache.memoryBytes());
+}
+
+TEST (Cache, TestMemoryDedup) {
+  auto mc = std::make_shared<MasternodeConfig>();
+  mc->maxRoutesToCache = 3;
+  ContentCache cache(mc);
+  std::string body(1000, 'x');
+  for (auto url : {"/app.js?v=1", "/app.js?v=2", "/app.js?v=3"}) {
+    EXPECT_TRUE(cache.addCachedRoute(url, folly::IOBuf::copyBuffer(body),
+      makeHeaders("application/javascript")));
+  }
+  // three routes, one buffer
+  EXPECT_EQ(3u, cache.memoryRoutes());
+  EXPECT_EQ(1u, cache.memoryBodies());
+  EXPECT_EQ(1000u, cache.memoryBytes());
+  EXPECT_EQ(cache.getCachedRoute("/app.js?v=1")->getContent()->data(),
+    cache.getCachedRoute("/app.js?v=3")->getContent()->data());
+  EXPECT_EQ(body, contentOf(cache.getCachedRoute("/app.js?v=2")));
+
+  // the body is only freed once the last route using it is evicted
+  for (auto url : {"/a", "/b"}) {
+    cache.addCachedRoute(url, folly::IOBuf::copyBuffer(url),
+      makeHeaders("text/plain"));
+  }
+  EXPECT_EQ(3u, cache.memoryRoutes());
+  EXPECT_EQ(1000u + 4, cache.memoryBytes());
+  cache.addCachedRoute("/c", folly::IOBuf::copyBuffer("/c"),
+    makeHeaders("text/plain"));
+  EXPECT_EQ(3u, cache.memoryBodies());
+  EXPECT_EQ(6u, cache.memoryBytes());
+}
+
+TEST (Cache, TestFrequencySketch) {
+  FrequencySketch sketch(100);
+  EXPECT_EQ(0u, sketch.estimate("/a"));
+  // the first access only goes into the doorkeeper
+  sketch.record("/a");
+  EXPECT_EQ(1u, sketch.estimate("/a"));
+  for (int i = 0; i < 5; i++) sketch.record("/a");
+  EXPECT_EQ(6u, sketch.estimate("/a"));
+  for (int i = 0; i < 100; i++) sketch.record("/a");
+  EXPECT_EQ(FrequencySketch::MAX_COUNT + 1, sketch.estimate("/a"));
+
+  // counts are halved as more accesses come in
+  for (int i = 0; i < 1000; i++) {
+    sketch.record("/other" + std::to_string(i));
+  }
+  EXPECT_GT(sketch.getResets(), 0u);
+  EXPECT_LT(sketch.estimate("/a"), FrequencySketch::MAX_COUNT);
+}
+
+TEST (Cache, TestAdmission) {
+  auto mc = std::make_shared<MasternodeConfig>();
+  mc->maxRoutesToCache = 2;
+  mc->cache_admission = true;
+  ContentCache cache(mc);
+  auto request = [&](const std::string& url, int times) {
+    for (int i = 0; i < times; i++) cache.getCachedRoute(url);
+  };
+
+  // routes are let in freely while there's room
+  request("/hot", 5);
+  EXPECT_TRUE(cache.addCachedRoute("/hot", folly::IOBuf::copyBuffer("hot"),
+    makeHeaders("text/plain")));
+  request("/warm", 3);
+  EXPECT_TRUE(cache.addCachedRoute("/warm", folly::IOBuf::copyBuffer("warm"),
+    makeHeaders("text/plain")));
+
+  // a one-off request doesn't push out a popular route
+  request("/once", 1);
+  EXPECT_FALSE(cache.addCachedRoute("/once", folly::IOBuf::copyBuffer("once"),
+    makeHeaders("text/plain")));
+  EXPECT_EQ(nullptr, cache.getCachedRoute("/once"));
+  EXPECT_EQ(1u, cache.rejected());
+
+  // a route requested more often than the victim does
+  request("/rising", 10);
+  EXPECT_TRUE(cache.addCachedRoute("/rising",
+    folly::IOBuf::copyBuffer("rising"), makeHeaders("text/plain")));
+  EXPECT_EQ(2u, cache.size());
+  EXPECT_EQ(3u, cache.admitted());
+}
+
+TEST (Cache, TestDiskIOEngines) {
+  folly::test::TemporaryDirectory tmp;
+  for (auto name : {"threads", "auto"}) {
+    auto io = DiskIOEngine::create(name, 2, 16);
+    std::string path = tmp.path().string() + "/" + name;
+
+    // a chained body is written in one go
+    auto body = folly::IOBuf::copyBuffer("hello ");
+    body->prependChain(folly::IOBuf::copyBuffer("world"));
+    folly::Baton<> written;
+    ssize_t result = 0;
+    io->writeFile(path, std::move(body), true, nullptr,
+      [&](ssize_t n, std::unique_ptr<folly::IOBuf>) {
+        result = n;
+        written.post();
+      });
+    written.wait();
+    EXPECT_EQ(11, result);
+
+    folly::File f(path, O_RDONLY);
+    folly::Baton<> read;
+    std::string data;
+    io->read(f.fd(), 6, 100, nullptr,
+      [&](ssize_t n, std::unique_ptr<folly::IOBuf> buf) {
+        result = n;
+        if (buf) data = buf->moveToFbString().toStdString();
+        read.post();
+      });
+    read.wait();
+    EXPECT_EQ(5, result);
+    EXPECT_EQ("world", data);
+
+    // errors are reported, not thrown
+    folly::Baton<> failed;
+    io->writeFile(tmp.path().string() + "/missing/file",
+      folly::IOBuf::copyBuffer("x"), false, nullptr,
+      [&](ssize_t n, std::unique_ptr<folly::IOBuf>) {
+        result = n;
+        failed.post();
+      });
+    failed.wait();
+    EXPECT_EQ(-ENOENT, result);
+
+    auto stats = io->getStats();
+    EXPECT_EQ(3u, stats.submitted);
+    EXPECT_EQ(3u, stats.completed);
+    EXPECT_EQ(1u, stats.failed);
+    EXPECT_EQ(0u, stats.queue_depth);
+  }
+}
+
+TEST (Cache, TestDiskStoreLayoutAndRefcounts) {
+  folly::test::TemporaryDirectory tmp;
+  std::string dir = tmp.path().string() + "/";
+  const std::string hash(64, 'a');
+  DiskStore store(dir, 2);
+  EXPECT_EQ(dir + "aa/aa/" + hash, store.pathFor(hash));
+  EXPECT_EQ(dir + hash, DiskStore(dir, 0).pathFor(hash));
+
+  // only the first reference writes the body
+  EXPECT_TRUE(store.acquire(hash, 4));
+  EXPECT_FALSE(store.acquire(hash, 4));
+  EXPECT_EQ(2u, store.getRefs(hash));
+  EXPECT_EQ(4u, store.getUsedBytes());
+  bool written = false;
+  store.whenWritten(hash, [&](bool ok) { written = ok; });
+  EXPECT_FALSE(written);
+  store.prepare(hash);
+  ASSERT_TRUE(folly::writeFile(std::string("body"), store.pathFor(hash).c_str()));
+  store.markWritten(hash, true);
+  EXPECT_TRUE(written);
+
+  // the body stays until the last reference is gone
+  store.release(hash);
+  EXPECT_EQ(0u, store.collect());
+  store.release(hash);
+  EXPECT_EQ(1u, store.collect());
+  EXPECT_EQ(0u, store.getUsedBytes());
+  EXPECT_NE(0, access(store.pathFor(hash).c_str(), F_OK));
+}
+
+TEST (Cache, TestDiskStoreAdoptAndOrphans) {
+  folly::test::TemporaryDirectory tmp;
+  std::string dir = tmp.path().string() + "/";
+  const std::string kept(64, 'b');
+  const std::string orphan(64, 'c');
+  DiskStore store(dir, 2);
+
+  // bodies from the flat layout are moved into their subdirectory
+  ASSERT_TRUE(folly::writeFile(std::string("kept"), (dir + kept).c_str()));
+  auto size = store.adopt(kept);
+  ASSERT_TRUE(size.hasValue());
+  EXPECT_EQ(4u, *size);
+  EXPECT_EQ(0, access(store.pathFor(kept).c_str(), F_OK));
+  EXPECT_FALSE(store.adopt(orphan).hasValue());
+
+  store.prepare(orphan);
+  ASSERT_TRUE(folly::writeFile(std::string("orphan"),
+    store.pathFor(orphan).c_str()));
+  ASSERT_TRUE(folly::writeFile(std::string("x"), (dir + "not-a-body").c_str()));
+  EXPECT_EQ(1u, store.removeOrphans());
+  EXPECT_EQ(0, access(store.pathFor(kept).c_str(), F_OK));
+  EXPECT_NE(0, access(store.pathFor(orphan).c_str(), F_OK));
+  EXPECT_EQ(0, access((dir + "not-a-body").c_str(), F_OK));
+}
+
+TEST (Cache, TestDedupAndDiskQuota) {
+  folly::test::TemporaryDirectory tmp;
+  std::string dir = tmp.path().string() + "/";
+  auto mc = makeConfig(dir);
+  mc->maxRoutesToCache = 1;
+  mc->cache_disk_quota_bytes = 150;
+  mc->cache_gc_interval = 0;
+  ContentCache cache(mc);
+
+  // identical bodies are stored once
+  const std::string body(100, 'x');
+  cache.addCachedRoute("/a?v=1", folly::IOBuf::copyBuffer(body),
+    makeHeaders("text/plain"));
+  waitForWrites(cache);
+  cache.addCachedRoute("/a?v=2", folly::IOBuf::copyBuffer(body),
+    makeHeaders("text/plain"));
+  waitForWrites(cache);
+  EXPECT_EQ(100u, cache.diskBytes());
+  EXPECT_TRUE(cache.getCachedRoute("/a?v=1")->isOnDisk());
+
+  cache.addCachedRoute("/b", folly::IOBuf::copyBuffer(std::string(100, 'y')),
+    makeHeaders("text/plain"));
+  waitForWrites(cache);
+  EXPECT_EQ(200u, cache.diskBytes());
+
+  // over quota, the oldest disk routes go until a body is freed
+  cache.collectGarbage();
+  EXPECT_EQ(100u, cache.diskBytes());
+  EXPECT_EQ(nullptr, cache.getCachedRoute("/a?v=1"));
+  EXPECT_EQ(nullptr, cache.getCachedRoute("/a?v=2"));
+  EXPECT_NE(nullptr, cache.getCachedRoute("/b"));
+}
+
+TEST (Cache, TestSnapshotRoundTrip) {
+  folly::test::TemporaryDirectory tmp;
+  std::string dir = tmp.path().string() + "/";
+  std::string snapshot = dir + "cache.snapshot";
+  {
+    auto mc = makeConfig(dir + "first/");
+    mkdir(mc->cache_directory.c_str(), 0777);
+    mc->maxRoutesToCache = 1;
+    ContentCache cache(mc);
+    cache.addCachedRoute("/old", folly::IOBuf::copyBuffer("old body"),
+      makeHeaders("text/plain"));
+    waitForWrites(cache);
+    cache.addCachedRoute("/new", folly::IOBuf::copyBuffer("<html></html>"),
+      makeHeaders("text/html"));
+    waitForWrites(cache);
+    // one route from each tier
+    ASSERT_TRUE(cache.getCachedRoute("/old")->isOnDisk());
+    EXPECT_EQ(2u, cache.writeSnapshot(snapshot));
+  }
+
+  // a node without a cache directory serves straight from the snapshot
+  auto mc = std::make_shared<MasternodeConfig>();
+  mc->cache_snapshot_path = snapshot;
+  ContentCache cache(mc);
+  cache.loadFromDisk();
+  EXPECT_EQ(2u, cache.size());
+  EXPECT_EQ("old body", contentOf(cache.getCachedRoute("/old")));
+  auto route = cache.getCachedRoute("/new");
+  ASSERT_NE(nullptr, route);
+  EXPECT_EQ("<html></html>", contentOf(route));
+  EXPECT_EQ("text/html", route->getHeaders().get(HTTP_HEADER_CONTENT_TYPE));
+
+  // bodies outlive the snapshot being replaced on disk
+  auto content = route->getContent();
+  cache.writeSnapshot(snapshot);
+  EXPECT_EQ("<html></html>", content->moveToFbString().toStdString());
+}
+
+TEST (Cache, TestVary) {
+  folly::test::TemporaryDirectory tmp;
+  std::string dir = tmp.path().string() + "/";
+  std::string snapshot = dir + "cache.snapshot";
+  {
+    auto mc = makeConfig(dir + "first/");
+    mkdir(mc->cache_directory.c_str(), 0777);
+    mc->maxRoutesToCache = 2;
+    ContentCache cache(mc);
+    EXPECT_EQ("", cache.getVary("/v"));
+    EXPECT_TRUE(cache.setVary("/v", "accept-language"));
+    EXPECT_TRUE(cache.setVary("/w", "cookie"));
+    EXPECT_EQ("accept-language", cache.getVary("/v"));
+    cache.clearVary("/w");
+    EXPECT_EQ("", cache.getVary("/w"));
+
+    auto headers = makeHeaders("text/plain");
+    headers->getHeaders().set(HTTP_HEADER_VARY,
+      "Accept-Encoding, Accept-Language");
+    cache.addCachedRoute("/v#vary=en", folly::IOBuf::copyBuffer("hello"),
+      headers);
+    waitForWrites(cache);
+    EXPECT_EQ(1u, cache.writeSnapshot(snapshot));
+  }
+
+  // restored variants can be looked up again
+  auto mc = std::make_shared<MasternodeConfig>();
+  mc->cache_snapshot_path = snapshot;
+  ContentCache cache(mc);
+  cache.loadFromDisk();
+  EXPECT_EQ("accept-language", cache.getVary("/v"));
+  EXPECT_EQ("hello", contentOf(cache.getCachedRoute("/v#vary=en")));
+}
+
+TEST (Cache, TestVaryFollowsVariants) {
+  auto mc = std::make_shared<MasternodeConfig>();
+  mc->maxRoutesToCache = 2;
+  ContentCache cache(mc);
+  size_t empty = cache.metadataBytes();
+  EXPECT_TRUE(cache.setVary("/v", "accept-language"));
+  EXPECT_TRUE(cache.setVary("/w", "cookie"));
+  EXPECT_GT(cache.metadataBytes(), empty);
+  for (auto url : {"/v#vary=en", "/w#vary=a"}) {
+    EXPECT_TRUE(cache.addCachedRoute(url, folly::IOBuf::copyBuffer(url),
+      makeHeaders("text/plain")));
+  }
+  // no more room while both routes have variants cached
+  EXPECT_FALSE(cache.setVary("/x", "cookie"));
+
+  // evicting the variants frees their routes' entries
+  for (auto url : {"/a", "/b"}) {
+    EXPECT_TRUE(cache.addCachedRoute(url, folly::IOBuf::copyBuffer(url),
+      makeHeaders("text/plain")));
+  }
+  EXPECT_EQ(nullptr, cache.getCachedRoute("/v#vary=en"));
+  EXPECT_EQ(nullptr, cache.getCachedRoute("/w#vary=a"));
+  EXPECT_EQ("", cache.getVary("/v"));
+  EXPECT_EQ("", cache.getVary("/w"));
+  EXPECT_TRUE(cache.setVary("/x", "cookie"));
+
+  // so do the entries of routes whose variants were never cached
+  EXPECT_TRUE(cache.setVary("/y", "cookie"));
+  EXPECT_TRUE(cache.setVary("/z", "cookie"));
+  EXPECT_EQ("", cache.getVary("/x"));
+  EXPECT_EQ("cookie", cache.getVary("/z"));
+}
+
+TEST (Cache, TestInvalidSnapshot) {
+  folly::test::TemporaryDirectory tmp;
+  std::string path = tmp.path().string() + "/bad.snapshot";
+  ASSERT_TRUE(folly::writeFile(std::string(64, 'x'), path.c_str()));
+  EXPECT_THROW(CacheSnapshot::open(path), std::runtime_error);
+
+  auto mc = std::make_shared<MasternodeConfig>();
+  ContentCache cache(mc);
+  EXPECT_EQ(0u, cache.loadSnapshot(path));
+  EXPECT_EQ(0u, cache.loadSnapshot(path + ".missing"));
+}
@@ -20,3 +20,11 @@ TEST (EdgeNode, TestGetFQDN) {
     EXPECT_EQ(node->getFQDN("examplepool.com", "foocdn"), 
         "https://0xdeadbeef.foocdn.examplepool.com:1234");
 }
+
+TEST (EdgeNode, TestGetHostname) {
+    auto node = std::make_shared<EdgeNode>(
+        "127.0.0.1", 1234, "0xdeadbeef", 12345678
+    );
+    EXPECT_EQ(node->getHostname("examplepool.com", "foocdn"), 
+        "0xdeadbeef.foocdn.examplepool.com");
+}
@@ -0,0 +1,84 @@
+#include <gtest/gtest.h>
+
+#include "HeaderPolicy.h"
+
+using namespace proxygen;
+
+namespace {
+  HeaderPolicy makePolicy() {
+    MasternodeConfig config;
+    config.origin_host = "origin.local";
+    config.origin_port = 80;
+    return HeaderPolicy(config);
+  }
+}
+
+TEST (HeaderPolicy, TestApply) {
+  auto policy = makePolicy();
+  HTTPHeaders in;
+  in.add(HTTP_HEADER_CONTENT_TYPE, "text/css");
+  in.add(HTTP_HEADER_CONTENT_LENGTH, "10");
+  in.add(HTTP_HEADER_CONNECTION, "keep-alive");
+  in.add(HTTP_HEADER_TRANSFER_ENCODING, "chunked");
+  in.add(HTTP_HEADER_ETAG, "\"v1\"");
+  in.add("X-Custom", "kept");
+
+  HTTPHeaders out;
+  auto summary = policy.apply(in, out, false);
+  EXPECT_TRUE(summary.shareable);
+  EXPECT_FALSE(summary.varies);
+  EXPECT_EQ("text/css", out.getSingleOrEmpty(HTTP_HEADER_CONTENT_TYPE));
+  EXPECT_EQ("10", out.getSingleOrEmpty(HTTP_HEADER_CONTENT_LENGTH));
+  EXPECT_EQ("\"v1\"", out.getSingleOrEmpty(HTTP_HEADER_ETAG));
+  EXPECT_EQ("kept", out.getSingleOrEmpty("X-Custom"));
+  // hop-by-hop headers never go through
+  EXPECT_FALSE(out.exists(HTTP_HEADER_CONNECTION));
+  EXPECT_FALSE(out.exists(HTTP_HEADER_TRANSFER_ENCODING));
+
+  // headers describing the body are left out when it changes
+  HTTPHeaders changed;
+  policy.apply(in, changed, true);
+  EXPECT_FALSE(changed.exists(HTTP_HEADER_CONTENT_LENGTH));
+  EXPECT_TRUE(changed.exists(HTTP_HEADER_ETAG));
+}
+
+TEST (HeaderPolicy, TestCacheability) {
+  auto policy = makePolicy();
+  auto summarize = [&](HTTPHeaderCode code, const std::string& value) {
+    HTTPHeaders in;
+    HTTPHeaders out;
+    in.add(code, value);
+    return policy.apply(in, out, false);
+  };
+  EXPECT_FALSE(summarize(HTTP_HEADER_SET_COOKIE, "session=1").shareable);
+  EXPECT_FALSE(summarize(HTTP_HEADER_CACHE_CONTROL, "no-store").shareable);
+  EXPECT_FALSE(summarize(HTTP_HEADER_CACHE_CONTROL,
+    "private, max-age=60").shareable);
+  EXPECT_TRUE(summarize(HTTP_HEADER_CACHE_CONTROL,
+    "public, max-age=60").shareable);
+  EXPECT_FALSE(summarize(HTTP_HEADER_VARY, "*").shareable);
+  EXPECT_FALSE(summarize(HTTP_HEADER_VARY, "accept-encoding").varies);
+  EXPECT_TRUE(summarize(HTTP_HEADER_VARY, "Accept-Encoding, Cookie").varies);
+  EXPECT_EQ("cookie,accept-language", summarize(HTTP_HEADER_VARY,
+    "Accept-Encoding, Cookie, Accept-Language").vary);
+}
+
+TEST (HeaderPolicy, TestRewriteURL) {
+  auto policy = makePolicy();
+  EXPECT_EQ("/new", policy.rewriteURL("http://origin.local/new"));
+  EXPECT_EQ("/new?a=1", policy.rewriteURL("http://origin.local:80/new?a=1"));
+  EXPECT_EQ("/", policy.rewriteURL("http://origin.local"));
+  EXPECT_EQ("/?a=1", policy.rewriteURL("http://ORIGIN.local?a=1"));
+  // other hosts (including ones that only start like the origin) are
+  // left alone
+  EXPECT_EQ("http://origin.local.evil/x",
+    policy.rewriteURL("http://origin.local.evil/x"));
+  EXPECT_EQ("https://example.com/", policy.rewriteURL("https://example.com/"));
+  EXPECT_EQ("/relative", policy.rewriteURL("/relative"));
+
+  HTTPHeaders in;
+  HTTPHeaders out;
+  in.add(HTTP_HEADER_LOCATION, "http://origin.local/login");
+  policy.apply(in, out, false);
+  EXPECT_EQ("/login", out.getSingleOrEmpty(HTTP_HEADER_LOCATION));
+}
@@ -1,8 +1,11 @@
 #include <gtest/gtest.h>
 #include <glog/logging.h>
 
+#include <atomic>
+
 #include <folly/FileUtil.h>
 #include <folly/experimental/TestUtil.h>
+#include <folly/json.h>
 
 #include <proxygen/lib/utils/TestUtils.h>
 #include <proxygen/httpserver/HTTPServer.h>
@@ -16,6 +19,9 @@
 #include "NetworkState.h"
 #include "Masternode.h"
 #include "MasternodeConfig.h"
+#include "OriginPool.h"
+#include "ProxyHandler.h"
+#include "RouteRules.h"
 
 using namespace folly;
 using namespace proxygen;
@@ -316,3 +322,629 @@ TEST (Masternode, TestCompression) {
   EXPECT_EQ(true, res->has_header("Content-Encoding"));
   EXPECT_EQ("gzip", res->get_header_value("Content-Encoding"));
 }
+
+TEST (Masternode, TestEdgeReportBeacon) {
+  // Create and start a masternode
+  std::vector<HTTPServer::IPConfig> IPs = {
+        {folly::SocketAddress("0.0.0.0", 8080, true),
+        HTTPServer::Protocol::HTTP}};
+
+  auto mc = std::make_shared<MasternodeConfig>();
+  mc->ip = "0.0.0.0";
+  mc->port = 8080;
+  mc->origin_host = "0.0.0.0";
+  mc->protected_domain = "0.0.0.0";
+  mc->origin_port = 8085;
+  mc->IPs = IPs;
+  mc->cache_directory = "/dev/null";
+  mc->options.threads = 1;
+  mc->options.idleTimeout = std::chrono::milliseconds(10000);
+  mc->options.shutdownOn = {SIGINT, SIGTERM};
+  mc->options.enableContentCompression = false;
+  mc->enableServiceWorker = false;
+  mc->enableP2P = true;
+  mc->edge_report_max_bytes = 512;
+  mc->metrics_token = "secret";
+  mc->route_rules = RouteRules::parseRules(R"([
+    {"extension": "mp4", "edge_offload": false},
+    {"path": "/private", "edge_offload": false}
+  ])");
+
+  auto master = std::make_unique<masternode::Masternode>(mc);
+  auto master_thread = std::make_unique<MasternodeThread>(master.get());
+
+  ASSERT_TRUE(master_thread->start());
+
+  httplib::Client client("0.0.0.0", 8080);
+  httplib::Headers hs;
+  hs.emplace("Gladius-Masternode-Direct", "");
+  auto res = client.Post("/masternode-edge-report", hs,
+    R"({"reports": [{"edge": "https://0xabc.cdn.example.com:8080", "ms": 31.5, "ok": true}, {"edge": "0xdef.cdn.example.com", "ok": false}, {"edge": "0x123.cdn.example.com", "ok": "yes", "ms": 10}]})",
+    "application/json");
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(204, res->status);
+
+  // beacons over the size limit are rejected
+  res = client.Post("/masternode-edge-report", hs,
+    std::string(1024, ' '), "application/json");
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(413, res->status);
+
+  // other direct requests still get the cache list, without the
+  // routes that may not be offloaded whatever shape their keys have
+  auto cache = master->getCache();
+  for (auto key : {"/v/a.mp4#slice=3", "@shop@/private/x", "@shop@/x.js",
+    "/y.js"}) {
+    auto headers = std::make_shared<HTTPMessage>();
+    headers->setStatusCode(200);
+    headers->getHeaders().set(HTTP_HEADER_CACHE_CONTROL, "max-age=60");
+    ASSERT_TRUE(cache->addCachedRoute(key, folly::IOBuf::copyBuffer("x"),
+      headers));
+  }
+  res = client.Get("/masternode-cache-list", hs);
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(200, res->status);
+  auto assets = folly::parseJson(res->body)["assetHashes"];
+  EXPECT_EQ(2, assets.size());
+  EXPECT_EQ(nullptr, assets.get_ptr("/v/a.mp4#slice=3"));
+  EXPECT_EQ(nullptr, assets.get_ptr("@shop@/private/x"));
+  EXPECT_NE(nullptr, assets.get_ptr("@shop@/x.js"));
+  EXPECT_NE(nullptr, assets.get_ptr("/y.js"));
+
+  // metrics need the token
+  res = client.Get("/metrics", hs);
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(403, res->status);
+  auto wrong = hs;
+  wrong.emplace("Authorization", "Bearer secreT");
+  res = client.Get("/metrics", wrong);
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(403, res->status);
+  auto authorized = hs;
+  authorized.emplace("Authorization", "Bearer secret");
+  res = client.Get("/metrics", authorized);
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(200, res->status);
+  // origins are labelled by index, not address
+  EXPECT_NE(std::string::npos, res->body.find(",origin=\"0\"}"));
+  EXPECT_EQ(std::string::npos, res->body.find("0.0.0.0:8085"));
+
+  // without a token there are no metrics
+  mc->metrics_token = "";
+  res = client.Get("/metrics", authorized);
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(404, res->status);
+}
+
+TEST (Masternode, TestDiskTierServing) {
+  // Create and start an origin server that counts the requests it gets
+  std::atomic<int> originHits{0};
+  const std::string big(200 * 1024, 'x');
+  auto origin = std::make_unique<httplib::Server>();
+  origin->Get("/big", [&](const httplib::Request& req, httplib::Response& res) {
+    originHits++;
+    res.set_content(big, "application/octet-stream");
+  });
+  origin->Get("/small", [&](const httplib::Request& req, httplib::Response& res) {
+    originHits++;
+    res.set_content("small", "text/plain");
+  });
+  auto origin_thread = std::make_unique<OriginThread>(*origin);
+  origin_thread->start();
+
+  folly::test::TemporaryDirectory cacheDir;
+
+  // Create and start a masternode with room in memory for one route
+  std::vector<HTTPServer::IPConfig> IPs = {
+        {folly::SocketAddress("0.0.0.0", 8080, true),
+        HTTPServer::Protocol::HTTP}};
+
+  auto mc = std::make_shared<MasternodeConfig>();
+  mc->ip = "0.0.0.0";
+  mc->port = 8080;
+  mc->origin_host = "0.0.0.0";
+  mc->protected_domain = "0.0.0.0";
+  mc->origin_port = 8085;
+  mc->IPs = IPs;
+  mc->cache_directory = cacheDir.path().string() + "/";
+  mc->enable_disk_tier = true;
+  mc->maxRoutesToCache = 1;
+  mc->options.threads = 1;
+  mc->options.idleTimeout = std::chrono::milliseconds(10000);
+  mc->options.shutdownOn = {SIGINT, SIGTERM};
+  mc->options.enableContentCompression = false;
+  mc->enableServiceWorker = false;
+
+  auto master = std::make_unique<masternode::Masternode>(mc);
+  auto master_thread = std::make_unique<MasternodeThread>(master.get());
+
+  ASSERT_TRUE(master_thread->start());
+
+  httplib::Client client("0.0.0.0", 8080);
+  auto res = client.Get("/big");
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(200, res->status);
+  // wait for the body to be written and indexed, it can't be demoted before
+  std::string journal;
+  while (journal.find("/big") == std::string::npos) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    folly::readFile((mc->cache_directory + ContentCache::JOURNAL_NAME).c_str(),
+      journal);
+  }
+  // caching /small pushes /big down to the disk tier
+  res = client.Get("/small");
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(200, res->status);
+  EXPECT_EQ(2, originHits);
+
+  // streamed back from disk, without going to the origin
+  res = client.Get("/big");
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(200, res->status);
+  EXPECT_EQ(big, res->body);
+  EXPECT_EQ("application/octet-stream", res->get_header_value("Content-Type"));
+  EXPECT_EQ(2, originHits);
+}
+
+TEST (Masternode, TestRangeRequests) {
+  // Create and start an origin server that answers ranges of /video
+  std::atomic<int> originHits{0};
+  std::string lastRange;
+  std::string video;
+  for (int i = 0; i < 10000; i++) {
+    video.push_back('a' + i % 26);
+  }
+  auto origin = std::make_unique<httplib::Server>();
+  origin->Get("/file", [&](const httplib::Request& req, httplib::Response& res) {
+    originHits++;
+    lastRange = req.get_header_value("Range");
+    res.set_content("0123456789", "text/plain");
+  });
+  origin->Get("/video", [&](const httplib::Request& req, httplib::Response& res) {
+    originHits++;
+    lastRange = req.get_header_value("Range");
+    size_t first = 0, last = 0;
+    if (sscanf(lastRange.c_str(), "bytes=%zu-%zu", &first, &last) != 2) {
+      res.set_content(video, "video/mp4");
+      return;
+    }
+    last = std::min(last, video.size() - 1);
+    res.status = 206;
+    res.set_header("Content-Range", ("bytes " + std::to_string(first) + "-" +
+      std::to_string(last) + "/" + std::to_string(video.size())).c_str());
+    res.set_content(video.substr(first, last - first + 1), "video/mp4");
+  });
+  auto origin_thread = std::make_unique<OriginThread>(*origin);
+  origin_thread->start();
+
+  // Create and start a masternode caching large objects in 4KB slices
+  std::vector<HTTPServer::IPConfig> IPs = {
+        {folly::SocketAddress("0.0.0.0", 8080, true),
+        HTTPServer::Protocol::HTTP}};
+
+  auto mc = std::make_shared<MasternodeConfig>();
+  mc->ip = "0.0.0.0";
+  mc->port = 8080;
+  mc->origin_host = "0.0.0.0";
+  mc->protected_domain = "0.0.0.0";
+  mc->origin_port = 8085;
+  mc->IPs = IPs;
+  mc->cache_slice_size = 4096;
+  mc->options.threads = 1;
+  mc->options.idleTimeout = std::chrono::milliseconds(10000);
+  mc->options.shutdownOn = {SIGINT, SIGTERM};
+  mc->options.enableContentCompression = false;
+  mc->enableServiceWorker = false;
+
+  auto master = std::make_unique<masternode::Masternode>(mc);
+  auto master_thread = std::make_unique<MasternodeThread>(master.get());
+
+  ASSERT_TRUE(master_thread->start());
+
+  httplib::Client client("0.0.0.0", 8080);
+  // a range within the first slice of an object that isn't known to
+  // be large fetches the whole object, which the range is cut out of
+  auto res = client.Get("/file", {httplib::make_range_header(2, 5)});
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(206, res->status);
+  EXPECT_EQ("2345", res->body);
+  EXPECT_EQ("bytes 2-5/10", res->get_header_value("Content-Range"));
+  EXPECT_EQ("", lastRange);
+
+  // and later ranges are cut out of the cached body
+  res = client.Get("/file", {{"Range", "bytes=-3"}});
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(206, res->status);
+  EXPECT_EQ("789", res->body);
+  res = client.Get("/file", {{"Range", "bytes=100-"}});
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(416, res->status);
+  EXPECT_EQ("bytes */10", res->get_header_value("Content-Range"));
+  res = client.Get("/file");
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(200, res->status);
+  EXPECT_EQ("0123456789", res->body);
+  EXPECT_EQ("bytes", res->get_header_value("Accept-Ranges"));
+  EXPECT_EQ(1, originHits);
+
+  // a range reaching past the first slice is sliced, the origin ignores
+  // the slice range and sends the whole object
+  res = client.Get("/file?v=2", {httplib::make_range_header(2, 5000)});
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(206, res->status);
+  EXPECT_EQ("23456789", res->body);
+  EXPECT_EQ("bytes 2-9/10", res->get_header_value("Content-Range"));
+  EXPECT_EQ("bytes=0-4095", lastRange);
+  originHits = 0;
+
+  // a seek into the video only fetches the slice holding it
+  res = client.Get("/video", {httplib::make_range_header(5000, 5099)});
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(206, res->status);
+  EXPECT_EQ(video.substr(5000, 100), res->body);
+  EXPECT_EQ("bytes 5000-5099/10000", res->get_header_value("Content-Range"));
+  EXPECT_EQ("bytes=4096-8191", lastRange);
+  EXPECT_EQ(1, originHits);
+
+  res = client.Get("/video", {httplib::make_range_header(6000, 6009)});
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(206, res->status);
+  EXPECT_EQ(video.substr(6000, 10), res->body);
+  EXPECT_EQ(1, originHits);
+
+  // a range crossing a slice boundary is answered up to the boundary
+  res = client.Get("/video", {httplib::make_range_header(8000, 8999)});
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(206, res->status);
+  EXPECT_EQ("bytes 8000-8191/10000", res->get_header_value("Content-Range"));
+  EXPECT_EQ(1, originHits);
+
+  res = client.Get("/video", {{"Range", "bytes=9000-"}});
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(206, res->status);
+  EXPECT_EQ(video.substr(9000), res->body);
+  EXPECT_EQ("bytes=8192-12287", lastRange);
+  EXPECT_EQ(2, originHits);
+
+  // the video is known to be large now, so even a range at its start
+  // is sliced rather than fetching all of it
+  res = client.Get("/video", {httplib::make_range_header(0, 99)});
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(206, res->status);
+  EXPECT_EQ(video.substr(0, 100), res->body);
+  EXPECT_EQ("bytes=0-4095", lastRange);
+  EXPECT_EQ(3, originHits);
+}
+
+TEST (Masternode, TestStreamingBypass) {
+  // Create and start an origin server that counts the requests it gets
+  std::atomic<int> originHits{0};
+  const std::string huge(256 * 1024, 'x');
+  auto origin = std::make_unique<httplib::Server>();
+  origin->Get("/huge", [&](const httplib::Request& req, httplib::Response& res) {
+    originHits++;
+    res.set_content(huge, "application/octet-stream");
+  });
+  origin->Get("/small", [&](const httplib::Request& req, httplib::Response& res) {
+    originHits++;
+    res.set_content("small", "text/plain");
+  });
+  auto origin_thread = std::make_unique<OriginThread>(*origin);
+  origin_thread->start();
+
+  // Create and start a masternode that caches responses up to 64KB
+  std::vector<HTTPServer::IPConfig> IPs = {
+        {folly::SocketAddress("0.0.0.0", 8080, true),
+        HTTPServer::Protocol::HTTP}};
+
+  auto mc = std::make_shared<MasternodeConfig>();
+  mc->ip = "0.0.0.0";
+  mc->port = 8080;
+  mc->origin_host = "0.0.0.0";
+  mc->protected_domain = "0.0.0.0";
+  mc->origin_port = 8085;
+  mc->IPs = IPs;
+  mc->cache_max_object_bytes = 64 * 1024;
+  mc->options.threads = 1;
+  mc->options.idleTimeout = std::chrono::milliseconds(10000);
+  mc->options.shutdownOn = {SIGINT, SIGTERM};
+  mc->options.enableContentCompression = false;
+  mc->enableServiceWorker = false;
+
+  auto master = std::make_unique<masternode::Masternode>(mc);
+  auto master_thread = std::make_unique<MasternodeThread>(master.get());
+
+  ASSERT_TRUE(master_thread->start());
+
+  // oversized responses are passed through every time
+  httplib::Client client("0.0.0.0", 8080);
+  for (int i = 1; i <= 2; i++) {
+    auto res = client.Get("/huge");
+    ASSERT_TRUE(res != nullptr);
+    EXPECT_EQ(200, res->status);
+    EXPECT_EQ(huge, res->body);
+    EXPECT_EQ("application/octet-stream",
+      res->get_header_value("Content-Type"));
+    EXPECT_EQ(i, originHits);
+  }
+
+  // small ones are still cached
+  for (int i = 0; i < 2; i++) {
+    auto res = client.Get("/small");
+    ASSERT_TRUE(res != nullptr);
+    EXPECT_EQ("small", res->body);
+  }
+  EXPECT_EQ(3, originHits);
+  EXPECT_EQ(0u, ProxyHandler::getBufferedBytes());
+}
+
+TEST (Masternode, TestOriginResponsePassthrough) {
+  // Create and start an origin server with responses that must reach the
+  // client as the origin sent them
+  std::atomic<int> originHits{0};
+  auto origin = std::make_unique<httplib::Server>();
+  origin->Get("/missing", [&](const httplib::Request& req, httplib::Response& res) {
+    originHits++;
+    res.status = 404;
+    res.set_content("not here", "text/plain");
+  });
+  origin->Get("/moved", [&](const httplib::Request& req, httplib::Response& res) {
+    res.status = 302;
+    res.set_header("Location", "http://0.0.0.0:8085/new");
+  });
+  origin->Get("/cookie", [&](const httplib::Request& req, httplib::Response& res) {
+    originHits++;
+    res.set_header("Set-Cookie", "session=1");
+    res.set_content("personal", "text/plain");
+  });
+  origin->Get("/asset", [&](const httplib::Request& req, httplib::Response& res) {
+    originHits++;
+    res.set_header("Cache-Control", "public, max-age=60");
+    res.set_header("ETag", "\"v1\"");
+    res.set_header("X-Origin", "yes");
+    res.set_header("Content-Security-Policy", "default-src 'self'");
+    res.set_content("asset", "text/plain");
+  });
+  auto origin_thread = std::make_unique<OriginThread>(*origin);
+  origin_thread->start();
+
+  // Create and start a masternode
+  std::vector<HTTPServer::IPConfig> IPs = {
+        {folly::SocketAddress("0.0.0.0", 8080, true),
+        HTTPServer::Protocol::HTTP}};
+
+  auto mc = std::make_shared<MasternodeConfig>();
+  mc->ip = "0.0.0.0";
+  mc->port = 8080;
+  mc->origin_host = "0.0.0.0";
+  mc->protected_domain = "0.0.0.0";
+  mc->origin_port = 8085;
+  mc->IPs = IPs;
+  mc->options.threads = 1;
+  mc->options.idleTimeout = std::chrono::milliseconds(10000);
+  mc->options.shutdownOn = {SIGINT, SIGTERM};
+  mc->options.enableContentCompression = false;
+  mc->enableServiceWorker = false;
+
+  auto master = std::make_unique<masternode::Masternode>(mc);
+  auto master_thread = std::make_unique<MasternodeThread>(master.get());
+
+  ASSERT_TRUE(master_thread->start());
+
+  httplib::Client client("0.0.0.0", 8080);
+  // errors keep their status
+  auto res = client.Get("/missing");
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(404, res->status);
+  EXPECT_EQ("not here", res->body);
+
+  // redirects to the origin itself are made relative
+  res = client.Get("/moved");
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(302, res->status);
+  EXPECT_EQ("/new", res->get_header_value("Location"));
+
+  // responses setting cookies are passed on but never shared
+  originHits = 0;
+  for (int i = 1; i <= 2; i++) {
+    res = client.Get("/cookie");
+    ASSERT_TRUE(res != nullptr);
+    EXPECT_EQ("session=1", res->get_header_value("Set-Cookie"));
+    EXPECT_EQ(i, originHits);
+  }
+
+  // the origin's headers come through, and cacheable responses are cached
+  originHits = 0;
+  res = client.Get("/asset");
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ("\"v1\"", res->get_header_value("ETag"));
+  EXPECT_EQ("public, max-age=60", res->get_header_value("Cache-Control"));
+  EXPECT_EQ("yes", res->get_header_value("X-Origin"));
+  res = client.Get("/asset");
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ("asset", res->body);
+  EXPECT_EQ("\"v1\"", res->get_header_value("ETag"));
+  // hits carry the headers the miss forwarded, not just the cache's own
+  EXPECT_EQ("yes", res->get_header_value("X-Origin"));
+  EXPECT_EQ("default-src 'self'",
+    res->get_header_value("Content-Security-Policy"));
+  EXPECT_EQ(1, originHits);
+}
+
+TEST (Masternode, TestNegativeCaching) {
+  // Create and start an origin server that counts the requests it gets
+  std::atomic<int> originHits{0};
+  auto origin = std::make_unique<httplib::Server>();
+  origin->Get("/missing", [&](const httplib::Request& req, httplib::Response& res) {
+    originHits++;
+    res.status = 404;
+    res.set_content("not here", "text/plain");
+  });
+  origin->Get("/busy", [&](const httplib::Request& req, httplib::Response& res) {
+    originHits++;
+    res.status = 503;
+    res.set_content("busy", "text/plain");
+  });
+  origin->Get("/broken", [&](const httplib::Request& req, httplib::Response& res) {
+    originHits++;
+    res.status = 500;
+    res.set_content("broken", "text/plain");
+  });
+  auto origin_thread = std::make_unique<OriginThread>(*origin);
+  origin_thread->start();
+
+  // Create and start a masternode that also caches 503s
+  std::vector<HTTPServer::IPConfig> IPs = {
+        {folly::SocketAddress("0.0.0.0", 8080, true),
+        HTTPServer::Protocol::HTTP}};
+
+  auto mc = std::make_shared<MasternodeConfig>();
+  mc->ip = "0.0.0.0";
+  mc->port = 8080;
+  mc->origin_host = "0.0.0.0";
+  mc->protected_domain = "0.0.0.0";
+  mc->origin_port = 8085;
+  mc->IPs = IPs;
+  mc->error_cache_statuses = {503};
+  mc->error_cache_ttl = 60;
+  mc->options.threads = 1;
+  mc->options.idleTimeout = std::chrono::milliseconds(10000);
+  mc->options.shutdownOn = {SIGINT, SIGTERM};
+  mc->options.enableContentCompression = false;
+  mc->enableServiceWorker = false;
+
+  auto master = std::make_unique<masternode::Masternode>(mc);
+  auto master_thread = std::make_unique<MasternodeThread>(master.get());
+
+  ASSERT_TRUE(master_thread->start());
+
+  httplib::Client client("0.0.0.0", 8080);
+  // repeated requests for missing content are answered from the cache
+  for (int i = 0; i < 3; i++) {
+    auto res = client.Get("/missing", {{"Range", "bytes=0-2"}});
+    ASSERT_TRUE(res != nullptr);
+    EXPECT_EQ(404, res->status);
+    // ranges aren't cut out of errors
+    EXPECT_EQ("not here", res->body);
+  }
+  EXPECT_EQ(1, originHits);
+
+  // as are the configured errors, but no others
+  originHits = 0;
+  for (int i = 0; i < 2; i++) {
+    auto res = client.Get("/busy");
+    ASSERT_TRUE(res != nullptr);
+    EXPECT_EQ(503, res->status);
+    res = client.Get("/broken");
+    ASSERT_TRUE(res != nullptr);
+    EXPECT_EQ(500, res->status);
+  }
+  EXPECT_EQ(3, originHits);
+}
+
+TEST (Masternode, TestStaleIfError) {
+  // Create and start an origin server whose responses expire right away,
+  // and that starts failing after the first request
+  std::atomic<int> originHits{0};
+  auto origin = std::make_unique<httplib::Server>();
+  origin->Get("/page", [&](const httplib::Request& req, httplib::Response& res) {
+    if (originHits++ > 0) {
+      res.status = 502;
+      return;
+    }
+    res.set_header("Cache-Control", "max-age=0");
+    res.set_content("page", "text/plain");
+  });
+  auto origin_thread = std::make_unique<OriginThread>(*origin);
+  origin_thread->start();
+
+  // Create and start a masternode
+  std::vector<HTTPServer::IPConfig> IPs = {
+        {folly::SocketAddress("0.0.0.0", 8080, true),
+        HTTPServer::Protocol::HTTP}};
+
+  auto mc = std::make_shared<MasternodeConfig>();
+  mc->ip = "0.0.0.0";
+  mc->port = 8080;
+  mc->origin_host = "0.0.0.0";
+  mc->protected_domain = "0.0.0.0";
+  mc->origin_port = 8085;
+  mc->IPs = IPs;
+  mc->options.threads = 1;
+  mc->options.idleTimeout = std::chrono::milliseconds(10000);
+  mc->options.shutdownOn = {SIGINT, SIGTERM};
+  mc->options.enableContentCompression = false;
+  mc->enableServiceWorker = false;
+
+  auto master = std::make_unique<masternode::Masternode>(mc);
+  auto master_thread = std::make_unique<MasternodeThread>(master.get());
+
+  ASSERT_TRUE(master_thread->start());
+
+  httplib::Client client("0.0.0.0", 8080);
+  auto res = client.Get("/page");
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(200, res->status);
+  EXPECT_FALSE(res->has_header("Warning"));
+
+  // the expired copy stands in for the origin's error
+  res = client.Get("/page");
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(200, res->status);
+  EXPECT_EQ("page", res->body);
+  EXPECT_EQ("111 - \"Revalidation Failed\"", res->get_header_value("Warning"));
+  EXPECT_TRUE(res->has_header("Age"));
+  EXPECT_EQ(2, originHits);
+
+  // and for an origin that's gone
+  origin_thread.reset();
+  res = client.Get("/page");
+  ASSERT_TRUE(res != nullptr);
+  EXPECT_EQ(200, res->status);
+  EXPECT_EQ("page", res->body);
+}
+
+TEST (Masternode, TestOriginPool) {
+  // Create and start an origin server, next to one that isn't running
+  std::atomic<int> originHits{0};
+  auto origin = std::make_unique<httplib::Server>();
+  origin->Get(R"(/item/(\d+))", [&](const httplib::Request& req, httplib::Response& res) {
+    originHits++;
+    res.set_content("item", "text/plain");
+  });
+  auto origin_thread = std::make_unique<OriginThread>(*origin);
+  origin_thread->start();
+
+  // Create and start a masternode
+  std::vector<HTTPServer::IPConfig> IPs = {
+        {folly::SocketAddress("0.0.0.0", 8080, true),
+        HTTPServer::Protocol::HTTP}};
+
+  auto mc = std::make_shared<MasternodeConfig>();
+  mc->ip = "0.0.0.0";
+  mc->port = 8080;
+  mc->origins = OriginPool::parseOrigins("127.0.0.1:8087,127.0.0.1:8085");
+  mc->origin_health_interval = 0;
+  mc->protected_domain = "0.0.0.0";
+  mc->IPs = IPs;
+  mc->options.threads = 1;
+  mc->options.idleTimeout = std::chrono::milliseconds(10000);
+  mc->options.shutdownOn = {SIGINT, SIGTERM};
+  mc->options.enableContentCompression = false;
+  mc->enableServiceWorker = false;
+
+  auto master = std::make_unique<masternode::Masternode>(mc);
+  auto master_thread = std::make_unique<MasternodeThread>(master.get());
+
+  ASSERT_TRUE(master_thread->start());
+
+  // requests that land on the dead origin are retried on the other one
+  httplib::Client client("0.0.0.0", 8080);
+  for (int i = 0; i < 6; i++) {
+    auto res = client.Get(folly::to<std::string>("/item/", i).c_str());
+    ASSERT_TRUE(res != nullptr);
+    EXPECT_EQ(200, res->status);
+    EXPECT_EQ("item", res->body);
+  }
+  EXPECT_EQ(6, originHits);
+}
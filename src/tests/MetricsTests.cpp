@@ -0,0 +1,70 @@
+#include <gtest/gtest.h>
+
+#include <thread>
+
+#include "Metrics.h"
+
+TEST (Metrics, TestHistogram) {
+  Histogram h;
+  h.record(0.05);
+  h.record(3.0);
+  h.record(3.0);
+  h.record(60000.0);
+  auto s = h.snapshot();
+  EXPECT_EQ(4u, s.count);
+  EXPECT_EQ(1u, s.buckets[0]);
+  // 3ms falls in the (2.5, 5] bucket
+  EXPECT_EQ(2u, s.buckets[5]);
+  EXPECT_EQ(1u, s.buckets[Histogram::NUM_BOUNDS]);
+  EXPECT_NEAR(60006.05, s.sum, 0.01);
+}
+
+TEST (Metrics, TestThreadsMerged) {
+  Histogram h;
+  Counter c;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++) {
+    threads.emplace_back([&]() {
+      for (int j = 0; j < 1000; j++) {
+        h.record(1.0);
+        c.add();
+      }
+    });
+  }
+  for (auto& t : threads) t.join();
+  h.record(1.0);
+  // the counts of threads that exited are kept
+  auto s = h.snapshot();
+  EXPECT_EQ(4001u, s.count);
+  EXPECT_EQ(4001u, s.buckets[3]);
+  EXPECT_EQ(4000u, c.value());
+}
+
+TEST (Metrics, TestRender) {
+  Histogram h;
+  h.record(7.0);
+  std::string out;
+  Metrics::appendHistogram(out, "test_ms", "Test", h);
+  EXPECT_NE(std::string::npos, out.find("# TYPE test_ms histogram\n"));
+  EXPECT_NE(std::string::npos, out.find("test_ms_bucket{le=\"5\"} 0\n"));
+  EXPECT_NE(std::string::npos, out.find("test_ms_bucket{le=\"10\"} 1\n"));
+  EXPECT_NE(std::string::npos, out.find("test_ms_bucket{le=\"+Inf\"} 1\n"));
+  EXPECT_NE(std::string::npos, out.find("test_ms_count 1\n"));
+
+  out.clear();
+  Metrics::appendSample(out, "test_gauge", "site=\"a\"", 2);
+  EXPECT_EQ("test_gauge{site=\"a\"} 2\n", out);
+
+  // label values are escaped
+  std::string labels;
+  Metrics::appendLabel(labels, "site", "a\"b\\c\nd");
+  Metrics::appendLabel(labels, "origin", "0");
+  EXPECT_EQ("site=\"a\\\"b\\\\c\\nd\",origin=\"0\"", labels);
+
+  out.clear();
+  Metrics::get().requests[Metrics::PROXY].add();
+  Metrics::get().render(out);
+  EXPECT_NE(std::string::npos,
+    out.find("masternode_requests_total{handler=\"proxy\"} "));
+  EXPECT_NE(std::string::npos, out.find("masternode_kdtree_query_ms_count"));
+}
@@ -102,6 +102,8 @@ TEST (NetworkState, TestGetNearestNodes) {
 
   auto mc = std::make_shared<MasternodeConfig>();
   mc->pool_domain = "example.com";
+  // only consider the 2 nearest nodes so the result is deterministic
+  mc->edge_candidate_factor = 1;
   auto state = std::make_unique<NetworkState>(mc, std::move(g));
   state->setEdgeNodes(nodes);
 
@@ -114,3 +116,180 @@ TEST (NetworkState, TestGetNearestNodes) {
   EXPECT_EQ("127.3.3.3", nearest_nodes.at(0)->getIP());
   EXPECT_EQ("127.1.1.1", nearest_nodes.at(1)->getIP());
 }
+
+TEST (NetworkState, TestRankingAvoidsSaturatedNodes) {
+  std::unique_ptr<Geo> g = std::make_unique<Geo>();
+
+  std::vector<std::shared_ptr<EdgeNode>> nodes;
+
+  auto nyc = std::make_shared<EdgeNode>(
+      "127.3.3.3", 1234, "0xabc", 12345
+  );
+  Location l = {40.730610, -73.935242, 0.0, 0.0, 0.0};
+  l.convertToCartesian();
+  nyc->setLocation(l);
+  // nearest node is saturated
+  nyc->setLoad(1.0);
+  nyc->setErrorRate(0.5);
+  nodes.push_back(nyc);
+
+  auto atl = std::make_shared<EdgeNode>(
+      "127.1.1.1", 1234, "0xabc", 12345
+  );
+  Location l2 = {33.753746, -84.386330, 0.0, 0.0, 0.0};
+  l2.convertToCartesian();
+  atl->setLocation(l2);
+  nodes.push_back(atl);
+
+  auto reno = std::make_shared<EdgeNode>(
+      "127.6.6.6", 1234, "0xabc", 12345
+  );
+  Location l3 = {39.530895, -119.814972, 0.0, 0.0, 0.0};
+  l3.convertToCartesian();
+  reno->setLocation(l3);
+  nodes.push_back(reno);
+
+  auto treeData = g->buildTreeData(nodes);
+  g->setTreeData(treeData);
+
+  auto mc = std::make_shared<MasternodeConfig>();
+  mc->pool_domain = "example.com";
+  mc->edge_candidate_factor = 3;
+  auto state = std::make_unique<NetworkState>(mc, std::move(g));
+  state->setEdgeNodes(nodes);
+
+  // a saturated node loses every power-of-two comparison, so
+  // it should never be handed out as the only node
+  Location dc = {38.889931, -77.009003, 0.0, 0.0, 0.0};
+  dc.convertToCartesian();
+  for (int i = 0; i < 50; i++) {
+    auto selected = state->getNearestEdgeNodes(dc, 1);
+    ASSERT_EQ(1, selected.size());
+    EXPECT_NE("127.3.3.3", selected.at(0)->getIP());
+  }
+
+  // asking for every node returns all of them, cheapest first
+  auto all = state->getNearestEdgeNodes(dc, 3);
+  ASSERT_EQ(3, all.size());
+  EXPECT_EQ("127.3.3.3", all.at(2)->getIP());
+}
+
+TEST (NetworkState, TestStateParsingRankingFields) {
+  auto mc = std::make_shared<MasternodeConfig>();
+  mc->pool_domain = "example.com";
+  auto state = std::make_unique<NetworkState>(mc);
+  auto sample = R"({"response": {"node_data_map": {"0xdeadbeef": {"content_port": {"data": "8080"}, "ip_address": {"data": "127.0.0.1"}, "heartbeat": {"data": "999999999"}, "disk_content": {"data": ["yes"]}, "load": {"data": 0.75}, "bandwidth": {"data": 100}, "error_rate": {"data": "0.1"}}}}})";
+  state->parseStateUpdate(sample, true);
+
+  ASSERT_EQ(1, state->getEdgeNodes().size());
+  auto node = state->getEdgeNodes()[0];
+  EXPECT_DOUBLE_EQ(0.75, node->getLoad());
+  EXPECT_DOUBLE_EQ(100.0, node->getBandwidth());
+  EXPECT_DOUBLE_EQ(0.1, node->getErrorRate());
+}
+
+TEST (NetworkState, TestEdgeProbingDemotesDeadNodes) {
+  // Create and start a stand-in edge node
+  auto edge = std::make_unique<httplib::Server>();
+  auto edge_thread = std::make_unique<OriginThread>(edge.get()
+    ->Get("/", [](const httplib::Request& req, httplib::Response& res) {
+        res.set_content("edge node", "text/plain");
+      }));
+  edge_thread->start();
+  // probes would race the stand-in edge's listen otherwise
+  ASSERT_TRUE(edge_thread->waitUntilListening());
+
+  auto mc = std::make_shared<MasternodeConfig>();
+  mc->pool_domain = "example.com";
+  mc->enable_edge_probing = true;
+  mc->edge_probe_tls = false;
+  mc->edge_probe_timeout_ms = 500;
+  mc->edge_probe_max_failures = 1;
+  auto state = std::make_unique<NetworkState>(mc);
+
+  // 0xaaa is served by the stand-in edge, nothing listens for 0xbbb
+  auto sample = R"({"response": {"node_data_map": {
+    "0xaaa": {"content_port": {"data": "8085"}, "ip_address": {"data": "127.0.0.1"}, "heartbeat": {"data": "999999999"}, "disk_content": {"data": ["yes"]}},
+    "0xbbb": {"content_port": {"data": "8089"}, "ip_address": {"data": "127.0.0.1"}, "heartbeat": {"data": "999999999"}, "disk_content": {"data": ["yes"]}}}}})";
+  state->parseStateUpdate(sample, true);
+  // nodes are healthy until probed
+  EXPECT_EQ(2, state->getEdgeNodes().size());
+
+  state->probeEdgeNodes();
+
+  auto healthy = state->getProber()->getHealth("0xaaa");
+  ASSERT_TRUE(healthy.hasValue());
+  EXPECT_EQ(1, healthy->successes);
+  EXPECT_EQ(0, healthy->consecutive_failures);
+  EXPECT_GT(healthy->rtt_ms, 0.0);
+  EXPECT_GE(healthy->rtt_ms, healthy->connect_ms);
+
+  auto dead = state->getProber()->getHealth("0xbbb");
+  ASSERT_TRUE(dead.hasValue());
+  EXPECT_EQ(1, dead->failures);
+  EXPECT_FALSE(state->getProber()->isHealthy("0xbbb"));
+
+  // the dead node is left out of the next snapshot
+  state->parseStateUpdate(sample, true);
+  ASSERT_EQ(1, state->getEdgeNodes().size());
+  EXPECT_EQ("0xaaa", state->getEdgeNodes()[0]->getEthAddress());
+}
+
+TEST (NetworkState, TestEdgeReportsFeedRanking) {
+  auto mc = std::make_shared<MasternodeConfig>();
+  mc->pool_domain = "example.com";
+  mc->edge_report_min_samples = 4;
+  auto state = std::make_unique<NetworkState>(mc);
+
+  EXPECT_EQ("0xdeadbeef", EdgeReports::ethAddressFromHost(
+    "https://0xDEADBEEF.cdn.example.com:8080"));
+  EXPECT_EQ("0xdeadbeef", EdgeReports::ethAddressFromHost(
+    "0xdeadbeef.cdn.example.com"));
+
+  // reports are only taken for nodes in the network state
+  auto sample = R"({"response": {"node_data_map": {"0xdeadbeef": {"content_port": {"data": "8080"}, "ip_address": {"data": "127.0.0.1"}, "heartbeat": {"data": "999999999"}, "disk_content": {"data": ["yes"]}}}}})";
+  state->recordEdgeReport("10.1.2.3", "0xdeadbeef", true, 40.0);
+  state->recordEdgeReport("10.1.2.3", "0xjunk", true, 40.0);
+  EXPECT_EQ(0, state->getEdgeReports().edgeEntries());
+  state->parseStateUpdate(sample, true);
+
+  for (int i = 0; i < 6; i++) {
+    state->recordEdgeReport("10.1.2.3", "0xdeadbeef", true, 40.0);
+  }
+  state->recordEdgeReport("10.1.2.3", "0xjunk", true, 40.0);
+  EXPECT_EQ(1, state->getEdgeReports().edgeEntries());
+  for (int i = 0; i < 2; i++) {
+    state->recordEdgeReport("10.1.2.4", "0xdeadbeef", false, 0.0);
+  }
+  auto summary = state->getEdgeReports().getSummary("10.1.2.0/24", "0xdeadbeef");
+  ASSERT_TRUE(summary.hasValue());
+  EXPECT_EQ(8, summary->reports);
+  EXPECT_EQ(2, summary->failures);
+  EXPECT_DOUBLE_EQ(40.0, summary->mean_ms);
+
+  state->parseStateUpdate(sample, true);
+
+  ASSERT_EQ(1, state->getEdgeNodes().size());
+  auto node = state->getEdgeNodes()[0];
+  EXPECT_DOUBLE_EQ(40.0, node->getLatency());
+  EXPECT_DOUBLE_EQ(0.25, node->getErrorRate());
+}
+
+TEST (NetworkState, TestEdgeReportsDecayAway) {
+  EdgeReports reports(2);
+  reports.record("10.1.2.0/24", "0xaaa", true, 10.0);
+  reports.record("10.1.2.0/24", "0xaaa", true, 10.0);
+  reports.record("10.1.3.0/24", "0xbbb", true, 10.0);
+  EXPECT_EQ(2, reports.edgeEntries());
+  // full, no room for another edge node
+  reports.record("10.1.4.0/24", "0xccc", true, 10.0);
+  EXPECT_FALSE(reports.getEdgeSummary("0xccc").hasValue());
+
+  // entries decayed to nothing are dropped and make room again
+  reports.decay();
+  EXPECT_EQ(1, reports.edgeEntries());
+  EXPECT_EQ(1, reports.pairEntries());
+  ASSERT_TRUE(reports.getEdgeSummary("0xaaa").hasValue());
+  reports.record("10.1.4.0/24", "0xccc", true, 10.0);
+  EXPECT_TRUE(reports.getEdgeSummary("0xccc").hasValue());
+}
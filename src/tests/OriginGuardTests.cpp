@@ -0,0 +1,94 @@
+#include <gtest/gtest.h>
+
+#include <thread>
+
+#include "OriginGuard.h"
+
+using namespace std::chrono;
+
+namespace {
+  MasternodeConfig makeConfig() {
+    MasternodeConfig config;
+    config.origin_breaker_failure_ratio = 0.5;
+    config.origin_breaker_min_requests = 4;
+    config.origin_breaker_open_ms = 50;
+    config.origin_retry_ratio = 0.5;
+    return config;
+  }
+}
+
+TEST (OriginGuard, TestBreaker) {
+  OriginGuard guard(makeConfig());
+  EXPECT_EQ(OriginGuard::State::CLOSED, guard.getState());
+
+  // too few requests to judge the origin by
+  EXPECT_TRUE(guard.allowRequest());
+  guard.recordFailure();
+  EXPECT_TRUE(guard.allowRequest());
+  guard.recordFailure();
+  EXPECT_EQ(OriginGuard::State::CLOSED, guard.getState());
+
+  EXPECT_TRUE(guard.allowRequest());
+  guard.recordSuccess(milliseconds(5));
+  EXPECT_TRUE(guard.allowRequest());
+  guard.recordFailure();
+  EXPECT_EQ(OriginGuard::State::OPEN, guard.getState());
+  EXPECT_FALSE(guard.allowRequest());
+
+  // one probe is let through after the cool down
+  std::this_thread::sleep_for(milliseconds(60));
+  EXPECT_TRUE(guard.allowRequest());
+  EXPECT_EQ(OriginGuard::State::HALF_OPEN, guard.getState());
+  EXPECT_FALSE(guard.allowRequest());
+
+  // a failed probe opens the circuit again
+  guard.recordFailure();
+  EXPECT_EQ(OriginGuard::State::OPEN, guard.getState());
+  EXPECT_FALSE(guard.allowRequest());
+
+  std::this_thread::sleep_for(milliseconds(60));
+  EXPECT_TRUE(guard.allowRequest());
+  guard.recordSuccess(milliseconds(5));
+  EXPECT_EQ(OriginGuard::State::CLOSED, guard.getState());
+  EXPECT_TRUE(guard.allowRequest());
+}
+
+TEST (OriginGuard, TestSlowResponses) {
+  auto config = makeConfig();
+  config.origin_slow_ms = 100;
+  OriginGuard guard(config);
+  for (int i = 0; i < 4; i++) {
+    EXPECT_TRUE(guard.allowRequest());
+    guard.recordSuccess(milliseconds(i % 2 == 0 ? 10 : 500));
+  }
+  EXPECT_EQ(OriginGuard::State::OPEN, guard.getState());
+}
+
+TEST (OriginGuard, TestRetryBudget) {
+  OriginGuard guard(makeConfig());
+  // starts with a full budget
+  for (int i = 0; i < 10; i++) {
+    EXPECT_TRUE(guard.withdrawRetry());
+  }
+  EXPECT_FALSE(guard.withdrawRetry());
+
+  // every request adds half a retry
+  EXPECT_TRUE(guard.allowRequest());
+  EXPECT_FALSE(guard.withdrawRetry());
+  EXPECT_TRUE(guard.allowRequest());
+  EXPECT_TRUE(guard.withdrawRetry());
+  EXPECT_FALSE(guard.withdrawRetry());
+}
+
+TEST (OriginGuard, TestHedgeDelay) {
+  OriginGuard guard(makeConfig());
+  EXPECT_EQ(0, guard.getHedgeDelay().count());
+  for (int i = 1; i <= 100; i++) {
+    guard.recordConnect(milliseconds(i));
+    if (i < 16) {
+      EXPECT_EQ(0, guard.getHedgeDelay().count());
+    }
+  }
+  // worked out from the first 96 samples
+  EXPECT_EQ(92, guard.getHedgeDelay().count());
+}
@@ -0,0 +1,121 @@
+#include <gtest/gtest.h>
+
+#include "OriginPool.h"
+
+namespace {
+  std::shared_ptr<MasternodeConfig> makeConfig(const std::string& origins) {
+    auto config = std::make_shared<MasternodeConfig>();
+    config->origins = OriginPool::parseOrigins(origins);
+    config->origin_health_interval = 0;
+    config->origin_health_max_failures = 2;
+    config->origin_breaker_min_requests = 1;
+    config->origin_breaker_open_ms = 60000;
+    return config;
+  }
+}
+
+TEST (OriginPool, TestParseOrigins) {
+  auto servers = OriginPool::parseOrigins(
+    "10.0.0.1:8080*3, origin.local ,[::1]:81,[::2],bad:port,x:80*0,");
+  ASSERT_EQ(4, servers.size());
+  EXPECT_EQ("10.0.0.1", servers[0].host);
+  EXPECT_EQ(8080, servers[0].port);
+  EXPECT_EQ(3, servers[0].weight);
+  EXPECT_EQ("origin.local", servers[1].host);
+  EXPECT_EQ(80, servers[1].port);
+  EXPECT_EQ(1, servers[1].weight);
+  EXPECT_EQ("::1", servers[2].host);
+  EXPECT_EQ(81, servers[2].port);
+  EXPECT_EQ("::2", servers[3].host);
+  EXPECT_EQ(80, servers[3].port);
+
+  // without a pool the single origin is used
+  MasternodeConfig config;
+  config.origin_host = "127.0.0.1";
+  config.origin_port = 8085;
+  auto origins = config.getOrigins();
+  ASSERT_EQ(1, origins.size());
+  EXPECT_EQ(8085, origins[0].port);
+}
+
+TEST (OriginPool, TestLeastOutstanding) {
+  OriginPool pool(makeConfig("127.0.0.1:8001*2,127.0.0.1:8002"));
+  auto& origins = pool.getOrigins();
+  ASSERT_EQ(2, origins.size());
+
+  // the heavier origin takes twice the requests in flight
+  std::vector<int> picks(2, 0);
+  for (int i = 0; i < 6; i++) {
+    auto origin = pool.pick();
+    ASSERT_TRUE(origin != nullptr);
+    origin->startRequest();
+    picks[origin->getIndex()]++;
+  }
+  EXPECT_EQ(4, picks[0]);
+  EXPECT_EQ(2, picks[1]);
+
+  // an origin that just failed is only picked as a last resort
+  auto other = pool.pick(origins[0].get());
+  EXPECT_EQ(1, other->getIndex());
+}
+
+TEST (OriginPool, TestEwma) {
+  auto config = makeConfig("127.0.0.1:8001,127.0.0.1:8002");
+  config->origin_balancing = "ewma";
+  OriginPool pool(config);
+  auto& origins = pool.getOrigins();
+  origins[0]->startRequest();
+  origins[0]->finishRequest(std::chrono::milliseconds(100));
+  origins[1]->startRequest();
+  origins[1]->finishRequest(std::chrono::milliseconds(10));
+  EXPECT_DOUBLE_EQ(100.0, origins[0]->getLatency());
+
+  // the faster origin is picked until enough requests wait on it
+  for (int i = 0; i < 5; i++) {
+    auto origin = pool.pick();
+    EXPECT_EQ(1, origin->getIndex());
+    origin->startRequest();
+  }
+}
+
+TEST (OriginPool, TestHealth) {
+  OriginPool pool(makeConfig("127.0.0.1:8001,127.0.0.1:8002"));
+  auto& origins = pool.getOrigins();
+  origins[0]->recordHealthCheck(false, 2);
+  EXPECT_TRUE(origins[0]->isHealthy());
+  origins[0]->recordHealthCheck(false, 2);
+  EXPECT_FALSE(origins[0]->isHealthy());
+  for (int i = 0; i < 4; i++) {
+    EXPECT_EQ(1, pool.pick()->getIndex());
+  }
+
+  // with every origin unhealthy, requests still go out
+  origins[1]->recordHealthCheck(false, 2);
+  origins[1]->recordHealthCheck(false, 2);
+  EXPECT_TRUE(pool.pick() != nullptr);
+
+  origins[0]->recordHealthCheck(true, 2);
+  EXPECT_EQ(0, pool.pick()->getIndex());
+
+  // origins with an open circuit are skipped, for an unhealthy origin
+  // if need be
+  origins[0]->getGuard().recordFailure();
+  EXPECT_EQ(OriginGuard::State::OPEN, origins[0]->getGuard().getState());
+  EXPECT_FALSE(origins[1]->isHealthy());
+  auto fallback = pool.pick();
+  ASSERT_TRUE(fallback != nullptr);
+  EXPECT_EQ(1, fallback->getIndex());
+
+  origins[1]->getGuard().recordFailure();
+  EXPECT_TRUE(pool.pick() == nullptr);
+}
+
+TEST (OriginPool, TestUnresolvedOriginsAreSkipped) {
+  OriginPool pool(makeConfig("127.0.0.1:8001,origin.invalid:8002"));
+  auto& origins = pool.getOrigins();
+  EXPECT_TRUE(origins[0]->isResolved());
+  EXPECT_FALSE(origins[1]->isResolved());
+  for (int i = 0; i < 4; i++) {
+    EXPECT_EQ(0, pool.pick()->getIndex());
+  }
+}
@@ -0,0 +1,81 @@
+#include <gtest/gtest.h>
+
+#include "RouteRules.h"
+
+using proxygen::HTTPHeaders;
+
+TEST (RouteRules, TestGlobMatch) {
+  EXPECT_TRUE(RouteRules::globMatch("*.zip", "a/b.zip"));
+  EXPECT_TRUE(RouteRules::globMatch("a?c", "abc"));
+  EXPECT_TRUE(RouteRules::globMatch("*", ""));
+  EXPECT_TRUE(RouteRules::globMatch("a*b*c", "aXbYbZc"));
+  EXPECT_FALSE(RouteRules::globMatch("a*b*c", "aXbYbZ"));
+  EXPECT_FALSE(RouteRules::globMatch("a?c", "ac"));
+  EXPECT_FALSE(RouteRules::globMatch("", "a"));
+}
+
+TEST (RouteRules, TestParseRules) {
+  auto rules = RouteRules::parseRules(R"([
+    {"path": "/admin/", "handler": "reject"},
+    {"glob": "/static/*.css", "method": "get", "cache_ttl": 600,
+     "compress": false},
+    {"extension": ".mp4", "bypass_cache": true, "edge_offload": false,
+     "inject_service_worker": false}
+  ])");
+  ASSERT_EQ(3, rules.size());
+  EXPECT_EQ(RouteAction::Handler::REJECT, rules[0].action.handler);
+  EXPECT_EQ("GET", rules[1].method);
+  EXPECT_EQ(600, rules[1].action.cache_ttl);
+  EXPECT_FALSE(rules[1].action.compress);
+  EXPECT_EQ("mp4", rules[2].extension);
+  EXPECT_TRUE(rules[2].action.bypass_cache);
+  EXPECT_FALSE(rules[2].action.edge_offload);
+  EXPECT_FALSE(rules[2].action.inject_service_worker);
+
+  EXPECT_THROW(RouteRules::parseRules(R"([{"handler": "drop"}])"),
+    std::invalid_argument);
+  EXPECT_ANY_THROW(RouteRules::parseRules("not json"));
+}
+
+TEST (RouteRules, TestMatch) {
+  RouteRules rules(RouteRules::parseRules(R"([
+    {"path": "/api/", "method": "POST", "handler": "reject"},
+    {"path": "/api/", "bypass_cache": true},
+    {"glob": "/static/*.css", "cache_ttl": 600},
+    {"path": "/static/", "cache_ttl": 60},
+    {"extension": "mp4", "edge_offload": false},
+    {"path": "/private", "header": "Authorization", "bypass_cache": true},
+    {"path": "/beta", "header": "X-Beta", "compress": false}
+  ])"));
+  EXPECT_EQ(7, rules.size());
+
+  // first declared rule wins, whatever its prefix length
+  EXPECT_EQ(RouteAction::Handler::REJECT,
+    rules.match("/api/users", "POST", nullptr).handler);
+  const RouteAction& api = rules.match("/api/users", "GET", nullptr);
+  EXPECT_EQ(RouteAction::Handler::PROXY, api.handler);
+  EXPECT_TRUE(api.bypass_cache);
+
+  EXPECT_EQ(600, rules.match("/static/site.css", "GET", nullptr).cache_ttl);
+  EXPECT_EQ(60, rules.match("/static/site.js", "GET", nullptr).cache_ttl);
+  EXPECT_FALSE(rules.match("/videos/a.mp4", "GET", nullptr).edge_offload);
+  // the extension is only taken from the last path segment
+  EXPECT_TRUE(rules.match("/a.mp4/b", "GET", nullptr).edge_offload);
+
+  HTTPHeaders headers;
+  EXPECT_FALSE(rules.match("/private/x", "GET", &headers).bypass_cache);
+  headers.add("Authorization", "Bearer x");
+  EXPECT_TRUE(rules.match("/private/x", "GET", &headers).bypass_cache);
+  EXPECT_TRUE(rules.match("/beta", "GET", &headers).compress);
+  headers.add("X-Beta", "1");
+  EXPECT_FALSE(rules.match("/beta", "GET", &headers).compress);
+
+  // nothing matched, the default action
+  const RouteAction& other = rules.match("/", "GET", nullptr);
+  EXPECT_EQ(-1, other.cache_ttl);
+  EXPECT_FALSE(other.bypass_cache);
+  EXPECT_TRUE(other.edge_offload);
+
+  RouteRules none(std::vector<RouteRule>{});
+  EXPECT_FALSE(none.match("/api/", "GET", nullptr).bypass_cache);
+}
@@ -0,0 +1,61 @@
+#include <gtest/gtest.h>
+
+#include "Tenant.h"
+
+TEST (Tenant, TestParseTenants) {
+  auto tenants = TenantTable::parseTenants(R"([
+    {"name": "shop", "hosts": ["shop.example.com", "www.shop.example.com"],
+     "origins": "10.0.0.5:8080*2,10.0.0.6", "service_worker": true,
+     "cache_share": 0.25},
+    {"name": "blog", "hosts": ["blog.example.com"], "origins": "10.0.0.7"}
+  ])");
+  ASSERT_EQ(2, tenants.size());
+  EXPECT_EQ("shop", tenants[0].name);
+  EXPECT_EQ(2, tenants[0].hosts.size());
+  ASSERT_EQ(2, tenants[0].origins.size());
+  EXPECT_EQ(2, tenants[0].origins[0].weight);
+  EXPECT_TRUE(tenants[0].enable_service_worker);
+  EXPECT_DOUBLE_EQ(0.25, tenants[0].cache_share);
+  EXPECT_FALSE(tenants[1].enable_service_worker);
+  EXPECT_DOUBLE_EQ(0.0, tenants[1].cache_share);
+
+  EXPECT_THROW(TenantTable::parseTenants(
+    R"([{"name": "a/b", "hosts": [], "origins": "10.0.0.1"}])"),
+    std::invalid_argument);
+  EXPECT_THROW(TenantTable::parseTenants(
+    R"([{"name": "a@b", "hosts": [], "origins": "10.0.0.1"}])"),
+    std::invalid_argument);
+  EXPECT_THROW(TenantTable::parseTenants(
+    R"([{"name": "empty", "hosts": [], "origins": ""}])"),
+    std::invalid_argument);
+  EXPECT_ANY_THROW(TenantTable::parseTenants("not json"));
+}
+
+TEST (Tenant, TestFind) {
+  auto mc = std::make_shared<MasternodeConfig>();
+  mc->protected_domain = "www.example.com";
+  mc->origin_host = "127.0.0.1";
+  mc->port = 8080;
+  mc->origin_health_interval = 0;
+  mc->tenants = TenantTable::parseTenants(R"([
+    {"name": "shop", "hosts": ["shop.example.com"], "origins": "127.0.0.1:8001"}
+  ])");
+  TenantTable table(mc);
+  ASSERT_EQ(2, table.getTenants().size());
+
+  auto main = table.find("www.example.com");
+  ASSERT_NE(nullptr, main);
+  EXPECT_EQ("", main->cacheNamespace);
+  EXPECT_EQ(main, table.find("www.example.com:8080"));
+
+  auto shop = table.find("shop.example.com:8080");
+  ASSERT_NE(nullptr, shop);
+  EXPECT_EQ("shop", shop->cacheNamespace);
+  EXPECT_EQ(shop, table.find("Shop.Example.com"));
+  ASSERT_EQ(1, shop->origins->getOrigins().size());
+  EXPECT_EQ(8001, shop->origins->getOrigins()[0]->getServer().port);
+
+  // ports the masternode doesn't listen on aren't accepted
+  EXPECT_EQ(nullptr, table.find("shop.example.com:9999"));
+  EXPECT_EQ(nullptr, table.find("other.example.com"));
+}
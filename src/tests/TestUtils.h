@@ -1,5 +1,12 @@
 #pragma once
 
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+
 #include <boost/thread.hpp>
 #include <proxygen/httpserver/HTTPServer.h>
 
@@ -59,9 +66,30 @@ class OriginThread {
 
   void start() {
     t_ = std::thread([&]() {
-      server_.listen("0.0.0.0", 8085);
+      server_.listen("0.0.0.0", PORT);
     });
   }
+
+  // Blocks until the server accepts connections (or the timeout passes)
+  bool waitUntilListening(
+    std::chrono::milliseconds timeout = std::chrono::seconds(5)) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (std::chrono::steady_clock::now() < deadline) {
+      int fd = socket(AF_INET, SOCK_STREAM, 0);
+      bool connected = fd >= 0 && connect(fd,
+        reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+      if (fd >= 0) close(fd);
+      if (connected) return true;
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+  }
+
+  static const int PORT = 8085;
 };
 
 class MasternodeThread {
@@ -0,0 +1,106 @@
+#include <gtest/gtest.h>
+
+#include <random>
+
+#include "Vivaldi.h"
+
+namespace {
+  struct Point { double x, y; };
+
+  // RTT between two points on a flat "map" with a fixed 5ms of
+  // access link latency per path
+  double rtt(Point a, Point b) {
+    return std::hypot(a.x - b.x, a.y - b.y) + 5.0;
+  }
+}
+
+TEST (Vivaldi, TestClientPrefix) {
+  EXPECT_EQ("192.168.1.0/24", VivaldiSystem::clientPrefix("192.168.1.77"));
+  EXPECT_EQ("2001:db8:1::/48", VivaldiSystem::clientPrefix("2001:db8:1:2::1"));
+}
+
+TEST (Vivaldi, TestUpdateMovesTowardsSample) {
+  NetworkCoordinate a;
+  NetworkCoordinate b;
+  b.x = 100.0;
+  b.error = 0.1;
+  // a predicts ~100ms, but measured 50ms so it should move closer to b
+  double before = a.distanceTo(b);
+  VivaldiSystem::update(a, b, 50.0);
+  EXPECT_LT(a.distanceTo(b), before);
+  EXPECT_EQ(1, a.samples);
+}
+
+TEST (Vivaldi, TestCoordinatesConverge) {
+  std::vector<Point> edges = {{0, 0}, {100, 0}, {0, 100}, {100, 100}, {200, 30}};
+  Point self = {60, 40};
+  std::mt19937 gen(42);
+  std::vector<Point> clients;
+  std::uniform_real_distribution<double> xs(0, 200), ys(0, 100);
+  for (int i = 0; i < 30; i++) {
+    clients.push_back({xs(gen), ys(gen)});
+  }
+
+  VivaldiSystem vs;
+  std::vector<std::shared_ptr<EdgeNode>> nodes;
+  for (size_t i = 0; i < edges.size(); i++) {
+    nodes.push_back(std::make_shared<EdgeNode>(
+      "127.0.0.1", 1234, "0x" + std::to_string(i), 12345));
+  }
+
+  for (int it = 0; it < 50000; it++) {
+    size_t e = gen() % edges.size();
+    vs.observeEdge(nodes[e]->getEthAddress(), rtt(self, edges[e]));
+    size_t c = gen() % clients.size();
+    e = gen() % edges.size();
+    vs.observeClient("client" + std::to_string(c),
+      nodes[e]->getEthAddress(), rtt(clients[c], edges[e]));
+  }
+
+  // predicted RTTs should be close to the real ones
+  double totalError = 0.0;
+  int samples = 0;
+  for (size_t c = 0; c < clients.size(); c++) {
+    auto cc = vs.getClientCoordinate("client" + std::to_string(c));
+    ASSERT_TRUE(cc.hasValue());
+    for (size_t e = 0; e < edges.size(); e++) {
+      auto ec = vs.getEdgeCoordinate(nodes[e]->getEthAddress());
+      ASSERT_TRUE(ec.hasValue());
+      double actual = rtt(clients[c], edges[e]);
+      totalError += std::fabs(cc->distanceTo(*ec) - actual) / actual;
+      samples++;
+    }
+  }
+  EXPECT_LT(totalError / samples, 0.1);
+
+  // the coordinate tree should find the lowest latency edge
+  vs.setTreeData(vs.buildTreeData(nodes));
+  auto cc = vs.getClientCoordinate("client0");
+  ASSERT_TRUE(cc.hasValue());
+  size_t best = 0;
+  for (size_t e = 1; e < edges.size(); e++) {
+    if (rtt(clients[0], edges[e]) < rtt(clients[0], edges[best])) best = e;
+  }
+  auto nearest = vs.getNearestNeighbors(*cc, 1);
+  ASSERT_EQ(1, nearest.size());
+  EXPECT_EQ(nodes[best]->getEthAddress(), nearest[0].node->getEthAddress());
+}
+
+TEST (Vivaldi, TestUnknownEdgeIgnoredForClients) {
+  VivaldiSystem vs;
+  vs.observeClient("10.0.0.0/24", "0xunknown", 20.0);
+  EXPECT_FALSE(vs.getClientCoordinate("10.0.0.0/24").hasValue());
+}
+
+TEST (Vivaldi, TestClientPrefixesEvicted) {
+  VivaldiSystem vs(2);
+  vs.observeEdge("0xedge", 10.0);
+  vs.observeClient("10.0.0.0/24", "0xedge", 20.0);
+  vs.observeClient("10.0.1.0/24", "0xedge", 20.0);
+  // hearing from the first prefix again keeps it
+  vs.observeClient("10.0.0.0/24", "0xedge", 20.0);
+  vs.observeClient("10.0.2.0/24", "0xedge", 20.0);
+  EXPECT_TRUE(vs.getClientCoordinate("10.0.0.0/24").hasValue());
+  EXPECT_FALSE(vs.getClientCoordinate("10.0.1.0/24").hasValue());
+  EXPECT_EQ(1u, vs.getClientCoordinate("10.0.2.0/24")->samples);
+}